@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <lib/arena.h>
+#include <lib/console.h>
+#include <kernel/thread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_TEST_COUNT 1024
+#define ARENA_TEST_SIZE  24
+
+static void arena_test_bump(void)
+{
+    printf("running bump allocation tests...\n");
+
+    arena_t *arena = arena_create("arena test", 256);
+    if (!arena)
+        panic("arena_create failed\n");
+
+    /* allocations come out in order, aligned and don't overlap */
+    uint8_t *last = NULL;
+    uint8_t **ptrs = arena_alloc(arena, ARENA_TEST_COUNT * sizeof(uint8_t *));
+    if (!ptrs)
+        panic("allocation failed\n");
+    for (uint i = 0; i < ARENA_TEST_COUNT; i++) {
+        uint8_t *p = arena_alloc(arena, ARENA_TEST_SIZE);
+        if (!p)
+            panic("allocation %u failed\n", i);
+        if (!IS_ALIGNED(p, ARENA_ALIGN))
+            panic("allocation %p not aligned\n", p);
+        if (last && p > last && p < last + ARENA_TEST_SIZE)
+            panic("allocation %p overlaps %p\n", p, last);
+        memset(p, i, ARENA_TEST_SIZE);
+        ptrs[i] = last = p;
+    }
+    for (uint i = 0; i < ARENA_TEST_COUNT; i++) {
+        for (uint j = 0; j < ARENA_TEST_SIZE; j++) {
+            if (ptrs[i][j] != (uint8_t)i)
+                panic("allocation %p was overwritten\n", ptrs[i]);
+        }
+    }
+
+    /* that doesn't fit in the first chunk, so more were chained on */
+    if (arena->chunk_count < 2)
+        panic("arena didn't grow, %zu chunks\n", arena->chunk_count);
+
+    /* bigger than a chunk */
+    uint8_t *big = arena_alloc(arena, arena->chunk_size * 2);
+    if (!big)
+        panic("large allocation failed\n");
+    memset(big, 0x99, arena->chunk_size * 2);
+
+    char *str = arena_strdup(arena, "arena test");
+    if (!str || strcmp(str, "arena test"))
+        panic("arena_strdup failed\n");
+
+    arena_destroy(arena);
+}
+
+static void arena_test_align(void)
+{
+    printf("running alignment tests...\n");
+
+    arena_t *arena = arena_create("arena test", PAGE_SIZE);
+    if (!arena)
+        panic("arena_create failed\n");
+
+    for (size_t align = 1; align <= PAGE_SIZE; align <<= 1) {
+        /* knock the position off alignment first */
+        if (!arena_alloc_aligned(arena, 1, 1))
+            panic("allocation failed\n");
+
+        void *p = arena_alloc_aligned(arena, 3, align);
+        if (!p)
+            panic("allocation aligned to %zu failed\n", align);
+        if (!IS_ALIGNED(p, MAX(align, ARENA_ALIGN)))
+            panic("allocation %p not aligned to %zu\n", p, align);
+    }
+
+    arena_destroy(arena);
+}
+
+static void arena_test_mark_reset(void)
+{
+    printf("running mark and reset tests...\n");
+
+    arena_t *arena = arena_create("arena test", 256);
+    if (!arena)
+        panic("arena_create failed\n");
+
+    void *first = arena_alloc(arena, ARENA_TEST_SIZE);
+    if (!first)
+        panic("allocation failed\n");
+
+    /* release back to a mark, across chunks */
+    arena_mark_t mark = arena_mark(arena);
+    size_t chunks = arena->chunk_count;
+    void *after_mark = arena_alloc(arena, ARENA_TEST_SIZE);
+    for (uint i = 0; i < ARENA_TEST_COUNT; i++) {
+        if (!arena_alloc(arena, ARENA_TEST_SIZE))
+            panic("allocation %u failed\n", i);
+    }
+    if (arena->chunk_count == chunks)
+        panic("arena didn't grow\n");
+
+    arena_release(arena, mark);
+    if (arena->chunk_count != chunks)
+        panic("%zu chunks after release, expected %zu\n", arena->chunk_count, chunks);
+    if (arena->bytes_allocated != ARENA_TEST_SIZE)
+        panic("%zu bytes allocated after release\n", arena->bytes_allocated);
+    if (arena_alloc(arena, ARENA_TEST_SIZE) != after_mark)
+        panic("release didn't rewind the arena\n");
+
+    /* reset goes back to an empty first chunk */
+    for (uint i = 0; i < ARENA_TEST_COUNT; i++) {
+        if (!arena_alloc(arena, ARENA_TEST_SIZE))
+            panic("allocation %u failed\n", i);
+    }
+    arena_reset(arena);
+    if (arena->chunk_count != 1 || arena->bytes_allocated != 0)
+        panic("reset left %zu chunks, %zu bytes\n", arena->chunk_count, arena->bytes_allocated);
+    if (arena_alloc(arena, ARENA_TEST_SIZE) != first)
+        panic("reset didn't rewind the arena\n");
+
+    arena_destroy(arena);
+}
+
+static int arena_test_scratch_thread(void *arg)
+{
+    arena_t *parent = arg;
+
+    /* a new thread doesn't start out with its parent's arena */
+    arena_t *a = arena_scratch_get();
+    if (!a || a == parent)
+        panic("thread got scratch arena %p, its parent's is %p\n", a, parent);
+    arena_scratch_put(a);
+
+    /* and keeps its own */
+    if (arena_scratch_get() != a)
+        panic("thread didn't keep its scratch arena\n");
+    arena_scratch_put(a);
+
+    return 0;
+}
+
+static void arena_test_scratch(void)
+{
+    printf("running scratch arena tests...\n");
+
+    /* the thread keeps the arena it put back for its next get */
+    arena_t *mine = arena_scratch_get();
+    if (!mine)
+        panic("scratch arena failed\n");
+    arena_scratch_put(mine);
+    if (arena_scratch_get() != mine)
+        panic("scratch arena wasn't kept for the thread\n");
+
+    /* a nested get can't have the one that is in use */
+    arena_t *nested = arena_scratch_get();
+    if (!nested || nested == mine)
+        panic("nested scratch arena %p, outer %p\n", nested, mine);
+    arena_scratch_put(nested);
+    arena_scratch_put(mine);
+
+    /* the inner one went back first, so the thread kept that */
+    if (arena_scratch_get() != nested)
+        panic("thread didn't keep the first scratch arena put back\n");
+    arena_scratch_put(nested);
+
+    /* another thread takes its arena from the pool and gives it back when it exits */
+    uint before = arena_scratch_available();
+    thread_t *t = thread_create("arena test", &arena_test_scratch_thread, nested,
+                                DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!t)
+        panic("thread_create failed\n");
+    thread_resume(t);
+    thread_join(t, NULL, INFINITE_TIME);
+    if (arena_scratch_available() != MAX(before, 1u))
+        panic("exiting thread didn't return its scratch arena\n");
+
+    printf("running scratch pool tests...\n");
+
+    /* take the thread's arena, everything in the pool and then some, which
+     * creates new arenas */
+    uint available = arena_scratch_available();
+    uint count = available + 3;
+    arena_t **scratch = calloc(count, sizeof(arena_t *));
+    if (!scratch)
+        panic("out of memory\n");
+
+    for (uint i = 0; i < count; i++) {
+        scratch[i] = arena_scratch_get();
+        if (!scratch[i])
+            panic("scratch arena %u of %u failed\n", i, count);
+        if (scratch[i]->bytes_allocated != 0)
+            panic("scratch arena %p wasn't reset\n", scratch[i]);
+        for (uint j = 0; j < i; j++) {
+            if (scratch[j] == scratch[i])
+                panic("scratch arena %p handed out twice\n", scratch[i]);
+        }
+        if (!arena_alloc(scratch[i], ARENA_TEST_SIZE))
+            panic("scratch allocation failed\n");
+    }
+    if (arena_scratch_available() != 0)
+        panic("pool not empty, %u left\n", arena_scratch_available());
+
+    /* giving them all back refills the thread's slot, then the pool, and
+     * destroys the rest */
+    for (uint i = 0; i < count; i++)
+        arena_scratch_put(scratch[i]);
+    if (arena_scratch_available() != MIN(count - 1, (uint)ARENA_SCRATCH_MAX))
+        panic("%u arenas in the pool, expected %u\n", arena_scratch_available(),
+              MIN(count - 1, (uint)ARENA_SCRATCH_MAX));
+
+    /* and what comes out again is empty */
+    arena_t *a = arena_scratch_get();
+    if (!a || a->bytes_allocated != 0 || a->chunk_count != 1)
+        panic("scratch arena %p wasn't reset\n", a);
+    arena_scratch_put(a);
+
+    free(scratch);
+}
+
+int arena_tests(int argc, const cmd_args *argv)
+{
+    arena_test_bump();
+    arena_test_align();
+    arena_test_mark_reset();
+    arena_test_scratch();
+
+    printf("arena tests passed\n");
+
+    return NO_ERROR;
+}
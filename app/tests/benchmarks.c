@@ -31,6 +31,7 @@
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <kernel/event.h>
+#include <kernel/mp.h>
 #include <platform.h>
 
 const size_t BUFSIZE = (1024*1024);
@@ -243,6 +244,201 @@ __NO_INLINE static void bench_sincos(void)
 
 #endif // WITH_LIB_LIBM
 
+#define BENCH_MALLOC_SLOTS 64
+#define BENCH_MALLOC_ITER 100000
+
+static event_t bench_malloc_start;
+
+/* churn through a small working set of randomly sized small allocations */
+static int bench_malloc_thread(void *arg)
+{
+    void *slots[BENCH_MALLOC_SLOTS] = { 0 };
+    uint32_t seed = (uintptr_t)arg;
+
+    event_wait(&bench_malloc_start);
+
+    for (uint i = 0; i < BENCH_MALLOC_ITER; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint slot = (seed >> 16) % BENCH_MALLOC_SLOTS;
+
+        free(slots[slot]);
+        slots[slot] = malloc(16 + (seed >> 8) % 240);
+    }
+
+    for (uint i = 0; i < BENCH_MALLOC_SLOTS; i++)
+        free(slots[i]);
+
+    return 0;
+}
+
+__NO_INLINE static void bench_malloc_threads(void)
+{
+    __UNUSED uint cpus[SMP_MAX_CPUS];
+    uint cpu_count = 0;
+
+#if WITH_SMP
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (mp_is_cpu_active(i))
+            cpus[cpu_count++] = i;
+    }
+#else
+    cpus[cpu_count++] = 0;
+#endif
+
+    for (uint n = 1; n <= cpu_count; n++) {
+        thread_t *threads[SMP_MAX_CPUS];
+
+        event_init(&bench_malloc_start, false, 0);
+        for (uint i = 0; i < n; i++) {
+            threads[i] = thread_create("malloc bench", &bench_malloc_thread,
+                                       (void *)(uintptr_t)(i + 1), DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+            thread_set_pinned_cpu(threads[i], cpus[i]);
+            thread_resume(threads[i]);
+        }
+
+        /* let everyone get to the start line */
+        thread_sleep(10);
+
+        lk_bigtime_t t = current_time_hires();
+        event_signal(&bench_malloc_start, true);
+        for (uint i = 0; i < n; i++)
+            thread_join(threads[i], NULL, INFINITE_TIME);
+        t = current_time_hires() - t;
+        event_destroy(&bench_malloc_start);
+
+        /* a free and a malloc per iteration */
+        uint64_t ops = (uint64_t)n * BENCH_MALLOC_ITER * 2;
+        printf("%u cpu%s: %llu malloc/free ops in %llu usecs (%llu ops/sec, %llu ops/sec per cpu)\n",
+               n, (n == 1) ? "" : "s", ops, t, ops * 1000000 / t, ops * 1000000 / t / n);
+    }
+}
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+
+static volatile bool bench_vm_busy;
+
+static int bench_vm_busy_thread(void *arg)
+{
+    volatile uint8_t *buf = arg;
+
+    /* keep this cpu active and walking kernel mappings */
+    while (bench_vm_busy) {
+        for (size_t i = 0; i < BUFSIZE; i += PAGE_SIZE)
+            buf[i]++;
+    }
+
+    return 0;
+}
+
+__NO_INLINE static void bench_vm_unmap(void)
+{
+    static const size_t sizes[] = { 16 * 1024, 256 * 1024, 4 * 1024 * 1024, 32 * 1024 * 1024 };
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+
+    uint8_t *busy_buf = malloc(BUFSIZE);
+    if (!busy_buf) {
+        printf("failed to allocate buffer\n");
+        return;
+    }
+
+    /* with SMP, park a busy thread on every other cpu so invalidates have to reach them */
+    thread_t *busy[SMP_MAX_CPUS];
+    uint busy_count = 0;
+    bench_vm_busy = true;
+#if WITH_SMP
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        if (i == arch_curr_cpu_num() || !mp_is_cpu_active(i))
+            continue;
+
+        busy[busy_count] = thread_create("unmap bench busy", &bench_vm_busy_thread, busy_buf,
+                                         LOW_PRIORITY, DEFAULT_STACK_SIZE);
+        thread_set_pinned_cpu(busy[busy_count], i);
+        thread_resume(busy[busy_count]);
+        busy_count++;
+    }
+#endif
+
+    for (uint i = 0; i < countof(sizes); i++) {
+        size_t size = sizes[i];
+        void *ptr;
+
+        status_t err = vmm_alloc(aspace, "unmap bench", size, &ptr, 0, 0, 0);
+        if (err < 0) {
+            printf("failed to allocate %zu byte region\n", size);
+            continue;
+        }
+
+        /* pull the mappings into the TLB */
+        for (size_t off = 0; off < size; off += PAGE_SIZE)
+            ((volatile uint8_t *)ptr)[off] = 0;
+
+        lk_bigtime_t t = current_time_hires();
+        vmm_free_region(aspace, (vaddr_t)ptr);
+        t = current_time_hires() - t;
+
+        printf("took %llu usecs to unmap and free a region of %zu bytes (%zu pages) with %u other busy cpus\n",
+               t, size, size / PAGE_SIZE, busy_count);
+    }
+
+    bench_vm_busy = false;
+    for (uint i = 0; i < busy_count; i++)
+        thread_join(busy[i], NULL, INFINITE_TIME);
+
+    free(busy_buf);
+}
+
+#define BENCH_ASPACE_COUNT 4
+#define BENCH_ASPACE_PAGES 16
+#define BENCH_ASPACE_ROUNDS 10000
+
+/* bounce between a few user address spaces, touching a handful of pages in
+ * each, to measure what a context switch costs in TLB refills */
+__NO_INLINE static void bench_aspace_switch(void)
+{
+    vmm_aspace_t *aspaces[BENCH_ASPACE_COUNT] = { 0 };
+    vmm_aspace_t *old_aspace = get_current_thread()->aspace;
+    void *ptr = (void *)(USER_ASPACE_BASE + 16 * 1024 * 1024);
+
+    for (uint i = 0; i < BENCH_ASPACE_COUNT; i++) {
+        status_t err = vmm_create_aspace(&aspaces[i], "switch bench", 0);
+        if (err < 0) {
+            printf("failed to create aspace, err %d\n", err);
+            goto out;
+        }
+
+        /* kernel only permissions so the touches below are allowed */
+        err = vmm_alloc(aspaces[i], "switch bench", BENCH_ASPACE_PAGES * PAGE_SIZE, &ptr, 0,
+                        VMM_FLAG_VALLOC_SPECIFIC, 0);
+        if (err < 0) {
+            printf("failed to allocate in aspace, err %d\n", err);
+            goto out;
+        }
+    }
+
+    lk_bigtime_t t = current_time_hires();
+    for (uint r = 0; r < BENCH_ASPACE_ROUNDS; r++) {
+        for (uint i = 0; i < BENCH_ASPACE_COUNT; i++) {
+            vmm_set_active_aspace(aspaces[i]);
+            for (uint p = 0; p < BENCH_ASPACE_PAGES; p++)
+                ((volatile uint8_t *)ptr)[p * PAGE_SIZE]++;
+        }
+    }
+    t = current_time_hires() - t;
+
+    uint switches = BENCH_ASPACE_ROUNDS * BENCH_ASPACE_COUNT;
+    printf("took %llu usecs for %u aspace switches touching %u pages each (%llu nsecs per switch)\n",
+           t, switches, BENCH_ASPACE_PAGES, t * 1000 / switches);
+
+out:
+    vmm_set_active_aspace(old_aspace);
+    for (uint i = 0; i < BENCH_ASPACE_COUNT; i++) {
+        if (aspaces[i])
+            vmm_free_aspace(aspaces[i]);
+    }
+}
+#endif // WITH_KERNEL_VM
+
 void benchmarks(void)
 {
     bench_set_overhead();
@@ -264,6 +460,11 @@ void benchmarks(void)
 #endif
 #if WITH_LIB_LIBM
     bench_sincos();
+#endif
+    bench_malloc_threads();
+#if WITH_KERNEL_VM
+    bench_vm_unmap();
+    bench_aspace_switch();
 #endif
 }
 
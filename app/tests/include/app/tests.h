@@ -25,9 +25,11 @@
 
 #include <lib/console.h>
 
+int arena_tests(int argc, const cmd_args *argv);
 int cbuf_tests(int argc, const cmd_args *argv);
 int fibo(int argc, const cmd_args *argv);
 int port_tests(void);
+int slab_tests(int argc, const cmd_args *argv);
 int spinner(int argc, const cmd_args *argv);
 int thread_tests(void);
 void benchmarks(void);
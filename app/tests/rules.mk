@@ -3,6 +3,7 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_SRCS += \
+    $(LOCAL_DIR)/arena_tests.c \
     $(LOCAL_DIR)/benchmarks.c \
     $(LOCAL_DIR)/cache_tests.c \
     $(LOCAL_DIR)/cbuf_tests.c \
@@ -13,6 +14,7 @@ MODULE_SRCS += \
     $(LOCAL_DIR)/float_test_vec.c \
     $(LOCAL_DIR)/mem_tests.c \
     $(LOCAL_DIR)/printf_tests.c \
+    $(LOCAL_DIR)/slab_tests.c \
     $(LOCAL_DIR)/tests.c \
     $(LOCAL_DIR)/thread_tests.c \
     $(LOCAL_DIR)/port_tests.c \
@@ -20,7 +22,9 @@ MODULE_SRCS += \
 MODULE_ARM_OVERRIDE_SRCS := \
 
 MODULE_DEPS += \
-    lib/cbuf
+    lib/arena \
+    lib/cbuf \
+    lib/slab
 
 MODULE_COMPILEFLAGS += -Wno-format -fno-builtin
 
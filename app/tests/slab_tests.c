@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <lib/console.h>
+#include <lib/slab.h>
+#include <rand.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SLAB_TEST_MAGIC 0x51ab51ab
+#define SLAB_TEST_COUNT 1024
+
+struct slab_test_obj {
+    uint32_t magic;
+    uint32_t data[13];
+};
+
+static void slab_test_ctor(void *_obj)
+{
+    struct slab_test_obj *obj = _obj;
+
+    obj->magic = SLAB_TEST_MAGIC;
+}
+
+int slab_tests(int argc, const cmd_args *argv)
+{
+    struct slab_test_obj **objs = calloc(SLAB_TEST_COUNT, sizeof(*objs));
+    if (!objs)
+        return ERR_NO_MEMORY;
+
+    slab_cache_t *cache = slab_cache_create("slab test", sizeof(struct slab_test_obj),
+                                            __alignof(struct slab_test_obj), &slab_test_ctor);
+    if (!cache) {
+        free(objs);
+        return ERR_NO_MEMORY;
+    }
+
+    printf("running basic tests...\n");
+
+    /* every object comes back constructed and unique */
+    for (uint i = 0; i < SLAB_TEST_COUNT; i++) {
+        objs[i] = slab_cache_alloc(cache);
+        if (!objs[i])
+            panic("allocation %u failed\n", i);
+        if (objs[i]->magic != SLAB_TEST_MAGIC)
+            panic("object %p not constructed\n", objs[i]);
+        memset(objs[i]->data, i, sizeof(objs[i]->data));
+    }
+    for (uint i = 0; i < SLAB_TEST_COUNT; i++) {
+        for (uint j = 0; j < countof(objs[i]->data); j++) {
+            if (objs[i]->data[j] != (i & 0xff) * 0x01010101U)
+                panic("object %p was overwritten\n", objs[i]);
+        }
+    }
+
+    printf("running random tests...\n");
+
+    /* free and reallocate at random, objects must keep their constructed state */
+    for (uint n = 0; n < SLAB_TEST_COUNT * 16; n++) {
+        uint i = rand() % SLAB_TEST_COUNT;
+        if (objs[i]) {
+            slab_cache_free(cache, objs[i]);
+            objs[i] = NULL;
+        } else {
+            objs[i] = slab_cache_alloc(cache);
+            if (!objs[i] || objs[i]->magic != SLAB_TEST_MAGIC)
+                panic("bad object %p\n", objs[i]);
+        }
+    }
+
+    for (uint i = 0; i < SLAB_TEST_COUNT; i++) {
+        if (objs[i])
+            slab_cache_free(cache, objs[i]);
+    }
+
+    size_t pages = slab_cache_reclaim(cache);
+    if (pages == 0)
+        panic("nothing was reclaimed\n");
+    printf("reclaimed %zu pages\n", pages);
+
+    slab_cache_destroy(cache);
+    free(objs);
+
+    printf("slab tests passed\n");
+
+    return NO_ERROR;
+}
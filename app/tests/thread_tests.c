@@ -576,6 +576,36 @@ static void join_test(void)
     printf("thread_join returns err %d, retval %d (should be 0 and 55)\n", err, ret);
 }
 
+#define STACK_TEST_SIZE (64 * 1024)
+
+static int stack_tester(void *arg)
+{
+    /* grow down through most of the stack a page at a time, the way a deep
+     * call chain would, so a stack committed on demand faults in each page */
+    volatile uint8_t buf[STACK_TEST_SIZE - 8192];
+
+    for (size_t i = sizeof(buf); i > 0; i -= 4096)
+        buf[i - 1] = (uint8_t)i;
+    for (size_t i = sizeof(buf); i > 0; i -= 4096) {
+        if (buf[i - 1] != (uint8_t)i)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void stack_test(void)
+{
+    int ret = -1;
+
+    printf("testing a thread using most of its stack\n");
+
+    thread_t *t = thread_create("stack tester", &stack_tester, NULL, DEFAULT_PRIORITY, STACK_TEST_SIZE);
+    thread_resume(t);
+    thread_join(t, &ret, INFINITE_TIME);
+    printf("stack tester returns %d (should be 0)\n", ret);
+}
+
 static void spinlock_test(void)
 {
     spin_lock_saved_state_t state;
@@ -631,6 +661,7 @@ int thread_tests(void)
     preempt_test();
 
     join_test();
+    stack_test();
 
     return 0;
 }
@@ -415,13 +415,11 @@ static status_t get_l2_table(arch_aspace_t *aspace, uint32_t l1_index, paddr_t *
     }
 
     /* not found: allocate it */
-    uint32_t *l2_va = pmm_alloc_kpages(1, &aspace->pt_page_list);
+    /* comes back zeroed, which is no access */
+    uint32_t *l2_va = pmm_alloc_zeroed_kpage(&aspace->pt_page_list);
     if (!l2_va)
         return ERR_NO_MEMORY;
 
-    /* wipe it clean to set no access */
-    memset(l2_va, 0, PAGE_SIZE);
-
     /* get physical address */
     ret = arm_vtop((vaddr_t)l2_va, &pa);
     ASSERT(!ret);
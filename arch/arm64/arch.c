@@ -22,6 +22,7 @@
  */
 #include <debug.h>
 #include <stdlib.h>
+#include <string.h>
 #include <arch.h>
 #include <arch/ops.h>
 #include <arch/arm64.h>
@@ -91,6 +92,22 @@ void arch_idle(void)
     __asm__ volatile("wfi");
 }
 
+void arch_zero_page(void *ptr)
+{
+    uint64_t dczid = ARM64_READ_SYSREG(dczid_el0);
+
+    /* DC ZVA is prohibited, fall back to regular stores */
+    if (dczid & (1U << 4)) {
+        memset(ptr, 0, PAGE_SIZE);
+        return;
+    }
+
+    /* zero a whole block per instruction without reading the lines in */
+    size_t block_size = 4U << (dczid & 0xf);
+    for (uint8_t *p = ptr; p < (uint8_t *)ptr + PAGE_SIZE; p += block_size)
+        __asm__ volatile("dc zva, %0" :: "r" (p) : "memory");
+}
+
 void arch_chain_load(void *entry, ulong arg0, ulong arg1, ulong arg2, ulong arg3)
 {
     PANIC_UNIMPLEMENTED;
@@ -334,8 +334,18 @@ __BEGIN_CDECLS
     ISB; \
 })
 
+/* issue a tlbi without synchronizing, for batches that are completed with a single DSB/ISB */
+#define ARM64_TLBI_NOSYNC(op, val) \
+({ \
+    __asm__ volatile("tlbi " #op ", %0" :: "r" (val) : "memory"); \
+})
+
+#define ARM64_TLBI_NOADDR_NOSYNC(op) \
+({ \
+    __asm__ volatile("tlbi " #op ::: "memory"); \
+})
+
 #define MMU_ARM64_GLOBAL_ASID (~0U)
-#define MMU_ARM64_USER_ASID (0U)
 int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
                   vaddr_t vaddr_base, uint top_size_shift,
                   uint top_index_shift, uint page_size_shift,
@@ -38,6 +38,13 @@ struct arch_aspace {
     /* range of address space */
     vaddr_t base;
     size_t size;
+
+    /* asid tagged with its allocation generation, 0 if none assigned yet */
+    uint64_t asid;
+
+    /* mask of cpus that have loaded this address space and may still hold
+     * TLB entries for it */
+    volatile int tlb_cpus;
 };
 
 __END_CDECLS
@@ -22,9 +22,12 @@
  */
 
 #include <arch/arm64/mmu.h>
+#include <arch/ops.h>
 #include <assert.h>
 #include <debug.h>
 #include <err.h>
+#include <kernel/mp.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 #include <lib/heap.h>
 #include <stdlib.h>
@@ -35,6 +38,12 @@
 #define LOCAL_TRACE 0
 #define TRACE_CONTEXT_SWITCH 0
 
+/* Invalidating more than this many pages at once is done with a single
+ * invalidate of the whole ASID (or of the whole TLB for global mappings). */
+#ifndef ARM64_TLB_FLUSH_ALL_THRESHOLD
+#define ARM64_TLB_FLUSH_ALL_THRESHOLD 32
+#endif
+
 STATIC_ASSERT(((long)KERNEL_BASE >> MMU_KERNEL_SIZE_SHIFT) == -1);
 STATIC_ASSERT(((long)KERNEL_ASPACE_BASE >> MMU_KERNEL_SIZE_SHIFT) == -1);
 STATIC_ASSERT(MMU_KERNEL_SIZE_SHIFT <= 48);
@@ -45,11 +54,142 @@ pte_t arm64_kernel_translation_table[MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP]
     __ALIGNED(MMU_KERNEL_PAGE_TABLE_ENTRIES_TOP * 8)
     __SECTION(".bss.prebss.translation_table");
 
+/* ASID allocator. TCR_EL1.AS is left clear, so there are 8 bits of ASID.
+ * Values stored in arch_aspace_t and the tables below carry the generation
+ * the ASID was handed out in above the ASID bits. When the ASIDs run out a
+ * new generation is started and every cpu flushes its TLB before it loads
+ * an ASID again; ASIDs live on a cpu at that point are carried over. */
+#define ARM64_ASID_BITS 8
+#define ARM64_NUM_ASIDS (1UL << ARM64_ASID_BITS)
+#define ARM64_ASID_MASK (ARM64_NUM_ASIDS - 1)
+
+static spin_lock_t arm64_asid_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint64_t arm64_asid_generation = ARM64_NUM_ASIDS;
+static uint32_t arm64_asid_map[ARM64_NUM_ASIDS / 32];
+static uint64_t arm64_active_asid[SMP_MAX_CPUS];
+static uint64_t arm64_reserved_asid[SMP_MAX_CPUS];
+static uint arm64_asid_flush_pending;
+
 static inline bool is_valid_vaddr(arch_aspace_t *aspace, vaddr_t vaddr)
 {
     return (vaddr >= aspace->base && vaddr <= aspace->base + aspace->size - 1);
 }
 
+/* TLB invalidates and page table frees collected while walking the page
+ * tables, so they can be completed together once the walk is done. */
+struct arm64_tlb_batch {
+    arch_aspace_t *aspace;
+    uint asid;
+    uint page_size_shift;
+    bool broadcast;
+
+    /* range of virtual addresses with stale entries */
+    vaddr_t start;
+    vaddr_t end;
+
+    /* page tables that may only be freed once the TLB has been flushed */
+    struct list_node free_tables;
+};
+
+/* can other cpus have TLB entries for this aspace or asid? */
+static bool arm64_tlb_needs_broadcast(arch_aspace_t *aspace, uint asid)
+{
+#if WITH_SMP
+    uint cpu_mask = 1U << arch_curr_cpu_num();
+
+    if (asid == MMU_ARM64_GLOBAL_ASID || !aspace)
+        return (mp.active_cpus & ~cpu_mask) != 0;
+
+    /* order our page table updates against other cpus loading the aspace */
+    __asm__ volatile("dsb ish" ::: "memory");
+    return (aspace->tlb_cpus & ~cpu_mask) != 0;
+#else
+    return false;
+#endif
+}
+
+static void arm64_tlb_batch_init(struct arm64_tlb_batch *batch, arch_aspace_t *aspace,
+                                 uint asid, uint page_size_shift, bool broadcast)
+{
+    batch->aspace = aspace;
+    batch->asid = asid;
+    batch->page_size_shift = page_size_shift;
+    batch->broadcast = broadcast;
+    batch->start = batch->end = 0;
+    list_initialize(&batch->free_tables);
+}
+
+static void arm64_tlb_batch_add(struct arm64_tlb_batch *batch, vaddr_t vaddr, size_t size)
+{
+    if (batch->start == batch->end) {
+        batch->start = vaddr;
+        batch->end = vaddr + size;
+    } else {
+        batch->start = MIN(batch->start, vaddr);
+        batch->end = MAX(batch->end, vaddr + size);
+    }
+}
+
+static void arm64_tlb_batch_flush(struct arm64_tlb_batch *batch)
+{
+    if (batch->start != batch->end) {
+        size_t count = (batch->end - batch->start) >> batch->page_size_shift;
+        bool global = (batch->asid == MMU_ARM64_GLOBAL_ASID);
+
+        /* the aspace may have been given a new asid or been loaded on another
+         * cpu since the batch was started, look again now that the cleared
+         * entries are visible */
+        if (batch->aspace && !global) {
+            batch->broadcast = arm64_tlb_needs_broadcast(batch->aspace, batch->asid);
+            batch->asid = batch->aspace->asid & ARM64_ASID_MASK;
+        }
+
+        LTRACEF("start 0x%lx end 0x%lx count %zu asid 0x%x broadcast %d\n",
+                batch->start, batch->end, count, batch->asid, batch->broadcast);
+
+        /* make the cleared entries visible to the table walkers */
+        if (batch->broadcast)
+            __asm__ volatile("dsb ishst" ::: "memory");
+        else
+            __asm__ volatile("dsb nshst" ::: "memory");
+
+        if (count > ARM64_TLB_FLUSH_ALL_THRESHOLD) {
+            if (global && batch->broadcast)
+                ARM64_TLBI_NOADDR_NOSYNC(vmalle1is);
+            else if (global)
+                ARM64_TLBI_NOADDR_NOSYNC(vmalle1);
+            else if (batch->broadcast)
+                ARM64_TLBI_NOSYNC(aside1is, (uint64_t)batch->asid << 48);
+            else
+                ARM64_TLBI_NOSYNC(aside1, (uint64_t)batch->asid << 48);
+        } else {
+            for (vaddr_t va = batch->start; va != batch->end; va += 1UL << batch->page_size_shift) {
+                if (global && batch->broadcast)
+                    ARM64_TLBI_NOSYNC(vaae1is, va >> 12);
+                else if (global)
+                    ARM64_TLBI_NOSYNC(vaae1, va >> 12);
+                else if (batch->broadcast)
+                    ARM64_TLBI_NOSYNC(vae1is, va >> 12 | (vaddr_t)batch->asid << 48);
+                else
+                    ARM64_TLBI_NOSYNC(vae1, va >> 12 | (vaddr_t)batch->asid << 48);
+            }
+        }
+
+        if (batch->broadcast)
+            __asm__ volatile("dsb ish" ::: "memory");
+        else
+            __asm__ volatile("dsb nsh" ::: "memory");
+        ISB;
+
+        batch->start = batch->end = 0;
+    }
+
+    /* nothing can be walking the freed tables anymore */
+    vm_page_t *page;
+    while ((page = list_remove_head_type(&batch->free_tables, vm_page_t, node)))
+        pmm_free_page(page);
+}
+
 /* convert user level mmu flags to flags that go in L1 descriptors */
 static pte_t mmu_flags_to_pte_attr(uint flags)
 {
@@ -212,11 +352,17 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift)
 
     LTRACEF("page_size_shift %u\n", page_size_shift);
 
-    if (size >= PAGE_SIZE) {
+    if (size == PAGE_SIZE) {
+        void *vaddr = pmm_alloc_zeroed_kpage(NULL);
+        if (!vaddr)
+            return ERR_NO_MEMORY;
+        *paddrp = vaddr_to_paddr(vaddr);
+    } else if (size > PAGE_SIZE) {
         size_t count = size / PAGE_SIZE;
         size_t ret = pmm_alloc_contiguous(count, page_size_shift, paddrp, NULL);
         if (ret != count)
             return ERR_NO_MEMORY;
+        memset(paddr_to_kvaddr(*paddrp), 0, size);
     } else {
         void *vaddr = memalign(size, size);
         if (!vaddr)
@@ -226,13 +372,15 @@ static int alloc_page_table(paddr_t *paddrp, uint page_size_shift)
             free(vaddr);
             return ERR_NO_MEMORY;
         }
+        memset(vaddr, 0, size);
     }
 
     LTRACEF("allocated 0x%lx\n", *paddrp);
     return 0;
 }
 
-static void free_page_table(void *vaddr, paddr_t paddr, uint page_size_shift)
+static void free_page_table(void *vaddr, paddr_t paddr, uint page_size_shift,
+                            struct arm64_tlb_batch *batch)
 {
     LTRACEF("vaddr %p paddr 0x%lx page_size_shift %u\n", vaddr, paddr, page_size_shift);
 
@@ -243,8 +391,10 @@ static void free_page_table(void *vaddr, paddr_t paddr, uint page_size_shift)
         page = paddr_to_vm_page(paddr);
         if (!page)
             panic("bad page table paddr 0x%lx\n", paddr);
-        pmm_free_page(page);
+        list_add_tail(&batch->free_tables, &page->node);
     } else {
+        /* heap backed tables can't be queued, flush now */
+        arm64_tlb_batch_flush(batch);
         free(vaddr);
     }
 }
@@ -267,8 +417,8 @@ static pte_t *arm64_mmu_get_page_table(vaddr_t index, uint page_size_shift, pte_
             vaddr = paddr_to_kvaddr(paddr);
 
             LTRACEF("allocated page table, vaddr %p, paddr 0x%lx\n", vaddr, paddr);
-            memset(vaddr, MMU_PTE_DESCRIPTOR_INVALID, 1U << page_size_shift);
 
+            /* tables come back zeroed, which is all MMU_PTE_DESCRIPTOR_INVALID */
             __asm__ volatile("dmb ishst" ::: "memory");
 
             pte = paddr | MMU_PTE_L012_DESCRIPTOR_TABLE;
@@ -311,7 +461,7 @@ static bool page_table_is_clear(pte_t *page_table, uint page_size_shift)
 static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
                                size_t size,
                                uint index_shift, uint page_size_shift,
-                               pte_t *page_table, uint asid)
+                               pte_t *page_table, struct arm64_tlb_batch *batch)
 {
     pte_t *next_page_table;
     vaddr_t index;
@@ -341,22 +491,21 @@ static void arm64_mmu_unmap_pt(vaddr_t vaddr, vaddr_t vaddr_rel,
             arm64_mmu_unmap_pt(vaddr, vaddr_rem, chunk_size,
                                index_shift - (page_size_shift - 3),
                                page_size_shift,
-                               next_page_table, asid);
+                               next_page_table, batch);
             if (chunk_size == block_size ||
                     page_table_is_clear(next_page_table, page_size_shift)) {
                 LTRACEF("pte %p[0x%lx] = 0 (was page table)\n", page_table, index);
                 page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
                 __asm__ volatile("dmb ishst" ::: "memory");
-                free_page_table(next_page_table, page_table_paddr, page_size_shift);
+                /* walk caches may still hold the table descriptor */
+                arm64_tlb_batch_add(batch, vaddr, chunk_size);
+                free_page_table(next_page_table, page_table_paddr, page_size_shift, batch);
             }
         } else if (pte) {
             LTRACEF("pte %p[0x%lx] = 0\n", page_table, index);
             page_table[index] = MMU_PTE_DESCRIPTOR_INVALID;
             CF;
-            if (asid == MMU_ARM64_GLOBAL_ASID)
-                ARM64_TLBI(vaae1is, vaddr >> 12);
-            else
-                ARM64_TLBI(vae1is, vaddr >> 12 | (vaddr_t)asid << 48);
+            arm64_tlb_batch_add(batch, vaddr, chunk_size);
         } else {
             LTRACEF("pte %p[0x%lx] already clear\n", page_table, index);
         }
@@ -439,9 +588,13 @@ static int arm64_mmu_map_pt(vaddr_t vaddr_in, vaddr_t vaddr_rel_in,
 
     return 0;
 
-err:
-    arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
-                       index_shift, page_size_shift, page_table, asid);
+err: {
+        struct arm64_tlb_batch batch;
+        arm64_tlb_batch_init(&batch, NULL, asid, page_size_shift, arm64_tlb_needs_broadcast(NULL, asid));
+        arm64_mmu_unmap_pt(vaddr_in, vaddr_rel_in, size_in - size,
+                           index_shift, page_size_shift, page_table, &batch);
+        arm64_tlb_batch_flush(&batch);
+    }
     DSB;
     return ERR_GENERIC;
 }
@@ -475,10 +628,10 @@ int arm64_mmu_map(vaddr_t vaddr, paddr_t paddr, size_t size, pte_t attrs,
     return ret;
 }
 
-int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
-                    vaddr_t vaddr_base, uint top_size_shift,
-                    uint top_index_shift, uint page_size_shift,
-                    pte_t *top_page_table, uint asid)
+static int arm64_mmu_unmap_aspace(arch_aspace_t *aspace, vaddr_t vaddr, size_t size,
+                                  vaddr_t vaddr_base, uint top_size_shift,
+                                  uint top_index_shift, uint page_size_shift,
+                                  pte_t *top_page_table, uint asid)
 {
     vaddr_t vaddr_rel = vaddr - vaddr_base;
     vaddr_t vaddr_rel_max = 1UL << top_size_shift;
@@ -496,12 +649,24 @@ int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
         return ERR_INVALID_ARGS;
     }
 
+    struct arm64_tlb_batch batch;
+    arm64_tlb_batch_init(&batch, aspace, asid, page_size_shift, arm64_tlb_needs_broadcast(aspace, asid));
+
     arm64_mmu_unmap_pt(vaddr, vaddr_rel, size,
-                       top_index_shift, page_size_shift, top_page_table, asid);
-    DSB;
+                       top_index_shift, page_size_shift, top_page_table, &batch);
+    arm64_tlb_batch_flush(&batch);
     return 0;
 }
 
+int arm64_mmu_unmap(vaddr_t vaddr, size_t size,
+                    vaddr_t vaddr_base, uint top_size_shift,
+                    uint top_index_shift, uint page_size_shift,
+                    pte_t *top_page_table, uint asid)
+{
+    return arm64_mmu_unmap_aspace(NULL, vaddr, size, vaddr_base, top_size_shift,
+                                  top_index_shift, page_size_shift, top_page_table, asid);
+}
+
 int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 {
     LTRACEF("vaddr 0x%lx paddr 0x%lx count %u flags 0x%x\n", vaddr, paddr, count, flags);
@@ -530,11 +695,13 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
                          MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
                          aspace->tt_virt, MMU_ARM64_GLOBAL_ASID);
     } else {
+        /* non global, so the entries are tagged with the asid and don't leak
+         * into other address spaces now that switching doesn't flush */
         ret = arm64_mmu_map(vaddr, paddr, count * PAGE_SIZE,
-                         mmu_flags_to_pte_attr(flags),
+                         mmu_flags_to_pte_attr(flags) | MMU_PTE_ATTR_NON_GLOBAL,
                          0, MMU_USER_SIZE_SHIFT,
                          MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
-                         aspace->tt_virt, MMU_ARM64_USER_ASID);
+                         aspace->tt_virt, aspace->asid & ARM64_ASID_MASK);
     }
 
     return ret;
@@ -558,17 +725,17 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
 
     int ret;
     if (aspace->flags & ARCH_ASPACE_FLAG_KERNEL) {
-        ret = arm64_mmu_unmap(vaddr, count * PAGE_SIZE,
-                           ~0UL << MMU_KERNEL_SIZE_SHIFT, MMU_KERNEL_SIZE_SHIFT,
-                           MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
-                           aspace->tt_virt,
-                           MMU_ARM64_GLOBAL_ASID);
+        ret = arm64_mmu_unmap_aspace(aspace, vaddr, count * PAGE_SIZE,
+                                     ~0UL << MMU_KERNEL_SIZE_SHIFT, MMU_KERNEL_SIZE_SHIFT,
+                                     MMU_KERNEL_TOP_SHIFT, MMU_KERNEL_PAGE_SIZE_SHIFT,
+                                     aspace->tt_virt,
+                                     MMU_ARM64_GLOBAL_ASID);
     } else {
-        ret = arm64_mmu_unmap(vaddr, count * PAGE_SIZE,
-                           0, MMU_USER_SIZE_SHIFT,
-                           MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
-                           aspace->tt_virt,
-                           MMU_ARM64_USER_ASID);
+        ret = arm64_mmu_unmap_aspace(aspace, vaddr, count * PAGE_SIZE,
+                                     0, MMU_USER_SIZE_SHIFT,
+                                     MMU_USER_TOP_SHIFT, MMU_USER_PAGE_SIZE_SHIFT,
+                                     aspace->tt_virt,
+                                     aspace->asid & ARM64_ASID_MASK);
     }
 
     return ret;
@@ -601,16 +768,13 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
         aspace->base = base;
         aspace->size = size;
 
-        pte_t *va = pmm_alloc_kpages(1, NULL);
+        /* start with an empty top level translation table */
+        pte_t *va = pmm_alloc_zeroed_kpage(NULL);
         if (!va)
             return ERR_NO_MEMORY;
 
         aspace->tt_virt = va;
         aspace->tt_phys = vaddr_to_paddr(aspace->tt_virt);
-
-        /* zero the top level translation table */
-        /* XXX remove when PMM starts returning pre-zeroed pages */
-        memset(aspace->tt_virt, 0, PAGE_SIZE);
     }
 
     LTRACEF("tt_phys 0x%lx tt_virt %p\n", aspace->tt_phys, aspace->tt_virt);
@@ -618,6 +782,89 @@ status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size,
     return NO_ERROR;
 }
 
+static bool arm64_asid_map_test(uint asid)
+{
+    return arm64_asid_map[asid / 32] & (1U << (asid % 32));
+}
+
+static void arm64_asid_map_set(uint asid)
+{
+    arm64_asid_map[asid / 32] |= 1U << (asid % 32);
+}
+
+static void arm64_asid_map_clear(uint asid)
+{
+    arm64_asid_map[asid / 32] &= ~(1U << (asid % 32));
+}
+
+static bool arm64_asid_is_current(uint64_t asid)
+{
+    return (asid & ~ARM64_ASID_MASK) == arm64_asid_generation;
+}
+
+/* start a new generation, keeping the asids that are loaded right now */
+static void arm64_asid_rollover(void)
+{
+    arm64_asid_generation += ARM64_NUM_ASIDS;
+    memset(arm64_asid_map, 0, sizeof(arm64_asid_map));
+
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        uint64_t asid = arm64_active_asid[i];
+
+        /* a cpu that hasn't loaded an asid since the last rollover is still
+         * running with the one reserved back then */
+        if (asid == 0)
+            asid = arm64_reserved_asid[i];
+        if (asid != 0)
+            arm64_asid_map_set(asid & ARM64_ASID_MASK);
+        arm64_reserved_asid[i] = asid;
+        arm64_active_asid[i] = 0;
+    }
+
+    arm64_asid_flush_pending = (1UL << SMP_MAX_CPUS) - 1;
+}
+
+/* pick an asid in the current generation for the aspace, called with the
+ * asid lock held */
+static uint64_t arm64_asid_alloc(arch_aspace_t *aspace)
+{
+    uint64_t old = aspace->asid;
+
+    if (old != 0) {
+        uint64_t asid = arm64_asid_generation | (old & ARM64_ASID_MASK);
+
+        /* still loaded somewhere across the rollover, it keeps its number */
+        bool reserved = false;
+        for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+            if (arm64_reserved_asid[i] == old) {
+                arm64_reserved_asid[i] = asid;
+                reserved = true;
+            }
+        }
+        if (reserved)
+            return asid;
+
+        /* otherwise try to reuse the same number */
+        if (!arm64_asid_map_test(old & ARM64_ASID_MASK)) {
+            arm64_asid_map_set(old & ARM64_ASID_MASK);
+            return asid;
+        }
+    }
+
+    for (;;) {
+        /* asid 0 is never handed out, it marks an aspace without one */
+        for (uint i = 1; i < ARM64_NUM_ASIDS; i++) {
+            if (!arm64_asid_map_test(i)) {
+                arm64_asid_map_set(i);
+                return arm64_asid_generation | i;
+            }
+        }
+
+        LTRACEF("asid rollover, generation 0x%llx\n", arm64_asid_generation);
+        arm64_asid_rollover();
+    }
+}
+
 status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
 {
     LTRACEF("aspace %p\n", aspace);
@@ -627,6 +874,23 @@ status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
 
     // XXX make sure it's not mapped
 
+    /* give back the asid, flushing anything still tagged with it. If it's from
+     * an older generation the number may belong to someone else now and the
+     * pending flushes from the rollover take care of it. */
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&arm64_asid_lock, state);
+    if (aspace->asid != 0 && arm64_asid_is_current(aspace->asid)) {
+        uint asid = aspace->asid & ARM64_ASID_MASK;
+
+        if (arm64_tlb_needs_broadcast(aspace, asid))
+            ARM64_TLBI(aside1is, (uint64_t)asid << 48);
+        else
+            ARM64_TLBI(aside1, (uint64_t)asid << 48);
+        arm64_asid_map_clear(asid);
+    }
+    aspace->asid = 0;
+    spin_unlock_irqrestore(&arm64_asid_lock, state);
+
     vm_page_t *page = paddr_to_vm_page(aspace->tt_phys);
     DEBUG_ASSERT(page);
     pmm_free_page(page);
@@ -639,18 +903,44 @@ void arch_mmu_context_switch(arch_aspace_t *aspace)
     if (TRACE_CONTEXT_SWITCH)
         TRACEF("aspace %p\n", aspace);
 
+    uint cpu = arch_curr_cpu_num();
+
     uint64_t tcr;
     uint64_t ttbr;
     if (aspace) {
         DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
 
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&arm64_asid_lock, state);
+
+        if (!arm64_asid_is_current(aspace->asid))
+            aspace->asid = arm64_asid_alloc(aspace);
+        arm64_active_asid[cpu] = aspace->asid;
+
+        bool flush = arm64_asid_flush_pending & (1U << cpu);
+        arm64_asid_flush_pending &= ~(1U << cpu);
+
+        spin_unlock_irqrestore(&arm64_asid_lock, state);
+
+        /* entries cached under this asid stay in the TLB after we switch away,
+         * so the cpu is left in the mask until the aspace is destroyed */
+        if ((aspace->tlb_cpus & (1U << cpu)) == 0) {
+            atomic_or(&aspace->tlb_cpus, 1U << cpu);
+            __asm__ volatile("dsb ish" ::: "memory");
+        }
+
+        /* asids were recycled since this cpu last loaded one */
+        if (flush) {
+            ARM64_TLBI_NOADDR_NOSYNC(vmalle1);
+            __asm__ volatile("dsb nsh" ::: "memory");
+        }
+
         tcr = MMU_TCR_FLAGS_USER;
-        ttbr = ((uint64_t)MMU_ARM64_USER_ASID << 48) | aspace->tt_phys;
+        ttbr = ((aspace->asid & ARM64_ASID_MASK) << 48) | aspace->tt_phys;
         ARM64_WRITE_SYSREG(ttbr0_el1, ttbr);
 
         if (TRACE_CONTEXT_SWITCH)
             TRACEF("ttbr 0x%llx, tcr 0x%llx\n", ttbr, tcr);
-        ARM64_TLBI(aside1, (uint64_t)MMU_ARM64_USER_ASID << 48);
     } else {
         tcr = MMU_TCR_FLAGS_KERNEL;
 
@@ -660,4 +950,3 @@ void arch_mmu_context_switch(arch_aspace_t *aspace)
 
     ARM64_WRITE_SYSREG(tcr_el1, tcr);
 }
-
@@ -35,10 +35,37 @@
 #include <assert.h>
 #include <err.h>
 #include <arch/arch_ops.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
 
 #define LOCAL_TRACE 0
 
+/* Invalidating more than this many pages at once is done by flushing the whole TLB */
+#ifndef X86_TLB_FLUSH_ALL_THRESHOLD
+#define X86_TLB_FLUSH_ALL_THRESHOLD 32
+#endif
+
+/* TLB invalidations and page table frees collected while unmapping, completed
+ * together once the page tables have been updated.
+ *
+ * x86 only runs on a single cpu in this tree, so there are no other cpus
+ * to shoot down.
+ */
+struct x86_tlb_batch {
+    /* user aspace being unmapped from, NULL for the kernel or the loaded tables */
+    arch_aspace_t *aspace;
+
+    /* range of virtual addresses with stale entries */
+    vaddr_t start;
+    vaddr_t end;
+
+    /* whether any of the cleared entries were global */
+    bool global;
+
+    /* page tables that may only be freed once the TLB has been flushed */
+    struct list_node free_tables;
+};
+
 /* Address width including virtual/physical address*/
 uint8_t g_vaddr_width = 0;
 uint8_t g_paddr_width = 0;
@@ -54,6 +81,22 @@ map_addr_t pdp_high[NO_OF_PT_ENTRIES] __ALIGNED(PAGE_SIZE);
 /* a big pile of page tables needed to map 64GB of memory into kernel space using 2MB pages */
 map_addr_t linear_map_pdp[(64ULL*GB) / (2*MB)];
 
+/* cr3 the kernel booted with, loaded when no user aspace is active */
+static paddr_t kernel_cr3;
+
+/* Process context ids. When the cpu supports them each user aspace is tagged
+ * with its own pcid so its TLB entries survive switching to another aspace.
+ * pcid 0 is used by the kernel tables and by aspaces that could not get one,
+ * those are flushed on every switch as before. */
+#define X86_NUM_PCIDS       4096
+#define X86_CR3_PCID_MASK   0xfffULL
+#define X86_CR3_NOFLUSH     (1ULL << 63)
+
+static bool x86_pcid_enabled;
+static bool x86_invpcid_supported;
+static spin_lock_t x86_pcid_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint32_t x86_pcid_map[X86_NUM_PCIDS / 32];
+
 /**
  * @brief  check if the virtual address is aligned and canonical
  *
@@ -322,7 +365,7 @@ static void update_pt_entry(vaddr_t vaddr, paddr_t paddr,  uint64_t pde, arch_fl
     pt_index = (((uint64_t)vaddr >> PT_SHIFT) & ((1ul << ADDR_OFFSET) - 1));
     pt_table[pt_index] = (uint64_t)paddr;
     pt_table[pt_index] |= flags | X86_MMU_PG_P;
-    if (!(flags & X86_MMU_PG_U))
+    if (!(flags & X86_MMU_PG_U) && is_kernel_address(vaddr))
         pt_table[pt_index] |= X86_MMU_PG_G; /* setting global flag for kernel pages */
 }
 
@@ -373,12 +416,9 @@ static void update_pml4_entry(vaddr_t vaddr, addr_t pml4_addr, map_addr_t m, arc
  */
 static map_addr_t *_map_alloc_page(void)
 {
-    map_addr_t *page_ptr = pmm_alloc_kpage();
+    map_addr_t *page_ptr = pmm_alloc_zeroed_kpage(NULL);
     DEBUG_ASSERT(page_ptr);
 
-    if (page_ptr)
-        memset(page_ptr, 0, PAGE_SIZE);
-
     return page_ptr;
 }
 
@@ -474,11 +514,82 @@ clean:
     return ret;
 }
 
+static void x86_tlb_batch_init(struct x86_tlb_batch *batch, arch_aspace_t *aspace)
+{
+    batch->aspace = aspace;
+    batch->start = batch->end = 0;
+    batch->global = false;
+    list_initialize(&batch->free_tables);
+}
+
+static void x86_tlb_batch_add(struct x86_tlb_batch *batch, vaddr_t vaddr, bool global)
+{
+    if (batch->start == batch->end) {
+        batch->start = vaddr;
+        batch->end = vaddr + PAGE_SIZE;
+    } else {
+        batch->start = MIN(batch->start, vaddr);
+        batch->end = MAX(batch->end, vaddr + PAGE_SIZE);
+    }
+    batch->global |= global;
+}
+
+static void x86_tlb_flush_all(bool global)
+{
+    uint64_t cr4 = x86_get_cr4();
+
+    if (global) {
+        /* changing PGE either way drops every entry, global ones and
+         * those of all pcids included */
+        x86_set_cr4(cr4 ^ X86_CR4_PGE);
+        x86_set_cr4(cr4);
+    } else {
+        /* reloading cr3 flushes the non global entries of the current pcid */
+        x86_set_cr3(x86_get_cr3());
+    }
+}
+
+/* is the aspace's top level table the one currently loaded? */
+static bool x86_aspace_is_loaded(arch_aspace_t *aspace)
+{
+    return (x86_get_cr3() & X86_PG_FRAME) == aspace->pml4_phys;
+}
+
+static void x86_tlb_batch_flush(struct x86_tlb_batch *batch)
+{
+    if (batch->start != batch->end) {
+        size_t count = (batch->end - batch->start) / PAGE_SIZE;
+
+        LTRACEF("start 0x%lx end 0x%lx count %zu global %d\n",
+                batch->start, batch->end, count, batch->global);
+
+        if (batch->aspace && !batch->global && !x86_aspace_is_loaded(batch->aspace)) {
+            /* invlpg only reaches the current pcid, so leave the flush to
+             * when the aspace is next loaded */
+            batch->aspace->tlb_stale = true;
+        } else if (count > X86_TLB_FLUSH_ALL_THRESHOLD) {
+            x86_tlb_flush_all(batch->global);
+        } else {
+            for (vaddr_t va = batch->start; va != batch->end; va += PAGE_SIZE)
+                x86_invlpg(va);
+        }
+
+        batch->start = batch->end = 0;
+        batch->global = false;
+    }
+
+    /* nothing can be walking the freed tables anymore */
+    vm_page_t *page;
+    while ((page = list_remove_head_type(&batch->free_tables, vm_page_t, node)))
+        pmm_free_page(page);
+}
+
 /**
  * @brief  x86-64 MMU unmap an entry in the page tables recursively and clear out tables
  *
  */
-static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
+static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry,
+                                struct x86_tlb_batch *batch)
 {
     uint32_t offset = 0, next_level_offset = 0;
     vaddr_t *table, *next_table_addr, value;
@@ -531,7 +642,7 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
     LTRACEF_LEVEL(2, "recursing\n");
 
     level -= 1;
-    x86_mmu_unmap_entry(vaddr, level, (vaddr_t)next_table_addr);
+    x86_mmu_unmap_entry(vaddr, level, (vaddr_t)next_table_addr, batch);
     level += 1;
 
     LTRACEF_LEVEL(2, "next_table_addr %p\n", next_table_addr);
@@ -543,19 +654,22 @@ static void x86_mmu_unmap_entry(vaddr_t vaddr, int level, vaddr_t table_entry)
             if ((next_table_addr[next_level_offset] & X86_MMU_PG_P) != 0)
                 return; /* There is an entry in the next level table */
         }
-        pmm_free_page(paddr_to_vm_page(X86_VIRT_TO_PHYS(next_table_addr)));
+        list_add_tail(&batch->free_tables,
+                      &paddr_to_vm_page(X86_VIRT_TO_PHYS(next_table_addr))->node);
     }
     /* All present bits for all entries in next level table for this address are 0 */
     if ((X86_PHYS_TO_VIRT(table[offset]) & X86_MMU_PG_P) != 0) {
         arch_disable_ints();
         value = table[offset];
+        x86_tlb_batch_add(batch, vaddr, (value & X86_MMU_PG_G) != 0);
         value = value & X86_PTE_NOT_PRESENT;
         table[offset] = value;
         arch_enable_ints();
     }
 }
 
-status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
+static status_t x86_mmu_unmap_aspace(arch_aspace_t *aspace, map_addr_t pml4,
+                                     vaddr_t vaddr, uint count)
 {
     vaddr_t next_aligned_v_addr;
 
@@ -566,19 +680,27 @@ status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
     if (count == 0)
         return NO_ERROR;
 
+    struct x86_tlb_batch batch;
+    x86_tlb_batch_init(&batch, aspace);
+
     next_aligned_v_addr = vaddr;
     while (count > 0) {
-        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, pml4);
+        x86_mmu_unmap_entry(next_aligned_v_addr, X86_PAGING_LEVELS, pml4, &batch);
         next_aligned_v_addr += PAGE_SIZE;
         count--;
     }
+
+    x86_tlb_batch_flush(&batch);
     return NO_ERROR;
 }
 
-int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
+status_t x86_mmu_unmap(map_addr_t pml4, vaddr_t vaddr, uint count)
 {
-    addr_t current_cr3_val;
+    return x86_mmu_unmap_aspace(NULL, pml4, vaddr, count);
+}
 
+int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
+{
     LTRACEF("aspace %p, vaddr 0x%lx, count %u\n", aspace, vaddr, count);
 
     DEBUG_ASSERT(aspace);
@@ -589,10 +711,8 @@ int arch_mmu_unmap(arch_aspace_t *aspace, vaddr_t vaddr, uint count)
     if (count == 0)
         return NO_ERROR;
 
-    DEBUG_ASSERT(x86_get_cr3());
-    current_cr3_val = (addr_t)x86_get_cr3();
-
-    return (x86_mmu_unmap(X86_PHYS_TO_VIRT(current_cr3_val), vaddr, count));
+    return (x86_mmu_unmap_aspace((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) ? NULL : aspace,
+                                 aspace->pml4_virt, vaddr, count));
 }
 
 /**
@@ -638,7 +758,6 @@ status_t x86_mmu_map_range(map_addr_t pml4, struct map_range *range, arch_flags_
 
 status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, uint *flags)
 {
-    addr_t current_cr3_val;
     uint32_t ret_level;
     map_addr_t last_valid_entry;
     arch_flags_t ret_flags;
@@ -651,10 +770,7 @@ status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, ui
     if (!paddr)
         return ERR_INVALID_ARGS;
 
-    DEBUG_ASSERT(x86_get_cr3());
-    current_cr3_val = (addr_t)x86_get_cr3();
-
-    stat = x86_mmu_get_mapping(X86_PHYS_TO_VIRT(current_cr3_val), vaddr, &ret_level, &ret_flags, &last_valid_entry);
+    stat = x86_mmu_get_mapping(aspace->pml4_virt, vaddr, &ret_level, &ret_flags, &last_valid_entry);
     if (stat)
         return stat;
 
@@ -670,7 +786,6 @@ status_t arch_mmu_query(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t *paddr, ui
 
 int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count, uint flags)
 {
-    addr_t current_cr3_val;
     struct map_range range;
 
     DEBUG_ASSERT(aspace);
@@ -686,14 +801,11 @@ int arch_mmu_map(arch_aspace_t *aspace, vaddr_t vaddr, paddr_t paddr, uint count
     if (count == 0)
         return NO_ERROR;
 
-    DEBUG_ASSERT(x86_get_cr3());
-    current_cr3_val = (addr_t)x86_get_cr3();
-
     range.start_vaddr = vaddr;
     range.start_paddr = paddr;
     range.size = count * PAGE_SIZE;
 
-    return (x86_mmu_map_range(X86_PHYS_TO_VIRT(current_cr3_val), &range, flags));
+    return (x86_mmu_map_range(aspace->pml4_virt, &range, flags));
 }
 
 void x86_mmu_early_init(void)
@@ -731,37 +843,140 @@ void x86_mmu_early_init(void)
     pml4[0] = 0;
 
     /* tlb flush */
-    x86_set_cr3(x86_get_cr3());
+    kernel_cr3 = x86_get_cr3() & X86_PG_FRAME;
+    x86_set_cr3(kernel_cr3);
+
+    /* tag user aspaces with pcids if we can. PCIDE may only be set while
+     * the pcid field of cr3 is zero, which it is for the kernel tables. */
+    if (check_pcid_avail()) {
+        x86_set_cr4(x86_get_cr4() | X86_CR4_PCIDE);
+        x86_pcid_enabled = true;
+        x86_invpcid_supported = check_invpcid_avail();
+
+        /* pcid 0 is the untagged context */
+        x86_pcid_map[0] = 1;
+    }
+
+    LTRACEF("pcid %d invpcid %d\n", x86_pcid_enabled, x86_invpcid_supported);
 }
 
 void x86_mmu_init(void)
 {
 }
 
-/*
- * x86-64 does not support multiple address spaces at the moment, so fail if these apis
- * are used for it.
- */
+static uint x86_pcid_alloc(void)
+{
+    uint pcid = 0;
+
+    if (!x86_pcid_enabled)
+        return 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&x86_pcid_lock, state);
+    for (uint i = 1; i < X86_NUM_PCIDS; i++) {
+        if ((x86_pcid_map[i / 32] & (1U << (i % 32))) == 0) {
+            x86_pcid_map[i / 32] |= 1U << (i % 32);
+            pcid = i;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&x86_pcid_lock, state);
+
+    /* out of pcids, the aspace shares the untagged context */
+    return pcid;
+}
+
+static void x86_pcid_free(uint pcid)
+{
+    if (pcid == 0)
+        return;
+
+    /* nothing tagged with the pcid may be left behind for its next owner */
+    if (x86_invpcid_supported)
+        x86_invpcid(X86_INVPCID_SINGLE, pcid, 0);
+    else
+        x86_tlb_flush_all(true);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&x86_pcid_lock, state);
+    x86_pcid_map[pcid / 32] &= ~(1U << (pcid % 32));
+    spin_unlock_irqrestore(&x86_pcid_lock, state);
+}
+
 status_t arch_mmu_init_aspace(arch_aspace_t *aspace, vaddr_t base, size_t size, uint flags)
 {
+    LTRACEF("aspace %p, base 0x%lx, size 0x%zx, flags 0x%x\n", aspace, base, size, flags);
+
     DEBUG_ASSERT(aspace);
 
-    if ((flags & ARCH_ASPACE_FLAG_KERNEL) == 0) {
-        return ERR_NOT_SUPPORTED;
+    aspace->flags = flags;
+    aspace->base = base;
+    aspace->size = size;
+    aspace->pcid = 0;
+    aspace->tlb_stale = false;
+
+    if (flags & ARCH_ASPACE_FLAG_KERNEL) {
+        aspace->pml4_phys = x86_get_cr3() & X86_PG_FRAME;
+        aspace->pml4_virt = X86_PHYS_TO_VIRT(aspace->pml4_phys);
+    } else {
+        /* user aspaces live below the kernel's single top level slot */
+        DEBUG_ASSERT(base + size <= KERNEL_ASPACE_BASE);
+
+        map_addr_t *va = _map_alloc_page();
+        if (!va)
+            return ERR_NO_MEMORY;
+
+        /* share the kernel half of the address space */
+        map_addr_t *kernel_pml4 = (map_addr_t *)X86_PHYS_TO_VIRT(kernel_cr3);
+        for (uint i = NO_OF_PT_ENTRIES / 2; i < NO_OF_PT_ENTRIES; i++)
+            va[i] = kernel_pml4[i];
+
+        aspace->pml4_virt = (vaddr_t)va;
+        aspace->pml4_phys = X86_VIRT_TO_PHYS(va);
+        aspace->pcid = x86_pcid_alloc();
     }
 
+    LTRACEF("pml4 0x%lx phys 0x%lx pcid %u\n", aspace->pml4_virt, aspace->pml4_phys, aspace->pcid);
+
     return NO_ERROR;
 }
 
 status_t arch_mmu_destroy_aspace(arch_aspace_t *aspace)
 {
+    LTRACEF("aspace %p\n", aspace);
+
+    DEBUG_ASSERT(aspace);
+    DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+    DEBUG_ASSERT(!x86_aspace_is_loaded(aspace));
+
+    x86_pcid_free(aspace->pcid);
+    aspace->pcid = 0;
+
+    pmm_free_page(paddr_to_vm_page(aspace->pml4_phys));
+
     return NO_ERROR;
 }
 
 void arch_mmu_context_switch(arch_aspace_t *aspace)
 {
-    if (aspace != NULL) {
-        PANIC_UNIMPLEMENTED;
+    uint64_t cr3;
+
+    if (aspace) {
+        DEBUG_ASSERT((aspace->flags & ARCH_ASPACE_FLAG_KERNEL) == 0);
+
+        cr3 = aspace->pml4_phys;
+        if (aspace->pcid) {
+            /* keep the entries cached under the pcid unless some went stale */
+            cr3 |= aspace->pcid;
+            if (!aspace->tlb_stale)
+                cr3 |= X86_CR3_NOFLUSH;
+        }
+        aspace->tlb_stale = false;
+    } else {
+        cr3 = kernel_cr3;
     }
-}
 
+    LTRACEF_LEVEL(2, "aspace %p cr3 0x%llx\n", aspace, cr3);
+
+    x86_set_cr3(cr3);
+}
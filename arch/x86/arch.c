@@ -44,6 +44,13 @@ __SECTION(".data") void *_multiboot_info;
 /* main tss */
 static tss_t system_tss;
 
+#if ARCH_X86_64
+/* where the tss puts double and page faults, so they can still be taken when
+ * the thread stack is the thing that faulted */
+static uint8_t x86_double_fault_stack[PAGE_SIZE * 2] __ALIGNED(16);
+static uint8_t x86_page_fault_stack[PAGE_SIZE * 2] __ALIGNED(16);
+#endif
+
 void arch_early_init(void)
 {
     /* enable caches here for now */
@@ -60,10 +67,20 @@ void arch_early_init(void)
     system_tss.bitmap = offsetof(tss_32_t, tss_bitmap);
     system_tss.trace = 1; // trap on hardware task switch
 #endif
+#if ARCH_X86_64
+    system_tss.ist1 = (uintptr_t)x86_double_fault_stack + sizeof(x86_double_fault_stack);
+    system_tss.ist2 = (uintptr_t)x86_page_fault_stack + sizeof(x86_page_fault_stack);
+#endif
 
     set_global_desc(TSS_SELECTOR, &system_tss, sizeof(system_tss), 1, 0, 0, SEG_TYPE_TSS, 0, 0);
     x86_ltr(TSS_SELECTOR);
 
+#if ARCH_X86_64
+    /* only now that the tss has stacks for them */
+    x86_set_idt_ist(0x08, IST_DOUBLE_FAULT);
+    x86_set_idt_ist(0x0e, IST_PAGE_FAULT);
+#endif
+
     x86_mmu_early_init();
 }
 
@@ -76,6 +93,18 @@ void arch_init(void)
 #endif
 }
 
+void arch_zero_page(void *ptr)
+{
+    size_t len = PAGE_SIZE;
+
+    /* fast string stores fill whole lines without reading them in */
+    __asm__ volatile(
+        "rep stosb"
+        : "+D" (ptr), "+c" (len)
+        : "a" (0)
+        : "memory");
+}
+
 void arch_chain_load(void *entry, ulong arg0, ulong arg1, ulong arg2, ulong arg3)
 {
     PANIC_UNIMPLEMENTED;
@@ -26,3 +26,16 @@
 void arch_sync_cache_range(addr_t start, size_t len)
 {
 }
+
+/* dma is cache coherent on x86, there is nothing to clean or invalidate */
+void arch_clean_cache_range(addr_t start, size_t len)
+{
+}
+
+void arch_clean_invalidate_cache_range(addr_t start, size_t len)
+{
+}
+
+void arch_invalidate_cache_range(addr_t start, size_t len)
+{
+}
@@ -65,4 +65,23 @@ void set_global_desc(seg_sel_t sel, void *base, uint32_t limit,
     _gdt[index].g = gran != 0;      // granularity
     _gdt[index].s = sys != 0;       // system / non-system
     _gdt[index].d_b = bits != 0;    // 16 / 32 bit
+
+#if ARCH_X86_64
+    // system descriptors take two slots in long mode, the second holds base 63:32
+    if (!sys) {
+        uint32_t *upper = (uint32_t *)&_gdt[index + 1];
+        upper[0] = (uint64_t)(uintptr_t)base >> 32;
+        upper[1] = 0;
+    }
+#endif
+}
+
+#if ARCH_X86_64
+extern uint8_t _idt[];
+
+void x86_set_idt_ist(uint vector, uint ist)
+{
+    // byte 4 of a 16 byte long mode gate picks the interrupt stack table slot
+    _idt[vector * 16 + 4] = ist & 0x7;
 }
+#endif
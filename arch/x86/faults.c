@@ -22,16 +22,21 @@
  * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 #include <debug.h>
+#include <err.h>
 #include <trace.h>
 #include <arch/x86.h>
 #include <arch/fpu.h>
 #include <kernel/thread.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
 
 /* exceptions */
 #define INT_DIVIDE_0        0x00
 #define INT_DEBUG_EX        0x01
 #define INT_INVALID_OP      0x06
 #define INT_DEV_NA_EX       0x07
+#define INT_DOUBLE_FAULT    0x08
 #define INT_STACK_FAULT     0x0c
 #define INT_GP_FAULT        0x0d
 #define INT_PAGE_FAULT      0x0e
@@ -86,6 +91,21 @@ static void exception_die(x86_iframe_t *frame, const char *msg)
     }
 }
 
+/* say so if a kernel fault at addr is the current thread running off the
+ * bottom of its stack into the guard page below it */
+static void check_stack_overflow(vaddr_t addr)
+{
+#if WITH_KERNEL_VM
+    thread_t *t = get_current_thread();
+    vaddr_t stack = (vaddr_t)t->stack;
+
+    if ((t->flags & THREAD_FLAG_FREE_STACK) && addr < stack && addr >= stack - PAGE_SIZE) {
+        dprintf(CRITICAL, "stack overflow in thread %p (%s), stack %p size %zu\n",
+                t, t->name, t->stack, t->stack_size);
+    }
+#endif
+}
+
 void x86_syscall_handler(x86_iframe_t *frame)
 {
     exception_die(frame, "unhandled syscall, halting\n");
@@ -107,6 +127,14 @@ void x86_unhandled_exception(x86_iframe_t *frame)
     exception_die(frame, "unhandled exception, halting\n");
 }
 
+/* a fault that couldn't be delivered, such as a page fault that had nowhere
+ * to push its frame. cr2 still holds the address the page fault was after. */
+void x86_df_handler(x86_iframe_t *frame)
+{
+    check_stack_overflow(x86_get_cr2());
+    exception_die(frame, "double fault, halting\n");
+}
+
 void x86_pfe_handler(x86_iframe_t *frame)
 {
     /* Handle a page fault exception */
@@ -114,6 +142,13 @@ void x86_pfe_handler(x86_iframe_t *frame)
     thread_t *current_thread;
     error_code = frame->err_code;
 
+#if WITH_KERNEL_VM
+    /* the kernel touching a page that is committed on demand, such as
+     * a part of a thread stack it hasn't grown into before */
+    if (!(error_code & (PFEX_U | PFEX_P)) && vmm_page_fault(x86_get_cr2()) == NO_ERROR)
+        return;
+#endif
+
 #ifdef PAGE_FAULT_DEBUG_INFO
     addr_t v_addr, ssp, esp, ip, rip;
     v_addr = x86_get_cr2();
@@ -166,6 +201,7 @@ void x86_pfe_handler(x86_iframe_t *frame)
             case 1:
             case 2:
             case 3:
+                check_stack_overflow(x86_get_cr2());
                 exception_die(frame, "Page Fault exception, halting\n");
                 break;
         }
@@ -196,6 +232,10 @@ void x86_exception_handler(x86_iframe_t *frame)
             x86_pfe_handler(frame);
             break;
 
+        case INT_DOUBLE_FAULT:
+            x86_df_handler(frame);
+            break;
+
         case INT_DEV_NA_EX:
 #if X86_WITH_FPU
             fpu_dev_na_handler();
@@ -119,4 +119,18 @@ static inline uint arch_curr_cpu_num(void)
     return 0;
 }
 
+#define mb()        __asm__ volatile("mfence" : : : "memory")
+#define rmb()       __asm__ volatile("lfence" : : : "memory")
+#define wmb()       __asm__ volatile("sfence" : : : "memory")
+
+/* loads and stores are not reordered against each other, only stores
+ * against later loads */
+#ifdef WITH_SMP
+#define smp_mb()    mb()
+#else
+#define smp_mb()    CF
+#endif
+#define smp_rmb()   CF
+#define smp_wmb()   CF
+
 #endif // !ASSEMBLY
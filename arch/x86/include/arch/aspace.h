@@ -23,11 +23,31 @@
 #pragma once
 
 #include <compiler.h>
+#include <sys/types.h>
 
 __BEGIN_CDECLS
 
 struct arch_aspace {
+#if ARCH_X86_64
+    /* top level page table */
+    vaddr_t pml4_virt;
+    paddr_t pml4_phys;
+
+    uint flags;
+
+    /* range of address space */
+    vaddr_t base;
+    size_t size;
+
+    /* process context id tagging this aspace's TLB entries, 0 if none */
+    uint pcid;
+
+    /* entries were unmapped while the aspace wasn't loaded, so its TLB
+     * entries must be flushed the next time it is */
+    bool tlb_stale;
+#else
     // nothing for now, does not support address spaces other than the kernel
+#endif
 };
 
 __END_CDECLS
@@ -31,3 +31,8 @@
 #define ARCH_DEFAULT_STACK_SIZE 8192
 #define DEFAULT_TSS 4096
 
+#if ARCH_X86_64
+/* double and page faults switch to stacks of their own through the tss */
+#define ARCH_HAS_FAULT_STACK 1
+#endif
+
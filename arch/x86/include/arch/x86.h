@@ -146,8 +146,10 @@ typedef tss_64_t tss_t;
 #define X86_CR0_CD 0x40000000 /* cache disable */
 #define X86_CR0_PG 0x80000000 /* enable paging */
 #define X86_CR4_PAE 0x00000020 /* PAE paging */
+#define X86_CR4_PGE 0x00000080 /* page global enable */
 #define X86_CR4_OSFXSR 0x00000200 /* os supports fxsave */
 #define X86_CR4_OSXMMEXPT 0x00000400 /* os supports xmm exception */
+#define X86_CR4_PCIDE 0x00020000 /* process context ids enable */
 #define X86_CR4_OSXSAVE 0x00040000 /* os supports xsave */
 #define X86_CR4_SMEP 0x00100000 /* SMEP protection enabling */
 #define X86_CR4_SMAP 0x00200000 /* SMAP protection enabling */
@@ -843,6 +845,59 @@ static inline uint64_t check_smap_avail(void)
     return ((reg_b>>0x13) & 0x1);
 }
 
+static inline uint64_t check_pcid_avail(void)
+{
+    uint64_t reg_a = 0x01;
+    uint64_t reg_b = 0x0;
+    uint64_t reg_c = 0x0;
+    uint64_t reg_d = 0x0;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"+a" (reg_a),"=b" (reg_b),"+c" (reg_c),"=d" (reg_d));
+    return ((reg_c>>0x11) & 0x1);
+}
+
+static inline uint64_t check_invpcid_avail(void)
+{
+    uint64_t reg_a = 0x07;
+    uint64_t reg_b = 0x0;
+    uint64_t reg_c = 0x0;
+    uint64_t reg_d = 0x0;
+    __asm__ __volatile__ (
+        "cpuid \n\t"
+        :"+a" (reg_a),"=b" (reg_b),"+c" (reg_c),"=d" (reg_d));
+    return ((reg_b>>0x0a) & 0x1);
+}
+
+static inline void x86_invlpg(vaddr_t vaddr)
+{
+    __asm__ __volatile__ (
+        "invlpg (%0) \n\t"
+        :
+        : "r" (vaddr)
+        : "memory");
+}
+
+/* invpcid types */
+#define X86_INVPCID_ADDR          0 /* one address in one pcid */
+#define X86_INVPCID_SINGLE        1 /* everything but global entries in one pcid */
+#define X86_INVPCID_ALL_GLOBAL    2 /* everything, including global entries */
+#define X86_INVPCID_ALL           3 /* everything but global entries */
+
+static inline void x86_invpcid(uint64_t type, uint64_t pcid, vaddr_t vaddr)
+{
+    struct {
+        uint64_t pcid;
+        uint64_t addr;
+    } desc = { pcid, vaddr };
+
+    __asm__ __volatile__ (
+        "invpcid %0, %1 \n\t"
+        :
+        : "m" (desc), "r" (type)
+        : "memory");
+}
+
 #endif // ARCH_X86_64
 
 __END_CDECLS
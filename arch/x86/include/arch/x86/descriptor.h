@@ -42,6 +42,12 @@
 
 #define TSS_SELECTOR        0x48
 
+/*
+ * Interrupt stack table slots (x86-64)
+ */
+#define IST_DOUBLE_FAULT    1
+#define IST_PAGE_FAULT      2
+
 /*
  * Descriptor Types
  */
@@ -61,4 +67,8 @@ typedef uint16_t seg_sel_t;
 void set_global_desc(seg_sel_t sel, void *base, uint32_t limit,
                      uint8_t present, uint8_t ring, uint8_t sys, uint8_t type, uint8_t gran, uint8_t bits);
 
+#if ARCH_X86_64
+void x86_set_idt_ist(uint vector, uint ist);
+#endif
+
 #endif
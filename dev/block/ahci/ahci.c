@@ -0,0 +1,1126 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <compiler.h>
+#include <debug.h>
+#include <err.h>
+#include <pow2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/pci.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <lib/dma.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+
+/*
+ * AHCI sata controllers on the pci bus.
+ *
+ * Every port with an ata disk behind it is registered as a block device
+ * with a native submit hook. Each of the port's command slots carries one
+ * command with its own prd table, so up to 32 transfers can be in flight.
+ * Disks that support native command queuing get them as queued commands,
+ * others have the hba run them back to back.
+ *
+ * On an error the port stops and everything on it is failed. The next
+ * submitter restarts the port before issuing anything new.
+ */
+
+#define LOCAL_TRACE 0
+
+#define AHCI_CLASS_CODE         0x010601    /* mass storage, sata, ahci 1.0 */
+#define AHCI_ABAR               5
+
+/* hba registers */
+#define AHCI_CAP                0x00
+#define AHCI_GHC                0x04
+#define AHCI_IS                 0x08
+#define AHCI_PI                 0x0c
+#define AHCI_VS                 0x10
+#define AHCI_CAP2               0x24
+#define AHCI_BOHC               0x28
+
+#define AHCI_CAP_NCS(cap)       ((((cap) >> 8) & 0x1f) + 1)
+#define AHCI_CAP_SNCQ           (1u << 30)
+#define AHCI_CAP_S64A           (1u << 31)
+
+#define AHCI_CAP2_BOH           (1u << 0)
+#define AHCI_BOHC_BOS           (1u << 0)
+#define AHCI_BOHC_OOS           (1u << 1)
+
+#define AHCI_GHC_HR             (1u << 0)
+#define AHCI_GHC_IE             (1u << 1)
+#define AHCI_GHC_AE             (1u << 31)
+
+/* port registers */
+#define AHCI_PORT_BASE          0x100
+#define AHCI_PORT_SIZE          0x80
+
+#define AHCI_PxCLB              0x00
+#define AHCI_PxCLBU             0x04
+#define AHCI_PxFB               0x08
+#define AHCI_PxFBU              0x0c
+#define AHCI_PxIS               0x10
+#define AHCI_PxIE               0x14
+#define AHCI_PxCMD              0x18
+#define AHCI_PxTFD              0x20
+#define AHCI_PxSIG              0x24
+#define AHCI_PxSSTS             0x28
+#define AHCI_PxSCTL             0x2c
+#define AHCI_PxSERR             0x30
+#define AHCI_PxSACT             0x34
+#define AHCI_PxCI               0x38
+
+#define AHCI_PxCMD_ST           (1u << 0)
+#define AHCI_PxCMD_SUD          (1u << 1)
+#define AHCI_PxCMD_POD          (1u << 2)
+#define AHCI_PxCMD_FRE          (1u << 4)
+#define AHCI_PxCMD_FR           (1u << 14)
+#define AHCI_PxCMD_CR           (1u << 15)
+
+#define AHCI_PxTFD_ERR          (1u << 0)
+#define AHCI_PxTFD_DRQ          (1u << 3)
+#define AHCI_PxTFD_BSY          (1u << 7)
+
+#define AHCI_PxSSTS_DET_MASK    0xf
+#define AHCI_PxSSTS_DET_PRESENT 0x3
+#define AHCI_PxSCTL_DET_MASK    0xf
+#define AHCI_PxSCTL_DET_INIT    0x1
+
+#define AHCI_PxIS_DHRS          (1u << 0)
+#define AHCI_PxIS_PSS           (1u << 1)
+#define AHCI_PxIS_DSS           (1u << 2)
+#define AHCI_PxIS_SDBS          (1u << 3)
+#define AHCI_PxIS_DPS           (1u << 5)
+#define AHCI_PxIS_OFS           (1u << 24)
+#define AHCI_PxIS_IFS           (1u << 27)
+#define AHCI_PxIS_HBDS          (1u << 28)
+#define AHCI_PxIS_HBFS          (1u << 29)
+#define AHCI_PxIS_TFES          (1u << 30)
+
+#define AHCI_PxIS_DONE          (AHCI_PxIS_DHRS | AHCI_PxIS_PSS | AHCI_PxIS_DSS | AHCI_PxIS_SDBS | AHCI_PxIS_DPS)
+#define AHCI_PxIS_ERROR         (AHCI_PxIS_OFS | AHCI_PxIS_IFS | AHCI_PxIS_HBDS | AHCI_PxIS_HBFS | AHCI_PxIS_TFES)
+
+#define AHCI_SIG_ATA            0x00000101
+
+/* fis and ata commands */
+#define FIS_TYPE_REG_H2D        0x27
+#define FIS_H2D_COMMAND         0x80
+#define ATA_DEVICE_LBA          0x40
+
+#define ATA_CMD_READ_DMA        0xc8
+#define ATA_CMD_WRITE_DMA       0xca
+#define ATA_CMD_READ_DMA_EXT    0x25
+#define ATA_CMD_WRITE_DMA_EXT   0x35
+#define ATA_CMD_READ_FPDMA      0x60
+#define ATA_CMD_WRITE_FPDMA     0x61
+#define ATA_CMD_FLUSH_CACHE     0xe7
+#define ATA_CMD_FLUSH_CACHE_EXT 0xea
+#define ATA_CMD_IDENTIFY        0xec
+
+/* command list entry */
+struct ahci_cmd_header {
+    uint32_t flags;     /* fis length in dwords, direction and prdt length */
+    uint32_t prdbc;     /* bytes transferred */
+    uint64_t ctba;      /* command table, 128 byte aligned */
+    uint32_t rsvd[4];
+} __PACKED;
+
+#define AHCI_CMD_CFL_H2D        5
+#define AHCI_CMD_WRITE          (1u << 6)
+#define AHCI_CMD_PRDTL(n)       ((uint32_t)(n) << 16)
+
+struct ahci_prd {
+    uint64_t dba;       /* word aligned */
+    uint32_t rsvd;
+    uint32_t dbc;       /* byte count - 1 */
+} __PACKED;
+
+/* longest transfer a single command takes, and the prd entries that needs
+ * with a page per entry and a partial one at either end */
+#define AHCI_MAX_XFER           (256 * 1024)
+#define AHCI_MAX_PRDS           (AHCI_MAX_XFER / PAGE_SIZE + 1)
+
+struct ahci_cmd_table {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t rsvd[48];
+    struct ahci_prd prdt[AHCI_MAX_PRDS];
+} __ALIGNED(128);
+
+STATIC_ASSERT(sizeof(struct ahci_cmd_header) == 32);
+STATIC_ASSERT(offsetof(struct ahci_cmd_table, prdt) == 0x80);
+
+#define AHCI_MAX_SLOTS          32
+
+/* per port: the command list, the received fis area, then the tables, each suitably aligned */
+#define AHCI_CMD_LIST_SIZE      (AHCI_MAX_SLOTS * sizeof(struct ahci_cmd_header))
+#define AHCI_FIS_SIZE           256
+#define AHCI_PORT_MEM_SIZE      (AHCI_CMD_LIST_SIZE + AHCI_FIS_SIZE + AHCI_MAX_SLOTS * sizeof(struct ahci_cmd_table))
+
+#define AHCI_TIMEOUT            1000
+#define AHCI_LINK_TIMEOUT       20
+
+struct ahci_hba;
+
+/* a block request, split up into one or more commands */
+struct ahci_io {
+    bio_request_t *req;
+    uint pending;       /* commands in flight, plus one while still submitting */
+    ssize_t result;
+    struct ahci_io *next_free;
+};
+
+/* a command in flight, indexed by slot */
+struct ahci_slot {
+    struct ahci_io *io;
+    dma_map_t map;
+    size_t len;         /* 0 for commands without data */
+};
+
+struct ahci_port {
+    struct ahci_hba *hba;
+    uint index;
+    volatile uint8_t *regs;
+
+    /* command list, received fis area and command tables, in coherent memory */
+    void *mem;
+    paddr_t mem_phys;
+    volatile struct ahci_cmd_header *cmd_list;
+    struct ahci_cmd_table *tables;
+    paddr_t tables_phys;
+
+    /* what the disk can do */
+    bool lba48;
+    bool ncq;
+    bool flush;
+    uint32_t max_sectors;
+    size_t max_xfer;
+
+    /* serializes submitters, held while mapping, waiting for slots and
+     * restarting the port */
+    mutex_t lock;
+
+    /* protects the slots, the request states and the error flag, which the
+     * irq handler also touches */
+    spin_lock_t ring_lock;
+    uint32_t free_slots;
+    uint32_t issued;
+    bool error;
+    uint inflight_count;
+    event_t slot_event;     /* slots or request states were returned */
+    event_t idle_event;     /* nothing in flight */
+
+    /* every request holds a slot or is being submitted, so one more request
+     * state than slots lets the submitter take one with all the slots busy */
+    struct ahci_slot slots[AHCI_MAX_SLOTS];
+    struct ahci_io ios[AHCI_MAX_SLOTS + 1];
+    struct ahci_io *free_io;
+
+    /* scratch for the buffer being mapped, under lock */
+    dma_segment_t segs[AHCI_MAX_PRDS];
+
+    bdev_t bdev;
+};
+
+struct ahci_hba {
+    pci_location_t loc;
+    volatile uint8_t *regs;
+    uint32_t cap;
+
+    struct dma_device dma;
+
+    /* legacy interrupt vector, or the msi one */
+    uint vector;
+    bool msi;
+
+    struct ahci_port *ports[32];
+};
+
+static inline uint32_t ahci_read(struct ahci_hba *hba, uint reg)
+{
+    return *(volatile uint32_t *)(hba->regs + reg);
+}
+
+static inline void ahci_write(struct ahci_hba *hba, uint reg, uint32_t val)
+{
+    *(volatile uint32_t *)(hba->regs + reg) = val;
+}
+
+static inline uint32_t ahci_port_read(struct ahci_port *port, uint reg)
+{
+    return *(volatile uint32_t *)(port->regs + reg);
+}
+
+static inline void ahci_port_write(struct ahci_port *port, uint reg, uint32_t val)
+{
+    *(volatile uint32_t *)(port->regs + reg) = val;
+}
+
+/* wait for the masked bits of a register to read as val */
+static status_t ahci_wait(volatile uint8_t *regs, uint reg, uint32_t mask, uint32_t val, lk_time_t timeout)
+{
+    lk_time_t start = current_time();
+
+    while ((*(volatile uint32_t *)(regs + reg) & mask) != val) {
+        if (current_time() - start > timeout)
+            return ERR_TIMED_OUT;
+        thread_sleep(1);
+    }
+
+    return NO_ERROR;
+}
+
+/* stop command processing and fis reception, after which the hba leaves the port's memory alone */
+static status_t ahci_port_stop(struct ahci_port *port)
+{
+    uint32_t cmd = ahci_port_read(port, AHCI_PxCMD);
+
+    ahci_port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_ST);
+    status_t err = ahci_wait(port->regs, AHCI_PxCMD, AHCI_PxCMD_CR, 0, AHCI_TIMEOUT);
+    if (err < 0)
+        return err;
+
+    cmd = ahci_port_read(port, AHCI_PxCMD);
+    ahci_port_write(port, AHCI_PxCMD, cmd & ~AHCI_PxCMD_FRE);
+    return ahci_wait(port->regs, AHCI_PxCMD, AHCI_PxCMD_FR, 0, AHCI_TIMEOUT);
+}
+
+static status_t ahci_port_start(struct ahci_port *port)
+{
+    /* the device has to be idle before commands can be issued */
+    status_t err = ahci_wait(port->regs, AHCI_PxTFD, AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ, 0, AHCI_TIMEOUT);
+    if (err < 0)
+        return err;
+
+    uint32_t cmd = ahci_port_read(port, AHCI_PxCMD);
+    ahci_port_write(port, AHCI_PxCMD, cmd | AHCI_PxCMD_FRE | AHCI_PxCMD_ST);
+
+    return NO_ERROR;
+}
+
+/* reset the link, for when the device is stuck busy */
+static status_t ahci_port_comreset(struct ahci_port *port)
+{
+    uint32_t sctl = ahci_port_read(port, AHCI_PxSCTL) & ~AHCI_PxSCTL_DET_MASK;
+
+    ahci_port_write(port, AHCI_PxSCTL, sctl | AHCI_PxSCTL_DET_INIT);
+    thread_sleep(1);
+    ahci_port_write(port, AHCI_PxSCTL, sctl);
+
+    status_t err = ahci_wait(port->regs, AHCI_PxSSTS, AHCI_PxSSTS_DET_MASK, AHCI_PxSSTS_DET_PRESENT,
+                             AHCI_LINK_TIMEOUT);
+    ahci_port_write(port, AHCI_PxSERR, ~0U);
+
+    return err;
+}
+
+/* get a port going again after an error. The irq handler has already
+ * failed everything that was in flight. Called with the lock held. */
+static void ahci_port_recover(struct ahci_port *port)
+{
+    DEBUG_ASSERT(is_mutex_held(&port->lock));
+
+    TRACEF("port %u: recovering, tfd 0x%x serr 0x%x\n", port->index,
+           ahci_port_read(port, AHCI_PxTFD), ahci_port_read(port, AHCI_PxSERR));
+
+    ahci_port_stop(port);
+    ahci_port_write(port, AHCI_PxSERR, ~0U);
+    ahci_port_write(port, AHCI_PxIS, ~0U);
+
+    if (ahci_port_read(port, AHCI_PxTFD) & (AHCI_PxTFD_BSY | AHCI_PxTFD_DRQ))
+        ahci_port_comreset(port);
+
+    if (ahci_port_start(port) < 0)
+        TRACEF("port %u: failed to restart\n", port->index);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+    port->error = false;
+    spin_unlock_irqrestore(&port->ring_lock, state);
+}
+
+/* fill in a command header and its register fis */
+static void ahci_setup_cmd(struct ahci_port *port, uint slot, const uint8_t *fis, uint prdtl, bool write)
+{
+    struct ahci_cmd_table *table = &port->tables[slot];
+    volatile struct ahci_cmd_header *header = &port->cmd_list[slot];
+
+    memcpy(table->cfis, fis, 20);
+
+    header->flags = AHCI_CMD_CFL_H2D | (write ? AHCI_CMD_WRITE : 0) | AHCI_CMD_PRDTL(prdtl);
+    header->prdbc = 0;
+    header->ctba = port->tables_phys + slot * sizeof(struct ahci_cmd_table);
+}
+
+/* run a command in slot 0 and poll for it, only used before the port takes interrupts */
+static status_t ahci_exec_polled(struct ahci_port *port, const uint8_t *fis, paddr_t buf, size_t len)
+{
+    struct ahci_cmd_table *table = &port->tables[0];
+
+    table->prdt[0].dba = buf;
+    table->prdt[0].dbc = len - 1;
+    ahci_setup_cmd(port, 0, fis, len ? 1 : 0, false);
+
+    wmb();
+    ahci_port_write(port, AHCI_PxCI, 1);
+
+    lk_time_t start = current_time();
+    while (ahci_port_read(port, AHCI_PxCI) & 1) {
+        if (ahci_port_read(port, AHCI_PxIS) & AHCI_PxIS_TFES)
+            return ERR_IO;
+        if (current_time() - start > AHCI_TIMEOUT)
+            return ERR_TIMED_OUT;
+        thread_sleep(1);
+    }
+
+    if (ahci_port_read(port, AHCI_PxTFD) & AHCI_PxTFD_ERR)
+        return ERR_IO;
+
+    return NO_ERROR;
+}
+
+/* take a command off a slot the hba is done with and account it to its request */
+static void ahci_complete_slot(struct ahci_port *port, uint slot, bool failed)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+
+    struct ahci_slot *s = &port->slots[slot];
+    struct ahci_io *io = s->io;
+    dma_map_t map = s->map;
+    size_t len = s->len;
+    DEBUG_ASSERT(io);
+
+    s->io = NULL;
+    port->free_slots |= 1u << slot;
+    DEBUG_ASSERT(port->inflight_count > 0);
+    if (--port->inflight_count == 0)
+        event_signal(&port->idle_event, false);
+
+    spin_unlock_irqrestore(&port->ring_lock, state);
+
+    LTRACEF("port %u slot %u%s\n", port->index, slot, failed ? " failed" : "");
+
+    if (len > 0)
+        dma_unmap(&map);
+
+    /* the request only completes once all of its buffers are back with the cpu */
+    spin_lock_irqsave(&port->ring_lock, state);
+    if (failed)
+        io->result = ERR_IO;
+    else if (io->result >= 0)
+        io->result += len;
+    bio_request_t *req = NULL;
+    ssize_t result = io->result;
+    if (--io->pending == 0) {
+        req = io->req;
+        io->next_free = port->free_io;
+        port->free_io = io;
+    }
+    spin_unlock_irqrestore(&port->ring_lock, state);
+
+    /* wake a submitter waiting for a slot or a request state */
+    event_signal(&port->slot_event, false);
+
+    if (req)
+        bio_complete(req, result);
+}
+
+static enum handler_return ahci_port_irq(struct ahci_port *port)
+{
+    uint32_t is = ahci_port_read(port, AHCI_PxIS);
+    ahci_port_write(port, AHCI_PxIS, is);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+
+    /* the port stops on errors and there is no telling which queued
+     * command failed, so everything on it goes */
+    bool failed = is & AHCI_PxIS_ERROR;
+    uint32_t done;
+    if (failed) {
+        port->error = true;
+        done = port->issued;
+    } else {
+        done = port->issued & ~(ahci_port_read(port, AHCI_PxSACT) | ahci_port_read(port, AHCI_PxCI));
+    }
+    port->issued &= ~done;
+
+    spin_unlock_irqrestore(&port->ring_lock, state);
+
+    if (failed)
+        TRACEF("port %u: error, is 0x%x tfd 0x%x\n", port->index, is, ahci_port_read(port, AHCI_PxTFD));
+
+    while (done) {
+        uint slot = __builtin_ctz(done);
+        done &= ~(1u << slot);
+        ahci_complete_slot(port, slot, failed);
+    }
+
+    return INT_RESCHEDULE;
+}
+
+static enum handler_return ahci_irq(void *arg)
+{
+    struct ahci_hba *hba = arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    /* keep going until nothing is pending, so a legacy interrupt line drops */
+    uint32_t is;
+    while ((is = ahci_read(hba, AHCI_IS)) != 0) {
+        for (uint32_t pending = is; pending; pending &= pending - 1) {
+            uint n = __builtin_ctz(pending);
+            struct ahci_port *port = hba->ports[n];
+            if (port) {
+                if (ahci_port_irq(port) == INT_RESCHEDULE)
+                    ret = INT_RESCHEDULE;
+            } else {
+                volatile uint32_t *port_is = (volatile uint32_t *)(hba->regs + AHCI_PORT_BASE +
+                                                                   n * AHCI_PORT_SIZE + AHCI_PxIS);
+                *port_is = *port_is;
+            }
+        }
+        ahci_write(hba, AHCI_IS, is);
+    }
+
+    return ret;
+}
+
+/* take a free request state, waiting for one if they are all in use. A
+ * request's state is only returned after its slots, once its buffers are
+ * unmapped, so there may be none free for a moment even with free slots.
+ * Called with the lock held. */
+static struct ahci_io *ahci_alloc_io(struct ahci_port *port, bio_request_t *req)
+{
+    DEBUG_ASSERT(is_mutex_held(&port->lock));
+
+    struct ahci_io *io;
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&port->ring_lock, state);
+        io = port->free_io;
+        if (io)
+            port->free_io = io->next_free;
+        spin_unlock_irqrestore(&port->ring_lock, state);
+        if (io)
+            break;
+
+        event_wait(&port->slot_event);
+    }
+
+    io->req = req;
+    io->pending = 1;
+    io->result = 0;
+
+    return io;
+}
+
+static void ahci_free_io(struct ahci_port *port, struct ahci_io *io)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+    io->next_free = port->free_io;
+    port->free_io = io;
+    spin_unlock_irqrestore(&port->ring_lock, state);
+}
+
+/* drop the submitter's hold on a request, completing it if its commands are done */
+static void ahci_release_io(struct ahci_port *port, struct ahci_io *io, status_t err)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+    if (err < 0)
+        io->result = err;
+    bio_request_t *req = NULL;
+    ssize_t result = io->result;
+    if (--io->pending == 0) {
+        req = io->req;
+        io->next_free = port->free_io;
+        port->free_io = io;
+    }
+    spin_unlock_irqrestore(&port->ring_lock, state);
+
+    if (req)
+        bio_complete(req, result);
+}
+
+/* take a free slot, waiting for one if they are all in use. Called with the lock held. */
+static uint ahci_get_slot(struct ahci_port *port)
+{
+    DEBUG_ASSERT(is_mutex_held(&port->lock));
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&port->ring_lock, state);
+        if (port->free_slots) {
+            uint slot = __builtin_ctz(port->free_slots);
+            port->free_slots &= ~(1u << slot);
+            spin_unlock_irqrestore(&port->ring_lock, state);
+            return slot;
+        }
+        spin_unlock_irqrestore(&port->ring_lock, state);
+
+        event_wait(&port->slot_event);
+    }
+}
+
+static void ahci_put_slot(struct ahci_port *port, uint slot)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+    port->free_slots |= 1u << slot;
+    spin_unlock_irqrestore(&port->ring_lock, state);
+}
+
+/* hand a prepared slot to the hba, the map is owned by the command from here
+ * on. Restarts the port first if it stopped on an error. Called with the lock held. */
+static void ahci_issue(struct ahci_port *port, uint slot, bool queued,
+                       struct ahci_io *io, const dma_map_t *map, size_t len)
+{
+    struct ahci_slot *s = &port->slots[slot];
+    uint32_t bit = 1u << slot;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&port->ring_lock, state);
+    while (port->error) {
+        spin_unlock_irqrestore(&port->ring_lock, state);
+        ahci_port_recover(port);
+        spin_lock_irqsave(&port->ring_lock, state);
+    }
+
+    DEBUG_ASSERT(!s->io);
+    s->io = io;
+    s->len = len;
+    if (map)
+        s->map = *map;
+    io->pending++;
+
+    port->inflight_count++;
+    event_unsignal(&port->idle_event);
+
+    wmb();
+    if (queued)
+        ahci_port_write(port, AHCI_PxSACT, bit);
+    ahci_port_write(port, AHCI_PxCI, bit);
+    port->issued |= bit;
+
+    spin_unlock_irqrestore(&port->ring_lock, state);
+}
+
+/* fill in the prd table from the mapped segments, returning the entry count */
+static ssize_t ahci_build_prdt(struct ahci_port *port, uint slot, uint nsegs)
+{
+    struct ahci_prd *prd = port->tables[slot].prdt;
+
+    for (uint s = 0; s < nsegs; s++) {
+        if (port->segs[s].addr & 1)
+            return ERR_NOT_SUPPORTED;
+
+        prd[s].dba = port->segs[s].addr;
+        prd[s].rsvd = 0;
+        prd[s].dbc = port->segs[s].len - 1;
+    }
+
+    return nsegs;
+}
+
+static void ahci_rw_fis(struct ahci_port *port, uint8_t *fis, bool write, uint64_t lba, uint32_t count, uint slot)
+{
+    memset(fis, 0, 20);
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = FIS_H2D_COMMAND;
+    fis[4] = lba;
+    fis[5] = lba >> 8;
+    fis[6] = lba >> 16;
+    fis[7] = ATA_DEVICE_LBA;
+
+    if (port->ncq) {
+        /* the count moves to the features register, the count register holds the tag */
+        fis[2] = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+        fis[3] = count;
+        fis[11] = count >> 8;
+        fis[12] = slot << 3;
+    } else if (port->lba48) {
+        fis[2] = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+        fis[12] = count;
+        fis[13] = count >> 8;
+    } else {
+        fis[2] = write ? ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA;
+        fis[7] |= (lba >> 24) & 0xf;
+        fis[12] = count;
+        return;
+    }
+
+    fis[8] = lba >> 24;
+    fis[9] = lba >> 32;
+    fis[10] = lba >> 40;
+}
+
+/* queue a read or write, called with the lock held */
+static status_t ahci_queue_rw(struct ahci_port *port, bio_request_t *req, bool write)
+{
+    struct ahci_hba *hba = port->hba;
+    uint block_shift = port->bdev.block_shift;
+    uint8_t *buf = req->buf;
+    uint64_t lba = req->offset >> block_shift;
+    size_t left = req->len;
+    bool queued = false;
+    status_t err = NO_ERROR;
+
+    DEBUG_ASSERT(is_mutex_held(&port->lock));
+
+    struct ahci_io *io = ahci_alloc_io(port, req);
+
+    while (left > 0) {
+        size_t len = MIN(left, port->max_xfer);
+
+        dma_map_t map;
+        ssize_t nsegs = dma_map_single(&hba->dma, buf, len, write ? DMA_TO_DEVICE : DMA_FROM_DEVICE,
+                                       port->segs, countof(port->segs), &map);
+        if (nsegs < 0) {
+            err = nsegs;
+            break;
+        }
+
+        uint slot = ahci_get_slot(port);
+
+        ssize_t prdtl = ahci_build_prdt(port, slot, nsegs);
+        if (prdtl < 0) {
+            err = prdtl;
+            ahci_put_slot(port, slot);
+            dma_unmap(&map);
+            break;
+        }
+
+        uint8_t fis[20];
+        ahci_rw_fis(port, fis, write, lba, len >> block_shift, slot);
+        ahci_setup_cmd(port, slot, fis, prdtl, write);
+        LTRACEF("slot %u lba %llu blocks %zu, %zd segments\n", slot, lba, len >> block_shift, nsegs);
+
+        ahci_issue(port, slot, port->ncq, io, &map, len);
+        queued = true;
+
+        buf += len;
+        lba += len >> block_shift;
+        left -= len;
+    }
+
+    /* if nothing went out, fail the submission instead of the request */
+    if (err < 0 && !queued) {
+        ahci_free_io(port, io);
+        return err;
+    }
+
+    ahci_release_io(port, io, err);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct ahci_port *port = containerof(bdev, struct ahci_port, bdev);
+    status_t err;
+
+    LTRACEF("port %u, req %p op %d, buf %p, offset 0x%llx, len %zu\n",
+            port->index, req, req->op, req->buf, req->offset, req->len);
+
+    mutex_acquire(&port->lock);
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            err = ahci_queue_rw(port, req, req->op == BIO_OP_WRITE);
+            break;
+        case BIO_OP_FLUSH:
+            /* A flush only covers writes that completed before it, and can't
+             * run next to queued commands, so drain the port around it.
+             * Holding the lock keeps later requests behind us. Without a
+             * write cache draining is all there is to it. */
+            event_wait(&port->idle_event);
+            if (port->flush) {
+                uint8_t fis[20] = {};
+                fis[0] = FIS_TYPE_REG_H2D;
+                fis[1] = FIS_H2D_COMMAND;
+                fis[2] = port->lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE;
+                fis[7] = ATA_DEVICE_LBA;
+
+                struct ahci_io *io = ahci_alloc_io(port, req);
+                uint slot = ahci_get_slot(port);
+                ahci_setup_cmd(port, slot, fis, 0, false);
+                ahci_issue(port, slot, false, io, NULL, 0);
+                ahci_release_io(port, io, NO_ERROR);
+                event_wait(&port->idle_event);
+            } else {
+                bio_complete(req, NO_ERROR);
+            }
+            err = NO_ERROR;
+            break;
+        default:
+            err = ERR_NOT_SUPPORTED;
+            break;
+    }
+
+    mutex_release(&port->lock);
+
+    return err;
+}
+
+/* identify the disk and work out how to talk to it */
+static status_t ahci_port_identify(struct ahci_port *port, uint16_t *id, paddr_t id_phys)
+{
+    struct ahci_hba *hba = port->hba;
+
+    uint8_t fis[20] = {};
+    fis[0] = FIS_TYPE_REG_H2D;
+    fis[1] = FIS_H2D_COMMAND;
+    fis[2] = ATA_CMD_IDENTIFY;
+
+    status_t err = ahci_exec_polled(port, fis, id_phys, 512);
+    if (err < 0)
+        return err;
+
+    port->lba48 = id[83] & (1u << 10);
+    uint64_t sectors;
+    if (port->lba48) {
+        sectors = id[100] | ((uint32_t)id[101] << 16) | ((uint64_t)id[102] << 32) | ((uint64_t)id[103] << 48);
+        port->max_sectors = 65536;
+    } else {
+        sectors = id[60] | ((uint32_t)id[61] << 16);
+        port->max_sectors = 256;
+    }
+
+    /* queued commands are capped by the hba's slots and the disk's queue depth */
+    uint slots = AHCI_CAP_NCS(hba->cap);
+    port->ncq = (hba->cap & AHCI_CAP_SNCQ) && (id[76] & (1u << 8));
+    if (port->ncq)
+        slots = MIN(slots, (id[75] & 0x1fu) + 1);
+    port->free_slots = (slots == 32) ? ~0U : (1u << slots) - 1;
+
+    /* only bother flushing if the write cache is on */
+    port->flush = (id[85] & (1u << 5)) && (id[83] & (port->lba48 ? (1u << 13) : (1u << 12)));
+
+    size_t block_size = 512;
+    if ((id[106] & 0xc000) == 0x4000 && (id[106] & (1u << 12)))
+        block_size = (id[117] | ((uint32_t)id[118] << 16)) * 2;
+    if (block_size < 512 || block_size > PAGE_SIZE || !ispow2(block_size))
+        return ERR_NOT_SUPPORTED;
+
+    port->max_xfer = MIN((size_t)AHCI_MAX_XFER, port->max_sectors * block_size);
+
+    /* the model string comes byte swapped */
+    char model[41];
+    for (uint i = 0; i < 20; i++) {
+        model[i * 2] = id[27 + i] >> 8;
+        model[i * 2 + 1] = id[27 + i];
+    }
+    model[40] = 0;
+    for (int i = 39; i >= 0 && model[i] == ' '; i--)
+        model[i] = 0;
+
+    bnum_t block_count = sectors;
+    if (block_count != sectors) {
+        TRACEF("port %u: truncated to %u blocks\n", port->index, ~0U);
+        block_count = ~0U;
+    }
+
+    static uint found_index = 0;
+    char name[16];
+    snprintf(name, sizeof(name), "ahci%u", found_index++);
+    /* a rotation rate of 1 means solid state, disks that don't say are assumed to spin */
+    uint32_t flags = (id[217] == 1) ? BIO_FLAGS_NONE : BIO_FLAG_ROTATIONAL;
+    bio_initialize_bdev(&port->bdev, name, block_size, block_count, 0, NULL, flags);
+
+    dprintf(INFO, "%s: %s, %llu blocks of %zu bytes, %s, %u slots\n", name, model, sectors, block_size,
+            port->ncq ? "ncq" : (port->lba48 ? "lba48" : "lba28"), slots);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_port_init(struct ahci_hba *hba, uint n, uint16_t *id, paddr_t id_phys)
+{
+    struct ahci_port *port = calloc(1, sizeof(struct ahci_port));
+    if (!port)
+        return ERR_NO_MEMORY;
+
+    port->hba = hba;
+    port->index = n;
+    port->regs = hba->regs + AHCI_PORT_BASE + n * AHCI_PORT_SIZE;
+    mutex_init(&port->lock);
+    spin_lock_init(&port->ring_lock);
+    event_init(&port->slot_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&port->idle_event, true, 0);
+
+    for (uint i = 0; i < countof(port->ios); i++) {
+        port->ios[i].next_free = port->free_io;
+        port->free_io = &port->ios[i];
+    }
+
+    status_t err = ahci_port_stop(port);
+    if (err < 0)
+        goto err_stop;
+
+    /* command list first, then the received fis area, then the tables */
+    port->mem = dma_alloc_coherent(&hba->dma, AHCI_PORT_MEM_SIZE, &port->mem_phys);
+    if (!port->mem) {
+        err = ERR_NO_MEMORY;
+        goto err_stop;
+    }
+    port->cmd_list = port->mem;
+    paddr_t fis_phys = port->mem_phys + AHCI_CMD_LIST_SIZE;
+    port->tables = (void *)((uint8_t *)port->mem + AHCI_CMD_LIST_SIZE + AHCI_FIS_SIZE);
+    port->tables_phys = port->mem_phys + AHCI_CMD_LIST_SIZE + AHCI_FIS_SIZE;
+
+    ahci_port_write(port, AHCI_PxCLB, port->mem_phys);
+    ahci_port_write(port, AHCI_PxCLBU, (uint64_t)port->mem_phys >> 32);
+    ahci_port_write(port, AHCI_PxFB, fis_phys);
+    ahci_port_write(port, AHCI_PxFBU, (uint64_t)fis_phys >> 32);
+    ahci_port_write(port, AHCI_PxSERR, ~0U);
+    ahci_port_write(port, AHCI_PxIS, ~0U);
+
+    /* power and spin up the device, then look for a link */
+    uint32_t cmd = ahci_port_read(port, AHCI_PxCMD);
+    ahci_port_write(port, AHCI_PxCMD, cmd | AHCI_PxCMD_FRE | AHCI_PxCMD_POD | AHCI_PxCMD_SUD);
+
+    err = ahci_wait(port->regs, AHCI_PxSSTS, AHCI_PxSSTS_DET_MASK, AHCI_PxSSTS_DET_PRESENT, AHCI_LINK_TIMEOUT);
+    if (err < 0) {
+        LTRACEF("port %u: no device\n", n);
+        goto err_free;
+    }
+    ahci_port_write(port, AHCI_PxSERR, ~0U);
+
+    /* the signature is in once the device has reported in */
+    err = ahci_port_start(port);
+    if (err < 0)
+        goto err_free;
+
+    uint32_t sig = ahci_port_read(port, AHCI_PxSIG);
+    if (sig != AHCI_SIG_ATA) {
+        LTRACEF("port %u: signature 0x%x is not a disk\n", n, sig);
+        err = ERR_NOT_SUPPORTED;
+        goto err_free;
+    }
+
+    err = ahci_port_identify(port, id, id_phys);
+    if (err < 0) {
+        TRACEF("port %u: identify failed, error %d\n", n, err);
+        goto err_free;
+    }
+
+    /* requests are queued natively, the block hooks are submit and wait */
+    port->bdev.submit = &ahci_bdev_submit;
+
+    ahci_port_write(port, AHCI_PxIS, ~0U);
+    hba->ports[n] = port;
+    ahci_port_write(port, AHCI_PxIE, AHCI_PxIS_DONE | AHCI_PxIS_ERROR);
+
+    bio_register_device(&port->bdev);
+
+    return NO_ERROR;
+
+err_free:
+    /* the hba has to let go of the memory before it can be freed */
+    if (ahci_port_stop(port) < 0)
+        return err;
+    dma_free_coherent(port->mem, AHCI_PORT_MEM_SIZE);
+err_stop:
+    free(port);
+    return err;
+}
+
+/* a single msi vector for the whole hba */
+static status_t ahci_setup_msi(struct ahci_hba *hba)
+{
+    const pci_location_t *loc = &hba->loc;
+
+    uint16_t status;
+    pci_read_config_half(loc, PCI_CONFIG_STATUS, &status);
+    if (!(status & PCI_STATUS_NEW_CAPS))
+        return ERR_NOT_SUPPORTED;
+
+    uint8_t cap, msi_cap = 0;
+    pci_read_config_byte(loc, PCI_CONFIG_CAPABILITIES, &cap);
+    for (uint n = 0; cap && !msi_cap && n < 48; n++) {
+        pci_capability_t c;
+        cap &= ~3;
+        pci_read_config_byte(loc, cap, &c.id);
+        pci_read_config_byte(loc, cap + 1, &c.next);
+        if (c.id == PCI_CAP_ID_MSI)
+            msi_cap = cap;
+        cap = c.next;
+    }
+    if (!msi_cap)
+        return ERR_NOT_SUPPORTED;
+
+    uint vector;
+    if (platform_allocate_interrupts(1, &vector) < 0)
+        return ERR_NO_RESOURCES;
+
+    uint64_t addr;
+    uint32_t data;
+    status_t err = platform_compose_msi_msg(vector, &addr, &data);
+    DEBUG_ASSERT(err >= 0);
+
+    uint16_t ctrl;
+    pci_read_config_half(loc, msi_cap + PCI_MSI_CTRL, &ctrl);
+    pci_write_config_word(loc, msi_cap + PCI_MSI_ADDR_LO, addr);
+    if (ctrl & PCI_MSI_CTRL_64BIT) {
+        pci_write_config_word(loc, msi_cap + PCI_MSI_ADDR_HI, addr >> 32);
+        pci_write_config_half(loc, msi_cap + PCI_MSI_DATA_64, data);
+    } else {
+        pci_write_config_half(loc, msi_cap + PCI_MSI_DATA_32, data);
+    }
+
+    register_int_handler(vector, &ahci_irq, hba);
+
+    ctrl &= ~PCI_MSI_CTRL_MME_MASK;
+    pci_write_config_half(loc, msi_cap + PCI_MSI_CTRL, ctrl | PCI_MSI_CTRL_ENABLE);
+
+    hba->vector = vector;
+    hba->msi = true;
+
+    LTRACEF("msi vector %u\n", vector);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_setup_intx(struct ahci_hba *hba)
+{
+    uint8_t line;
+    uint vector;
+
+    pci_read_config_byte(&hba->loc, PCI_CONFIG_INTERRUPT_LINE, &line);
+    if (platform_pci_int_to_vector(line, &vector) < 0)
+        return ERR_NOT_SUPPORTED;
+
+    hba->vector = vector;
+    mask_interrupt(vector);
+    register_int_handler(vector, &ahci_irq, hba);
+
+    LTRACEF("legacy interrupt line %u, vector %u\n", line, vector);
+
+    return NO_ERROR;
+}
+
+static status_t ahci_probe(const pci_location_t *loc)
+{
+    LTRACEF("ahci at %u:0x%x\n", loc->bus, loc->dev_fn);
+
+    struct ahci_hba *hba = calloc(1, sizeof(struct ahci_hba));
+    if (!hba)
+        return ERR_NO_MEMORY;
+
+    hba->loc = *loc;
+
+    void *regs;
+    size_t regs_len;
+    status_t err = pci_map_bar(loc, AHCI_ABAR, "ahci", &regs, &regs_len);
+    if (err < 0 || regs_len < AHCI_PORT_BASE) {
+        TRACEF("ahci at %u:0x%x has no usable registers\n", loc->bus, loc->dev_fn);
+        free(hba);
+        return ERR_NOT_SUPPORTED;
+    }
+    hba->regs = regs;
+
+    uint16_t command;
+    pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    /* take the hba from the firmware, then reset it */
+    if (ahci_read(hba, AHCI_CAP2) & AHCI_CAP2_BOH) {
+        ahci_write(hba, AHCI_BOHC, ahci_read(hba, AHCI_BOHC) | AHCI_BOHC_OOS);
+        ahci_wait(hba->regs, AHCI_BOHC, AHCI_BOHC_BOS, 0, AHCI_TIMEOUT);
+    }
+
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE);
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_HR);
+    err = ahci_wait(hba->regs, AHCI_GHC, AHCI_GHC_HR, 0, AHCI_TIMEOUT);
+    if (err < 0) {
+        TRACEF("ahci at %u:0x%x failed to reset\n", loc->bus, loc->dev_fn);
+        free(hba);
+        return err;
+    }
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE);
+
+    hba->cap = ahci_read(hba, AHCI_CAP);
+    uint32_t pi = ahci_read(hba, AHCI_PI);
+    LTRACEF("cap 0x%x pi 0x%x version 0x%x\n", hba->cap, pi, ahci_read(hba, AHCI_VS));
+
+    /* pci dma snoops the caches */
+    hba->dma.coherent = true;
+    if (!(hba->cap & AHCI_CAP_S64A))
+        hba->dma.addr_limit = 0xffffffff;
+
+    if (ahci_setup_msi(hba) < 0 && ahci_setup_intx(hba) < 0) {
+        TRACEF("ahci at %u:0x%x has no usable interrupt\n", loc->bus, loc->dev_fn);
+        free(hba);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    /* scratch for identify data */
+    paddr_t id_phys;
+    uint16_t *id = dma_alloc_coherent(&hba->dma, PAGE_SIZE, &id_phys);
+    if (!id)
+        return ERR_NO_MEMORY;
+
+    uint found = 0;
+    for (uint n = 0; n < 32; n++) {
+        if ((pi & (1u << n)) && (size_t)AHCI_PORT_BASE + (n + 1) * AHCI_PORT_SIZE <= regs_len) {
+            if (ahci_port_init(hba, n, id, id_phys) == NO_ERROR)
+                found++;
+        }
+    }
+
+    dma_free_coherent(id, PAGE_SIZE);
+
+    ahci_write(hba, AHCI_IS, ~0U);
+    ahci_write(hba, AHCI_GHC, AHCI_GHC_AE | AHCI_GHC_IE);
+    if (!hba->msi)
+        unmask_interrupt(hba->vector);
+
+    LTRACEF("%u disks\n", found);
+
+    return NO_ERROR;
+}
+
+static void ahci_init(uint level)
+{
+    pci_location_t loc;
+
+    for (uint16_t n = 0; pci_find_pci_class_code(&loc, AHCI_CLASS_CODE, n) == _PCI_SUCCESSFUL; n++) {
+        status_t err = ahci_probe(&loc);
+        if (err < 0)
+            TRACEF("ahci at %u:0x%x failed to come up, error %d\n", loc.bus, loc.dev_fn, err);
+    }
+}
+
+LK_INIT_HOOK(ahci, &ahci_init, LK_INIT_LEVEL_PLATFORM);
@@ -0,0 +1,10 @@
+LOCAL_DIR := $(GET_LOCAL_DIR)
+
+MODULE := $(LOCAL_DIR)
+
+MODULE_SRCS += \
+	$(LOCAL_DIR)/ahci.c
+
+MODULE_DEPS := lib/bio lib/dma
+
+include make/module.mk
@@ -0,0 +1,1124 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <assert.h>
+#include <compiler.h>
+#include <debug.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <dev/pci.h>
+#include <kernel/event.h>
+#include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+#include <kernel/vm.h>
+#include <lib/bio.h>
+#include <lib/dma.h>
+#include <lk/init.h>
+#include <platform.h>
+#include <platform/interrupts.h>
+
+/*
+ * NVM Express controllers on the pci bus.
+ *
+ * The admin queue is only used while bringing the controller up and is
+ * polled. After that there is an i/o queue pair per cpu, as many as the
+ * controller grants. Each completion queue gets its own msi-x vector. Without
+ * msi-x the completion queues are polled off a timer instead.
+ *
+ * Each namespace with a plain lba format is registered as a block device
+ * with a native submit hook. Transfers are described with prp entries, built
+ * from the physical segments of the buffer. Requests longer than the
+ * controller takes in one go are split up into several commands.
+ */
+
+#define LOCAL_TRACE 0
+
+#define NVME_CLASS_CODE         0x010802    /* mass storage, nvm, nvm express */
+
+/* controller registers */
+#define NVME_REG_CAP            0x00
+#define NVME_REG_VS             0x08
+#define NVME_REG_CC             0x14
+#define NVME_REG_CSTS           0x1c
+#define NVME_REG_AQA            0x24
+#define NVME_REG_ASQ            0x28
+#define NVME_REG_ACQ            0x30
+#define NVME_REG_DOORBELLS      0x1000
+
+#define NVME_CAP_MQES(cap)      ((uint32_t)(cap) & 0xffff)
+#define NVME_CAP_TO(cap)        (((uint32_t)(cap) >> 24) & 0xff)    /* 500ms units */
+#define NVME_CAP_DSTRD(cap)     ((uint32_t)((cap) >> 32) & 0xf)
+#define NVME_CAP_MPSMIN(cap)    ((uint32_t)((cap) >> 48) & 0xf)
+#define NVME_CAP_MPSMAX(cap)    ((uint32_t)((cap) >> 52) & 0xf)
+
+#define NVME_CC_EN              (1u << 0)
+#define NVME_CC_MPS(shift)      (((shift) - 12u) << 7)
+#define NVME_CC_IOSQES(shift)   ((shift) << 16)
+#define NVME_CC_IOCQES(shift)   ((shift) << 20)
+
+#define NVME_CSTS_RDY           (1u << 0)
+#define NVME_CSTS_CFS           (1u << 1)
+
+/* admin commands */
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_IDENTIFY_NS        0
+#define NVME_IDENTIFY_CTRL      1
+
+#define NVME_FEAT_NUM_QUEUES    0x07
+
+#define NVME_QUEUE_PHYS_CONTIG  (1u << 0)
+#define NVME_CQ_IRQ_ENABLED     (1u << 1)
+
+/* nvm commands */
+#define NVME_CMD_FLUSH          0x00
+#define NVME_CMD_WRITE          0x01
+#define NVME_CMD_READ           0x02
+
+/* 64 byte submission and 16 byte completion queue entries */
+struct nvme_sqe {
+    uint8_t opc;
+    uint8_t flags;
+    uint16_t cid;
+    uint32_t nsid;
+    uint64_t rsvd;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __PACKED;
+
+struct nvme_cqe {
+    uint32_t result;
+    uint32_t rsvd;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;    /* phase tag in bit 0, status code above it */
+} __PACKED;
+
+STATIC_ASSERT(sizeof(struct nvme_sqe) == 64);
+STATIC_ASSERT(sizeof(struct nvme_cqe) == 16);
+
+#define NVME_SQE_SHIFT          6
+#define NVME_CQE_SHIFT          4
+#define NVME_CQE_PHASE          1
+
+/* the bits of the identify data that are used */
+struct nvme_id_ctrl {
+    uint16_t vid;
+    uint16_t ssvid;
+    char sn[20];
+    char mn[40];
+    char fr[8];
+    uint8_t rab;
+    uint8_t ieee[3];
+    uint8_t cmic;
+    uint8_t mdts;       /* max transfer, log2 of min pages, 0 for no limit */
+    uint8_t rsvd78[438];
+    uint32_t nn;        /* number of namespaces */
+    uint16_t oncs;
+    uint16_t fuses;
+    uint8_t fna;
+    uint8_t vwc;        /* bit 0: volatile write cache present */
+    uint8_t rsvd526[3570];
+} __PACKED;
+
+struct nvme_id_ns {
+    uint64_t nsze;      /* size in blocks, 0 if inactive */
+    uint64_t ncap;
+    uint64_t nuse;
+    uint8_t nsfeat;
+    uint8_t nlbaf;
+    uint8_t flbas;      /* bits 3:0 pick the lba format in use */
+    uint8_t rsvd27[101];
+    uint32_t lbaf[16];  /* metadata size in 15:0, log2 of the block size in 23:16 */
+    uint8_t rsvd192[3904];
+} __PACKED;
+
+STATIC_ASSERT(sizeof(struct nvme_id_ctrl) == 4096);
+STATIC_ASSERT(sizeof(struct nvme_id_ns) == 4096);
+
+#define NVME_ADMIN_QUEUE_SIZE   32
+#define NVME_IO_QUEUE_SIZE      256
+
+/* prp list entries per command, which caps a command at this many pages */
+#define NVME_MAX_PRPS           64
+
+#define NVME_MAX_NAMESPACES     16
+
+#define NVME_ADMIN_TIMEOUT      5000
+#define NVME_POLL_INTERVAL      1
+
+#define NVME_CID_NONE           0xffff
+
+struct nvme_ctrl;
+
+/* a block request, split up into one or more commands */
+struct nvme_io {
+    bio_request_t *req;
+    uint pending;       /* commands in flight, plus one while still submitting */
+    ssize_t result;
+    struct nvme_io *next_free;
+};
+
+/* a command in flight, indexed by command id */
+struct nvme_cmd {
+    struct nvme_io *io;
+    dma_map_t map;
+    size_t len;         /* 0 for commands without data */
+    uint16_t next_free;
+};
+
+/* a submission and completion queue pair. The admin queue only uses the
+ * first half, i/o queues are owned by a cpu each. */
+struct nvme_queue {
+    struct nvme_ctrl *ctrl;
+    uint16_t qid;
+    uint16_t size;
+
+    volatile struct nvme_sqe *sq;
+    paddr_t sq_phys;
+    uint16_t sq_tail;
+    volatile uint32_t *sq_db;
+
+    volatile struct nvme_cqe *cq;
+    paddr_t cq_phys;
+    uint16_t cq_head;
+    uint8_t cq_phase;
+    volatile uint32_t *cq_db;
+
+    /* serializes submitters, held while mapping and waiting for command ids */
+    mutex_t lock;
+
+    /* protects the sq tail, the cq head, command ids and request state,
+     * which the irq handler also touches */
+    spin_lock_t ring_lock;
+    uint16_t free_cid;
+    uint inflight_count;
+    event_t cmd_event;      /* command ids or request states were returned */
+    event_t idle_event;     /* nothing in flight */
+
+    struct nvme_cmd *cmds;
+    struct nvme_io *ios;
+    struct nvme_io *free_io;
+
+    /* a prp list per command id, in coherent memory */
+    uint64_t *prp_lists;
+    paddr_t prp_lists_phys;
+
+    /* scratch for the buffer being mapped, under lock */
+    dma_segment_t segs[NVME_MAX_PRPS + 1];
+};
+
+struct nvme_ctrl {
+    pci_location_t loc;
+    uint index;
+
+    volatile uint8_t *regs;
+    size_t regs_len;
+    uint db_stride;
+    uint64_t cap;
+
+    struct dma_device dma;
+
+    /* longest transfer a single command takes */
+    size_t max_xfer;
+    bool write_cache;
+
+    struct nvme_queue admin;
+
+    uint queue_count;
+    struct nvme_queue *queues;
+
+    /* msi-x, queue q completes on vector base + q. Entry 0 is the admin
+     * queue's, which stays masked. With no vectors the queues are polled. */
+    uint msix_count;
+    uint msix_base;
+    timer_t poll_timer;
+
+    /* scratch page for identify data */
+    void *scratch;
+    paddr_t scratch_phys;
+};
+
+/* a namespace, exposed as a block device */
+struct nvme_ns {
+    struct nvme_ctrl *ctrl;
+    uint32_t nsid;
+    uint lba_shift;
+
+    bdev_t bdev;
+};
+
+static inline uint32_t nvme_read32(struct nvme_ctrl *ctrl, uint reg)
+{
+    return *(volatile uint32_t *)(ctrl->regs + reg);
+}
+
+static inline void nvme_write32(struct nvme_ctrl *ctrl, uint reg, uint32_t val)
+{
+    *(volatile uint32_t *)(ctrl->regs + reg) = val;
+}
+
+/* 64 bit registers are accessed as two halves, low first, which works on 32 bit cpus too */
+static inline uint64_t nvme_read64(struct nvme_ctrl *ctrl, uint reg)
+{
+    uint32_t lo = nvme_read32(ctrl, reg);
+    return ((uint64_t)nvme_read32(ctrl, reg + 4) << 32) | lo;
+}
+
+static inline void nvme_write64(struct nvme_ctrl *ctrl, uint reg, uint64_t val)
+{
+    nvme_write32(ctrl, reg, val);
+    nvme_write32(ctrl, reg + 4, val >> 32);
+}
+
+/* the sq tail doorbell of queue y is 2y, the cq head one 2y + 1 */
+static volatile uint32_t *nvme_doorbell(struct nvme_ctrl *ctrl, uint qid, bool cq)
+{
+    return (volatile uint32_t *)(ctrl->regs + NVME_REG_DOORBELLS + (2 * qid + cq) * ctrl->db_stride);
+}
+
+static status_t nvme_wait_ready(struct nvme_ctrl *ctrl, bool ready)
+{
+    lk_time_t timeout = MAX(NVME_CAP_TO(ctrl->cap), 1u) * 500;
+    lk_time_t start = current_time();
+
+    for (;;) {
+        uint32_t csts = nvme_read32(ctrl, NVME_REG_CSTS);
+        if (csts == ~0U || (csts & NVME_CSTS_CFS))
+            return ERR_IO;
+        if (!!(csts & NVME_CSTS_RDY) == ready)
+            return NO_ERROR;
+        if (current_time() - start > timeout)
+            return ERR_TIMED_OUT;
+        thread_sleep(1);
+    }
+}
+
+static status_t nvme_alloc_queue(struct nvme_ctrl *ctrl, struct nvme_queue *queue, uint16_t qid, uint16_t size)
+{
+    queue->ctrl = ctrl;
+    queue->qid = qid;
+    queue->size = size;
+    queue->cq_phase = 1;
+    queue->sq_db = nvme_doorbell(ctrl, qid, false);
+    queue->cq_db = nvme_doorbell(ctrl, qid, true);
+
+    queue->sq = dma_alloc_coherent(&ctrl->dma, size << NVME_SQE_SHIFT, &queue->sq_phys);
+    queue->cq = dma_alloc_coherent(&ctrl->dma, size << NVME_CQE_SHIFT, &queue->cq_phys);
+    if (!queue->sq || !queue->cq)
+        return ERR_NO_MEMORY;
+
+    LTRACEF("queue %u size %u sq %p (0x%lx phys) cq %p (0x%lx phys)\n",
+            qid, size, queue->sq, queue->sq_phys, queue->cq, queue->cq_phys);
+
+    if (qid == 0)
+        return NO_ERROR;
+
+    mutex_init(&queue->lock);
+    spin_lock_init(&queue->ring_lock);
+    event_init(&queue->cmd_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&queue->idle_event, true, 0);
+
+    queue->cmds = calloc(size, sizeof(struct nvme_cmd));
+    queue->ios = calloc(size, sizeof(struct nvme_io));
+    queue->prp_lists = dma_alloc_coherent(&ctrl->dma, size * NVME_MAX_PRPS * sizeof(uint64_t),
+                                          &queue->prp_lists_phys);
+    if (!queue->cmds || !queue->ios || !queue->prp_lists)
+        return ERR_NO_MEMORY;
+
+    /* a full sq is one short of its size, so that many commands may be
+     * outstanding. Every request holds a command or is being submitted, so
+     * there is always a free request state to go with a command id. */
+    queue->free_cid = NVME_CID_NONE;
+    for (int i = size - 2; i >= 0; i--) {
+        queue->cmds[i].next_free = queue->free_cid;
+        queue->free_cid = i;
+    }
+    for (uint i = 0; i < size; i++) {
+        queue->ios[i].next_free = queue->free_io;
+        queue->free_io = &queue->ios[i];
+    }
+
+    return NO_ERROR;
+}
+
+static void nvme_free_queue(struct nvme_ctrl *ctrl, struct nvme_queue *queue)
+{
+    if (queue->sq)
+        dma_free_coherent((void *)queue->sq, queue->size << NVME_SQE_SHIFT);
+    if (queue->cq)
+        dma_free_coherent((void *)queue->cq, queue->size << NVME_CQE_SHIFT);
+    if (queue->prp_lists)
+        dma_free_coherent(queue->prp_lists, queue->size * NVME_MAX_PRPS * sizeof(uint64_t));
+    free(queue->cmds);
+    free(queue->ios);
+}
+
+/* put a command on the tail of the sq and ring the doorbell */
+static void nvme_post(struct nvme_queue *queue, const struct nvme_sqe *sqe)
+{
+    memcpy((void *)&queue->sq[queue->sq_tail], sqe, sizeof(*sqe));
+    if (++queue->sq_tail == queue->size)
+        queue->sq_tail = 0;
+
+    wmb();
+    *queue->sq_db = queue->sq_tail;
+}
+
+/* run an admin command and poll for its completion, only used during bring up */
+static status_t nvme_admin_cmd(struct nvme_ctrl *ctrl, struct nvme_sqe *sqe, uint32_t *result)
+{
+    struct nvme_queue *queue = &ctrl->admin;
+
+    sqe->cid = queue->sq_tail;
+    nvme_post(queue, sqe);
+
+    volatile struct nvme_cqe *cqe = &queue->cq[queue->cq_head];
+    lk_time_t start = current_time();
+    while ((cqe->status & NVME_CQE_PHASE) != queue->cq_phase) {
+        if (current_time() - start > NVME_ADMIN_TIMEOUT) {
+            TRACEF("admin command 0x%hhx timed out\n", sqe->opc);
+            return ERR_TIMED_OUT;
+        }
+        thread_yield();
+    }
+    rmb();
+
+    uint16_t status = cqe->status >> 1;
+    if (result)
+        *result = cqe->result;
+
+    if (++queue->cq_head == queue->size) {
+        queue->cq_head = 0;
+        queue->cq_phase ^= 1;
+    }
+    *queue->cq_db = queue->cq_head;
+
+    if (status) {
+        TRACEF("admin command 0x%hhx failed, status 0x%hx\n", sqe->opc, status);
+        return ERR_IO;
+    }
+
+    return NO_ERROR;
+}
+
+static status_t nvme_identify(struct nvme_ctrl *ctrl, uint cns, uint32_t nsid)
+{
+    struct nvme_sqe sqe = {};
+    sqe.opc = NVME_ADMIN_IDENTIFY;
+    sqe.nsid = nsid;
+    sqe.prp1 = ctrl->scratch_phys;
+    sqe.cdw10 = cns;
+
+    return nvme_admin_cmd(ctrl, &sqe, NULL);
+}
+
+/* reap the completion queue. Each completion is taken off the queue under
+ * the lock, unmapped without it and then accounted to its request, so a
+ * request only completes once all of its buffers are back with the cpu. */
+static enum handler_return nvme_queue_reap(struct nvme_queue *queue)
+{
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    bool reaped = false;
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&queue->ring_lock, state);
+
+        volatile struct nvme_cqe *cqe = &queue->cq[queue->cq_head];
+        if ((cqe->status & NVME_CQE_PHASE) != queue->cq_phase) {
+            /* the head is only passed back once, at the end */
+            if (reaped)
+                *queue->cq_db = queue->cq_head;
+            spin_unlock_irqrestore(&queue->ring_lock, state);
+            break;
+        }
+        rmb();
+
+        uint16_t cid = cqe->cid;
+        uint16_t status = cqe->status >> 1;
+        if (++queue->cq_head == queue->size) {
+            queue->cq_head = 0;
+            queue->cq_phase ^= 1;
+        }
+        reaped = true;
+
+        DEBUG_ASSERT(cid < queue->size);
+        struct nvme_cmd *cmd = &queue->cmds[cid];
+        struct nvme_io *io = cmd->io;
+        dma_map_t map = cmd->map;
+        size_t len = cmd->len;
+        DEBUG_ASSERT(io);
+
+        cmd->io = NULL;
+        cmd->next_free = queue->free_cid;
+        queue->free_cid = cid;
+        DEBUG_ASSERT(queue->inflight_count > 0);
+        if (--queue->inflight_count == 0)
+            event_signal(&queue->idle_event, false);
+
+        spin_unlock_irqrestore(&queue->ring_lock, state);
+
+        LTRACEF("queue %u cid %u status 0x%hx\n", queue->qid, cid, status);
+
+        if (len > 0)
+            dma_unmap(&map);
+
+        spin_lock_irqsave(&queue->ring_lock, state);
+        if (status)
+            io->result = ERR_IO;
+        else if (io->result >= 0)
+            io->result += len;
+        bio_request_t *req = NULL;
+        ssize_t result = io->result;
+        if (--io->pending == 0) {
+            req = io->req;
+            io->next_free = queue->free_io;
+            queue->free_io = io;
+        }
+        spin_unlock_irqrestore(&queue->ring_lock, state);
+
+        /* wake a submitter waiting for a command id or a request state */
+        event_signal(&queue->cmd_event, false);
+
+        if (req)
+            bio_complete(req, result);
+
+        ret = INT_RESCHEDULE;
+    }
+
+    return ret;
+}
+
+static enum handler_return nvme_msix_irq(void *arg)
+{
+    return nvme_queue_reap(arg);
+}
+
+static enum handler_return nvme_poll(struct timer *t, lk_time_t now, void *arg)
+{
+    struct nvme_ctrl *ctrl = arg;
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    for (uint q = 0; q < ctrl->queue_count; q++) {
+        if (nvme_queue_reap(&ctrl->queues[q]) == INT_RESCHEDULE)
+            ret = INT_RESCHEDULE;
+    }
+
+    return ret;
+}
+
+/* take a free request state, waiting for one if they are all in use. A
+ * request's state is only returned after its command ids, once its buffers
+ * are unmapped, so there may be none free for a moment even with free ids.
+ * Called with the lock held. */
+static struct nvme_io *nvme_alloc_io(struct nvme_queue *queue, bio_request_t *req)
+{
+    DEBUG_ASSERT(is_mutex_held(&queue->lock));
+
+    struct nvme_io *io;
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&queue->ring_lock, state);
+        io = queue->free_io;
+        if (io)
+            queue->free_io = io->next_free;
+        spin_unlock_irqrestore(&queue->ring_lock, state);
+        if (io)
+            break;
+
+        event_wait(&queue->cmd_event);
+    }
+
+    io->req = req;
+    io->pending = 1;
+    io->result = 0;
+
+    return io;
+}
+
+/* drop the submitter's hold on a request, completing it if its commands are done */
+static void nvme_release_io(struct nvme_queue *queue, struct nvme_io *io, status_t err)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&queue->ring_lock, state);
+    if (err < 0)
+        io->result = err;
+    bio_request_t *req = NULL;
+    ssize_t result = io->result;
+    if (--io->pending == 0) {
+        req = io->req;
+        io->next_free = queue->free_io;
+        queue->free_io = io;
+    }
+    spin_unlock_irqrestore(&queue->ring_lock, state);
+
+    if (req)
+        bio_complete(req, result);
+}
+
+/* take a command id, waiting for one if they are all in use. Called with the lock held. */
+static uint16_t nvme_get_cid(struct nvme_queue *queue)
+{
+    DEBUG_ASSERT(is_mutex_held(&queue->lock));
+
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&queue->ring_lock, state);
+        uint16_t cid = queue->free_cid;
+        if (cid != NVME_CID_NONE) {
+            queue->free_cid = queue->cmds[cid].next_free;
+            spin_unlock_irqrestore(&queue->ring_lock, state);
+            return cid;
+        }
+        spin_unlock_irqrestore(&queue->ring_lock, state);
+
+        event_wait(&queue->cmd_event);
+    }
+}
+
+static void nvme_put_cid(struct nvme_queue *queue, uint16_t cid)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&queue->ring_lock, state);
+    queue->cmds[cid].next_free = queue->free_cid;
+    queue->free_cid = cid;
+    spin_unlock_irqrestore(&queue->ring_lock, state);
+}
+
+/* submit a command for a request, the map is owned by the command from here on */
+static void nvme_queue_cmd(struct nvme_queue *queue, uint16_t cid, struct nvme_sqe *sqe,
+                           struct nvme_io *io, const dma_map_t *map, size_t len)
+{
+    struct nvme_cmd *cmd = &queue->cmds[cid];
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&queue->ring_lock, state);
+
+    DEBUG_ASSERT(!cmd->io);
+    cmd->io = io;
+    cmd->len = len;
+    if (map)
+        cmd->map = *map;
+    io->pending++;
+
+    queue->inflight_count++;
+    event_unsignal(&queue->idle_event);
+
+    sqe->cid = cid;
+    nvme_post(queue, sqe);
+
+    spin_unlock_irqrestore(&queue->ring_lock, state);
+}
+
+/* Describe the mapped segments with prp entries. The first entry may start
+ * anywhere, the rest are whole pages. Two entries fit in the command, more
+ * go in the command's prp list. */
+static status_t nvme_build_prps(struct nvme_queue *queue, uint16_t cid, uint nsegs, struct nvme_sqe *sqe)
+{
+    uint64_t *list = &queue->prp_lists[cid * NVME_MAX_PRPS];
+    uint n = 0;
+
+    for (uint s = 0; s < nsegs; s++) {
+        paddr_t addr = queue->segs[s].addr;
+        size_t len = queue->segs[s].len;
+
+        /* segments of a virtually contiguous buffer only break at page
+         * boundaries, but check anyway */
+        if (s > 0 && (addr & (PAGE_SIZE - 1)))
+            return ERR_NOT_SUPPORTED;
+        if (s + 1 < nsegs && ((addr + len) & (PAGE_SIZE - 1)))
+            return ERR_NOT_SUPPORTED;
+
+        while (len > 0) {
+            size_t chunk = MIN(len, PAGE_SIZE - (addr & (PAGE_SIZE - 1)));
+            if (n == 0) {
+                sqe->prp1 = addr;
+            } else {
+                if (n > NVME_MAX_PRPS)
+                    return ERR_TOO_BIG;
+                list[n - 1] = addr;
+            }
+            n++;
+            addr += chunk;
+            len -= chunk;
+        }
+    }
+
+    if (n == 2)
+        sqe->prp2 = list[0];
+    else if (n > 2)
+        sqe->prp2 = queue->prp_lists_phys + cid * NVME_MAX_PRPS * sizeof(uint64_t);
+
+    return NO_ERROR;
+}
+
+/* queue a read or write, called with the lock held */
+static status_t nvme_queue_rw(struct nvme_ns *ns, struct nvme_queue *queue, bio_request_t *req, bool write)
+{
+    struct nvme_ctrl *ctrl = ns->ctrl;
+    size_t max_len = ctrl->max_xfer & ~(ns->bdev.block_size - 1);
+    uint8_t *buf = req->buf;
+    uint64_t lba = req->offset >> ns->lba_shift;
+    size_t left = req->len;
+    bool queued = false;
+    status_t err = NO_ERROR;
+
+    DEBUG_ASSERT(is_mutex_held(&queue->lock));
+
+    struct nvme_io *io = nvme_alloc_io(queue, req);
+
+    while (left > 0) {
+        size_t len = MIN(left, max_len);
+
+        dma_map_t map;
+        ssize_t nsegs = dma_map_single(&ctrl->dma, buf, len, write ? DMA_TO_DEVICE : DMA_FROM_DEVICE,
+                                       queue->segs, countof(queue->segs), &map);
+        if (nsegs < 0) {
+            err = nsegs;
+            break;
+        }
+
+        uint16_t cid = nvme_get_cid(queue);
+
+        struct nvme_sqe sqe = {};
+        err = nvme_build_prps(queue, cid, nsegs, &sqe);
+        if (err < 0) {
+            nvme_put_cid(queue, cid);
+            dma_unmap(&map);
+            break;
+        }
+
+        sqe.opc = write ? NVME_CMD_WRITE : NVME_CMD_READ;
+        sqe.nsid = ns->nsid;
+        sqe.cdw10 = lba;
+        sqe.cdw11 = lba >> 32;
+        sqe.cdw12 = (len >> ns->lba_shift) - 1;
+        LTRACEF("cid %u lba %llu blocks %zu, %zd segments\n", cid, lba, len >> ns->lba_shift, nsegs);
+
+        nvme_queue_cmd(queue, cid, &sqe, io, &map, len);
+        queued = true;
+
+        buf += len;
+        lba += len >> ns->lba_shift;
+        left -= len;
+    }
+
+    /* if nothing went out, fail the submission instead of the request */
+    if (err < 0 && !queued) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&queue->ring_lock, state);
+        io->next_free = queue->free_io;
+        queue->free_io = io;
+        spin_unlock_irqrestore(&queue->ring_lock, state);
+        return err;
+    }
+
+    nvme_release_io(queue, io, err);
+
+    return NO_ERROR;
+}
+
+static status_t nvme_bdev_submit(struct bdev *bdev, bio_request_t *req)
+{
+    struct nvme_ns *ns = containerof(bdev, struct nvme_ns, bdev);
+    struct nvme_ctrl *ctrl = ns->ctrl;
+    status_t err;
+
+    LTRACEF("ns %u, req %p op %d, buf %p, offset 0x%llx, len %zu\n",
+            ns->nsid, req, req->op, req->buf, req->offset, req->len);
+
+    /* a thread that migrates after picking a queue just ends up on another
+     * cpu's queue, which is slower but still correct */
+    struct nvme_queue *queue = &ctrl->queues[arch_curr_cpu_num() % ctrl->queue_count];
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            mutex_acquire(&queue->lock);
+            err = nvme_queue_rw(ns, queue, req, req->op == BIO_OP_WRITE);
+            mutex_release(&queue->lock);
+            break;
+        case BIO_OP_FLUSH:
+            /* A flush only covers writes that completed before it was
+             * issued, so wait for everything in flight. Holding the locks
+             * keeps later requests behind us. Without a volatile write cache
+             * that is all there is to it. */
+            for (uint q = 0; q < ctrl->queue_count; q++) {
+                mutex_acquire(&ctrl->queues[q].lock);
+                event_wait(&ctrl->queues[q].idle_event);
+            }
+            if (ctrl->write_cache) {
+                struct nvme_sqe sqe = {};
+                sqe.opc = NVME_CMD_FLUSH;
+                sqe.nsid = ns->nsid;
+
+                struct nvme_io *io = nvme_alloc_io(queue, req);
+                nvme_queue_cmd(queue, nvme_get_cid(queue), &sqe, io, NULL, 0);
+                nvme_release_io(queue, io, NO_ERROR);
+            } else {
+                bio_complete(req, NO_ERROR);
+            }
+            for (uint q = 0; q < ctrl->queue_count; q++)
+                mutex_release(&ctrl->queues[q].lock);
+            err = NO_ERROR;
+            break;
+        default:
+            err = ERR_NOT_SUPPORTED;
+            break;
+    }
+
+    return err;
+}
+
+/* find the msi-x capability and hook up a vector per i/o queue, trimming
+ * the number of queues to what the table and the platform can take */
+static status_t nvme_setup_msix(struct nvme_ctrl *ctrl, uint *queue_count)
+{
+    const pci_location_t *loc = &ctrl->loc;
+
+    uint16_t status;
+    pci_read_config_half(loc, PCI_CONFIG_STATUS, &status);
+    if (!(status & PCI_STATUS_NEW_CAPS))
+        return ERR_NOT_SUPPORTED;
+
+    uint8_t cap, msix_cap = 0;
+    pci_read_config_byte(loc, PCI_CONFIG_CAPABILITIES, &cap);
+    for (uint n = 0; cap && !msix_cap && n < 48; n++) {
+        pci_capability_t c;
+        cap &= ~3;
+        pci_read_config_byte(loc, cap, &c.id);
+        pci_read_config_byte(loc, cap + 1, &c.next);
+        if (c.id == PCI_CAP_ID_MSIX)
+            msix_cap = cap;
+        cap = c.next;
+    }
+    if (!msix_cap)
+        return ERR_NOT_SUPPORTED;
+    cap = msix_cap;
+
+    uint16_t ctrl_reg;
+    uint32_t table;
+    pci_read_config_half(loc, cap + PCI_MSIX_CTRL, &ctrl_reg);
+    pci_read_config_word(loc, cap + PCI_MSIX_TABLE, &table);
+
+    uint table_size = (ctrl_reg & PCI_MSIX_CTRL_TABLE_SIZE) + 1;
+    uint bar = table & PCI_MSIX_TABLE_BIR;
+    uint32_t table_off = table & ~PCI_MSIX_TABLE_BIR;
+
+    volatile uint8_t *base = ctrl->regs;
+    size_t len = ctrl->regs_len;
+    if (bar != 0) {
+        void *ptr;
+        if (pci_map_bar(loc, bar, "nvme-msix", &ptr, &len) < 0)
+            return ERR_NOT_SUPPORTED;
+        base = ptr;
+    }
+    if (table_size < 2 || (uint64_t)table_off + table_size * PCI_MSIX_ENTRY_SIZE > len)
+        return ERR_NOT_SUPPORTED;
+
+    /* entry 0 belongs to the admin queue, take as many of the rest as we can get */
+    uint count = MIN(*queue_count, table_size - 1);
+    uint vector;
+    while (platform_allocate_interrupts(count, &vector) < 0) {
+        if (--count == 0)
+            return ERR_NO_RESOURCES;
+    }
+
+    volatile uint8_t *entries = base + table_off;
+    for (uint i = 0; i < count; i++) {
+        uint64_t addr;
+        uint32_t data;
+
+        status_t err = platform_compose_msi_msg(vector + i, &addr, &data);
+        DEBUG_ASSERT(err >= 0);
+
+        register_int_handler(vector + i, &nvme_msix_irq, &ctrl->queues[i]);
+
+        volatile uint32_t *entry = (volatile uint32_t *)(entries + (i + 1) * PCI_MSIX_ENTRY_SIZE);
+        entry[PCI_MSIX_ENTRY_ADDR_LO / 4] = addr;
+        entry[PCI_MSIX_ENTRY_ADDR_HI / 4] = addr >> 32;
+        entry[PCI_MSIX_ENTRY_DATA / 4] = data;
+        entry[PCI_MSIX_ENTRY_CTRL / 4] = 0;
+    }
+
+    ctrl_reg &= ~PCI_MSIX_CTRL_FUNC_MASK;
+    pci_write_config_half(loc, cap + PCI_MSIX_CTRL, ctrl_reg | PCI_MSIX_CTRL_ENABLE);
+
+    ctrl->msix_count = count;
+    ctrl->msix_base = vector;
+    *queue_count = count;
+
+    LTRACEF("%u msi-x vectors from %u\n", count, vector);
+
+    return NO_ERROR;
+}
+
+static status_t nvme_create_io_queue(struct nvme_ctrl *ctrl, struct nvme_queue *queue)
+{
+    struct nvme_sqe sqe = {};
+
+    sqe.opc = NVME_ADMIN_CREATE_CQ;
+    sqe.prp1 = queue->cq_phys;
+    sqe.cdw10 = ((uint32_t)(queue->size - 1) << 16) | queue->qid;
+    sqe.cdw11 = NVME_QUEUE_PHYS_CONTIG;
+    if (ctrl->msix_count > 0)
+        sqe.cdw11 |= ((uint32_t)queue->qid << 16) | NVME_CQ_IRQ_ENABLED;
+    status_t err = nvme_admin_cmd(ctrl, &sqe, NULL);
+    if (err < 0)
+        return err;
+
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opc = NVME_ADMIN_CREATE_SQ;
+    sqe.prp1 = queue->sq_phys;
+    sqe.cdw10 = ((uint32_t)(queue->size - 1) << 16) | queue->qid;
+    sqe.cdw11 = ((uint32_t)queue->qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+
+    return nvme_admin_cmd(ctrl, &sqe, NULL);
+}
+
+static void nvme_register_namespace(struct nvme_ctrl *ctrl, uint32_t nsid)
+{
+    if (nvme_identify(ctrl, NVME_IDENTIFY_NS, nsid) < 0)
+        return;
+
+    const struct nvme_id_ns *id = ctrl->scratch;
+    if (id->nsze == 0)
+        return;
+
+    uint32_t lbaf = id->lbaf[id->flbas & 0xf];
+    uint lba_shift = (lbaf >> 16) & 0xff;
+    if ((lbaf & 0xffff) != 0 || lba_shift < 9 || lba_shift > PAGE_SIZE_SHIFT) {
+        TRACEF("nvme%u: namespace %u has an unsupported lba format 0x%x\n", ctrl->index, nsid, lbaf);
+        return;
+    }
+
+    bnum_t block_count = id->nsze;
+    if (block_count != id->nsze) {
+        TRACEF("nvme%u: namespace %u truncated to %u blocks\n", ctrl->index, nsid, ~0U);
+        block_count = ~0U;
+    }
+
+    struct nvme_ns *ns = calloc(1, sizeof(struct nvme_ns));
+    if (!ns)
+        return;
+
+    ns->ctrl = ctrl;
+    ns->nsid = nsid;
+    ns->lba_shift = lba_shift;
+
+    char name[16];
+    snprintf(name, sizeof(name), "nvme%un%u", ctrl->index, nsid);
+    bio_initialize_bdev(&ns->bdev, name, 1u << lba_shift, block_count, 0, NULL, BIO_FLAGS_NONE);
+
+    /* requests are queued natively, the block hooks are submit and wait */
+    ns->bdev.submit = &nvme_bdev_submit;
+
+    bio_register_device(&ns->bdev);
+
+    LTRACEF("%s: %u blocks of %u bytes\n", name, block_count, 1u << lba_shift);
+}
+
+/* bring up a controller with its registers mapped */
+static status_t nvme_setup(struct nvme_ctrl *ctrl)
+{
+    const pci_location_t *loc = &ctrl->loc;
+    uint index = ctrl->index;
+    status_t err;
+
+    uint16_t command;
+    pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    ctrl->cap = nvme_read64(ctrl, NVME_REG_CAP);
+    ctrl->db_stride = 4u << NVME_CAP_DSTRD(ctrl->cap);
+    LTRACEF("cap 0x%llx version 0x%x\n", ctrl->cap, nvme_read32(ctrl, NVME_REG_VS));
+
+    uint page_shift = PAGE_SIZE_SHIFT;
+    if (page_shift < 12 + NVME_CAP_MPSMIN(ctrl->cap) || page_shift > 12 + NVME_CAP_MPSMAX(ctrl->cap)) {
+        TRACEF("nvme%u: page size %u not supported\n", index, (uint)PAGE_SIZE);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    /* the firmware may have left the controller running */
+    if (nvme_read32(ctrl, NVME_REG_CC) & NVME_CC_EN) {
+        nvme_write32(ctrl, NVME_REG_CC, 0);
+        err = nvme_wait_ready(ctrl, false);
+        if (err < 0)
+            return err;
+    }
+
+    /* admin queue */
+    uint16_t mqes = NVME_CAP_MQES(ctrl->cap) + 1;
+    err = nvme_alloc_queue(ctrl, &ctrl->admin, 0, MIN(NVME_ADMIN_QUEUE_SIZE, mqes));
+    if (err < 0) {
+        nvme_free_queue(ctrl, &ctrl->admin);
+        return err;
+    }
+
+    nvme_write32(ctrl, NVME_REG_AQA, ((uint32_t)(ctrl->admin.size - 1) << 16) | (ctrl->admin.size - 1));
+    nvme_write64(ctrl, NVME_REG_ASQ, ctrl->admin.sq_phys);
+    nvme_write64(ctrl, NVME_REG_ACQ, ctrl->admin.cq_phys);
+
+    nvme_write32(ctrl, NVME_REG_CC, NVME_CC_IOCQES(NVME_CQE_SHIFT) | NVME_CC_IOSQES(NVME_SQE_SHIFT) |
+                                    NVME_CC_MPS(page_shift) | NVME_CC_EN);
+    err = nvme_wait_ready(ctrl, true);
+    if (err < 0) {
+        TRACEF("nvme%u: controller failed to come up, csts 0x%x\n", index, nvme_read32(ctrl, NVME_REG_CSTS));
+        return err;
+    }
+
+    ctrl->scratch = dma_alloc_coherent(&ctrl->dma, PAGE_SIZE, &ctrl->scratch_phys);
+    if (!ctrl->scratch)
+        return ERR_NO_MEMORY;
+
+    err = nvme_identify(ctrl, NVME_IDENTIFY_CTRL, 0);
+    if (err < 0)
+        return err;
+
+    const struct nvme_id_ctrl *id = ctrl->scratch;
+    ctrl->max_xfer = NVME_MAX_PRPS * PAGE_SIZE;
+    if (id->mdts)
+        ctrl->max_xfer = MIN(ctrl->max_xfer, ((size_t)1 << (12 + NVME_CAP_MPSMIN(ctrl->cap))) << id->mdts);
+    ctrl->write_cache = id->vwc & 1;
+    uint32_t nn = id->nn;
+
+    dprintf(INFO, "nvme%u: %.40s, %u namespaces, max transfer %zu\n", index, id->mn, nn, ctrl->max_xfer);
+
+    /* ask for a queue pair per cpu, the result says how many were granted */
+    uint queue_count = SMP_MAX_CPUS;
+    struct nvme_sqe sqe = {};
+    sqe.opc = NVME_ADMIN_SET_FEATURES;
+    sqe.cdw10 = NVME_FEAT_NUM_QUEUES;
+    sqe.cdw11 = ((queue_count - 1) << 16) | (queue_count - 1);
+    uint32_t granted;
+    err = nvme_admin_cmd(ctrl, &sqe, &granted);
+    if (err < 0)
+        return err;
+    queue_count = MIN(queue_count, MIN(granted & 0xffff, granted >> 16) + 1);
+
+    ctrl->queues = calloc(queue_count, sizeof(struct nvme_queue));
+    if (!ctrl->queues)
+        return ERR_NO_MEMORY;
+
+    if (nvme_setup_msix(ctrl, &queue_count) < 0) {
+        LTRACEF("no msi-x, polling\n");
+        queue_count = 1;
+    }
+
+    uint16_t size = MIN(NVME_IO_QUEUE_SIZE, mqes);
+    for (uint q = 0; q < queue_count; q++) {
+        err = nvme_alloc_queue(ctrl, &ctrl->queues[q], q + 1, size);
+        if (err < 0) {
+            nvme_free_queue(ctrl, &ctrl->queues[q]);
+            break;
+        }
+        err = nvme_create_io_queue(ctrl, &ctrl->queues[q]);
+        if (err < 0) {
+            /* the controller may hold on to half a pair, so it isn't freed */
+            TRACEF("nvme%u: error %d creating queue %u\n", index, err, q + 1);
+            break;
+        }
+        ctrl->queue_count++;
+    }
+    if (ctrl->queue_count == 0)
+        return ERR_NO_RESOURCES;
+
+    if (ctrl->msix_count == 0) {
+        timer_initialize(&ctrl->poll_timer);
+        timer_set_periodic(&ctrl->poll_timer, NVME_POLL_INTERVAL, &nvme_poll, ctrl);
+    }
+
+    LTRACEF("%u i/o queues of %u\n", ctrl->queue_count, size);
+
+    for (uint32_t nsid = 1; nsid <= MIN(nn, NVME_MAX_NAMESPACES); nsid++)
+        nvme_register_namespace(ctrl, nsid);
+
+    return NO_ERROR;
+}
+
+static status_t nvme_probe(const pci_location_t *loc, uint index)
+{
+    LTRACEF("nvme at %u:0x%x\n", loc->bus, loc->dev_fn);
+
+    struct nvme_ctrl *ctrl = calloc(1, sizeof(struct nvme_ctrl));
+    if (!ctrl)
+        return ERR_NO_MEMORY;
+
+    ctrl->loc = *loc;
+    ctrl->index = index;
+
+    /* pci dma snoops the caches */
+    ctrl->dma.coherent = true;
+
+    void *regs;
+    status_t err = pci_map_bar(loc, 0, "nvme", &regs, &ctrl->regs_len);
+    if (err < 0 || ctrl->regs_len < NVME_REG_DOORBELLS + 8) {
+        TRACEF("nvme at %u:0x%x has no usable registers\n", loc->bus, loc->dev_fn);
+        free(ctrl);
+        return ERR_NOT_SUPPORTED;
+    }
+    ctrl->regs = regs;
+
+    err = nvme_setup(ctrl);
+    if (err < 0) {
+        /* Stop the controller, which drops any queues it was given. What
+         * was allocated is left behind, interrupt handlers may point at it. */
+        nvme_write32(ctrl, NVME_REG_CC, 0);
+        return err;
+    }
+
+    return NO_ERROR;
+}
+
+static void nvme_init(uint level)
+{
+    pci_location_t loc;
+    uint index = 0;
+
+    for (uint16_t n = 0; pci_find_pci_class_code(&loc, NVME_CLASS_CODE, n) == _PCI_SUCCESSFUL; n++) {
+        status_t err = nvme_probe(&loc, index);
+        if (err < 0)
+            TRACEF("nvme at %u:0x%x failed to come up, error %d\n", loc.bus, loc.dev_fn, err);
+        else
+            index++;
+    }
+}
+
+LK_INIT_HOOK(nvme, &nvme_init, LK_INIT_LEVEL_PLATFORM);
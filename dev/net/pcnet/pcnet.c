@@ -37,6 +37,7 @@
 #include <kernel/event.h>
 #include <dev/class/netif.h>
 #include <dev/pci.h>
+#include <lib/dma.h>
 #include <stdlib.h>
 #include <malloc.h>
 #include <string.h>
@@ -50,6 +51,12 @@
 
 #define QEMU_IRQ_BUG_WORKAROUND 1
 
+/* style 3 descriptors hold 32 bit addresses, and pci dma snoops the caches */
+static const struct dma_device pcnet_dma = {
+    .addr_limit = 0xffffffff,
+    .coherent = true,
+};
+
 struct pcnet_state {
     int irq;
     addr_t base;
@@ -57,12 +64,17 @@ struct pcnet_state {
     uint8_t padr[6];
 
     struct init_block_32 *ib;
+    paddr_t ib_pa;
 
     struct rd_style3 *rd;
     struct td_style3 *td;
+    paddr_t rd_pa;
+    paddr_t td_pa;
 
     struct pbuf **rx_buffers;
     struct pbuf **tx_buffers;
+    dma_map_t *rx_maps;
+    dma_map_t *tx_maps;
 
     /* queue accounting */
     int rd_head;
@@ -113,6 +125,24 @@ static struct netif_ops pcnet_ops = {
 
 DRIVER_EXPORT(netif, &pcnet_ops.std);
 
+/* hand an empty rx buffer to the controller */
+static status_t pcnet_queue_rx(struct pcnet_state *state, int i, struct pbuf *p)
+{
+    struct rd_style3 *rd = &state->rd[i];
+    dma_segment_t seg;
+
+    if (dma_map_single(&pcnet_dma, p->payload, p->tot_len, DMA_FROM_DEVICE, &seg, 1, &state->rx_maps[i]) < 0)
+        return ERR_NO_MEMORY;
+
+    memset(rd, 0, sizeof(*rd));
+    rd->rbadr = (uint32_t) seg.addr;
+    rd->bcnt = -p->tot_len;
+    rd->ones = 0xf;
+    rd->own = 1;
+
+    return NO_ERROR;
+}
+
 static inline uint32_t pcnet_read_csr(struct device *dev, uint8_t rap)
 {
     struct pcnet_state *state = dev->state;
@@ -190,24 +220,24 @@ static status_t pcnet_init(struct device *dev)
     /* allocate 128 tx and 128 rx descriptor rings */
     state->td_count = 128;
     state->rd_count = 128;
-    state->td = memalign(16, state->td_count * DESC_SIZE);
-    state->rd = memalign(16, state->rd_count * DESC_SIZE);
+    state->td = dma_alloc_coherent(&pcnet_dma, state->td_count * DESC_SIZE, &state->td_pa);
+    state->rd = dma_alloc_coherent(&pcnet_dma, state->rd_count * DESC_SIZE, &state->rd_pa);
 
     state->rx_buffers = calloc(state->rd_count, sizeof(struct pbuf *));
     state->tx_buffers = calloc(state->td_count, sizeof(struct pbuf *));
+    state->rx_maps = calloc(state->rd_count, sizeof(dma_map_t));
+    state->tx_maps = calloc(state->td_count, sizeof(dma_map_t));
 
     state->tx_pending = 0;
 
-    if (!state->td || !state->rd || !state->tx_buffers || !state->rx_buffers) {
+    if (!state->td || !state->rd || !state->tx_buffers || !state->rx_buffers ||
+            !state->tx_maps || !state->rx_maps) {
         res = ERR_NO_MEMORY;
         goto error;
     }
 
-    memset(state->td, 0, state->td_count * DESC_SIZE);
-    memset(state->rd, 0, state->rd_count * DESC_SIZE);
-
     /* allocate temporary init block space */
-    state->ib = memalign(4, sizeof(struct init_block_32));
+    state->ib = dma_alloc_coherent(&pcnet_dma, sizeof(struct init_block_32), &state->ib_pa);
     if (!state->ib) {
         res = ERR_NO_MEMORY;
         goto error;
@@ -221,24 +251,25 @@ static status_t pcnet_init(struct device *dev)
     state->ib->mode = 0;
 
     state->ib->ladr = ~0;
-    state->ib->tdra = (uint32_t) state->td;
-    state->ib->rdra = (uint32_t) state->rd;
+    state->ib->tdra = (uint32_t) state->td_pa;
+    state->ib->rdra = (uint32_t) state->rd_pa;
 
     memcpy(state->ib->padr, state->padr, 6);
 
     /* load the init block address */
-    pcnet_write_csr(dev, 1, (uint32_t) state->ib);
-    pcnet_write_csr(dev, 2, (uint32_t) state->ib >> 16);
+    pcnet_write_csr(dev, 1, (uint32_t) state->ib_pa);
+    pcnet_write_csr(dev, 2, (uint32_t) state->ib_pa >> 16);
 
     /* setup receive descriptors */
     for (i=0; i < state->rd_count; i++) {
         //LTRACEF("Allocating pbuf %d\n", i);
         struct pbuf *p = pbuf_alloc(PBUF_RAW, MAX_PACKET_SIZE, PBUF_RAM);
-
-        state->rd[i].rbadr = (uint32_t) p->payload;
-        state->rd[i].bcnt = -p->tot_len;
-        state->rd[i].ones = 0xf;
-        state->rd[i].own = 1;
+        if (!p || pcnet_queue_rx(state, i, p) < 0) {
+            if (p)
+                pbuf_free(p);
+            res = ERR_NO_MEMORY;
+            goto error;
+        }
 
         state->rx_buffers[i] = p;
     }
@@ -276,11 +307,22 @@ error:
     LTRACEF("Error: %d\n", res);
 
     if (state) {
-        free(state->td);
-        free(state->rd);
-        free(state->ib);
+        if (state->rx_buffers) {
+            for (i = 0; i < state->rd_count; i++) {
+                if (state->rx_buffers[i]) {
+                    dma_unmap(&state->rx_maps[i]);
+                    pbuf_free(state->rx_buffers[i]);
+                }
+            }
+        }
+
+        dma_free_coherent(state->td, state->td_count * DESC_SIZE);
+        dma_free_coherent(state->rd, state->rd_count * DESC_SIZE);
+        dma_free_coherent(state->ib, sizeof(struct init_block_32));
         free(state->tx_buffers);
         free(state->rx_buffers);
+        free(state->tx_maps);
+        free(state->rx_maps);
     }
 
     free(state);
@@ -431,6 +473,7 @@ static bool pcnet_service_tx(struct device *dev)
         DEBUG_ASSERT(p);
 
         state->tx_buffers[state->td_tail] = NULL;
+        dma_unmap(&state->tx_maps[state->td_tail]);
 
         LTRACEF("Retiring packet: td_tail=%d p=%p tot_len=%u\n", state->td_tail, p, p->tot_len);
 
@@ -477,6 +520,8 @@ static bool pcnet_service_rx(struct device *dev)
 
         LTRACEF("Processing RX descriptor %d\n", state->rd_head);
 
+        dma_unmap(&state->rx_maps[state->rd_head]);
+
         if (rd->err) {
             LTRACEF("Descriptor error status encountered\n");
             hexdump8(rd, sizeof(*rd));
@@ -498,13 +543,10 @@ static bool pcnet_service_rx(struct device *dev)
             }
         }
 
-        memset(rd, 0, sizeof(*rd));
         memset(p->payload, 0, p->tot_len);
 
-        rd->rbadr = (uint32_t) p->payload;
-        rd->bcnt = -p->tot_len;
-        rd->ones = 0xf;
-        rd->own = 1;
+        if (pcnet_queue_rx(state, state->rd_head, p) < 0)
+            panic("pcnet: can't map rx buffer\n");
 
         state->rd_head = (state->rd_head + 1) % state->rd_count;
 
@@ -587,6 +629,15 @@ static status_t pcnet_output(struct device *dev, struct pbuf *p)
     pbuf_ref(p);
     p = pbuf_coalesce(p, PBUF_RAW);
 
+    dma_segment_t seg;
+    if (dma_map_single(&pcnet_dma, p->payload, p->tot_len, DMA_TO_DEVICE,
+                       &seg, 1, &state->tx_maps[state->td_head]) < 0) {
+        LTRACEF("can't map tx buffer\n");
+        pbuf_free(p);
+        res = ERR_NO_MEMORY;
+        goto done;
+    }
+
 #if LOCAL_TRACE
     LTRACEF("Queuing packet: td_head=%d p=%p tot_len=%u\n", state->td_head, p, p->tot_len);
     hexdump8(p->payload, p->tot_len);
@@ -595,7 +646,7 @@ static status_t pcnet_output(struct device *dev, struct pbuf *p)
     /* clear flags */
     memset(td, 0, sizeof(*td));
 
-    td->tbadr = (uint32_t) p->payload;
+    td->tbadr = (uint32_t) seg.addr;
     td->bcnt = -p->tot_len;
     td->stp = 1;
     td->enp = 1;
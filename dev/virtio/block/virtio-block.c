@@ -28,11 +28,17 @@
 #include <compiler.h>
 #include <list.h>
 #include <err.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <arch/ops.h>
 #include <lib/bio.h>
+#include <lib/dma.h>
 
 #define LOCAL_TRACE 0
 
@@ -46,6 +52,15 @@ struct virtio_blk_config {
         uint8_t sectors;
     } geometry;
     uint32_t blk_size;
+    struct virtio_blk_topology {
+        uint8_t physical_block_exp;
+        uint8_t alignment_offset;
+        uint16_t min_io_size;
+        uint32_t opt_io_size;
+    } topology;
+    uint8_t writeback;
+    uint8_t unused0;
+    uint16_t num_queues;
 } __PACKED;
 
 struct virtio_blk_req {
@@ -64,6 +79,7 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_F_FLUSH    (1<<9)
 #define VIRTIO_BLK_F_TOPOLOGY (1<<10)
 #define VIRTIO_BLK_F_CONFIG_WCE (1<<11)
+#define VIRTIO_BLK_F_MQ       (1<<12)
 
 #define VIRTIO_BLK_T_IN         0
 #define VIRTIO_BLK_T_OUT        1
@@ -73,57 +89,90 @@ struct virtio_blk_req {
 #define VIRTIO_BLK_S_IOERR      1
 #define VIRTIO_BLK_S_UNSUPP     2
 
+/* most physically discontiguous pieces a transfer is split into before it's bounced */
+#define VIRTIO_BLK_MAX_SEGS     64
+
+#define VIRTIO_BLK_RING_SIZE    256
+
+/* indirect tables set aside per queue, requests fall back to direct chains
+ * once they are all in use */
+#define VIRTIO_BLK_INDIRECT_TABLES 64
+
 static enum handler_return virtio_block_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count);
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count);
+static status_t virtio_bdev_submit(struct bdev *bdev, bio_request_t *req);
+
+/* header and status byte of a request, shared with the device. Aligned so
+ * the header in every slot of the array is naturally aligned. */
+struct virtio_blk_cmd {
+    struct virtio_blk_req req;
+    uint8_t status;
+} __ALIGNED(8);
+
+/* a request in flight */
+struct virtio_blk_slot {
+    bio_request_t *req;
+    dma_map_t map;
+};
 
-struct virtio_block_dev {
-    struct virtio_device *dev;
+/* one per virtqueue, submitters use the queue of the cpu they run on */
+struct virtio_blk_queue {
+    uint index;
 
+    /* serializes submitters, held while mapping and waiting for descriptors */
     mutex_t lock;
-    event_t io_event;
+
+    /* protects the descriptor free list, the avail ring and the in flight
+     * count, which the irq handler also touches */
+    spin_lock_t ring_lock;
+    uint inflight_count;
+    event_t desc_event;     /* descriptors were returned */
+    event_t idle_event;     /* nothing in flight */
+
+    /* per request state, indexed by the head of the descriptor chain. The
+     * commands live in coherent memory. */
+    struct virtio_blk_cmd *cmds;
+    paddr_t cmds_phys;
+    struct virtio_blk_slot slots[VIRTIO_BLK_RING_SIZE];
+
+    /* scratch for the buffer being mapped, under lock */
+    dma_segment_t segs[VIRTIO_BLK_MAX_SEGS];
+};
+
+struct virtio_block_dev {
+    struct virtio_device *dev;
 
     /* bio block device */
     bdev_t bdev;
 
-    /* one blk_req structure for io, not crossing a page boundary */
-    struct virtio_blk_req *blk_req;
-    paddr_t blk_req_phys;
-
-    /* one uint8_t response word */
-    uint8_t blk_response;
-    paddr_t blk_response_phys;
+    uint queue_count;
+    struct virtio_blk_queue *queues;
 };
 
-status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
+#define CMDS_SIZE (VIRTIO_BLK_RING_SIZE * sizeof(struct virtio_blk_cmd))
+
+static void virtio_block_free_queues(struct virtio_block_dev *bdev)
+{
+    for (uint q = 0; q < bdev->queue_count; q++) {
+        if (bdev->queues[q].cmds)
+            dma_free_coherent(bdev->queues[q].cmds, CMDS_SIZE);
+    }
+    free(bdev->queues);
+}
+
+status_t virtio_block_init(struct virtio_device *dev, uint32_t _host_features)
 {
-    LTRACEF("dev %p, host_features 0x%x\n", dev, host_features);
+    uint64_t host_features = virtio_get_host_features(dev);
+
+    LTRACEF("dev %p, host_features 0x%llx\n", dev, host_features);
 
     /* allocate a new block device */
-    struct virtio_block_dev *bdev = malloc(sizeof(struct virtio_block_dev));
+    struct virtio_block_dev *bdev = calloc(1, sizeof(struct virtio_block_dev));
     if (!bdev)
         return ERR_NO_MEMORY;
 
-    mutex_init(&bdev->lock);
-    event_init(&bdev->io_event, false, EVENT_FLAG_AUTOUNSIGNAL);
-
     bdev->dev = dev;
     dev->priv = bdev;
 
-    bdev->blk_req = memalign(sizeof(struct virtio_blk_req), sizeof(struct virtio_blk_req));
-#if WITH_KERNEL_VM
-    bdev->blk_req_phys = vaddr_to_paddr(bdev->blk_req);
-#else
-    bdev->blk_freq_phys = (uint64_t)(uintptr_t)bdev->blk_req;
-#endif
-    LTRACEF("blk_req structure at %p (0x%lx phys)\n", bdev->blk_req, bdev->blk_req_phys);
-
-#if WITH_KERNEL_VM
-    bdev->blk_response_phys = vaddr_to_paddr(&bdev->blk_response);
-#else
-    bdev->blk_response_phys = (uint64_t)(uintptr_t)&bdev->blk_response;
-#endif
-
     /* make sure the device is reset */
     virtio_reset_device(dev);
 
@@ -137,10 +186,57 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
     /* ack and set the driver status bit */
     virtio_status_acknowledge_driver(dev);
 
-    // XXX check features bits and ack/nak them
+    /* a queue per cpu, as many as the device and the bus allow */
+    uint64_t features = 0;
+    bdev->queue_count = 1;
+    if (host_features & VIRTIO_BLK_F_MQ) {
+        features |= VIRTIO_BLK_F_MQ;
+        bdev->queue_count = MIN(MAX(config->num_queues, 1u), MIN(SMP_MAX_CPUS, MAX_VIRTIO_RINGS));
+    }
+    /* with indirect descriptors a whole request takes one ring slot */
+    features |= host_features & (1u << VIRTIO_RING_F_INDIRECT_DESC);
+    features |= host_features & (1u << VIRTIO_RING_F_EVENT_IDX);
+    /* requests and config are the same on modern devices */
+    features |= host_features & VIRTIO_F_VERSION_1;
+    features |= host_features & VIRTIO_F_RING_PACKED;
+    status_t err = virtio_set_guest_features(dev, features);
+    if (err < 0) {
+        free(bdev);
+        return err;
+    }
+    dprintf(INFO, "virtio-block: %u queues, %s rings\n", bdev->queue_count,
+            (dev->features & VIRTIO_F_RING_PACKED) ? "packed" : "split");
+
+    bdev->queues = calloc(bdev->queue_count, sizeof(struct virtio_blk_queue));
+    if (!bdev->queues) {
+        free(bdev);
+        return ERR_NO_MEMORY;
+    }
+
+    for (uint q = 0; q < bdev->queue_count; q++) {
+        struct virtio_blk_queue *queue = &bdev->queues[q];
+
+        queue->index = q;
+        mutex_init(&queue->lock);
+        spin_lock_init(&queue->ring_lock);
+        event_init(&queue->desc_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+        event_init(&queue->idle_event, true, 0);
+
+        queue->cmds = dma_alloc_coherent(&dev->dma, CMDS_SIZE, &queue->cmds_phys);
+        if (!queue->cmds) {
+            virtio_block_free_queues(bdev);
+            free(bdev);
+            return ERR_NO_MEMORY;
+        }
+        LTRACEF("queue %u commands at %p (0x%lx phys)\n", q, queue->cmds, queue->cmds_phys);
+
+        /* allocate a virtio ring */
+        virtio_alloc_ring(dev, q, VIRTIO_BLK_RING_SIZE);
 
-    /* allocate a virtio ring */
-    virtio_alloc_ring(dev, 0, 256);
+        /* not fatal, every request just uses a direct chain */
+        if (features & (1u << VIRTIO_RING_F_INDIRECT_DESC))
+            virtio_alloc_indirect_tables(dev, q, VIRTIO_BLK_INDIRECT_TABLES, VIRTIO_BLK_MAX_SEGS + 2);
+    }
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_block_irq_driver_callback;
@@ -156,13 +252,13 @@ status_t virtio_block_init(struct virtio_device *dev, uint32_t host_features)
                         config->blk_size, config->capacity,
                         0, NULL, BIO_FLAGS_NONE);
 
-    /* override our block device hooks */
-    bdev->bdev.read_block = &virtio_bdev_read_block;
-    bdev->bdev.write_block = &virtio_bdev_write_block;
+    /* requests are queued natively, the block hooks are submit and wait */
+    bdev->bdev.submit = &virtio_bdev_submit;
 
     bio_register_device(&bdev->bdev);
 
-    printf("found virtio block device of size %lld\n", config->capacity * config->blk_size);
+    printf("found virtio block device of size %lld, %u queue%s\n", config->capacity * config->blk_size,
+           bdev->queue_count, (bdev->queue_count == 1) ? "" : "s");
 
     return NO_ERROR;
 }
@@ -173,8 +269,25 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
 
     LTRACEF("dev %p, ring %u, e %p, id %u, len %u\n", dev, ring, e, e->id, e->len);
 
+    DEBUG_ASSERT(ring < bdev->queue_count);
+    struct virtio_blk_queue *queue = &bdev->queues[ring];
+
+    /* pick up the request before its descriptors can be reused */
+    uint16_t head = e->id;
+    DEBUG_ASSERT(head < VIRTIO_BLK_RING_SIZE);
+    struct virtio_blk_slot *slot = &queue->slots[head];
+    bio_request_t *req = slot->req;
+    uint8_t status = queue->cmds[head].status;
+    DEBUG_ASSERT(req);
+
+    slot->req = NULL;
+    dma_unmap(&slot->map);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&queue->ring_lock, state);
+
     /* parse our descriptor chain, add back to the free queue */
-    uint16_t i = e->id;
+    uint16_t i = head;
     for (;;) {
         int next;
         struct vring_desc *desc = virtio_desc_index_to_desc(dev, ring, i);
@@ -195,146 +308,170 @@ static enum handler_return virtio_block_irq_driver_callback(struct virtio_device
         i = next;
     }
 
-    /* signal our event */
-    event_signal(&bdev->io_event, false);
+    DEBUG_ASSERT(queue->inflight_count > 0);
+    if (--queue->inflight_count == 0)
+        event_signal(&queue->idle_event, false);
+
+    spin_unlock_irqrestore(&queue->ring_lock, state);
+
+    /* wake a submitter waiting for room in the ring */
+    event_signal(&queue->desc_event, false);
+
+    LTRACEF("req %p status 0x%hhx\n", req, status);
+
+    bio_complete(req, (status == VIRTIO_BLK_S_OK) ? (ssize_t)req->len : ERR_IO);
 
     return INT_RESCHEDULE;
 }
 
-ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
+/* indirect tables are laid out in order, direct chains have to be walked */
+static inline struct vring_desc *virtio_block_next_desc(struct virtio_device *dev, struct virtio_blk_queue *queue,
+                                                        struct vring_desc *table, struct vring_desc *desc)
 {
-    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
+    if (table)
+        return desc + 1;
+    return virtio_desc_index_to_desc(dev, queue->index, desc->next);
+}
 
-    uint16_t i;
+/* queue a read or write, called with the lock held */
+static status_t virtio_block_queue(struct virtio_block_dev *bdev, struct virtio_blk_queue *queue,
+                                   bio_request_t *req, bool write)
+{
+    struct virtio_device *dev = bdev->dev;
     struct vring_desc *desc;
-    paddr_t pa;
-    vaddr_t va = (vaddr_t)buf;
+    struct vring_desc *table;
+    uint16_t i;
+    dma_map_t map;
 
-    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
+    DEBUG_ASSERT(is_mutex_held(&queue->lock));
 
-    mutex_acquire(&bdev->lock);
+    /* hand the buffer to the device, split up into physically contiguous runs */
+    ssize_t nsegs = dma_map_single(&dev->dma, req->buf, req->len, write ? DMA_TO_DEVICE : DMA_FROM_DEVICE,
+                                   queue->segs, countof(queue->segs), &map);
+    if (nsegs < 0)
+        return nsegs;
 
-    /* set up the request */
-    bdev->blk_req->type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
-    bdev->blk_req->ioprio = 0;
-    bdev->blk_req->sector = offset / 512;
-    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
-            bdev->blk_req->type, bdev->blk_req->ioprio, bdev->blk_req->sector);
+    /* put together a transfer, the header, one descriptor per segment and
+     * the response. Prefer an indirect table, which costs one ring slot.
+     * If the ring is full wait for something to complete. */
+    spin_lock_saved_state_t state;
+    for (;;) {
+        spin_lock_irqsave(&queue->ring_lock, state);
+        table = virtio_alloc_indirect_chain(dev, queue->index, nsegs + 2, &i);
+        if (table) {
+            desc = table;
+            break;
+        }
+        desc = virtio_alloc_desc_chain(dev, queue->index, nsegs + 2, &i);
+        if (desc)
+            break;
+        spin_unlock_irqrestore(&queue->ring_lock, state);
+
+        event_wait(&queue->desc_event);
+    }
+    LTRACEF("after alloc chain desc %p, i %u, indirect %d\n", desc, i, !!table);
+
+    /* the chain head names the request until it completes */
+    DEBUG_ASSERT(i < VIRTIO_BLK_RING_SIZE);
+    struct virtio_blk_cmd *cmd = &queue->cmds[i];
+    paddr_t cmd_phys = queue->cmds_phys + i * sizeof(struct virtio_blk_cmd);
 
-    /* put together a transfer */
-    desc = virtio_alloc_desc_chain(dev, 0, 3, &i);
-    LTRACEF("after alloc chain desc %p, i %u\n", desc, i);
+    DEBUG_ASSERT(!queue->slots[i].req);
+    queue->slots[i].req = req;
+    queue->slots[i].map = map;
 
-    // XXX not cache safe.
-    // At the moment only tested on arm qemu, which doesn't emulate cache.
+    /* set up the request */
+    cmd->req.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    cmd->req.ioprio = 0;
+    cmd->req.sector = req->offset / 512;
+    cmd->status = 0xff;
+    LTRACEF("blk_req type %u ioprio %u sector %llu\n",
+            cmd->req.type, cmd->req.ioprio, cmd->req.sector);
 
     /* set up the descriptor pointing to the head */
-    desc->addr = bdev->blk_req_phys;
+    desc->addr = cmd_phys + offsetof(struct virtio_blk_cmd, req);
     desc->len = sizeof(struct virtio_blk_req);
     desc->flags |= VRING_DESC_F_NEXT;
 
-    /* set up the descriptor pointing to the buffer */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-#if WITH_KERNEL_VM
-    /* translate the first buffer */
-    pa = vaddr_to_paddr((void *)va);
-    desc->addr = (uint64_t)pa;
-    /* desc->len is filled in below */
-#else
-    desc->addr = (uint64_t)(uintptr_t)buf;
-    desc->len = len;
-#endif
-    desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-    desc->flags |= VRING_DESC_F_NEXT;
-
-#if WITH_KERNEL_VM
-    /* see if we need to add more descriptors due to scatter gather */
-    paddr_t next_pa = PAGE_ALIGN(pa + 1);
-    desc->len = MIN(next_pa - pa, len);
-    LTRACEF("first descriptor va 0x%lx desc->addr 0x%llx desc->len %u\n", va, desc->addr, desc->len);
-    len -= desc->len;
-    while (len > 0) {
-        /* amount of source buffer handled by this iteration of the loop */
-        size_t len_tohandle = MIN(len, PAGE_SIZE);
-
-        /* translate the next page in the buffer */
-        va = PAGE_ALIGN(va + 1);
-        pa = vaddr_to_paddr((void *)va);
-        LTRACEF("va now 0x%lx, pa 0x%lx, next_pa 0x%lx, remaining len %zu\n", va, pa, next_pa, len);
-
-        /* is the new translated physical address contiguous to the last one? */
-        if (next_pa == pa) {
-            LTRACEF("extending last one by %zu bytes\n", len_tohandle);
-            desc->len += len_tohandle;
-        } else {
-            uint16_t next_i = virtio_alloc_desc(dev, 0);
-            struct vring_desc *next_desc = virtio_desc_index_to_desc(dev, 0, next_i);
-            DEBUG_ASSERT(next_desc);
-
-            LTRACEF("doesn't extend, need new desc, allocated desc %i (%p)\n", next_i, next_desc);
-
-            /* fill this descriptor in and put it after the last one but before the response descriptor */
-            next_desc->addr = (uint64_t)pa;
-            next_desc->len = len_tohandle;
-            next_desc->flags = write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
-            next_desc->flags |= VRING_DESC_F_NEXT;
-            next_desc->next = desc->next;
-            desc->next = next_i;
-
-            desc = next_desc;
-        }
-        len -= len_tohandle;
-        next_pa += PAGE_SIZE;
+    /* set up the descriptors pointing to the buffer */
+    for (ssize_t s = 0; s < nsegs; s++) {
+        desc = virtio_block_next_desc(dev, queue, table, desc);
+        desc->addr = queue->segs[s].addr;
+        desc->len = queue->segs[s].len;
+        desc->flags |= write ? 0 : VRING_DESC_F_WRITE; /* mark buffer as write-only if its a block read */
+        desc->flags |= VRING_DESC_F_NEXT;
+        LTRACEF("segment %zd addr 0x%llx len %u\n", s, desc->addr, desc->len);
     }
-#endif
 
     /* set up the descriptor pointing to the response */
-    desc = virtio_desc_index_to_desc(dev, 0, desc->next);
-    desc->addr = bdev->blk_response_phys;
+    desc = virtio_block_next_desc(dev, queue, table, desc);
+    desc->addr = cmd_phys + offsetof(struct virtio_blk_cmd, status);
     desc->len = 1;
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
-    virtio_submit_chain(dev, 0, i);
+    queue->inflight_count++;
+    event_unsignal(&queue->idle_event);
+    virtio_submit_chain(dev, queue->index, i);
 
     /* kick it off */
-    virtio_kick(dev, 0);
-
-    /* wait for the transfer to complete */
-    event_wait(&bdev->io_event);
+    virtio_kick(dev, queue->index);
 
-    LTRACEF("status 0x%hhx\n", bdev->blk_response);
+    spin_unlock_irqrestore(&queue->ring_lock, state);
 
-    mutex_release(&bdev->lock);
-
-    return len;
+    return NO_ERROR;
 }
 
-static ssize_t virtio_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+static status_t virtio_bdev_submit(struct bdev *_bdev, bio_request_t *req)
 {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
-
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
-
-    if (virtio_block_read_write(dev->dev, buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, false) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
+    struct virtio_block_dev *bdev = containerof(_bdev, struct virtio_block_dev, bdev);
+    status_t err;
+
+    LTRACEF("dev %p, req %p op %d, buf %p, offset 0x%llx, len %zu\n",
+            bdev, req, req->op, req->buf, req->offset, req->len);
+
+    /* a thread that migrates after picking a queue just ends up on another
+     * cpu's queue, which is slower but still correct */
+    struct virtio_blk_queue *queue = &bdev->queues[arch_curr_cpu_num() % bdev->queue_count];
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            mutex_acquire(&queue->lock);
+            err = virtio_block_queue(bdev, queue, req, req->op == BIO_OP_WRITE);
+            mutex_release(&queue->lock);
+            break;
+        case BIO_OP_FLUSH:
+            /* The write cache feature is never acked, so the device runs
+             * write through. Once everything in flight is done it is on
+             * disk. Holding the locks keeps later requests behind us. */
+            for (uint q = 0; q < bdev->queue_count; q++) {
+                mutex_acquire(&bdev->queues[q].lock);
+                event_wait(&bdev->queues[q].idle_event);
+            }
+            bio_complete(req, NO_ERROR);
+            for (uint q = 0; q < bdev->queue_count; q++)
+                mutex_release(&bdev->queues[q].lock);
+            err = NO_ERROR;
+            break;
+        default:
+            err = ERR_NOT_SUPPORTED;
+            break;
     }
+
+    return err;
 }
 
-static ssize_t virtio_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+ssize_t virtio_block_read_write(struct virtio_device *dev, void *buf, off_t offset, size_t len, bool write)
 {
-    struct virtio_block_dev *dev = containerof(bdev, struct virtio_block_dev, bdev);
+    struct virtio_block_dev *bdev = (struct virtio_block_dev *)dev->priv;
 
-    LTRACEF("dev %p, buf %p, block 0x%x, count %u\n", bdev, buf, block, count);
+    LTRACEF("dev %p, buf %p, offset 0x%llx, len %zu\n", dev, buf, offset, len);
 
-    if (virtio_block_read_write(dev->dev, (void *)buf, (off_t)block * dev->bdev.block_size,
-                                count * dev->bdev.block_size, true) == 0) {
-        return count * dev->bdev.block_size;
-    } else {
-        return ERR_IO;
-    }
-}
+    bio_request_t req;
+    bio_request_init(&req, write ? BIO_OP_WRITE : BIO_OP_READ, buf, offset, len, NULL, NULL);
 
+    ssize_t err = bio_submit_wait(&bdev->bdev, &req);
+
+    return (err < 0) ? err : NO_ERROR;
+}
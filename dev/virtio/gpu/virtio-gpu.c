@@ -460,6 +460,9 @@ status_t virtio_gpu_init(struct virtio_device *dev, uint32_t host_features)
     virtio_status_acknowledge_driver(dev);
 
     // XXX check features bits and ack/nak them
+    status_t err = virtio_set_guest_features(dev, virtio_get_host_features(dev) & VIRTIO_F_VERSION_1);
+    if (err < 0)
+        return err;
 
     /* allocate a virtio ring */
     virtio_alloc_ring(dev, 0, 16);
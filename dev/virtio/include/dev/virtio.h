@@ -27,26 +27,42 @@
 #include <list.h>
 #include <sys/types.h>
 #include <dev/virtio/virtio_ring.h>
+#include <lib/dma.h>
 
 /* detect a virtio mmio hardware block
  * returns number of devices found */
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[]);
 
+/* probe the pci bus for modern virtio devices
+ * returns number of devices found */
+int virtio_pci_detect(void);
+
 #define MAX_VIRTIO_RINGS 4
 
+/* device independent feature bits above the 32 a legacy device has */
+#define VIRTIO_F_VERSION_1      (1ull << 32)
+#define VIRTIO_F_RING_PACKED    (1ull << 34)
+
 struct virtio_mmio_config;
+struct virtio_transport;
 
 struct virtio_device {
     bool valid;
 
     uint index;
     uint irq;
+    uint version; /* of the transport, 1 is a legacy device */
 
+    const struct virtio_transport *transport;
     volatile struct virtio_mmio_config *mmio_config;
     void *config_ptr;
 
     void *priv; /* a place for the driver to put private data */
 
+    uint64_t features; /* what the driver acked */
+
+    struct dma_device dma; /* how drivers should map buffers for this device */
+
     enum handler_return (*irq_driver_callback)(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
     enum handler_return (*config_change_callback)(struct virtio_device *dev);
 
@@ -59,6 +75,20 @@ void virtio_reset_device(struct virtio_device *dev);
 void virtio_status_acknowledge_driver(struct virtio_device *dev);
 void virtio_status_driver_ok(struct virtio_device *dev);
 
+/* Feature negotiation, before any rings are allocated. Drivers ack the
+ * subset of the device's features they use. Legacy devices only have the
+ * low 32 bits. A modern device refuses to go on without VIRTIO_F_VERSION_1. */
+uint64_t virtio_get_host_features(struct virtio_device *dev);
+status_t virtio_set_guest_features(struct virtio_device *dev, uint64_t features);
+
+/* Whether VIRTIO_F_RING_PACKED may be negotiated, VIRTIO_PACKED_RING by
+ * default. virtio_set_guest_features() drops it otherwise, so drivers ack it
+ * whenever the device offers it. Only affects devices probed afterwards, so
+ * platforms set it from the kernel command line, where virtio.packed=0 or
+ * virtio.packed=1 picks the rings for one boot of the same image. */
+void virtio_set_packed_rings(bool enable);
+void virtio_parse_cmdline(const char *cmdline) __NONNULL();
+
 /* api used by devices to interact with the virtio bus */
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len) __NONNULL();
 
@@ -71,6 +101,17 @@ uint16_t virtio_alloc_desc(struct virtio_device *dev, uint ring_index);
 /* allocate a descriptor chain the free list */
 struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index);
 
+/* Set aside count indirect descriptor tables of len descriptors each for a
+ * ring. Only useful once VIRTIO_RING_F_INDIRECT_DESC has been acked. */
+status_t virtio_alloc_indirect_tables(struct virtio_device *dev, uint ring_index, uint16_t count, uint16_t len);
+
+/* Allocate a chain of count descriptors in an indirect table, costing a
+ * single ring descriptor, whose index is returned in start_index. Returns
+ * the table, which is already linked in order, or NULL if no table is free
+ * or count doesn't fit. The table goes back to the pool when the head
+ * descriptor is freed. */
+struct vring_desc *virtio_alloc_indirect_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index);
+
 static inline struct vring_desc *virtio_desc_index_to_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     DEBUG_ASSERT(desc_index != 0xffff);
@@ -82,6 +123,23 @@ void virtio_dump_desc(const struct vring_desc *desc);
 /* submit a chain to the avail list */
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index);
 
-void virtio_kick(struct virtio_device *dev, uint ring_idnex);
+/* Tell the device about newly submitted chains. Submit a batch of chains
+ * and kick once. With VIRTIO_RING_F_EVENT_IDX acked, or when the device set
+ * VRING_USED_F_NO_NOTIFY, the notify is skipped if the device hasn't asked
+ * for it. */
+void virtio_kick(struct virtio_device *dev, uint ring_index);
+
+/* Interrupt suppression. While disabled the device is asked not to interrupt
+ * for the ring. virtio_enable_interrupts() re-arms them and returns true if
+ * used elements arrived in the meantime, in which case the caller should
+ * drain the ring with virtio_poll_ring() and try again, or they may never
+ * raise an interrupt. The irq handler does this for every ring, drivers only
+ * need these to poll from a thread. Don't poll a ring while its interrupt is
+ * live. */
+void virtio_disable_interrupts(struct virtio_device *dev, uint ring_index);
+bool virtio_enable_interrupts(struct virtio_device *dev, uint ring_index);
+
+/* run the driver callback for every used element on the ring */
+enum handler_return virtio_poll_ring(struct virtio_device *dev, uint ring_index);
 
 
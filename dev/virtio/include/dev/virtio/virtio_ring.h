@@ -33,6 +33,7 @@
  *
  * Copyright Rusty Russell IBM Corporation 2007. */
 #include <stdint.h>
+#include <sys/types.h>
 #include <pow2.h>
 
 /* This marks a buffer as continuing via the next field. */
@@ -60,6 +61,18 @@
  * at the end of the used ring. Guest should ignore the used->flags field. */
 #define VIRTIO_RING_F_EVENT_IDX     29
 
+/* Packed ring descriptor flags, the driver flips its idea of these two on
+ * every lap of the ring. */
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+/* event suppression structure flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2   /* with VIRTIO_RING_F_EVENT_IDX */
+
+#define VRING_PACKED_EVENT_F_WRAP_CTR   15
+
 /* Virtio ring descriptors: 16 bytes.  These can chain together via "next". */
 struct vring_desc {
     /* Address (guest-physical). */
@@ -92,6 +105,19 @@ struct vring_used {
     struct vring_used_elem ring[];
 };
 
+/* packed ring descriptor, also used for packed indirect tables */
+struct vring_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct vring_packed_desc_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
 struct vring {
     uint32_t num;
     uint32_t num_mask;
@@ -99,13 +125,36 @@ struct vring {
     uint16_t free_list; /* head of a free list of descriptors per ring. 0xffff is NULL */
     uint16_t free_count;
 
-    uint16_t last_used;
+    uint16_t last_used;     /* free running, masked when indexing the used ring */
+    uint16_t kicked_avail;  /* avail index as of the last notify */
+
+    /* preallocated indirect descriptor tables, indirect_len descriptors
+     * each. Free tables are linked through the next field of their first
+     * descriptor. */
+    struct vring_desc *indirect;
+    paddr_t indirect_phys;
+    uint16_t indirect_len;
+    uint16_t indirect_count;
+    uint16_t indirect_free_list; /* 0xffff is NULL */
 
     struct vring_desc *desc;
 
     struct vring_avail *avail;
 
     struct vring_used *used;
+
+    /* Packed rings. The driver api still works on desc, which is then just
+     * a shadow table in normal memory. Submitting a chain copies it into the
+     * packed ring, and completions are handed to drivers as used elements.
+     * last_used is the next position to look at for a used descriptor. */
+    struct vring_packed_desc *packed;
+    struct vring_packed_desc_event *driver_event;
+    struct vring_packed_desc_event *device_event;
+    uint16_t *chain_len;    /* ring slots each chain took, by head index */
+    uint16_t next_avail;
+    uint16_t num_added;     /* slots filled since the last kick */
+    bool avail_wrap;
+    bool used_wrap;
 };
 
 /* The standard layout for the ring is a continuous chunk of memory which looks
@@ -135,7 +184,13 @@ struct vring {
 /* We publish the used event index at the end of the available ring, and vice
  * versa. They are at the end for backwards compatibility. */
 #define vring_used_event(vr) ((vr)->avail->ring[(vr)->num])
-#define vring_avail_event(vr) (*(uint16_t *)&(vr)->used->ring[(vr)->num])
+
+/* the avail event sits in the slot past the last used element, reach it
+ * through an address rather than a cast of the element to stay alias clean */
+static inline volatile uint16_t *vring_avail_event(struct vring *vr)
+{
+    return (volatile uint16_t *)(uintptr_t)&vr->used->ring[vr->num];
+}
 
 static inline void vring_init(struct vring *vr, unsigned int num, void *p,
                               unsigned long align)
@@ -145,6 +200,10 @@ static inline void vring_init(struct vring *vr, unsigned int num, void *p,
     vr->free_list = 0xffff;
     vr->free_count = 0;
     vr->last_used = 0;
+    vr->kicked_avail = 0;
+    vr->indirect = NULL;
+    vr->indirect_free_list = 0xffff;
+    vr->packed = NULL;
     vr->desc = p;
     vr->avail = p + num*sizeof(struct vring_desc);
     vr->used = (void *)(((unsigned long)&vr->avail->ring[num] + sizeof(uint16_t)
@@ -158,6 +217,37 @@ static inline unsigned vring_size(unsigned int num, unsigned long align)
            + sizeof(uint16_t) * 3 + sizeof(struct vring_used_elem) * num;
 }
 
+/* A packed ring is the descriptors followed by the driver and device event
+ * suppression structures. desc is the driver's shadow table. */
+static inline unsigned vring_packed_size(unsigned int num)
+{
+    return sizeof(struct vring_packed_desc) * num + 2 * sizeof(struct vring_packed_desc_event);
+}
+
+static inline void vring_init_packed(struct vring *vr, unsigned int num, void *p,
+                                     struct vring_desc *shadow, uint16_t *chain_len)
+{
+    vr->num = num;
+    vr->num_mask = (1 << log2_uint(num)) - 1;
+    vr->free_list = 0xffff;
+    vr->free_count = 0;
+    vr->last_used = 0;
+    vr->kicked_avail = 0;
+    vr->indirect = NULL;
+    vr->indirect_free_list = 0xffff;
+    vr->desc = shadow;
+    vr->avail = NULL;
+    vr->used = NULL;
+    vr->packed = p;
+    vr->driver_event = (struct vring_packed_desc_event *)&vr->packed[num];
+    vr->device_event = vr->driver_event + 1;
+    vr->chain_len = chain_len;
+    vr->next_avail = 0;
+    vr->num_added = 0;
+    vr->avail_wrap = true;
+    vr->used_wrap = true;
+}
+
 /* The following is used with USED_EVENT_IDX and AVAIL_EVENT_IDX */
 /* Assuming a given event_idx value from the other size, if
  * we have just incremented index from old to new_idx,
@@ -33,8 +33,11 @@
 #include <kernel/event.h>
 #include <kernel/spinlock.h>
 #include <kernel/vm.h>
+#include <lib/dma.h>
 #include <lib/pktbuf.h>
 #include <lib/minip.h>
+#include <lib/console.h>
+#include <platform.h>
 
 #define LOCAL_TRACE 0
 
@@ -93,12 +96,18 @@ struct virtio_net_dev {
 
     struct virtio_net_config *config;
 
+    /* modern devices always have num_buffers in the header */
+    size_t hdr_len;
+
     spin_lock_t lock;
     event_t rx_event;
+    event_t tx_event;       /* tx descriptors were returned */
 
     /* list of active tx/rx packets to be freed at irq time */
     pktbuf_t *pending_tx_packet[TX_RING_SIZE];
     pktbuf_t *pending_rx_packet[RX_RING_SIZE];
+    dma_map_t pending_tx_map[TX_RING_SIZE];
+    dma_map_t pending_rx_map[RX_RING_SIZE];
 
     uint tx_pending_count;
     struct list_node completed_rx_queue;
@@ -106,7 +115,7 @@ struct virtio_net_dev {
 
 static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *dev, uint ring, const struct vring_used_elem *e);
 static int virtio_net_rx_worker(void *arg);
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p);
+static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p, bool kick);
 
 // XXX remove need for this
 static struct virtio_net_dev *the_ndev;
@@ -153,6 +162,7 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
 
     ndev->lock = SPIN_LOCK_INITIAL_VALUE;
     event_init(&ndev->rx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    event_init(&ndev->tx_event, false, EVENT_FLAG_AUTOUNSIGNAL);
     list_initialize(&ndev->completed_rx_queue);
 
     ndev->config = (struct virtio_net_config *)dev->config_ptr;
@@ -162,17 +172,27 @@ status_t virtio_net_init(struct virtio_device *dev, uint32_t host_features)
 
     // XXX check features bits and ack/nak them
     dump_feature_bits(host_features);
+    uint64_t features = host_features & (1u << VIRTIO_RING_F_EVENT_IDX);
+    features |= virtio_get_host_features(dev) & (VIRTIO_F_VERSION_1 | VIRTIO_F_RING_PACKED);
+    status_t err = virtio_set_guest_features(dev, features);
+    if (err < 0)
+        return err;
+
+    ndev->hdr_len = sizeof(struct virtio_net_hdr);
+    if (!(dev->features & VIRTIO_F_VERSION_1))
+        ndev->hdr_len -= sizeof(uint16_t);
+    dprintf(INFO, "virtio-net: %s rings\n", (dev->features & VIRTIO_F_RING_PACKED) ? "packed" : "split");
 
     /* set our irq handler */
     dev->irq_driver_callback = &virtio_net_irq_driver_callback;
 
-    /* set DRIVER_OK */
-    virtio_status_driver_ok(dev);
-
-    /* allocate a pair of virtio rings */
+    /* allocate a pair of virtio rings, before the device goes live */
     virtio_alloc_ring(dev, RING_RX, RX_RING_SIZE); // rx
     virtio_alloc_ring(dev, RING_TX, TX_RING_SIZE); // tx
 
+    /* set DRIVER_OK */
+    virtio_status_driver_ok(dev);
+
     the_ndev = ndev;
 
     return NO_ERROR;
@@ -192,10 +212,15 @@ status_t virtio_net_start(void)
     for (uint i = 0; i < RX_RING_SIZE - 1; i++) {
         pktbuf_t *p = pktbuf_alloc();
         if (p) {
-            virtio_net_queue_rx(the_ndev, p);
+            virtio_net_queue_rx(the_ndev, p, false);
         }
     }
 
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&the_ndev->lock, state);
+    virtio_kick(the_ndev->dev, RING_RX);
+    spin_unlock_irqrestore(&the_ndev->lock, state);
+
     return NO_ERROR;
 }
 
@@ -213,9 +238,22 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
         return ERR_NO_MEMORY;
 
     /* point our header to the base of the first pktbuf */
-    struct virtio_net_hdr *hdr = pktbuf_append(p, sizeof(struct virtio_net_hdr) - 2);
+    struct virtio_net_hdr *hdr = pktbuf_append(p, ndev->hdr_len);
     memset(hdr, 0, p->dlen);
 
+    /* map the header and the packet, each a single segment */
+    dma_map_t hdr_map, pkt_map;
+    dma_segment_t hdr_seg, pkt_seg;
+    if (dma_map_single(&vdev->dma, p->data, p->dlen, DMA_TO_DEVICE, &hdr_seg, 1, &hdr_map) < 0) {
+        pktbuf_free(p, true);
+        return ERR_NO_MEMORY;
+    }
+    if (dma_map_single(&vdev->dma, p2->data, p2->dlen, DMA_TO_DEVICE, &pkt_seg, 1, &pkt_map) < 0) {
+        dma_unmap(&hdr_map);
+        pktbuf_free(p, true);
+        return ERR_NO_MEMORY;
+    }
+
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
 
@@ -226,10 +264,12 @@ static status_t virtio_net_queue_tx_pktbuf(struct virtio_net_dev *ndev, pktbuf_t
     /* allocate a chain of descriptors for our transfer */
     struct vring_desc *desc = virtio_alloc_desc_chain(vdev, RING_TX, 2, &i);
     if (!desc) {
+nodesc:
         spin_unlock_irqrestore(&ndev->lock, state);
 
-nodesc:
         TRACEF("out of virtio tx descriptors, tx_pending_count %u\n", ndev->tx_pending_count);
+        dma_unmap(&pkt_map);
+        dma_unmap(&hdr_map);
         pktbuf_free(p, true);
 
         return ERR_NO_MEMORY;
@@ -243,16 +283,18 @@ nodesc:
     DEBUG_ASSERT(ndev->pending_tx_packet[desc->next] == NULL);
     ndev->pending_tx_packet[i] = p;
     ndev->pending_tx_packet[desc->next] = p2;
+    ndev->pending_tx_map[i] = hdr_map;
+    ndev->pending_tx_map[desc->next] = pkt_map;
 
     /* set up the descriptor pointing to the header */
-    desc->addr = pktbuf_data_phys(p);
-    desc->len = p->dlen;
+    desc->addr = hdr_seg.addr;
+    desc->len = hdr_seg.len;
     desc->flags |= VRING_DESC_F_NEXT;
 
     /* set up the descriptor pointing to the buffer */
     desc = virtio_desc_index_to_desc(vdev, RING_TX, desc->next);
-    desc->addr = pktbuf_data_phys(p2);
-    desc->len = p2->dlen;
+    desc->addr = pkt_seg.addr;
+    desc->len = pkt_seg.len;
     desc->flags = 0;
 
     /* submit the transfer */
@@ -290,7 +332,7 @@ static status_t virtio_net_queue_tx(struct virtio_net_dev *ndev, const void *buf
     return err;
 }
 
-static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
+static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p, bool kick)
 {
     struct virtio_device *vdev = ndev->dev;
 
@@ -300,9 +342,14 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     /* point our header to the base of the pktbuf */
     p->data = p->buffer;
     struct virtio_net_hdr *hdr = (struct virtio_net_hdr *)p->data;
-    memset(hdr, 0, sizeof(struct virtio_net_hdr) - 2);
+    memset(hdr, 0, ndev->hdr_len);
 
-    p->dlen = sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS;
+    p->dlen = ndev->hdr_len + VIRTIO_NET_MSS;
+
+    dma_map_t map;
+    dma_segment_t seg;
+    if (dma_map_single(&vdev->dma, p->data, p->dlen, DMA_FROM_DEVICE, &seg, 1, &map) < 0)
+        return ERR_NO_MEMORY;
 
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&ndev->lock, state);
@@ -315,17 +362,19 @@ static status_t virtio_net_queue_rx(struct virtio_net_dev *ndev, pktbuf_t *p)
     /* save a pointer to our pktbufs for the irq handler to use */
     DEBUG_ASSERT(ndev->pending_rx_packet[i] == NULL);
     ndev->pending_rx_packet[i] = p;
+    ndev->pending_rx_map[i] = map;
 
     /* set up the descriptor pointing to the header */
-    desc->addr = pktbuf_data_phys(p);
-    desc->len = p->dlen;
+    desc->addr = seg.addr;
+    desc->len = seg.len;
     desc->flags = VRING_DESC_F_WRITE;
 
     /* submit the transfer */
     virtio_submit_chain(vdev, RING_RX, i);
 
-    /* kick it off */
-    virtio_kick(vdev, RING_RX);
+    /* kick it off, unless the caller is refilling a batch */
+    if (kick)
+        virtio_kick(vdev, RING_RX);
 
     spin_unlock_irqrestore(&ndev->lock, state);
 
@@ -363,8 +412,10 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
             DEBUG_ASSERT(p);
             LTRACEF("rx pktbuf %p filled\n", p);
 
+            dma_unmap(&ndev->pending_rx_map[i]);
+
             /* trim the pktbuf according to the written length in the used element descriptor */
-            if (e->len > (sizeof(struct virtio_net_hdr) - 2 + VIRTIO_NET_MSS)) {
+            if (e->len > (ndev->hdr_len + VIRTIO_NET_MSS)) {
                 TRACEF("bad used len on RX %u\n", e->len);
                 p->dlen = 0;
             } else {
@@ -381,6 +432,8 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
             DEBUG_ASSERT(p);
             LTRACEF("freeing pktbuf %p\n", p);
 
+            dma_unmap(&ndev->pending_tx_map[i]);
+
             pktbuf_free(p, false);
         }
 
@@ -394,6 +447,8 @@ static enum handler_return virtio_net_irq_driver_callback(struct virtio_device *
     /* if rx ring, signal our event */
     if (ring == 0) {
         event_signal(&ndev->rx_event, false);
+    } else {
+        event_signal(&ndev->tx_event, false);
     }
 
     return INT_RESCHEDULE;
@@ -406,7 +461,9 @@ static int virtio_net_rx_worker(void *arg)
     for (;;) {
         event_wait(&ndev->rx_event);
 
-        /* pull some packets from the received queue */
+        /* pull some packets from the received queue, handing them all back
+         * to the device with a single kick */
+        bool requeued = false;
         for (;;) {
             spin_lock_saved_state_t state;
             spin_lock_irqsave(&ndev->lock, state);
@@ -421,14 +478,22 @@ static int virtio_net_rx_worker(void *arg)
             LTRACEF("got packet len %u\n", p->dlen);
 
             /* process our packet */
-            struct virtio_net_hdr *hdr = pktbuf_consume(p, sizeof(struct virtio_net_hdr) - 2);
+            struct virtio_net_hdr *hdr = pktbuf_consume(p, ndev->hdr_len);
             if (hdr) {
                 /* call up into the stack */
                 minip_rx_driver_callback(p);
             }
 
             /* requeue the pktbuf in the rx queue */
-            virtio_net_queue_rx(ndev, p);
+            virtio_net_queue_rx(ndev, p, false);
+            requeued = true;
+        }
+
+        if (requeued) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&ndev->lock, state);
+            virtio_kick(ndev->dev, RING_RX);
+            spin_unlock_irqrestore(&ndev->lock, state);
         }
     }
     return 0;
@@ -471,3 +536,107 @@ status_t virtio_net_send_minip_pkt(pktbuf_t *p)
     return err;
 }
 
+
+#if WITH_LIB_CONSOLE
+
+#define BENCH_ETHERTYPE 0x88b5 /* local experimental */
+
+/* wait for room for another packet in the tx ring */
+static void virtio_net_bench_wait_tx(struct virtio_net_dev *ndev, uint pending)
+{
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&ndev->lock, state);
+        uint count = ndev->tx_pending_count;
+        spin_unlock_irqrestore(&ndev->lock, state);
+        if (count <= pending)
+            return;
+
+        /* time out in case someone else's packet took the last completion */
+        event_wait_timeout(&ndev->tx_event, 10);
+    }
+}
+
+/* transmit count broadcast frames of len bytes as fast as the tx ring takes them */
+static int virtio_net_bench(struct virtio_net_dev *ndev, uint count, size_t len)
+{
+    if (len < 60 || len > VIRTIO_NET_MSS)
+        return ERR_INVALID_ARGS;
+
+    uint8_t *frame = calloc(1, len);
+    if (!frame)
+        return ERR_NO_MEMORY;
+    memset(frame, 0xff, 6);
+    memcpy(frame + 6, ndev->config->mac, 6);
+    frame[12] = BENCH_ETHERTYPE >> 8;
+    frame[13] = BENCH_ETHERTYPE & 0xff;
+
+    int err = NO_ERROR;
+    uint sent = 0;
+    lk_bigtime_t start = current_time_hires();
+
+    while (sent < count) {
+        /* each packet takes two descriptors */
+        virtio_net_bench_wait_tx(ndev, TX_RING_SIZE - 2);
+
+        err = virtio_net_queue_tx(ndev, frame, len);
+        if (err == ERR_NO_MEMORY) {
+            /* out of pktbufs, let some come back */
+            event_wait_timeout(&ndev->tx_event, 10);
+            continue;
+        }
+        if (err < 0)
+            break;
+        sent++;
+    }
+
+    /* the last ones are only sent once the device hands them back */
+    virtio_net_bench_wait_tx(ndev, 0);
+
+    lk_bigtime_t elapsed = current_time_hires() - start;
+
+    if (err < 0) {
+        printf("error %d sending packet\n", err);
+    } else {
+        printf("%u packets of %zu bytes in %llu usecs, %s rings\n", sent, len, elapsed,
+               (ndev->dev->features & VIRTIO_F_RING_PACKED) ? "packed" : "split");
+        if (elapsed > 0) {
+            printf("%llu packets/sec, %llu KB/sec\n", (uint64_t)sent * 1000000 / elapsed,
+                   (uint64_t)sent * len * 1000000 / elapsed / 1024);
+        }
+    }
+
+    free(frame);
+
+    return err;
+}
+
+static int cmd_vnet(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+        printf("not enough arguments\n");
+usage:
+        printf("%s bench [count] [packet size]\n", argv[0].str);
+        return -1;
+    }
+
+    if (!the_ndev) {
+        printf("no virtio-net device\n");
+        return ERR_NOT_FOUND;
+    }
+
+    if (!strcmp(argv[1].str, "bench")) {
+        uint count = (argc > 2) ? argv[2].u : 100000;
+        size_t len = (argc > 3) ? argv[3].u : VIRTIO_NET_MSS;
+        return virtio_net_bench(the_ndev, count, len);
+    }
+
+    printf("unrecognized subcommand\n");
+    goto usage;
+}
+
+STATIC_COMMAND_START
+STATIC_COMMAND("vnet", "virtio-net commands", &cmd_vnet)
+STATIC_COMMAND_END(virtio_net);
+
+#endif
@@ -5,4 +5,18 @@ MODULE := $(LOCAL_DIR)
 MODULE_SRCS += \
 	$(LOCAL_DIR)/virtio.c
 
+# the pci transport, for platforms with a pci bus
+ifeq ($(VIRTIO_PCI),1)
+MODULE_SRCS += \
+	$(LOCAL_DIR)/virtio_pci.c
+endif
+
+MODULE_DEPS += \
+	lib/dma
+
+# negotiate packed virtqueues with devices that offer them by default, a
+# virtio.packed=0 or 1 on the kernel command line overrides it for one boot
+VIRTIO_PACKED_RING ?= 1
+GLOBAL_DEFINES += VIRTIO_PACKED_RING=$(VIRTIO_PACKED_RING)
+
 include make/module.mk
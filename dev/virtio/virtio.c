@@ -53,6 +53,9 @@
 
 static struct virtio_device *devices;
 
+/* negotiate packed rings with devices that offer them */
+static bool virtio_packed_rings = VIRTIO_PACKED_RING;
+
 static void dump_mmio_config(const volatile struct virtio_mmio_config *mmio)
 {
     printf("mmio at %p\n", mmio);
@@ -78,6 +81,25 @@ void virtio_dump_desc(const struct vring_desc *desc)
     printf("\tnext  0x%hhx\n", desc->next);
 }
 
+enum handler_return virtio_service_rings(struct virtio_device *dev, uint32_t rings)
+{
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    /* cycle through the active rings, keeping the device quiet until each
+     * one is drained */
+    for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
+        if ((dev->active_rings_bitmap & rings & (1<<r)) == 0)
+            continue;
+
+        virtio_disable_interrupts(dev, r);
+        do {
+            ret |= virtio_poll_ring(dev, r);
+        } while (virtio_enable_interrupts(dev, r));
+    }
+
+    return ret;
+}
+
 static enum handler_return virtio_mmio_irq(void *arg)
 {
     struct virtio_device *dev = (struct virtio_device *)arg;
@@ -91,28 +113,7 @@ static enum handler_return virtio_mmio_irq(void *arg)
         // XXX is this safe?
         dev->mmio_config->interrupt_ack = 0x1;
 
-        /* cycle through all the active rings */
-        for (uint r = 0; r < MAX_VIRTIO_RINGS; r++) {
-            if ((dev->active_rings_bitmap & (1<<r)) == 0)
-                continue;
-
-            struct vring *ring = &dev->ring[r];
-            LTRACEF("ring %u: used flags 0x%hhx idx 0x%hhx last_used %u\n", r, ring->used->flags, ring->used->idx, ring->last_used);
-
-            uint cur_idx = ring->used->idx;
-            for (uint i = ring->last_used; i != (cur_idx & ring->num_mask); i = (i + 1) & ring->num_mask) {
-                LTRACEF("looking at idx %u\n", i);
-
-                // process chain
-                struct vring_used_elem *used_elem = &ring->used->ring[i];
-                LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
-
-                DEBUG_ASSERT(dev->irq_driver_callback);
-                ret |= dev->irq_driver_callback(dev, r, used_elem);
-
-                ring->last_used = (ring->last_used + 1) & ring->num_mask;
-            }
-        }
+        ret |= virtio_service_rings(dev, dev->active_rings_bitmap);
     }
     if (irq_status & 0x2) { /* config change */
         dev->mmio_config->interrupt_ack = 0x2;
@@ -127,6 +128,130 @@ static enum handler_return virtio_mmio_irq(void *arg)
     return ret;
 }
 
+static uint8_t virtio_mmio_get_status(struct virtio_device *dev)
+{
+    return dev->mmio_config->status;
+}
+
+static void virtio_mmio_set_status(struct virtio_device *dev, uint8_t status)
+{
+    dev->mmio_config->status = status;
+}
+
+static uint64_t virtio_mmio_get_features(struct virtio_device *dev)
+{
+    dev->mmio_config->host_features_sel = 0;
+    uint64_t features = dev->mmio_config->host_features;
+    if (dev->version >= 2) {
+        dev->mmio_config->host_features_sel = 1;
+        features |= (uint64_t)dev->mmio_config->host_features << 32;
+    }
+
+    return features;
+}
+
+static void virtio_mmio_set_features(struct virtio_device *dev, uint64_t features)
+{
+    dev->mmio_config->guest_features_sel = 0;
+    dev->mmio_config->guest_features = features;
+    if (dev->version >= 2) {
+        dev->mmio_config->guest_features_sel = 1;
+        dev->mmio_config->guest_features = features >> 32;
+    }
+}
+
+static status_t virtio_mmio_setup_ring(struct virtio_device *dev, uint index, uint16_t len,
+                                       paddr_t desc, paddr_t driver, paddr_t device)
+{
+    if (dev->version >= 2) {
+        /* modern devices take the three areas separately */
+        uint64_t desc_pa = desc;
+        uint64_t driver_pa = driver;
+        uint64_t device_pa = device;
+
+        dev->mmio_config->queue_sel = index;
+        dev->mmio_config->queue_num = len;
+        dev->mmio_config->queue_desc_low = desc_pa;
+        dev->mmio_config->queue_desc_high = desc_pa >> 32;
+        dev->mmio_config->queue_driver_low = driver_pa;
+        dev->mmio_config->queue_driver_high = driver_pa >> 32;
+        dev->mmio_config->queue_device_low = device_pa;
+        dev->mmio_config->queue_device_high = device_pa >> 32;
+        dev->mmio_config->queue_ready = 1;
+    } else {
+        /* legacy rings are one page aligned block, found by its first page */
+        dev->mmio_config->guest_page_size = PAGE_SIZE;
+        dev->mmio_config->queue_sel = index;
+        dev->mmio_config->queue_num = len;
+        dev->mmio_config->queue_align = PAGE_SIZE;
+        dev->mmio_config->queue_pfn = desc / PAGE_SIZE;
+    }
+
+    return NO_ERROR;
+}
+
+static void virtio_mmio_notify(struct virtio_device *dev, uint index)
+{
+    dev->mmio_config->queue_notify = index;
+}
+
+static const struct virtio_transport virtio_mmio_transport = {
+    .get_status = virtio_mmio_get_status,
+    .set_status = virtio_mmio_set_status,
+    .get_features = virtio_mmio_get_features,
+    .set_features = virtio_mmio_set_features,
+    .setup_ring = virtio_mmio_setup_ring,
+    .notify = virtio_mmio_notify,
+};
+
+status_t virtio_probe_device(struct virtio_device *dev, uint device_id)
+{
+    LTRACEF("dev %p, device_id %u\n", dev, device_id);
+
+    DEBUG_ASSERT(dev->transport);
+
+    /* drivers only look at the legacy feature bits they are handed, the
+     * ones that care read the rest themselves */
+    __UNUSED uint32_t host_features = virtio_get_host_features(dev);
+
+    status_t err = ERR_NOT_FOUND;
+    switch (device_id) {
+#if WITH_DEV_VIRTIO_BLOCK
+        case 2: // block device
+            LTRACEF("found block device\n");
+            err = virtio_block_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_NET
+        case 1: // network device
+            LTRACEF("found net device\n");
+            err = virtio_net_init(dev, host_features);
+            break;
+#endif
+#if WITH_DEV_VIRTIO_GPU
+        case 0x10: // virtio-gpu
+            LTRACEF("found gpu device\n");
+            err = virtio_gpu_init(dev, host_features);
+            break;
+#endif
+    }
+    if (err < 0)
+        return err;
+
+    // good device
+    dev->valid = true;
+
+    if (dev->irq_driver_callback)
+        unmask_interrupt(dev->irq);
+
+#if WITH_DEV_VIRTIO_GPU
+    if (device_id == 0x10)
+        virtio_gpu_start(dev);
+#endif
+
+    return NO_ERROR;
+}
+
 int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 {
     LTRACEF("ptr %p, count %u\n", ptr, count);
@@ -157,6 +282,7 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
         if (mmio->magic != VIRTIO_MMIO_MAGIC) {
             continue;
         }
+        dev->version = mmio->version;
 
 #if LOCAL_TRACE
         if (mmio->device_id != 0) {
@@ -164,76 +290,14 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
         }
 #endif
 
-#if WITH_DEV_VIRTIO_BLOCK
-        if (mmio->device_id == 2) { // block device
-            LTRACEF("found block device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_block_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-
-                // XXX quick test code, remove
-#if 0
-                uint8_t buf[512];
-                memset(buf, 0x99, sizeof(buf));
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-
-                buf[0]++;
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), true);
-
-                virtio_block_read_write(dev, buf, 0, sizeof(buf), false);
-                hexdump8_ex(buf, sizeof(buf), 0);
-#endif
-            }
-
-        }
-#endif // WITH_DEV_VIRTIO_BLOCK
-#if WITH_DEV_VIRTIO_NET
-        if (mmio->device_id == 1) { // network device
-            LTRACEF("found net device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_net_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_NET
-#if WITH_DEV_VIRTIO_GPU
-        if (mmio->device_id == 0x10) { // virtio-gpu
-            LTRACEF("found gpu device\n");
-
-            dev->mmio_config = mmio;
-            dev->config_ptr = (void *)mmio->config;
-
-            status_t err = virtio_gpu_init(dev, mmio->host_features);
-            if (err >= 0) {
-                // good device
-                dev->valid = true;
-
-                if (dev->irq_driver_callback)
-                    unmask_interrupt(dev->irq);
+        if (mmio->device_id == 0)
+            continue;
 
-                virtio_gpu_start(dev);
-            }
-        }
-#endif // WITH_DEV_VIRTIO_GPU
+        dev->transport = &virtio_mmio_transport;
+        dev->mmio_config = mmio;
+        dev->config_ptr = (void *)mmio->config;
 
-        if (dev->valid)
+        if (virtio_probe_device(dev, mmio->device_id) >= 0)
             found++;
     }
 
@@ -243,6 +307,20 @@ int virtio_mmio_detect(void *ptr, uint count, const uint irqs[])
 void virtio_free_desc(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     LTRACEF("dev %p ring %u index %u free_count %u\n", dev, ring_index, desc_index, dev->ring[ring_index].free_count);
+
+    /* give back the indirect table this descriptor pointed at */
+    struct vring *ring = &dev->ring[ring_index];
+    DEBUG_ASSERT(desc_index < ring->num);
+    struct vring_desc *desc = &ring->desc[desc_index];
+    if ((desc->flags & VRING_DESC_F_INDIRECT) && ring->indirect) {
+        uint16_t t = (desc->addr - ring->indirect_phys) / (ring->indirect_len * sizeof(struct vring_desc));
+        DEBUG_ASSERT(t < ring->indirect_count);
+
+        ring->indirect[t * ring->indirect_len].next = ring->indirect_free_list;
+        ring->indirect_free_list = t;
+        desc->flags = 0;
+    }
+
     dev->ring[ring_index].desc[desc_index].next = dev->ring[ring_index].free_list;
     dev->ring[ring_index].free_list = desc_index;
     dev->ring[ring_index].free_count++;
@@ -298,15 +376,148 @@ struct vring_desc *virtio_alloc_desc_chain(struct virtio_device *dev, uint ring_
     return last;
 }
 
+status_t virtio_alloc_indirect_tables(struct virtio_device *dev, uint ring_index, uint16_t count, uint16_t len)
+{
+    LTRACEF("dev %p, ring %u, count %u, len %u\n", dev, ring_index, count, len);
+
+    DEBUG_ASSERT(ring_index < MAX_VIRTIO_RINGS);
+    DEBUG_ASSERT(count > 0 && len > 0);
+
+    struct vring *ring = &dev->ring[ring_index];
+    DEBUG_ASSERT(!ring->indirect);
+
+    paddr_t pa;
+    struct vring_desc *tables = dma_alloc_coherent(&dev->dma, (size_t)count * len * sizeof(struct vring_desc), &pa);
+    if (!tables)
+        return ERR_NO_MEMORY;
+
+    ring->indirect = tables;
+    ring->indirect_phys = pa;
+    ring->indirect_len = len;
+    ring->indirect_count = count;
+    ring->indirect_free_list = 0xffff;
+    for (uint t = count; t-- > 0; ) {
+        tables[t * len].next = ring->indirect_free_list;
+        ring->indirect_free_list = t;
+    }
+
+    return NO_ERROR;
+}
+
+struct vring_desc *virtio_alloc_indirect_chain(struct virtio_device *dev, uint ring_index, size_t count, uint16_t *start_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    if (!ring->indirect || count > ring->indirect_len || ring->indirect_free_list == 0xffff)
+        return NULL;
+
+    uint16_t head = virtio_alloc_desc(dev, ring_index);
+    if (head == 0xffff)
+        return NULL;
+
+    uint16_t t = ring->indirect_free_list;
+    struct vring_desc *table = &ring->indirect[t * ring->indirect_len];
+    ring->indirect_free_list = table[0].next;
+
+    for (size_t i = 0; i < count; i++) {
+        table[i].flags = (i + 1 < count) ? VRING_DESC_F_NEXT : 0;
+        table[i].next = i + 1;
+    }
+
+    /* the ring only sees one descriptor pointing at the table */
+    struct vring_desc *desc = &ring->desc[head];
+    desc->addr = ring->indirect_phys + (paddr_t)t * ring->indirect_len * sizeof(struct vring_desc);
+    desc->len = count * sizeof(struct vring_desc);
+    desc->flags = VRING_DESC_F_INDIRECT;
+    desc->next = 0;
+
+    if (start_index)
+        *start_index = head;
+
+    return table;
+}
+
+static bool virtio_event_idx(struct virtio_device *dev)
+{
+    return dev->features & (1u << VIRTIO_RING_F_EVENT_IDX);
+}
+
+/* packed indirect tables are a plain array of packed descriptors */
+static void virtio_packed_indirect(struct vring *ring, struct vring_desc *desc)
+{
+    DEBUG_ASSERT(ring->indirect);
+
+    struct vring_desc *table = &ring->indirect[(desc->addr - ring->indirect_phys) / sizeof(struct vring_desc)];
+    struct vring_packed_desc *ptable = (struct vring_packed_desc *)table;
+
+    for (uint i = 0; i < desc->len / sizeof(struct vring_desc); i++) {
+        uint16_t flags = table[i].flags & VRING_DESC_F_WRITE;
+        ptable[i].id = 0;
+        ptable[i].flags = flags;
+    }
+}
+
+static void virtio_submit_chain_packed(struct vring *ring, uint16_t desc_index)
+{
+    uint16_t head_pos = ring->next_avail;
+    uint16_t head_flags = 0;
+    uint16_t pos = head_pos;
+    bool wrap = ring->avail_wrap;
+    uint16_t n = 0;
+
+    /* copy the chain into the ring, publishing the head last */
+    for (uint16_t i = desc_index; ; ) {
+        struct vring_desc *desc = &ring->desc[i];
+        struct vring_packed_desc *p = &ring->packed[pos];
+
+        if (desc->flags & VRING_DESC_F_INDIRECT)
+            virtio_packed_indirect(ring, desc);
+
+        uint16_t flags = desc->flags & (VRING_DESC_F_NEXT | VRING_DESC_F_WRITE | VRING_DESC_F_INDIRECT);
+        flags |= wrap ? VRING_PACKED_DESC_F_AVAIL : VRING_PACKED_DESC_F_USED;
+
+        p->addr = desc->addr;
+        p->len = desc->len;
+        p->id = desc_index;
+        if (n == 0)
+            head_flags = flags;
+        else
+            p->flags = flags;
+
+        n++;
+        if (++pos == ring->num) {
+            pos = 0;
+            wrap = !wrap;
+        }
+
+        if (!(desc->flags & VRING_DESC_F_NEXT))
+            break;
+        i = desc->next;
+    }
+
+    ring->chain_len[desc_index] = n;
+    wmb();
+    ring->packed[head_pos].flags = head_flags;
+
+    ring->next_avail = pos;
+    ring->avail_wrap = wrap;
+    ring->num_added += n;
+}
+
 void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t desc_index)
 {
     LTRACEF("dev %p, ring %u, desc %u\n", dev, ring_index, desc_index);
 
+    if (dev->ring[ring_index].packed) {
+        virtio_submit_chain_packed(&dev->ring[ring_index], desc_index);
+        return;
+    }
+
     /* add the chain to the available list */
     struct vring_avail *avail = dev->ring[ring_index].avail;
 
     avail->ring[avail->idx & dev->ring[ring_index].num_mask] = desc_index;
-    DSB;
+    wmb();
     avail->idx++;
 
 #if LOCAL_TRACE
@@ -316,10 +527,152 @@ void virtio_submit_chain(struct virtio_device *dev, uint ring_index, uint16_t de
 
 void virtio_kick(struct virtio_device *dev, uint ring_index)
 {
-    LTRACEF("dev %p, ring %u\n", dev, ring_index);
+    struct vring *ring = &dev->ring[ring_index];
+    uint16_t new_avail, old_avail;
+    bool notify;
+
+    if (ring->packed) {
+        new_avail = ring->next_avail;
+        old_avail = new_avail - ring->num_added;
+        ring->num_added = 0;
+
+        mb();
+
+        struct vring_packed_desc_event event = *ring->device_event;
+        if (event.flags == VRING_PACKED_EVENT_FLAG_DESC) {
+            /* the event is a ring position, a lap behind if its wrap
+             * counter doesn't match ours */
+            uint16_t event_idx = event.off_wrap & ~(1u << VRING_PACKED_EVENT_F_WRAP_CTR);
+            if ((bool)(event.off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != ring->avail_wrap)
+                event_idx -= ring->num;
+            notify = vring_need_event(event_idx, new_avail, old_avail);
+        } else {
+            notify = event.flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+        }
+    } else {
+        new_avail = ring->avail->idx;
+        old_avail = ring->kicked_avail;
+        ring->kicked_avail = new_avail;
+
+        /* the device has to see the new avail index before we look at what
+         * it last asked for, or it could go to sleep on a stale one */
+        mb();
+
+        if (virtio_event_idx(dev))
+            notify = vring_need_event(*vring_avail_event(ring), new_avail, old_avail);
+        else
+            notify = !(ring->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
 
-    dev->mmio_config->queue_notify = ring_index;
-    DSB;
+    LTRACEF("dev %p, ring %u, avail %u -> %u, notify %d\n", dev, ring_index, old_avail, new_avail, notify);
+
+    if (notify) {
+        dev->transport->notify(dev, ring_index);
+        mb();
+    }
+}
+
+/* has the device handed back the packed descriptor at the current position */
+static bool virtio_packed_used(struct vring *ring)
+{
+    uint16_t flags = ring->packed[ring->last_used].flags;
+    bool avail = flags & VRING_PACKED_DESC_F_AVAIL;
+    bool used = flags & VRING_PACKED_DESC_F_USED;
+
+    return avail == used && used == ring->used_wrap;
+}
+
+void virtio_disable_interrupts(struct virtio_device *dev, uint ring_index)
+{
+    if (dev->ring[ring_index].packed) {
+        dev->ring[ring_index].driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+        return;
+    }
+
+    /* with event indices the device only interrupts once it passes the used
+     * event, which isn't moved until interrupts are enabled again */
+    if (!virtio_event_idx(dev))
+        dev->ring[ring_index].avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
+}
+
+bool virtio_enable_interrupts(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+
+    if (ring->packed) {
+        if (virtio_event_idx(dev)) {
+            ring->driver_event->off_wrap = ring->last_used |
+                                           (ring->used_wrap << VRING_PACKED_EVENT_F_WRAP_CTR);
+            wmb();
+            ring->driver_event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+        } else {
+            ring->driver_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+        }
+        mb();
+
+        return virtio_packed_used(ring);
+    }
+
+    if (virtio_event_idx(dev))
+        vring_used_event(ring) = ring->last_used;
+    else
+        ring->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+
+    /* catch anything the device used before it could see the change */
+    mb();
+
+    return ring->used->idx != ring->last_used;
+}
+
+enum handler_return virtio_poll_ring(struct virtio_device *dev, uint ring_index)
+{
+    struct vring *ring = &dev->ring[ring_index];
+    enum handler_return ret = INT_NO_RESCHEDULE;
+
+    if (ring->packed) {
+        while (virtio_packed_used(ring)) {
+            rmb();
+
+            /* the device writes one descriptor per chain, with the chain's
+             * id, and the chain's other slots are skipped */
+            struct vring_packed_desc *p = &ring->packed[ring->last_used];
+            struct vring_used_elem e = { .id = p->id, .len = p->len };
+            DEBUG_ASSERT(e.id < ring->num);
+            uint16_t n = ring->chain_len[e.id];
+
+            LTRACEF("packed pos %u, id %u, len %u, slots %u\n", ring->last_used, e.id, e.len, n);
+
+            DEBUG_ASSERT(dev->irq_driver_callback);
+            ret |= dev->irq_driver_callback(dev, ring_index, &e);
+
+            ring->last_used += n;
+            if (ring->last_used >= ring->num) {
+                ring->last_used -= ring->num;
+                ring->used_wrap = !ring->used_wrap;
+            }
+        }
+        return ret;
+    }
+
+    LTRACEF("ring %u: used flags 0x%hx idx 0x%hx last_used %u\n", ring_index, ring->used->flags, ring->used->idx, ring->last_used);
+
+    uint16_t used_idx = ring->used->idx;
+    rmb();
+
+    while (ring->last_used != used_idx) {
+        LTRACEF("looking at idx %u\n", ring->last_used);
+
+        // process chain
+        struct vring_used_elem *used_elem = &ring->used->ring[ring->last_used & ring->num_mask];
+        LTRACEF("id %u, len %u\n", used_elem->id, used_elem->len);
+
+        DEBUG_ASSERT(dev->irq_driver_callback);
+        ret |= dev->irq_driver_callback(dev, ring_index, used_elem);
+
+        ring->last_used++;
+    }
+
+    return ret;
 }
 
 status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
@@ -335,13 +688,28 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 
     struct vring *ring = &dev->ring[index];
 
+    /* packed rings keep the descriptors drivers fill in out of the ring */
+    bool packed = dev->features & VIRTIO_F_RING_PACKED;
+    struct vring_desc *shadow = NULL;
+    uint16_t *chain_len = NULL;
+    if (packed) {
+        shadow = calloc(len, sizeof(struct vring_desc));
+        chain_len = calloc(len, sizeof(uint16_t));
+        if (!shadow || !chain_len) {
+            free(shadow);
+            free(chain_len);
+            return ERR_NO_MEMORY;
+        }
+    }
+
     /* allocate a ring */
-    size_t size = vring_size(len, PAGE_SIZE);
-    LTRACEF("need %zu bytes\n", size);
+    size_t size = packed ? vring_packed_size(len) : vring_size(len, PAGE_SIZE);
+    LTRACEF("need %zu bytes, %s\n", size, packed ? "packed" : "split");
 
+    status_t err;
 #if WITH_KERNEL_VM
     void *vptr;
-    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
+    err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "virtio_ring", size, &vptr, 0, 0, ARCH_MMU_FLAG_UNCACHED_DEVICE);
     if (err < 0)
         return ERR_NO_MEMORY;
 
@@ -368,7 +736,10 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 #endif
 
     /* initialize the ring */
-    vring_init(ring, len, vptr, PAGE_SIZE);
+    if (packed)
+        vring_init_packed(ring, len, vptr, shadow, chain_len);
+    else
+        vring_init(ring, len, vptr, PAGE_SIZE);
     dev->ring[index].free_list = 0xffff;
     dev->ring[index].free_count = 0;
 
@@ -378,12 +749,21 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
     }
 
     /* register the ring with the device */
-    DEBUG_ASSERT(dev->mmio_config);
-    dev->mmio_config->guest_page_size = PAGE_SIZE;
-    dev->mmio_config->queue_sel = index;
-    dev->mmio_config->queue_num = len;
-    dev->mmio_config->queue_align = PAGE_SIZE;
-    dev->mmio_config->queue_pfn = pa / PAGE_SIZE;
+    paddr_t driver_pa = pa + ((uintptr_t)(packed ? (void *)ring->driver_event : (void *)ring->avail) - (uintptr_t)vptr);
+    paddr_t device_pa = pa + ((uintptr_t)(packed ? (void *)ring->device_event : (void *)ring->used) - (uintptr_t)vptr);
+    err = dev->transport->setup_ring(dev, index, len, pa, driver_pa, device_pa);
+    if (err < 0) {
+        TRACEF("device %u refused ring %u, len %u\n", dev->index, index, len);
+#if WITH_KERNEL_VM
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)vptr);
+#else
+        free(vptr);
+#endif
+        free(shadow);
+        free(chain_len);
+        memset(ring, 0, sizeof(*ring));
+        return err;
+    }
 
     /* mark the ring active */
     dev->active_rings_bitmap |= (1 << index);
@@ -393,17 +773,70 @@ status_t virtio_alloc_ring(struct virtio_device *dev, uint index, uint16_t len)
 
 void virtio_reset_device(struct virtio_device *dev)
 {
-    dev->mmio_config->status = 0;
+    dev->transport->set_status(dev, 0);
 }
 
 void virtio_status_acknowledge_driver(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER;
+    uint8_t status = dev->transport->get_status(dev);
+    dev->transport->set_status(dev, status | VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+}
+
+uint64_t virtio_get_host_features(struct virtio_device *dev)
+{
+    return dev->transport->get_features(dev);
+}
+
+status_t virtio_set_guest_features(struct virtio_device *dev, uint64_t features)
+{
+    LTRACEF("dev %p, features 0x%llx\n", dev, features);
+
+    if (dev->version < 2)
+        features &= 0xffffffff;
+    if (!virtio_packed_rings)
+        features &= ~VIRTIO_F_RING_PACKED;
+
+    dev->features = features;
+    dev->transport->set_features(dev, features);
+    if (dev->version < 2)
+        return NO_ERROR;
+
+    /* a modern device gets to refuse the set */
+    uint8_t status = dev->transport->get_status(dev);
+    dev->transport->set_status(dev, status | VIRTIO_STATUS_FEATURES_OK);
+    if (!(dev->transport->get_status(dev) & VIRTIO_STATUS_FEATURES_OK)) {
+        TRACEF("device %u refused features 0x%llx\n", dev->index, features);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    return NO_ERROR;
+}
+
+void virtio_set_packed_rings(bool enable)
+{
+    virtio_packed_rings = enable;
+}
+
+void virtio_parse_cmdline(const char *cmdline)
+{
+    static const char opt[] = "virtio.packed=";
+
+    for (const char *s = cmdline; (s = strstr(s, opt)); s += sizeof(opt) - 1) {
+        if (s != cmdline && s[-1] != ' ')
+            continue;
+
+        char val = s[sizeof(opt) - 1];
+        if (val == '0' || val == '1') {
+            virtio_set_packed_rings(val == '1');
+            dprintf(INFO, "virtio: %s rings\n", virtio_packed_rings ? "packed" : "split");
+        }
+    }
 }
 
 void virtio_status_driver_ok(struct virtio_device *dev)
 {
-    dev->mmio_config->status |= VIRTIO_STATUS_DRIVER_OK;
+    uint8_t status = dev->transport->get_status(dev);
+    dev->transport->set_status(dev, status | VIRTIO_STATUS_DRIVER_OK);
 }
 
 void virtio_init(uint level)
@@ -0,0 +1,521 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <dev/virtio.h>
+
+#include <debug.h>
+#include <assert.h>
+#include <trace.h>
+#include <compiler.h>
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arch/ops.h>
+#include <dev/pci.h>
+#include <platform/interrupts.h>
+
+#include "virtio_priv.h"
+
+#define LOCAL_TRACE 0
+
+/* The modern virtio pci interface. The device's registers live in memory
+ * bars, found through vendor capabilities in config space. Transitional
+ * devices also have the legacy i/o bar, which isn't used here. */
+
+#define VIRTIO_PCI_VENDOR_ID        0x1af4
+
+/* vendor capability types */
+#define VIRTIO_PCI_CAP_COMMON_CFG   1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG   2
+#define VIRTIO_PCI_CAP_ISR_CFG      3
+#define VIRTIO_PCI_CAP_DEVICE_CFG   4
+#define VIRTIO_PCI_CAP_PCI_CFG      5
+
+/* offsets into the vendor capability */
+#define VIRTIO_PCI_CAP_CFG_TYPE     3
+#define VIRTIO_PCI_CAP_BAR          4
+#define VIRTIO_PCI_CAP_OFFSET       8
+#define VIRTIO_PCI_CAP_LENGTH       12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT  16
+
+#define VIRTIO_PCI_ISR_QUEUE        0x1
+#define VIRTIO_PCI_ISR_CONFIG       0x2
+
+struct virtio_pci_common_cfg {
+    /* 0x00 */  uint32_t device_feature_select;
+    uint32_t device_feature;
+    uint32_t driver_feature_select;
+    uint32_t driver_feature;
+    /* 0x10 */  uint16_t msix_config;
+    uint16_t num_queues;
+    uint8_t device_status;
+    uint8_t config_generation;
+    /* per queue, picked by queue_select */
+    uint16_t queue_select;
+    /* 0x18 */  uint16_t queue_size;
+    uint16_t queue_msix_vector;
+    uint16_t queue_enable;
+    uint16_t queue_notify_off;
+    /* 0x20 */  uint32_t queue_desc_low;
+    uint32_t queue_desc_high;
+    /* 0x28 */  uint32_t queue_driver_low;
+    uint32_t queue_driver_high;
+    /* 0x30 */  uint32_t queue_device_low;
+    uint32_t queue_device_high;
+};
+
+STATIC_ASSERT(sizeof(struct virtio_pci_common_cfg) == 0x38);
+
+/* what an msi-x vector is for */
+#define VIRTIO_PCI_VECTOR_CONFIG    (-1)
+#define VIRTIO_PCI_VECTOR_SHARED    (-2)
+
+struct virtio_pci_dev;
+
+struct virtio_pci_vector {
+    struct virtio_pci_dev *pdev;
+    int ring; /* or one of the above */
+};
+
+struct virtio_pci_dev {
+    struct virtio_device dev;
+
+    pci_location_t loc;
+
+    /* memory bars, mapped the first time a capability points into them */
+    uint8_t *bar[6];
+    size_t bar_len[6];
+
+    volatile struct virtio_pci_common_cfg *common;
+    volatile uint8_t *isr;
+    volatile uint8_t *notify;
+    uint32_t notify_mult;
+    uint16_t notify_off[MAX_VIRTIO_RINGS];
+
+    /* msi-x, with no vectors the device raises its legacy interrupt line.
+     * Vector 0 is the config vector, ring r gets vector r + 1, unless there
+     * is only the one, in which case everything shares it. */
+    uint msix_count;
+    uint msix_base;
+    struct virtio_pci_vector vectors[1 + MAX_VIRTIO_RINGS];
+};
+
+/* pci device ids, transitional devices use 0x1000 + the legacy id and
+ * modern only ones 0x1040 + the virtio device id */
+static const struct {
+    uint16_t pci_device_id;
+    uint device_id;
+} virtio_pci_ids[] = {
+    { 0x1000, 1 },      // transitional network device
+    { 0x1001, 2 },      // transitional block device
+    { 0x1041, 1 },      // network device
+    { 0x1042, 2 },      // block device
+    { 0x1050, 0x10 },   // virtio-gpu
+};
+
+static inline struct virtio_pci_dev *to_pci_dev(struct virtio_device *dev)
+{
+    return containerof(dev, struct virtio_pci_dev, dev);
+}
+
+static uint8_t virtio_pci_get_status(struct virtio_device *dev)
+{
+    return to_pci_dev(dev)->common->device_status;
+}
+
+static void virtio_pci_set_status(struct virtio_device *dev, uint8_t status)
+{
+    struct virtio_pci_dev *pdev = to_pci_dev(dev);
+
+    pdev->common->device_status = status;
+    if (status != 0)
+        return;
+
+    /* the reset is done once the status reads back as 0, and it forgets
+     * the config vector */
+    while (pdev->common->device_status != 0)
+        ;
+    if (pdev->msix_count > 0)
+        pdev->common->msix_config = 0;
+}
+
+static uint64_t virtio_pci_get_features(struct virtio_device *dev)
+{
+    volatile struct virtio_pci_common_cfg *common = to_pci_dev(dev)->common;
+
+    common->device_feature_select = 0;
+    uint64_t features = common->device_feature;
+    common->device_feature_select = 1;
+    features |= (uint64_t)common->device_feature << 32;
+
+    return features;
+}
+
+static void virtio_pci_set_features(struct virtio_device *dev, uint64_t features)
+{
+    volatile struct virtio_pci_common_cfg *common = to_pci_dev(dev)->common;
+
+    common->driver_feature_select = 0;
+    common->driver_feature = features;
+    common->driver_feature_select = 1;
+    common->driver_feature = features >> 32;
+}
+
+static status_t virtio_pci_setup_ring(struct virtio_device *dev, uint index, uint16_t len,
+                                      paddr_t desc, paddr_t driver, paddr_t device)
+{
+    struct virtio_pci_dev *pdev = to_pci_dev(dev);
+    volatile struct virtio_pci_common_cfg *common = pdev->common;
+
+    common->queue_select = index;
+
+    /* queue_size starts out as the most the device can take */
+    uint16_t max = common->queue_size;
+    if (max == 0)
+        return ERR_NOT_FOUND;
+    if (len > max)
+        return ERR_INVALID_ARGS;
+    common->queue_size = len;
+
+    if (pdev->msix_count > 0) {
+        uint16_t vector = (pdev->msix_count > 1) ? index + 1 : 0;
+        common->queue_msix_vector = vector;
+        if (common->queue_msix_vector != vector) {
+            TRACEF("device %u has no room for vector %u\n", dev->index, vector);
+            return ERR_NO_RESOURCES;
+        }
+    }
+
+    uint64_t desc_pa = desc;
+    uint64_t driver_pa = driver;
+    uint64_t device_pa = device;
+    common->queue_desc_low = desc_pa;
+    common->queue_desc_high = desc_pa >> 32;
+    common->queue_driver_low = driver_pa;
+    common->queue_driver_high = driver_pa >> 32;
+    common->queue_device_low = device_pa;
+    common->queue_device_high = device_pa >> 32;
+
+    pdev->notify_off[index] = common->queue_notify_off;
+    common->queue_enable = 1;
+
+    return NO_ERROR;
+}
+
+static void virtio_pci_notify(struct virtio_device *dev, uint index)
+{
+    struct virtio_pci_dev *pdev = to_pci_dev(dev);
+
+    volatile uint16_t *notify = (volatile uint16_t *)(pdev->notify + pdev->notify_off[index] * pdev->notify_mult);
+    *notify = index;
+}
+
+static const struct virtio_transport virtio_pci_transport = {
+    .get_status = virtio_pci_get_status,
+    .set_status = virtio_pci_set_status,
+    .get_features = virtio_pci_get_features,
+    .set_features = virtio_pci_set_features,
+    .setup_ring = virtio_pci_setup_ring,
+    .notify = virtio_pci_notify,
+};
+
+static enum handler_return virtio_pci_config_change(struct virtio_pci_dev *pdev)
+{
+    if (pdev->dev.config_change_callback)
+        return pdev->dev.config_change_callback(&pdev->dev);
+
+    return INT_NO_RESCHEDULE;
+}
+
+static enum handler_return virtio_pci_msix_irq(void *arg)
+{
+    struct virtio_pci_vector *v = (struct virtio_pci_vector *)arg;
+    struct virtio_pci_dev *pdev = v->pdev;
+
+    LTRACEF("dev %p, ring %d\n", pdev, v->ring);
+
+    switch (v->ring) {
+        case VIRTIO_PCI_VECTOR_CONFIG:
+            return virtio_pci_config_change(pdev);
+        case VIRTIO_PCI_VECTOR_SHARED: {
+            enum handler_return ret = virtio_service_rings(&pdev->dev, pdev->dev.active_rings_bitmap);
+
+            /* config changes still show up in the isr */
+            if (*pdev->isr & VIRTIO_PCI_ISR_CONFIG)
+                ret |= virtio_pci_config_change(pdev);
+            return ret;
+        }
+        default:
+            return virtio_service_rings(&pdev->dev, 1u << v->ring);
+    }
+}
+
+static enum handler_return virtio_pci_intx_irq(void *arg)
+{
+    struct virtio_pci_dev *pdev = (struct virtio_pci_dev *)arg;
+
+    /* reading the isr acks it and drops the line */
+    uint8_t isr = *pdev->isr;
+    LTRACEF("dev %p, isr 0x%x\n", pdev, isr);
+
+    enum handler_return ret = INT_NO_RESCHEDULE;
+    if (isr & VIRTIO_PCI_ISR_QUEUE)
+        ret |= virtio_service_rings(&pdev->dev, pdev->dev.active_rings_bitmap);
+    if (isr & VIRTIO_PCI_ISR_CONFIG)
+        ret |= virtio_pci_config_change(pdev);
+
+    return ret;
+}
+
+/* map a memory bar, once */
+static status_t virtio_pci_map_bar(struct virtio_pci_dev *pdev, uint bar)
+{
+    DEBUG_ASSERT(bar < 6);
+
+    if (pdev->bar[bar])
+        return NO_ERROR;
+
+    void *ptr;
+    status_t err = pci_map_bar(&pdev->loc, bar, "virtio-pci", &ptr, &pdev->bar_len[bar]);
+    if (err < 0) {
+        LTRACEF("bar %u: err %d\n", bar, err);
+        return err;
+    }
+    LTRACEF("bar %u mapped at %p len 0x%zx\n", bar, ptr, pdev->bar_len[bar]);
+
+    pdev->bar[bar] = ptr;
+
+    return NO_ERROR;
+}
+
+/* map the structure a vendor capability points at */
+static volatile void *virtio_pci_map_cap(struct virtio_pci_dev *pdev, uint8_t cap)
+{
+    uint8_t bar;
+    uint32_t offset, length;
+
+    pci_read_config_byte(&pdev->loc, cap + VIRTIO_PCI_CAP_BAR, &bar);
+    pci_read_config_word(&pdev->loc, cap + VIRTIO_PCI_CAP_OFFSET, &offset);
+    pci_read_config_word(&pdev->loc, cap + VIRTIO_PCI_CAP_LENGTH, &length);
+
+    if (bar >= 6 || virtio_pci_map_bar(pdev, bar) < 0)
+        return NULL;
+    if ((uint64_t)offset + length > pdev->bar_len[bar])
+        return NULL;
+
+    return pdev->bar[bar] + offset;
+}
+
+static status_t virtio_pci_setup_msix(struct virtio_pci_dev *pdev, uint8_t cap)
+{
+    const pci_location_t *loc = &pdev->loc;
+    uint16_t ctrl;
+    uint32_t table;
+
+    pci_read_config_half(loc, cap + PCI_MSIX_CTRL, &ctrl);
+    pci_read_config_word(loc, cap + PCI_MSIX_TABLE, &table);
+
+    uint table_size = (ctrl & PCI_MSIX_CTRL_TABLE_SIZE) + 1;
+    uint bar = table & PCI_MSIX_TABLE_BIR;
+    uint32_t table_off = table & ~PCI_MSIX_TABLE_BIR;
+
+    if (bar >= 6 || virtio_pci_map_bar(pdev, bar) < 0)
+        return ERR_NOT_SUPPORTED;
+    if ((uint64_t)table_off + table_size * PCI_MSIX_ENTRY_SIZE > pdev->bar_len[bar])
+        return ERR_NOT_SUPPORTED;
+
+    /* one for config changes and one per ring, or failing that one for all */
+    uint count = 1 + MIN(pdev->common->num_queues, MAX_VIRTIO_RINGS);
+    uint base;
+    if (count > table_size || platform_allocate_interrupts(count, &base) < 0) {
+        count = 1;
+        if (platform_allocate_interrupts(count, &base) < 0)
+            return ERR_NO_RESOURCES;
+    }
+
+    volatile uint8_t *entries = pdev->bar[bar] + table_off;
+    for (uint i = 0; i < count; i++) {
+        uint64_t addr;
+        uint32_t data;
+
+        status_t err = platform_compose_msi_msg(base + i, &addr, &data);
+        DEBUG_ASSERT(err >= 0);
+
+        pdev->vectors[i].pdev = pdev;
+        if (count == 1)
+            pdev->vectors[i].ring = VIRTIO_PCI_VECTOR_SHARED;
+        else
+            pdev->vectors[i].ring = (i == 0) ? VIRTIO_PCI_VECTOR_CONFIG : (int)i - 1;
+        register_int_handler(base + i, &virtio_pci_msix_irq, &pdev->vectors[i]);
+
+        volatile uint32_t *entry = (volatile uint32_t *)(entries + i * PCI_MSIX_ENTRY_SIZE);
+        entry[PCI_MSIX_ENTRY_ADDR_LO / 4] = addr;
+        entry[PCI_MSIX_ENTRY_ADDR_HI / 4] = addr >> 32;
+        entry[PCI_MSIX_ENTRY_DATA / 4] = data;
+        entry[PCI_MSIX_ENTRY_CTRL / 4] = 0;
+    }
+
+    ctrl &= ~PCI_MSIX_CTRL_FUNC_MASK;
+    pci_write_config_half(loc, cap + PCI_MSIX_CTRL, ctrl | PCI_MSIX_CTRL_ENABLE);
+
+    pdev->msix_count = count;
+    pdev->msix_base = base;
+    pdev->dev.irq = base;
+
+    LTRACEF("%u msi-x vectors at %u\n", count, base);
+
+    return NO_ERROR;
+}
+
+static status_t virtio_pci_setup_intx(struct virtio_pci_dev *pdev)
+{
+    uint8_t line;
+    uint vector;
+
+    pci_read_config_byte(&pdev->loc, PCI_CONFIG_INTERRUPT_LINE, &line);
+    if (platform_pci_int_to_vector(line, &vector) < 0)
+        return ERR_NOT_SUPPORTED;
+
+    pdev->dev.irq = vector;
+    mask_interrupt(vector);
+    register_int_handler(vector, &virtio_pci_intx_irq, pdev);
+
+    LTRACEF("legacy interrupt line %u, vector %u\n", line, vector);
+
+    return NO_ERROR;
+}
+
+static status_t virtio_pci_probe(const pci_location_t *loc, uint index, uint device_id)
+{
+    LTRACEF("bus %u dev_fn 0x%x, device_id %u\n", loc->bus, loc->dev_fn, device_id);
+
+    uint16_t status;
+    pci_read_config_half(loc, PCI_CONFIG_STATUS, &status);
+    if (!(status & PCI_STATUS_NEW_CAPS))
+        return ERR_NOT_SUPPORTED;
+
+    struct virtio_pci_dev *pdev = calloc(1, sizeof(struct virtio_pci_dev));
+    if (!pdev)
+        return ERR_NO_MEMORY;
+
+    pdev->loc = *loc;
+
+    /* walk the capabilities, taking the first of each kind */
+    uint8_t cap, msix_cap = 0;
+    pci_read_config_byte(loc, PCI_CONFIG_CAPABILITIES, &cap);
+    for (uint n = 0; cap && n < 48; n++) {
+        pci_capability_t c;
+        cap &= ~3;
+        pci_read_config_byte(loc, cap, &c.id);
+        pci_read_config_byte(loc, cap + 1, &c.next);
+
+        if (c.id == PCI_CAP_ID_MSIX && !msix_cap) {
+            msix_cap = cap;
+        } else if (c.id == PCI_CAP_ID_VENDOR) {
+            uint8_t type;
+            pci_read_config_byte(loc, cap + VIRTIO_PCI_CAP_CFG_TYPE, &type);
+            LTRACEF("vendor cap at 0x%x, type %u\n", cap, type);
+
+            switch (type) {
+                case VIRTIO_PCI_CAP_COMMON_CFG:
+                    if (!pdev->common)
+                        pdev->common = virtio_pci_map_cap(pdev, cap);
+                    break;
+                case VIRTIO_PCI_CAP_NOTIFY_CFG:
+                    if (!pdev->notify) {
+                        pci_read_config_word(loc, cap + VIRTIO_PCI_CAP_NOTIFY_MULT, &pdev->notify_mult);
+                        pdev->notify = virtio_pci_map_cap(pdev, cap);
+                    }
+                    break;
+                case VIRTIO_PCI_CAP_ISR_CFG:
+                    if (!pdev->isr)
+                        pdev->isr = virtio_pci_map_cap(pdev, cap);
+                    break;
+                case VIRTIO_PCI_CAP_DEVICE_CFG:
+                    if (!pdev->dev.config_ptr)
+                        pdev->dev.config_ptr = (void *)virtio_pci_map_cap(pdev, cap);
+                    break;
+            }
+        }
+
+        cap = c.next;
+    }
+
+    if (!pdev->common || !pdev->notify || !pdev->isr) {
+        TRACEF("device at %u:0x%x has no modern interface\n", loc->bus, loc->dev_fn);
+        free(pdev);
+        return ERR_NOT_SUPPORTED;
+    }
+
+    uint16_t command;
+    pci_read_config_half(loc, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(loc, PCI_CONFIG_COMMAND, command | PCI_COMMAND_MEM_EN | PCI_COMMAND_BUS_MASTER_EN);
+
+    struct virtio_device *dev = &pdev->dev;
+    dev->index = index;
+    dev->version = 2;
+    dev->transport = &virtio_pci_transport;
+
+    /* pci dma snoops the caches */
+    dev->dma.coherent = true;
+
+    /* the firmware may have left the device running */
+    virtio_reset_device(dev);
+
+    if (!msix_cap || virtio_pci_setup_msix(pdev, msix_cap) < 0) {
+        if (virtio_pci_setup_intx(pdev) < 0) {
+            TRACEF("device at %u:0x%x has no usable interrupt\n", loc->bus, loc->dev_fn);
+            free(pdev);
+            return ERR_NOT_SUPPORTED;
+        }
+    } else {
+        pdev->common->msix_config = 0;
+    }
+
+    status_t err = virtio_probe_device(dev, device_id);
+    if (err < 0) {
+        virtio_reset_device(dev);
+        return err;
+    }
+
+    return NO_ERROR;
+}
+
+int virtio_pci_detect(void)
+{
+    int found = 0;
+    uint index = 0;
+
+    for (uint i = 0; i < countof(virtio_pci_ids); i++) {
+        pci_location_t loc;
+
+        for (uint16_t n = 0; pci_find_pci_device(&loc, virtio_pci_ids[i].pci_device_id,
+                                                 VIRTIO_PCI_VENDOR_ID, n) == _PCI_SUCCESSFUL; n++) {
+            if (virtio_pci_probe(&loc, index++, virtio_pci_ids[i].device_id) >= 0)
+                found++;
+        }
+    }
+
+    LTRACEF("found %d devices\n", found);
+
+    return found;
+}
@@ -24,6 +24,28 @@
 
 #include <compiler.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <dev/virtio.h>
+
+/* How the core reaches a device. Each transport fills one of these in for
+ * the devices it finds. */
+struct virtio_transport {
+    uint8_t (*get_status)(struct virtio_device *dev);
+    void (*set_status)(struct virtio_device *dev, uint8_t status);
+    uint64_t (*get_features)(struct virtio_device *dev);
+    void (*set_features)(struct virtio_device *dev, uint64_t features);
+
+    /* hand the device a ring's three areas and turn it on */
+    status_t (*setup_ring)(struct virtio_device *dev, uint index, uint16_t len,
+                           paddr_t desc, paddr_t driver, paddr_t device);
+    void (*notify)(struct virtio_device *dev, uint index);
+};
+
+/* start the driver for a device the transport has set up, by virtio device id */
+status_t virtio_probe_device(struct virtio_device *dev, uint device_id);
+
+/* drain the used rings in the bitmap, for the transports' irq handlers */
+enum handler_return virtio_service_rings(struct virtio_device *dev, uint32_t rings);
 
 struct virtio_mmio_config {
     /* 0x00 */  uint32_t magic;
@@ -41,15 +63,27 @@ struct virtio_mmio_config {
     uint32_t queue_num_max;
     uint32_t queue_num;
     uint32_t queue_align;
-    /* 0x40 */  uint32_t queue_pfn;
-    uint32_t __reserved2[3];
+    /* 0x40 */  uint32_t queue_pfn;     /* legacy only */
+    uint32_t queue_ready;               /* version 2 */
+    uint32_t __reserved2[2];
     /* 0x50 */  uint32_t queue_notify;
     uint32_t __reserved3[3];
     /* 0x60 */  uint32_t interrupt_status;
     uint32_t interrupt_ack;
     uint32_t __reserved4[2];
     /* 0x70 */  uint32_t status;
-    uint8_t __reserved5[0x8c];
+    uint32_t __reserved5[3];
+    /* version 2 queue addresses */
+    /* 0x80 */  uint32_t queue_desc_low;
+    uint32_t queue_desc_high;
+    uint32_t __reserved6[2];
+    /* 0x90 */  uint32_t queue_driver_low;
+    uint32_t queue_driver_high;
+    uint32_t __reserved7[2];
+    /* 0xa0 */  uint32_t queue_device_low;
+    uint32_t queue_device_high;
+    uint8_t __reserved8[0x54];
+    /* 0xfc */  uint32_t config_generation;
     /* 0x100 */ uint32_t config[0];
 };
 
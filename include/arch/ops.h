@@ -64,6 +64,9 @@ void arch_clean_invalidate_cache_range(addr_t start, size_t len);
 void arch_invalidate_cache_range(addr_t start, size_t len);
 void arch_sync_cache_range(addr_t start, size_t len);
 
+/* fill a page aligned, PAGE_SIZE sized block with zeros */
+void arch_zero_page(void *ptr);
+
 void arch_idle(void);
 
 __END_CDECLS
@@ -105,6 +105,50 @@
 #define PCI_STATUS_SERR_SIG         0x4000
 #define PCI_STATUS_PERR             0x8000
 
+/*
+ * PCI capability ids
+ */
+#define PCI_CAP_ID_MSI              0x05
+#define PCI_CAP_ID_VENDOR           0x09
+#define PCI_CAP_ID_MSIX             0x11
+
+/*
+ * MSI capability registers, the data register moves up on 64 bit capable functions
+ */
+#define PCI_MSI_CTRL                0x02
+#define PCI_MSI_ADDR_LO             0x04
+#define PCI_MSI_ADDR_HI             0x08
+#define PCI_MSI_DATA_32             0x08
+#define PCI_MSI_DATA_64             0x0c
+#define PCI_MSI_CTRL_ENABLE         0x0001
+#define PCI_MSI_CTRL_MME_MASK       0x0070
+#define PCI_MSI_CTRL_64BIT          0x0080
+
+/*
+ * MSI-X capability registers and table entries
+ */
+#define PCI_MSIX_CTRL               0x02
+#define PCI_MSIX_TABLE              0x04
+#define PCI_MSIX_CTRL_TABLE_SIZE    0x07ff
+#define PCI_MSIX_CTRL_FUNC_MASK     0x4000
+#define PCI_MSIX_CTRL_ENABLE        0x8000
+#define PCI_MSIX_TABLE_BIR          0x7
+
+#define PCI_MSIX_ENTRY_SIZE         16
+#define PCI_MSIX_ENTRY_ADDR_LO      0x0
+#define PCI_MSIX_ENTRY_ADDR_HI      0x4
+#define PCI_MSIX_ENTRY_DATA         0x8
+#define PCI_MSIX_ENTRY_CTRL         0xc
+#define PCI_MSIX_ENTRY_CTRL_MASKED  0x1
+
+/*
+ * base address register bits
+ */
+#define PCI_BAR_IO                  0x1
+#define PCI_BAR_MEM_TYPE_MASK       0x6
+#define PCI_BAR_MEM_TYPE_64         0x4
+#define PCI_BAR_MEM_ADDR_MASK       (~0xfU)
+
 typedef struct {
     uint16_t vendor_id;
     uint16_t device_id;
@@ -178,4 +222,7 @@ int pci_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t va
 int pci_get_irq_routing_options(irq_routing_entry *entries, uint16_t *count, uint16_t *pci_irqs);
 int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq);
 
+/* map a memory bar uncached into the kernel address space, 64 bit bars included */
+status_t pci_map_bar(const pci_location_t *state, uint bar, const char *name, void **ptr, size_t *len);
+
 #endif
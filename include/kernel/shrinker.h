@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#ifndef __KERNEL_SHRINKER_H
+#define __KERNEL_SHRINKER_H
+
+#include <compiler.h>
+#include <err.h>
+#include <list.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <kernel/mutex.h>
+
+__BEGIN_CDECLS;
+
+/* A shrinker is a callback a subsystem registers to give memory back when
+ * the system runs low. The callback is asked to free roughly 'target' bytes
+ * and returns how many it actually released, which may be more or less.
+ *
+ * Callbacks run from whichever thread hit the shortage, possibly in the
+ * middle of an allocation, so they must never block on a lock that an
+ * allocating thread could be holding. Use shrinker_trylock() and return 0
+ * if the cache is busy.
+ */
+typedef struct shrinker {
+    struct list_node node;
+    const char *name;
+    size_t (*shrink)(struct shrinker *s, size_t target);
+    uint cost;
+} shrinker_t;
+
+/* shrinkers are run cheapest first */
+#define SHRINKER_COST_FREE   0   /* memory nobody is using, e.g. allocator free lists */
+#define SHRINKER_COST_CACHE  10  /* clean cached data that is cheap to rebuild */
+#define SHRINKER_COST_EXPENSIVE 20 /* state that costs i/o or traffic to recreate */
+
+#define SHRINKER_INITIAL_VALUE(_name, _shrink, _cost) \
+{ \
+    .node = LIST_INITIAL_CLEARED_VALUE, \
+    .name = (_name), \
+    .shrink = (_shrink), \
+    .cost = (_cost), \
+}
+
+void shrinker_register(shrinker_t *s);
+void shrinker_unregister(shrinker_t *s);
+
+/* Run the registered shrinkers until at least 'target' bytes have been
+ * released or they run out of things to free. Returns bytes released.
+ * Does nothing if called from interrupt context, with interrupts disabled,
+ * or from inside a shrinker. */
+size_t shrinker_reclaim(size_t target);
+
+/* ask the background reclaim thread to run the shrinkers, safe from any context */
+void shrinker_kick(void);
+
+/* acquire a mutex only if it is uncontended and not already ours */
+static inline bool shrinker_trylock(mutex_t *m)
+{
+    if (is_mutex_held(m))
+        return false;
+    return mutex_acquire_timeout(m, 0) == NO_ERROR;
+}
+
+/* Memory pressure levels. The page allocator reports free memory and the
+ * level drops to LOW below the low watermark, returning to NORMAL only
+ * once free memory climbs back over the high watermark. */
+enum mem_pressure {
+    MEM_PRESSURE_NORMAL,
+    MEM_PRESSURE_LOW,
+};
+
+void mem_pressure_update(size_t free_bytes, size_t total_bytes);
+enum mem_pressure mem_pressure_get(void);
+
+/* Override the default watermarks, in bytes. A value of 0 restores the
+ * default derived from total memory. */
+void mem_pressure_set_watermarks(size_t low, size_t high);
+
+/* block until the pressure level is 'level' */
+status_t mem_pressure_wait(enum mem_pressure level, lk_time_t timeout);
+
+__END_CDECLS;
+
+#endif
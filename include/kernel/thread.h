@@ -68,6 +68,9 @@ enum thread_tls_list {
 #endif
 #ifdef WITH_LIB_LKUSER
     TLS_ENTRY_LKUSER,
+#endif
+#ifdef WITH_LIB_ARENA
+    TLS_ENTRY_ARENA,
 #endif
     MAX_TLS_ENTRY
 };
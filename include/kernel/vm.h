@@ -176,6 +176,22 @@ static inline void *pmm_alloc_kpage(void) { return pmm_alloc_kpages(1, NULL); }
 
 size_t pmm_free_kpages(void *ptr, uint count);
 
+/* Allocate a single zero filled page out of the kernel area and return the pointer
+ * in kernel space. Pages are taken from a pool kept filled by a background thread,
+ * falling back to zeroing one inline when the pool is empty.
+ * If the optional list is passed, append the allocated page structure to the tail of the list.
+ */
+void *pmm_alloc_zeroed_kpage(struct list_node *list);
+
+typedef struct pmm_zero_stats {
+    size_t pool_count;  /* pages currently in the pool */
+    uint64_t hits;      /* allocations served from the pool */
+    uint64_t misses;    /* allocations zeroed inline */
+    uint64_t zeroed;    /* pages zeroed by the background thread */
+} pmm_zero_stats_t;
+
+void pmm_get_zero_stats(pmm_zero_stats_t *stats) __NONNULL((1));
+
 /* physical to virtual */
 void *paddr_to_kvaddr(paddr_t pa);
 
@@ -202,6 +218,7 @@ typedef struct vmm_aspace {
     size_t  size;
 
     struct list_node region_list;
+    struct vmm_region *region_tree;
 
     arch_aspace_t arch_aspace;
 } vmm_aspace_t;
@@ -218,11 +235,24 @@ typedef struct vmm_region {
     vaddr_t base;
     size_t  size;
 
+    /* balanced tree of regions sorted by base address, augmented with the
+     * largest free gap preceding any region in the subtree */
+    struct vmm_region *tree_parent;
+    struct vmm_region *tree_left;
+    struct vmm_region *tree_right;
+    int tree_height;
+    size_t tree_max_gap;
+
     struct list_node page_list;
+
+    /* on the list of regions vmm_page_fault() may commit pages in */
+    struct list_node fault_node;
 } vmm_region_t;
 
 #define VMM_REGION_FLAG_RESERVED 0x1
 #define VMM_REGION_FLAG_PHYSICAL 0x2
+#define VMM_REGION_FLAG_GUARD_PAGE 0x4
+#define VMM_REGION_FLAG_COMMIT_ON_FAULT 0x8
 
 /* grab a handle to the kernel address space */
 extern vmm_aspace_t _kernel_aspace;
@@ -254,8 +284,36 @@ __NONNULL((1));
 /* Unmap previously allocated region and free physical memory pages backing it (if any) */
 status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t va);
 
+/* Grow or shrink a region created by vmm_alloc(), preserving its contents.
+   The region is extended in place if the address space after it is free,
+   otherwise its pages are remapped to a new spot. *ptr returns the new base. */
+status_t vmm_resize_region(vmm_aspace_t *aspace, vaddr_t va, size_t size, void **ptr)
+__NONNULL((1));
+
 /* For the above region creation routines. Allocate virtual space at the passed in pointer. */
 #define VMM_FLAG_VALLOC_SPECIFIC 0x1
+/* For vmm_alloc. Put an unmapped guard page below the allocation so running off the
+   bottom of it faults. The guard page is part of the region but is not backed. */
+#define VMM_FLAG_GUARD_PAGE 0x2
+/* For vmm_alloc. Only back the top page up front and commit the rest a page at a
+   time from vmm_page_fault() as it is touched, for stacks that grow down into it.
+   Regions bigger than VMM_COMMIT_ON_FAULT_MAX are backed up front as usual. */
+#define VMM_FLAG_COMMIT_ON_FAULT 0x4
+
+/* Span of a last level page table with 4K pages on x86-64 and arm64. A commit on
+   fault region is placed inside one, so the page tables covering it exist once
+   the top page is mapped and the fault path never has to allocate one. */
+#define VMM_COMMIT_ON_FAULT_MAX (2 * 1024 * 1024)
+
+/* Called by the arch page fault handler for a not present kernel fault, with
+   interrupts disabled and possibly with the faulting thread holding spinlocks.
+   Backs the page at vaddr if it is in a VMM_FLAG_COMMIT_ON_FAULT region, from
+   pages set aside by vmm_fault_reserve_fill(), and never blocks. Returns NO_ERROR
+   if the access can be retried. */
+status_t vmm_page_fault(vaddr_t vaddr);
+
+/* Top up the pages vmm_page_fault() takes from. Called from thread context. */
+void vmm_fault_reserve_fill(void);
 
 /* allocate a new address space */
 status_t vmm_create_aspace(vmm_aspace_t **aspace, const char *name, uint flags)
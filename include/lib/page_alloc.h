@@ -51,6 +51,20 @@ __BEGIN_CDECLS;
 void *page_alloc(size_t pages, int arena_mask);
 void page_free(void *ptr, size_t pages);
 
+/* running count of pages handed back through page_free(), so a caller can
+ * see how much a trim released. Wraps, compare with unsigned subtraction. */
+uint page_free_count(void);
+
+/* Virtually contiguous pages for large buffers. On virtual memory platforms
+ * these are mapped into the kernel address space and need not be physically
+ * contiguous. page_resize_mapped() grows or shrinks the run, moving it if it
+ * has to, and returns the new address or NULL if the run couldn't be resized,
+ * in which case the original is left untouched.
+ */
+void *page_alloc_mapped(size_t pages);
+void page_free_mapped(void *ptr, size_t pages);
+void *page_resize_mapped(void *ptr, size_t pages, size_t new_pages);
+
 #if WITH_KERNEL_VM
 struct page_range {
     void *address;
@@ -32,4 +32,14 @@ typedef enum handler_return (*int_handler)(void *arg);
 
 void register_int_handler(unsigned int vector, int_handler handler, void *arg);
 
+/* Interrupts for pci devices, on platforms that have a pci bus.
+ * platform_pci_int_to_vector() maps the legacy interrupt line a device's
+ * config space reports to a vector. platform_allocate_interrupts() sets
+ * aside count consecutive vectors for message signalled interrupts and
+ * platform_compose_msi_msg() returns the address and data a device has to
+ * write to raise one of them. */
+status_t platform_pci_int_to_vector(unsigned int pci_int, unsigned int *vector);
+status_t platform_allocate_interrupts(size_t count, unsigned int *vector);
+status_t platform_compose_msi_msg(unsigned int vector, uint64_t *address, uint32_t *data);
+
 #endif
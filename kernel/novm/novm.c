@@ -25,6 +25,7 @@
 
 #include <err.h>
 #include <assert.h>
+#include <bits.h>
 #include <trace.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,11 +34,21 @@
 
 #define LOCAL_TRACE 0
 
+/* The allocation map is a bitmap with one bit per page, set if the page is
+ * in use. On top of it are two summary bitmaps with one bit per map word:
+ * 'full' is set when every page in the word is in use, 'empty' when every
+ * page in the word is free. The search for a free run hops from one edge of
+ * a run to the next, and the summaries let it step over 64 words (4096 pages
+ * on 64-bit) of fully used or fully free map per load instead of scanning
+ * page by page. The bits past the end of the arena are kept marked as used.
+ */
 struct novm_arena {
     mutex_t lock;
     const char *name;
     size_t pages;
-    char *map;
+    unsigned long *map;
+    unsigned long *full;
+    unsigned long *empty;
     char *base;
     size_t size;
 
@@ -58,10 +69,16 @@ extern int _end_of_ram;
 #define MEM_SIZE ((MEMBASE + MEMSIZE) - MEM_START)
 #define DEFAULT_MAP_SIZE (MEMSIZE >> PAGE_SIZE_SHIFT)
 
-/* a static list of arenas */
+/* words of map and summary needed to track a number of pages */
+#define MAP_WORDS(pages) BITMAP_NUM_WORDS(pages)
+#define SUMMARY_WORDS(pages) BITMAP_NUM_WORDS(MAP_WORDS(pages))
+#define MAP_BYTES(pages) ((MAP_WORDS(pages) + 2 * SUMMARY_WORDS(pages)) * sizeof(unsigned long))
+
+/* a static list of arenas, the main one plus room for a few added by the platform */
 #ifndef NOVM_MAX_ARENAS
-#define NOVM_MAX_ARENAS 1
+#define NOVM_MAX_ARENAS 4
 #endif
+STATIC_ASSERT(NOVM_MAX_ARENAS <= 32);
 struct novm_arena arena[NOVM_MAX_ARENAS];
 
 int novm_get_arenas(struct page_range* ranges, int number_of_ranges)
@@ -99,31 +116,111 @@ static bool in_arena(struct novm_arena *n, void *p)
     return ptr >= base && ptr < base + n->size;
 }
 
+static inline bool map_test(const struct novm_arena *n, size_t page)
+{
+    return BIT_SET(n->map[BITMAP_WORD(page)], BITMAP_BIT_IN_WORD(page));
+}
+
+/* recompute the summary bits for one word of the map */
+static void update_summary(struct novm_arena *n, size_t word)
+{
+    unsigned long bit = 1UL << BITMAP_BIT_IN_WORD(word);
+
+    if (n->map[word] == ~0UL)
+        n->full[BITMAP_WORD(word)] |= bit;
+    else
+        n->full[BITMAP_WORD(word)] &= ~bit;
+
+    if (n->map[word] == 0)
+        n->empty[BITMAP_WORD(word)] |= bit;
+    else
+        n->empty[BITMAP_WORD(word)] &= ~bit;
+}
+
+/* mark a run of pages used or free */
+static void map_set_range(struct novm_arena *n, size_t start, size_t count, bool used)
+{
+    while (count > 0) {
+        size_t word = BITMAP_WORD(start);
+        size_t bit = BITMAP_BIT_IN_WORD(start);
+        size_t len = MIN(count, BITMAP_BITS_PER_WORD - bit);
+        unsigned long mask = BIT_MASK(len) << bit;
+
+        if (used)
+            n->map[word] |= mask;
+        else
+            n->map[word] &= ~mask;
+        update_summary(n, word);
+
+        start += len;
+        count -= len;
+    }
+}
+
+/* Find the first map word at or after word that is not entirely equal to the
+ * state the summary tracks, skipping whole summary words where they are all set.
+ */
+static size_t next_word_not_in(const unsigned long *summary, size_t word, size_t words)
+{
+    while (word < words) {
+        unsigned long s = ~summary[BITMAP_WORD(word)] & ~BIT_MASK(BITMAP_BIT_IN_WORD(word));
+        if (s)
+            return MIN(BITMAP_WORD(word) * BITMAP_BITS_PER_WORD + __builtin_ctzl(s), words);
+        word = ROUNDUP(word + 1, BITMAP_BITS_PER_WORD);
+    }
+    return words;
+}
+
+/* Find the first page at or after start in the given state, or n->pages */
+static size_t map_next(const struct novm_arena *n, size_t start, bool used)
+{
+    size_t words = MAP_WORDS(n->pages);
+    const unsigned long *skip = used ? n->empty : n->full;
+
+    if (start >= n->pages)
+        return n->pages;
+
+    size_t word = BITMAP_WORD(start);
+    unsigned long mask = ~BIT_MASK(BITMAP_BIT_IN_WORD(start));
+    for (;;) {
+        unsigned long w = (used ? n->map[word] : ~n->map[word]) & mask;
+        if (w)
+            return MIN(word * BITMAP_BITS_PER_WORD + __builtin_ctzl(w), n->pages);
+
+        word = next_word_not_in(skip, word + 1, words);
+        if (word >= words)
+            return n->pages;
+        mask = ~0UL;
+    }
+}
+
 static void novm_init_helper(struct novm_arena *n, const char *name,
                              uintptr_t arena_start, uintptr_t arena_size,
-                             char *default_map, size_t default_map_size)
+                             void *default_map, size_t default_map_size)
 {
     uintptr_t start = ROUNDUP(arena_start, PAGE_SIZE);
     uintptr_t size = ROUNDDOWN(arena_start + arena_size, PAGE_SIZE) - start;
 
     mutex_init(&n->lock);
 
-    size_t map_size = size >> PAGE_SIZE_SHIFT;
-    char *map = default_map;
-    if (map == NULL || default_map_size < map_size) {
+    size_t pages = size >> PAGE_SIZE_SHIFT;
+    unsigned long *map = default_map;
+    if (map == NULL || default_map_size < MAP_BYTES(pages)) {
         // allocate the map out of the arena itself
-        map = (char *)arena_start;
+        uintptr_t map_start = ROUNDUP(arena_start, sizeof(unsigned long));
+        map = (unsigned long *)map_start;
 
-        // Grab enough map for 16Mbyte of arena each time around the loop.
-        while (start - arena_start < map_size) {
+        // Give up pages at the front of the arena until the map fits before them.
+        while (start < map_start || start - map_start < MAP_BYTES(pages)) {
             start += PAGE_SIZE;
             size -= PAGE_SIZE;
-            map_size--;
+            pages--;
         }
 
-        if ((char *)start - (map + ROUNDUP(map_size, 4)) >= MINIMUM_USEFUL_UNALIGNED_SIZE) {
-            n->unaligned_area = map + ROUNDUP(map_size, 4);
-            n->unaligned_size = (char *)start - (map + ROUNDUP(map_size, 4));
+        uintptr_t map_end = map_start + MAP_BYTES(pages);
+        if (start - map_end >= MINIMUM_USEFUL_UNALIGNED_SIZE) {
+            n->unaligned_area = (void *)map_end;
+            n->unaligned_size = start - map_end;
         }
     } else if (start - arena_start >= MINIMUM_USEFUL_UNALIGNED_SIZE) {
         n->unaligned_area = (char *)arena_start;
@@ -131,10 +228,19 @@ static void novm_init_helper(struct novm_arena *n, const char *name,
     }
     n->name = name;
     n->map = map;
-    memset(n->map, 0, map_size);
-    n->pages = map_size;
+    n->full = map + MAP_WORDS(pages);
+    n->empty = n->full + SUMMARY_WORDS(pages);
+    n->pages = pages;
     n->base = (char *)start;
     n->size = size;
+
+    memset(n->map, 0, MAP_BYTES(pages));
+    for (size_t i = 0; i < MAP_WORDS(pages); i++)
+        update_summary(n, i);
+
+    // pages past the end of the arena are never free
+    size_t tail = MAP_WORDS(pages) * BITMAP_BITS_PER_WORD - pages;
+    map_set_range(n, pages, tail, true);
 }
 
 void novm_add_arena(const char *name, uintptr_t arena_start, uintptr_t arena_size)
@@ -150,8 +256,8 @@ void novm_add_arena(const char *name, uintptr_t arena_start, uintptr_t arena_siz
 
 static void novm_init(uint level)
 {
-    static char mem_allocation_map[DEFAULT_MAP_SIZE];
-    novm_init_helper(&arena[0], "main", MEM_START, MEM_SIZE, mem_allocation_map, DEFAULT_MAP_SIZE);
+    static unsigned long mem_allocation_map[MAP_BYTES(DEFAULT_MAP_SIZE) / sizeof(unsigned long)];
+    novm_init_helper(&arena[0], "main", MEM_START, MEM_SIZE, mem_allocation_map, sizeof(mem_allocation_map));
 }
 
 LK_INIT_HOOK(novm, &novm_init, LK_INIT_LEVEL_PLATFORM_EARLY - 1);
@@ -162,20 +268,16 @@ void *novm_alloc_helper(struct novm_arena *n, size_t pages)
         return NULL;
 
     mutex_acquire(&n->lock);
-    for (size_t i = 0; i <= n->pages - pages; i++) {
-        bool found = true;
-        for (size_t j = 0; j < pages; j++) {
-            if (n->map[i + j] != 0) {
-                i += j;
-                found = false;
-                break;
-            }
-        }
-        if (found) {
-            memset(n->map + i, 1, pages);
+    /* first fit, walking from each free run to the next */
+    size_t i = map_next(n, 0, false);
+    while (n->pages - i >= pages) {
+        size_t end = map_next(n, i, true);
+        if (end - i >= pages) {
+            map_set_range(n, i, pages, true);
             mutex_release(&n->lock);
             return n->base + (i << PAGE_SIZE_SHIFT);
         }
+        i = map_next(n, end, false);
     }
     mutex_release(&n->lock);
 
@@ -215,10 +317,9 @@ void novm_free_pages(void *address, size_t pages)
     DEBUG_ASSERT(in_arena(n, address));
 
     size_t index = ((char *)address - (char *)(n->base)) >> PAGE_SIZE_SHIFT;
-    char *map = n->map;
 
     mutex_acquire(&n->lock);
-    for (size_t i = 0; i < pages; i++) map[index + i] = 0;
+    map_set_range(n, index, pages, false);
     mutex_release(&n->lock);
 }
 
@@ -237,18 +338,17 @@ status_t novm_alloc_specific_pages(void *address, size_t pages)
         return ERR_NOT_FOUND;
 
     size_t index = ((char *)address - (char *)(n->base)) >> PAGE_SIZE_SHIFT;
-    char *map = n->map;
+
+    if (index + pages > n->pages)
+        return ERR_OUT_OF_RANGE;
 
     status_t err = NO_ERROR;
 
     mutex_acquire(&n->lock);
-    for (size_t i = 0; i < pages; i++) {
-        if (map[index + i] != 0) {
-            err = ERR_NO_MEMORY;
-            break;
-        }
-        map[index + i] = 1;
-    }
+    if (map_next(n, index, true) < index + pages)
+        err = ERR_NO_MEMORY;
+    else
+        map_set_range(n, index, pages, true);
     mutex_release(&n->lock);
 
     return err;
@@ -308,17 +408,18 @@ static void novm_dump_arena(struct novm_arena *n)
     }
 
     mutex_acquire(&n->lock);
-    printf("name '%s', %d pages, each %zdk (%zdk in all)\n", n->name, n->pages, PAGE_SIZE >> 10, (PAGE_SIZE * n->pages) >> 10);
+    printf("name '%s', %zu pages, each %zdk (%zdk in all)\n", n->name, n->pages, PAGE_SIZE >> 10, (PAGE_SIZE * n->pages) >> 10);
     printf("  range: %p-%p\n", (void *)n->base, (char *)n->base + n->size);
     printf("  unaligned range: %p-%p\n", n->unaligned_area, n->unaligned_area + n->unaligned_size);
     unsigned i;
     size_t in_use = 0;
-    for (i = 0; i < n->pages; i++) if (n->map[i] != 0) in_use++;
+    for (i = 0; i < MAP_WORDS(n->pages); i++) in_use += __builtin_popcountl(n->map[i]);
+    in_use -= MAP_WORDS(n->pages) * BITMAP_BITS_PER_WORD - n->pages;
     printf("  %zd/%zd in use\n", in_use, n->pages);
 #define MAX_PRINT 1024u
     for (i = 0; i < MAX_PRINT && i < n->pages; i++) {
         if ((i & 63) == 0) printf("    ");
-        printf("%c", n->map[i] ? '*' : '.');
+        printf("%c", map_test(n, i) ? '*' : '.');
         if ((i & 63) == 63) printf("\n");
     }
     if (i == MAX_PRINT && n->pages > MAX_PRINT) {
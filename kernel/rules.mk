@@ -5,7 +5,8 @@ MODULE := $(LOCAL_DIR)
 MODULE_DEPS := \
 	lib/libc \
 	lib/debug \
-	lib/heap
+	lib/heap \
+	lib/slab
 
 MODULE_SRCS := \
 	$(LOCAL_DIR)/debug.c \
@@ -15,6 +16,7 @@ MODULE_SRCS := \
 	$(LOCAL_DIR)/thread.c \
 	$(LOCAL_DIR)/timer.c \
 	$(LOCAL_DIR)/semaphore.c \
+	$(LOCAL_DIR)/shrinker.c \
 	$(LOCAL_DIR)/mp.c \
 	$(LOCAL_DIR)/port.c
 
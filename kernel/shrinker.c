@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <kernel/shrinker.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lib/console.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+/* how much the reclaim thread asks for when kicked without a watermark to aim at */
+#ifndef SHRINKER_DEFAULT_TARGET
+#define SHRINKER_DEFAULT_TARGET (64 * 1024)
+#endif
+
+/* registered shrinkers, sorted by cost. The lock is also held while they run,
+ * which serializes reclaim and lets a nested call spot itself. */
+static struct list_node shrinker_list = LIST_INITIAL_VALUE(shrinker_list);
+static mutex_t shrinker_lock = MUTEX_INITIAL_VALUE(shrinker_lock);
+static uint64_t shrinker_runs;
+static uint64_t shrinker_freed;
+
+static event_t reclaim_event = EVENT_INITIAL_VALUE(reclaim_event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+/* pressure state, updated by the page allocator */
+static spin_lock_t pressure_lock = SPIN_LOCK_INITIAL_VALUE;
+static enum mem_pressure pressure_level = MEM_PRESSURE_NORMAL;
+static size_t pressure_free;
+static size_t pressure_total;
+static size_t pressure_low_override;
+static size_t pressure_high_override;
+static event_t pressure_low_event = EVENT_INITIAL_VALUE(pressure_low_event, false, 0);
+static event_t pressure_normal_event = EVENT_INITIAL_VALUE(pressure_normal_event, true, 0);
+
+void shrinker_register(shrinker_t *s)
+{
+    DEBUG_ASSERT(s && s->shrink);
+    DEBUG_ASSERT(!list_in_list(&s->node));
+
+    LTRACEF("shrinker %p '%s' cost %u\n", s, s->name, s->cost);
+
+    mutex_acquire(&shrinker_lock);
+
+    shrinker_t *t;
+    list_for_every_entry(&shrinker_list, t, shrinker_t, node) {
+        if (t->cost > s->cost) {
+            list_add_before(&t->node, &s->node);
+            goto done;
+        }
+    }
+    list_add_tail(&shrinker_list, &s->node);
+
+done:
+    mutex_release(&shrinker_lock);
+}
+
+void shrinker_unregister(shrinker_t *s)
+{
+    mutex_acquire(&shrinker_lock);
+    if (list_in_list(&s->node))
+        list_delete(&s->node);
+    mutex_release(&shrinker_lock);
+}
+
+size_t shrinker_reclaim(size_t target)
+{
+    LTRACEF("target %zu\n", target);
+
+    /* interrupt handlers run with interrupts off, and a shrinker that
+     * allocates and fails would end up back here */
+    if (arch_ints_disabled() || is_mutex_held(&shrinker_lock))
+        return 0;
+
+    size_t freed = 0;
+
+    mutex_acquire(&shrinker_lock);
+    shrinker_runs++;
+
+    shrinker_t *s;
+    list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+        size_t n = s->shrink(s, target - freed);
+        LTRACEF("shrinker '%s' released %zu\n", s->name, n);
+
+        freed += n;
+        if (freed >= target)
+            break;
+    }
+
+    shrinker_freed += freed;
+    mutex_release(&shrinker_lock);
+
+    return freed;
+}
+
+void shrinker_kick(void)
+{
+    event_signal(&reclaim_event, false);
+}
+
+static void pressure_watermarks_locked(size_t *low, size_t *high)
+{
+    /* by default start reclaiming under 1/32 free and stop past 1/16 */
+    *low = pressure_low_override ? pressure_low_override : pressure_total / 32;
+    *high = pressure_high_override ? pressure_high_override : pressure_total / 16;
+    if (*high < *low)
+        *high = *low;
+}
+
+void mem_pressure_update(size_t free_bytes, size_t total_bytes)
+{
+    size_t low, high;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pressure_lock, state);
+
+    pressure_free = free_bytes;
+    pressure_total = total_bytes;
+    pressure_watermarks_locked(&low, &high);
+
+    /* the gap between the watermarks keeps the level from flapping */
+    if (pressure_level == MEM_PRESSURE_NORMAL && free_bytes < low) {
+        LTRACEF("low, free %zu < %zu\n", free_bytes, low);
+        pressure_level = MEM_PRESSURE_LOW;
+        event_unsignal(&pressure_normal_event);
+        event_signal(&pressure_low_event, false);
+        event_signal(&reclaim_event, false);
+    } else if (pressure_level == MEM_PRESSURE_LOW && free_bytes >= high) {
+        LTRACEF("normal, free %zu >= %zu\n", free_bytes, high);
+        pressure_level = MEM_PRESSURE_NORMAL;
+        event_unsignal(&pressure_low_event);
+        event_signal(&pressure_normal_event, false);
+    }
+
+    spin_unlock_irqrestore(&pressure_lock, state);
+}
+
+enum mem_pressure mem_pressure_get(void)
+{
+    return pressure_level;
+}
+
+void mem_pressure_set_watermarks(size_t low, size_t high)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pressure_lock, state);
+    pressure_low_override = low;
+    pressure_high_override = high;
+    spin_unlock_irqrestore(&pressure_lock, state);
+}
+
+status_t mem_pressure_wait(enum mem_pressure level, lk_time_t timeout)
+{
+    return event_wait_timeout(level == MEM_PRESSURE_LOW ? &pressure_low_event : &pressure_normal_event,
+                              timeout);
+}
+
+/* how far free memory is below the high watermark, 0 if nothing is reporting */
+static size_t reclaim_target(void)
+{
+    size_t low, high, target = 0;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pressure_lock, state);
+    if (pressure_total > 0) {
+        pressure_watermarks_locked(&low, &high);
+        if (pressure_free < high)
+            target = high - pressure_free;
+    }
+    spin_unlock_irqrestore(&pressure_lock, state);
+
+    return target;
+}
+
+static int reclaim_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&reclaim_event);
+
+        /* keep going until the high watermark is met or the shrinkers are dry */
+        size_t target = reclaim_target();
+        if (target == 0)
+            target = SHRINKER_DEFAULT_TARGET;
+
+        while (shrinker_reclaim(target) > 0) {
+            if (mem_pressure_get() != MEM_PRESSURE_LOW)
+                break;
+            target = reclaim_target();
+            if (target == 0)
+                break;
+        }
+    }
+
+    return 0;
+}
+
+static void shrinker_init(uint level)
+{
+    thread_detach_and_resume(thread_create("reclaim", &reclaim_thread, NULL,
+                                           DEFAULT_PRIORITY, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(shrinker, &shrinker_init, LK_INIT_LEVEL_THREADING);
+
+static int cmd_shrinker(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+notenoughargs:
+        printf("not enough arguments\n");
+usage:
+        printf("usage:\n");
+        printf("%s list\n", argv[0].str);
+        printf("%s reclaim <bytes>\n", argv[0].str);
+        printf("%s watermarks <low> <high>\n", argv[0].str);
+        return ERR_GENERIC;
+    }
+
+    if (!strcmp(argv[1].str, "list")) {
+        size_t low, high;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&pressure_lock, state);
+        pressure_watermarks_locked(&low, &high);
+        spin_unlock_irqrestore(&pressure_lock, state);
+
+        printf("pressure %s, free %zu of %zu bytes, watermarks low %zu high %zu\n",
+               pressure_level == MEM_PRESSURE_LOW ? "low" : "normal",
+               pressure_free, pressure_total, low, high);
+
+        mutex_acquire(&shrinker_lock);
+        printf("%llu reclaims released %llu bytes\n", shrinker_runs, shrinker_freed);
+        shrinker_t *s;
+        list_for_every_entry(&shrinker_list, s, shrinker_t, node) {
+            printf("\tshrinker %p '%s' cost %u\n", s, s->name, s->cost);
+        }
+        mutex_release(&shrinker_lock);
+    } else if (!strcmp(argv[1].str, "reclaim")) {
+        if (argc < 3) goto notenoughargs;
+
+        printf("released %zu bytes\n", shrinker_reclaim(argv[2].u));
+    } else if (!strcmp(argv[1].str, "watermarks")) {
+        if (argc < 4) goto notenoughargs;
+
+        mem_pressure_set_watermarks(argv[2].u, argv[3].u);
+    } else {
+        printf("unknown command\n");
+        goto usage;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 0
+STATIC_COMMAND("shrinker", "memory pressure and shrinkers", &cmd_shrinker)
+#endif
+STATIC_COMMAND_END(shrinker);
@@ -45,9 +45,14 @@
 #include <platform.h>
 #include <target.h>
 #include <lib/heap.h>
+#include <lib/slab.h>
+#include <lk/init.h>
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #endif
+#ifdef WITH_LIB_ARENA
+#include <lib/arena.h>
+#endif
 
 #if THREAD_STATS
 struct thread_stats thread_stats[SMP_MAX_CPUS];
@@ -61,6 +66,49 @@ struct thread_stats thread_stats[SMP_MAX_CPUS];
 /* global thread list */
 static struct list_node thread_list;
 
+/* cache the thread structures created by thread_create come from */
+static slab_cache_t thread_cache;
+
+/* detached threads that exited and still have to give back their structure */
+static struct list_node thread_reap_list = LIST_INITIAL_VALUE(thread_reap_list);
+
+/* the reaper thread waits here for thread_exit to queue something */
+static wait_queue_t thread_reaper_wait = WAIT_QUEUE_INITIAL_VALUE(thread_reaper_wait);
+
+#if WITH_KERNEL_VM
+/* Thread stacks get their own vmm region with an unmapped guard page below,
+ * so overflowing one faults instead of scribbling over its neighbor. The
+ * stacks of exited threads are kept in a small cache for the next
+ * thread_create to pick up.
+ *
+ * Where the arch takes page faults on a stack of their own, only the top
+ * page is backed up front and the page fault handler commits the rest as
+ * the thread grows into it. Elsewhere the fault would need the very stack
+ * it is faulting on, so the whole stack is backed at creation.
+ */
+#ifndef THREAD_STACK_CACHE_SIZE
+#define THREAD_STACK_CACHE_SIZE 4
+#endif
+
+#if ARCH_HAS_FAULT_STACK
+#define THREAD_STACK_VMM_FLAGS (VMM_FLAG_GUARD_PAGE | VMM_FLAG_COMMIT_ON_FAULT)
+#else
+#define THREAD_STACK_VMM_FLAGS VMM_FLAG_GUARD_PAGE
+#endif
+
+/* placed at the bottom of a stack while it is cached or waiting to be reaped */
+struct thread_stack {
+    struct list_node node;
+    size_t size;
+};
+
+static struct list_node thread_stack_cache = LIST_INITIAL_VALUE(thread_stack_cache);
+static uint thread_stack_cache_count;
+
+/* stacks of detached threads that exited while still running on them */
+static struct list_node thread_stack_reap_list = LIST_INITIAL_VALUE(thread_stack_reap_list);
+#endif
+
 /* master thread spinlock */
 spin_lock_t thread_lock = SPIN_LOCK_INITIAL_VALUE;
 
@@ -122,6 +170,116 @@ static void init_thread_struct(thread_t *t, const char *name)
     strlcpy(t->name, name, sizeof(t->name));
 }
 
+#if WITH_KERNEL_VM
+static void *thread_stack_alloc(size_t size)
+{
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(size));
+
+#if ARCH_HAS_FAULT_STACK
+    /* stacks from the cache fault their pages in too */
+    vmm_fault_reserve_fill();
+#endif
+
+    /* try the cache first */
+    struct thread_stack *s;
+    THREAD_LOCK(state);
+    list_for_every_entry(&thread_stack_cache, s, struct thread_stack, node) {
+        if (s->size == size) {
+            list_delete(&s->node);
+            thread_stack_cache_count--;
+            THREAD_UNLOCK(state);
+            return s;
+        }
+    }
+    THREAD_UNLOCK(state);
+
+    void *stack;
+    if (vmm_alloc(vmm_get_kernel_aspace(), "stack", size, &stack, 0,
+                  THREAD_STACK_VMM_FLAGS, ARCH_MMU_FLAG_PERM_NO_EXECUTE) < 0)
+        return NULL;
+
+    return stack;
+}
+
+static void thread_stack_free(void *stack, size_t size)
+{
+    struct thread_stack *s = stack;
+
+    THREAD_LOCK(state);
+    if (thread_stack_cache_count < THREAD_STACK_CACHE_SIZE) {
+        s->size = size;
+        list_add_head(&thread_stack_cache, &s->node);
+        thread_stack_cache_count++;
+        s = NULL;
+    }
+    THREAD_UNLOCK(state);
+
+    if (s)
+        vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)stack);
+}
+#else
+static inline void *thread_stack_alloc(size_t size)
+{
+    return malloc(size);
+}
+
+static inline void thread_stack_free(void *stack, size_t size)
+{
+    free(stack);
+}
+#endif
+
+/* free the structures and stacks of detached threads that have exited */
+static void thread_reap(void)
+{
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    thread_t *t;
+
+    THREAD_LOCK(state);
+    while ((t = list_remove_head_type(&thread_reap_list, thread_t, thread_list_node)))
+        list_add_tail(&list, &t->thread_list_node);
+#if WITH_KERNEL_VM
+    struct list_node stacks = LIST_INITIAL_VALUE(stacks);
+    struct thread_stack *s;
+    while ((s = list_remove_head_type(&thread_stack_reap_list, struct thread_stack, node)))
+        list_add_tail(&stacks, &s->node);
+#endif
+    THREAD_UNLOCK(state);
+
+    while ((t = list_remove_head_type(&list, thread_t, thread_list_node)))
+        slab_cache_free(&thread_cache, t);
+
+#if WITH_KERNEL_VM
+    while ((s = list_remove_head_type(&stacks, struct thread_stack, node)))
+        thread_stack_free(s, s->size);
+#endif
+}
+
+/* anything for thread_reap() to do, called with the thread lock held */
+static bool thread_reap_pending(void)
+{
+#if WITH_KERNEL_VM
+    if (!list_is_empty(&thread_stack_reap_list))
+        return true;
+#endif
+    return !list_is_empty(&thread_reap_list);
+}
+
+/* frees what detached threads leave behind as soon as they are off their stacks */
+static int thread_reaper(void *arg)
+{
+    for (;;) {
+        THREAD_LOCK(state);
+        if (!thread_reap_pending())
+            wait_queue_block(&thread_reaper_wait, INFINITE_TIME);
+        THREAD_UNLOCK(state);
+
+        thread_reap();
+    }
+
+    return 0;
+}
+
 /**
  * @brief  Create a new thread
  *
@@ -153,8 +311,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
 {
     unsigned int flags = 0;
 
+    thread_reap();
+
     if (!t) {
-        t = malloc(sizeof(thread_t));
+        t = slab_cache_alloc(&thread_cache);
         if (!t)
             return NULL;
         flags |= THREAD_FLAG_FREE_STRUCT;
@@ -183,10 +343,14 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
         stack_size += THREAD_STACK_PADDING_SIZE;
         flags |= THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
 #endif
-        t->stack = malloc(stack_size);
+#if WITH_KERNEL_VM
+        /* the stack gets whole pages anyway, let it use them */
+        stack_size = ROUNDUP(stack_size, PAGE_SIZE);
+#endif
+        t->stack = thread_stack_alloc(stack_size);
         if (!t->stack) {
             if (flags & THREAD_FLAG_FREE_STRUCT)
-                free(t);
+                slab_cache_free(&thread_cache, t);
             return NULL;
         }
         flags |= THREAD_FLAG_FREE_STACK;
@@ -215,6 +379,10 @@ thread_t *thread_create_etc(thread_t *t, const char *name, thread_start_routine
     int i;
     for (i=0; i < MAX_TLS_ENTRY; i++)
         t->tls[i] = current_thread->tls[i];
+#ifdef WITH_LIB_ARENA
+    /* but not the parent's scratch arena */
+    t->tls[TLS_ENTRY_ARENA] = 0;
+#endif
 
     /* set up the initial stack frame */
     arch_thread_initialize(t);
@@ -358,10 +526,10 @@ status_t thread_join(thread_t *t, int *retcode, lk_time_t timeout)
 
     /* free its stack and the thread structure itself */
     if (t->flags & THREAD_FLAG_FREE_STACK && t->stack)
-        free(t->stack);
+        thread_stack_free(t->stack, t->stack_size);
 
     if (t->flags & THREAD_FLAG_FREE_STRUCT)
-        free(t);
+        slab_cache_free(&thread_cache, t);
 
     return NO_ERROR;
 }
@@ -405,6 +573,10 @@ void thread_exit(int retcode)
 
 //  dprintf("thread_exit: current %p\n", current_thread);
 
+#ifdef WITH_LIB_ARENA
+    arena_scratch_thread_exit();
+#endif
+
     THREAD_LOCK(state);
 
     /* enter the dead state */
@@ -421,14 +593,27 @@ void thread_exit(int retcode)
 
         /* free its stack and the thread structure itself */
         if (current_thread->flags & THREAD_FLAG_FREE_STACK && current_thread->stack) {
+#if WITH_KERNEL_VM
+            /* still running on it, leave it for the reaper */
+            struct thread_stack *s = current_thread->stack;
+            s->size = current_thread->stack_size;
+            list_add_tail(&thread_stack_reap_list, &s->node);
+#else
             heap_delayed_free(current_thread->stack);
+#endif
 
             /* make sure its not going to get a bounds check performed on the half-freed stack */
             current_thread->flags &= ~THREAD_FLAG_DEBUG_STACK_BOUNDS_CHECK;
         }
 
+        /* the structure is still in use until we switch away, leave it for
+         * the reaper to free */
         if (current_thread->flags & THREAD_FLAG_FREE_STRUCT)
-            heap_delayed_free(current_thread);
+            list_add_tail(&thread_reap_list, &current_thread->thread_list_node);
+
+        /* it can't run before we've switched away, the thread lock is held until then */
+        if (thread_reap_pending())
+            wait_queue_wake_one(&thread_reaper_wait, false, NO_ERROR);
     } else {
         /* signal if anyone is waiting */
         wait_queue_wake_all(&current_thread->retcode_wait_queue, false, 0);
@@ -828,6 +1013,8 @@ void thread_init_early(void)
  */
 void thread_init(void)
 {
+    slab_cache_init(&thread_cache, "thread", sizeof(thread_t), __alignof(thread_t), NULL);
+
 #if PLATFORM_HAS_DYNAMIC_TIMER
     for (uint i = 0; i < SMP_MAX_CPUS; i++) {
         timer_initialize(&preempt_timer[i]);
@@ -835,6 +1022,14 @@ void thread_init(void)
 #endif
 }
 
+static void thread_reaper_init(uint level)
+{
+    thread_detach_and_resume(thread_create("reaper", &thread_reaper, NULL,
+                                           LOW_PRIORITY, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(thread_reaper, &thread_reaper_init, LK_INIT_LEVEL_THREADING);
+
 /**
  * @brief Change name of current thread
  */
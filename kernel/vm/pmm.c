@@ -31,13 +31,30 @@
 #include <string.h>
 #include <pow2.h>
 #include <lib/console.h>
+#include <lk/init.h>
+#include <arch/ops.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/shrinker.h>
+#include <kernel/thread.h>
 
 #define LOCAL_TRACE 0
 
+/* number of pre-zeroed pages the background thread tries to keep around */
+#ifndef PMM_ZERO_POOL_TARGET
+#define PMM_ZERO_POOL_TARGET 64
+#endif
+
 static struct list_node arena_list = LIST_INITIAL_VALUE(arena_list);
 static mutex_t lock = MUTEX_INITIAL_VALUE(lock);
 
+/* Free pages out of KMAP arenas that have already been zeroed. They are marked
+ * allocated as far as the arenas are concerned and are handed back to them if
+ * the arenas run dry. Protected by the pmm lock. */
+static struct list_node zero_pool = LIST_INITIAL_VALUE(zero_pool);
+static event_t zero_pool_event = EVENT_INITIAL_VALUE(zero_pool_event, true, EVENT_FLAG_AUTOUNSIGNAL);
+static pmm_zero_stats_t zero_stats;
+
 #define PAGE_BELONGS_TO_ARENA(page, arena) \
     (((uintptr_t)(page) >= (uintptr_t)(arena)->page_array) && \
      ((uintptr_t)(page) < ((uintptr_t)(arena)->page_array + (arena)->size / PAGE_SIZE * sizeof(vm_page_t))))
@@ -121,6 +138,39 @@ done_add:
     return NO_ERROR;
 }
 
+/* tell the pressure tracker how much is left, called with the lock held */
+static void pmm_report_pressure(void)
+{
+    size_t free = zero_stats.pool_count;
+    size_t total = 0;
+
+    pmm_arena_t *a;
+    list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+        free += a->free_count;
+        total += a->size / PAGE_SIZE;
+    }
+
+    mem_pressure_update(free * PAGE_SIZE, total * PAGE_SIZE);
+}
+
+/* give every page in the zeroed pool back to its arena, called with the lock held */
+static void zero_pool_drain(void)
+{
+    vm_page_t *page;
+    while ((page = list_remove_head_type(&zero_pool, vm_page_t, node))) {
+        pmm_arena_t *a;
+        list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+            if (PAGE_BELONGS_TO_ARENA(page, a)) {
+                page->flags &= ~VM_PAGE_FLAG_NONFREE;
+                list_add_head(&a->free_list, &page->node);
+                a->free_count++;
+                break;
+            }
+        }
+    }
+    zero_stats.pool_count = 0;
+}
+
 size_t pmm_alloc_pages(uint count, struct list_node *list)
 {
     LTRACEF("count %u\n", count);
@@ -152,7 +202,23 @@ size_t pmm_alloc_pages(uint count, struct list_node *list)
     }
 
 done:
+    /* dip into the zeroed pool before giving up */
+    while (allocated < count) {
+        vm_page_t *page = list_remove_head_type(&zero_pool, vm_page_t, node);
+        if (!page)
+            break;
+
+        zero_stats.pool_count--;
+        list_add_tail(list, &page->node);
+        allocated++;
+    }
+
+    pmm_report_pressure();
     mutex_release(&lock);
+
+    if (allocated < count)
+        shrinker_kick();
+
     return allocated;
 }
 
@@ -199,6 +265,7 @@ size_t pmm_alloc_range(paddr_t address, uint count, struct list_node *list)
             break;
     }
 
+    pmm_report_pressure();
     mutex_release(&lock);
     return allocated;
 }
@@ -232,6 +299,7 @@ size_t pmm_free(struct list_node *list)
         }
     }
 
+    pmm_report_pressure();
     mutex_release(&lock);
     return count;
 }
@@ -295,6 +363,8 @@ size_t pmm_alloc_contiguous(uint count, uint8_t alignment_log2, paddr_t *pa, str
 
     mutex_acquire(&lock);
 
+    bool drained = false;
+search:;
     pmm_arena_t *a;
     list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
         // XXX make this a flag to only search kmap?
@@ -348,6 +418,7 @@ retry:
                 if (pa)
                     *pa = a->base + start * PAGE_SIZE;
 
+                pmm_report_pressure();
                 mutex_release(&lock);
 
                 return count;
@@ -355,12 +426,121 @@ retry:
         }
     }
 
+    /* pages sitting in the zeroed pool may be breaking up a run, return them
+     * to their arenas and look again */
+    if (!drained && zero_stats.pool_count > 0) {
+        zero_pool_drain();
+        drained = true;
+        goto search;
+    }
+
     mutex_release(&lock);
 
     LTRACEF("couldn't find run\n");
+    shrinker_kick();
+    return 0;
+}
+
+/* fill the pool of zeroed pages while there is nothing better to do */
+static int zero_pool_thread(void *arg)
+{
+    for (;;) {
+        event_wait(&zero_pool_event);
+
+        for (;;) {
+            vm_page_t *page = NULL;
+            void *kva = NULL;
+
+            /* take one free page at a time so allocations aren't held off */
+            mutex_acquire(&lock);
+            if (zero_stats.pool_count < PMM_ZERO_POOL_TARGET) {
+                pmm_arena_t *a;
+                list_for_every_entry(&arena_list, a, pmm_arena_t, node) {
+                    if (!(a->flags & PMM_ARENA_FLAG_KMAP))
+                        continue;
+
+                    page = list_remove_head_type(&a->free_list, vm_page_t, node);
+                    if (page) {
+                        a->free_count--;
+                        page->flags |= VM_PAGE_FLAG_NONFREE;
+                        paddr_t pa = PAGE_ADDRESS_FROM_ARENA(page, a);
+                        kva = paddr_to_kvaddr(pa);
+                        break;
+                    }
+                }
+            }
+            mutex_release(&lock);
+
+            if (!page)
+                break;
+
+            arch_zero_page(kva);
+
+            mutex_acquire(&lock);
+            list_add_tail(&zero_pool, &page->node);
+            zero_stats.pool_count++;
+            zero_stats.zeroed++;
+            mutex_release(&lock);
+        }
+    }
+
     return 0;
 }
 
+static void zero_pool_init(uint level)
+{
+    thread_detach_and_resume(thread_create("pmm zero", &zero_pool_thread, NULL,
+                                           LOWEST_PRIORITY + 1, DEFAULT_STACK_SIZE));
+}
+
+LK_INIT_HOOK(pmm_zero, &zero_pool_init, LK_INIT_LEVEL_THREADING);
+
+void *pmm_alloc_zeroed_kpage(struct list_node *list)
+{
+    vm_page_t *page;
+    void *kva;
+
+    mutex_acquire(&lock);
+    page = list_remove_head_type(&zero_pool, vm_page_t, node);
+    if (page) {
+        zero_stats.pool_count--;
+        zero_stats.hits++;
+        if (zero_stats.pool_count < PMM_ZERO_POOL_TARGET / 2)
+            event_signal(&zero_pool_event, false);
+    } else {
+        zero_stats.misses++;
+        event_signal(&zero_pool_event, false);
+    }
+    mutex_release(&lock);
+
+    if (page) {
+        kva = paddr_to_kvaddr(vm_page_to_paddr(page));
+        if (list)
+            list_add_tail(list, &page->node);
+    } else {
+        /* pool is empty, zero one ourselves */
+        kva = pmm_alloc_kpages(1, list);
+        if (kva)
+            arch_zero_page(kva);
+    }
+
+    LTRACEF("page %p kva %p\n", page, kva);
+    return kva;
+}
+
+void pmm_get_zero_stats(pmm_zero_stats_t *stats)
+{
+    mutex_acquire(&lock);
+    *stats = zero_stats;
+    mutex_release(&lock);
+}
+
+/* weak default for architectures without a faster way to zero a page */
+__WEAK void arch_zero_page(void *ptr)
+{
+    memset(ptr, 0, PAGE_SIZE);
+}
+
 static void dump_page(const vm_page_t *page)
 {
     printf("page %p: address 0x%lx flags 0x%x\n", page, vm_page_to_paddr(page), page->flags);
@@ -415,6 +595,7 @@ usage:
         printf("%s alloc_contig <count> <alignment>\n", argv[0].str);
         printf("%s dump_alloced\n", argv[0].str);
         printf("%s free_alloced\n", argv[0].str);
+        printf("%s zero_pool\n", argv[0].str);
         return ERR_GENERIC;
     }
 
@@ -493,6 +674,14 @@ usage:
     } else if (!strcmp(argv[1].str, "free_alloced")) {
         size_t err = pmm_free(&allocated);
         printf("pmm_free returns %zu\n", err);
+    } else if (!strcmp(argv[1].str, "zero_pool")) {
+        pmm_zero_stats_t stats;
+        pmm_get_zero_stats(&stats);
+
+        uint64_t total = stats.hits + stats.misses;
+        printf("zero pool: %zu/%u pages, %llu hits %llu misses (%llu%% hit rate), %llu pages zeroed\n",
+               stats.pool_count, PMM_ZERO_POOL_TARGET, stats.hits, stats.misses,
+               total ? stats.hits * 100 / total : 0ULL, stats.zeroed);
     } else {
         printf("unknown command\n");
         goto usage;
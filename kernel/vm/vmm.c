@@ -25,8 +25,11 @@
 #include <err.h>
 #include <string.h>
 #include <lib/console.h>
+#include <lib/slab.h>
 #include <kernel/vm.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <pow2.h>
 #include "vm_priv.h"
 
 #define LOCAL_TRACE 0
@@ -36,6 +39,21 @@ static mutex_t vmm_lock = MUTEX_INITIAL_VALUE(vmm_lock);
 
 vmm_aspace_t _kernel_aspace;
 
+static slab_cache_t region_cache;
+
+/* vmm_page_fault() runs in the fault handler and can take neither the vmm lock
+ * nor the pmm's, so it only looks at the regions it may commit pages in and a
+ * reserve of free pages, both kept under a spinlock.
+ */
+#ifndef VMM_FAULT_RESERVE
+#define VMM_FAULT_RESERVE 16
+#endif
+
+static spin_lock_t fault_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct list_node fault_region_list = LIST_INITIAL_VALUE(fault_region_list);
+static struct list_node fault_reserve = LIST_INITIAL_VALUE(fault_reserve);
+static uint fault_reserve_count;
+
 static void dump_aspace(const vmm_aspace_t *a);
 static void dump_region(const vmm_region_t *r);
 
@@ -47,10 +65,13 @@ void vmm_init_preheap(void)
     _kernel_aspace.size = KERNEL_ASPACE_SIZE;
     _kernel_aspace.flags = VMM_ASPACE_FLAG_KERNEL;
     list_initialize(&_kernel_aspace.region_list);
+    _kernel_aspace.region_tree = NULL;
 
     arch_mmu_init_aspace(&_kernel_aspace.arch_aspace, KERNEL_ASPACE_BASE, KERNEL_ASPACE_SIZE, ARCH_ASPACE_FLAG_KERNEL);
 
     list_add_head(&aspace_list, &_kernel_aspace.node);
+
+    slab_cache_init(&region_cache, "vmm region", sizeof(vmm_region_t), __alignof(vmm_region_t), NULL);
 }
 
 void vmm_init(void)
@@ -112,9 +133,10 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
 {
     DEBUG_ASSERT(name);
 
-    vmm_region_t *r = calloc(1, sizeof(vmm_region_t));
+    vmm_region_t *r = slab_cache_alloc(&region_cache);
     if (!r)
         return NULL;
+    memset(r, 0, sizeof(*r));
 
     strlcpy(r->name, name, sizeof(r->name));
     r->base = base;
@@ -126,7 +148,178 @@ static vmm_region_t *alloc_region_struct(const char *name, vaddr_t base, size_t
     return r;
 }
 
-/* add a region to the appropriate spot in the address space list,
+/*
+ * Region tree
+ *
+ * Regions are kept both on the sorted aspace->region_list, which gives cheap
+ * access to neighbours, and in an AVL tree keyed by base address. Each tree
+ * node caches the largest free gap found in front of any region in its
+ * subtree, which lets lookups and free space searches skip whole subtrees.
+ */
+static inline int region_tree_height(const vmm_region_t *r)
+{
+    return r ? r->tree_height : 0;
+}
+
+static inline size_t region_tree_max_gap(const vmm_region_t *r)
+{
+    return r ? r->tree_max_gap : 0;
+}
+
+/* size of the free gap between the previous region (or the start of the aspace) and r */
+static size_t region_gap_before(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    vaddr_t gap_beg = prev ? prev->base + prev->size : aspace->base;
+
+    return r->base - gap_beg;
+}
+
+/* recompute the height and augmented gap of a node from its children */
+static void region_tree_update(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    r->tree_height = 1 + MAX(region_tree_height(r->tree_left), region_tree_height(r->tree_right));
+
+    size_t gap = region_gap_before(aspace, r);
+    gap = MAX(gap, region_tree_max_gap(r->tree_left));
+    gap = MAX(gap, region_tree_max_gap(r->tree_right));
+    r->tree_max_gap = gap;
+}
+
+static void region_tree_replace_child(vmm_aspace_t *aspace, vmm_region_t *parent,
+                                      vmm_region_t *old, vmm_region_t *new)
+{
+    if (!parent)
+        aspace->region_tree = new;
+    else if (parent->tree_left == old)
+        parent->tree_left = new;
+    else
+        parent->tree_right = new;
+
+    if (new)
+        new->tree_parent = parent;
+}
+
+static vmm_region_t *region_tree_rotate_left(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *p = r->tree_right;
+
+    region_tree_replace_child(aspace, r->tree_parent, r, p);
+    r->tree_right = p->tree_left;
+    if (r->tree_right)
+        r->tree_right->tree_parent = r;
+    p->tree_left = r;
+    r->tree_parent = p;
+
+    region_tree_update(aspace, r);
+    region_tree_update(aspace, p);
+    return p;
+}
+
+static vmm_region_t *region_tree_rotate_right(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    vmm_region_t *p = r->tree_left;
+
+    region_tree_replace_child(aspace, r->tree_parent, r, p);
+    r->tree_left = p->tree_right;
+    if (r->tree_left)
+        r->tree_left->tree_parent = r;
+    p->tree_right = r;
+    r->tree_parent = p;
+
+    region_tree_update(aspace, r);
+    region_tree_update(aspace, p);
+    return p;
+}
+
+/* rebalance the subtree rooted at r, returning the new subtree root */
+static vmm_region_t *region_tree_balance(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    int balance = region_tree_height(r->tree_left) - region_tree_height(r->tree_right);
+
+    if (balance > 1) {
+        vmm_region_t *l = r->tree_left;
+        if (region_tree_height(l->tree_left) < region_tree_height(l->tree_right))
+            region_tree_rotate_left(aspace, l);
+        return region_tree_rotate_right(aspace, r);
+    } else if (balance < -1) {
+        vmm_region_t *rr = r->tree_right;
+        if (region_tree_height(rr->tree_right) < region_tree_height(rr->tree_left))
+            region_tree_rotate_right(aspace, rr);
+        return region_tree_rotate_left(aspace, r);
+    }
+
+    region_tree_update(aspace, r);
+    return r;
+}
+
+/* walk from r up to the root, rebalancing and refreshing the cached gaps */
+static void region_tree_fixup(vmm_aspace_t *aspace, vmm_region_t *r)
+{
+    while (r) {
+        r = region_tree_balance(aspace, r);
+        r = r->tree_parent;
+    }
+}
+
+/* link r into the tree as a child of parent. r must already be on the region list. */
+static void region_tree_insert(vmm_aspace_t *aspace, vmm_region_t *parent, vmm_region_t *r)
+{
+    r->tree_parent = parent;
+    r->tree_left = r->tree_right = NULL;
+
+    if (!parent)
+        aspace->region_tree = r;
+    else if (r->base < parent->base)
+        parent->tree_left = r;
+    else
+        parent->tree_right = r;
+
+    region_tree_fixup(aspace, r);
+
+    /* the region following us just had its gap shrink */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+    if (next)
+        region_tree_fixup(aspace, next);
+}
+
+/* unlink r from the tree. r must already be off the region list. */
+static void region_tree_remove(vmm_aspace_t *aspace, vmm_region_t *r, vmm_region_t *next)
+{
+    vmm_region_t *fix;
+
+    if (r->tree_left && r->tree_right) {
+        /* replace r with its in-order successor */
+        vmm_region_t *s = r->tree_right;
+        while (s->tree_left)
+            s = s->tree_left;
+
+        if (s->tree_parent != r) {
+            fix = s->tree_parent;
+            region_tree_replace_child(aspace, s->tree_parent, s, s->tree_right);
+            s->tree_right = r->tree_right;
+            s->tree_right->tree_parent = s;
+        } else {
+            fix = s;
+        }
+        s->tree_left = r->tree_left;
+        s->tree_left->tree_parent = s;
+        region_tree_replace_child(aspace, r->tree_parent, r, s);
+    } else {
+        fix = r->tree_parent;
+        region_tree_replace_child(aspace, r->tree_parent, r, r->tree_left ? r->tree_left : r->tree_right);
+    }
+
+    r->tree_parent = r->tree_left = r->tree_right = NULL;
+
+    region_tree_fixup(aspace, fix);
+
+    /* the region that followed us just had its gap grow */
+    if (next)
+        region_tree_fixup(aspace, next);
+}
+
+/* add a region to the appropriate spot in the address space list and tree,
  * testing to see if there's a space */
 static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 {
@@ -144,31 +337,33 @@ static status_t add_region_to_aspace(vmm_aspace_t *aspace, vmm_region_t *r)
 
     vaddr_t r_end = r->base + r->size - 1;
 
-    /* does it fit in front */
-    vmm_region_t *last;
-    last = list_peek_head_type(&aspace->region_list, vmm_region_t, node);
-    if (!last || r_end < last->base) {
-        /* empty list or not empty and fits before the first element */
-        list_add_head(&aspace->region_list, &r->node);
-        return NO_ERROR;
-    }
-
-    /* walk the list, finding the right spot to put it */
-    list_for_every_entry(&aspace->region_list, last, vmm_region_t, node) {
-        /* does it go after last? */
-        if (r->base > last->base + last->size - 1) {
-            /* get the next element in the list */
-            vmm_region_t *next = list_next_type(&aspace->region_list, &last->node, vmm_region_t, node);
-            if (!next || (r_end < next->base)) {
-                /* end of the list or next exists and it goes between them */
-                list_add_after(&last->node, &r->node);
-                return NO_ERROR;
-            }
+    /* walk down the tree to the insertion point. Since regions never overlap,
+     * any region that collides with the new one will be on this path. */
+    vmm_region_t *parent = NULL;
+    vmm_region_t *prev = NULL;
+    vmm_region_t *n = aspace->region_tree;
+    while (n) {
+        parent = n;
+        if (r_end < n->base) {
+            n = n->tree_left;
+        } else if (r->base > n->base + n->size - 1) {
+            prev = n;
+            n = n->tree_right;
+        } else {
+            LTRACEF("couldn't find spot\n");
+            return ERR_NO_MEMORY;
         }
     }
 
-    LTRACEF("couldn't find spot\n");
-    return ERR_NO_MEMORY;
+    /* the last node we stepped right from is our predecessor in the list */
+    if (prev)
+        list_add_after(&prev->node, &r->node);
+    else
+        list_add_head(&aspace->region_list, &r->node);
+
+    region_tree_insert(aspace, parent, r);
+
+    return NO_ERROR;
 }
 
 /*
@@ -231,8 +426,33 @@ not_found:
     return true; /* not_found: stop search */
 }
 
+/*
+ *  In-order walk of the region tree looking for the lowest gap that fits,
+ *  skipping any subtree whose largest gap is too small.
+ *
+ *  Returns true if the caller has to stop search
+ */
+static bool find_spot_in_tree(vmm_aspace_t *aspace, vmm_region_t *r,
+                              vaddr_t *pva, vaddr_t align, size_t size,
+                              uint arch_mmu_flags)
+{
+    if (!r || r->tree_max_gap < size)
+        return false;
+
+    if (find_spot_in_tree(aspace, r->tree_left, pva, align, size, arch_mmu_flags))
+        return true;
+
+    if (region_gap_before(aspace, r) >= size) {
+        vmm_region_t *prev = list_prev_type(&aspace->region_list, &r->node, vmm_region_t, node);
+        if (check_gap(aspace, prev, r, pva, align, size, arch_mmu_flags))
+            return true;
+    }
+
+    return find_spot_in_tree(aspace, r->tree_right, pva, align, size, arch_mmu_flags);
+}
+
 static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
-                          uint arch_mmu_flags, struct list_node **before)
+                          uint arch_mmu_flags)
 {
     DEBUG_ASSERT(aspace);
     DEBUG_ASSERT(size > 0 && IS_PAGE_ALIGNED(size));
@@ -244,29 +464,18 @@ static vaddr_t alloc_spot(vmm_aspace_t *aspace, size_t size, uint8_t align_pow2,
     vaddr_t align = 1UL << align_pow2;
 
     vaddr_t spot;
-    vmm_region_t *r = NULL;
 
-    /* try to pick spot at the beginning of address space */
-    if (check_gap(aspace, NULL,
-                  list_peek_head_type(&aspace->region_list, vmm_region_t, node),
-                  &spot, align, size, arch_mmu_flags))
-        goto done;
+    /* try the gaps in front of each region */
+    if (find_spot_in_tree(aspace, aspace->region_tree, &spot, align, size, arch_mmu_flags))
+        return spot;
 
-    /* search the middle of the list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if (check_gap(aspace, r,
-                      list_next_type(&aspace->region_list, &r->node, vmm_region_t, node),
-                      &spot, align, size, arch_mmu_flags))
-            goto done;
-    }
+    /* try the gap between the last region and the end of address space */
+    if (check_gap(aspace, list_peek_tail_type(&aspace->region_list, vmm_region_t, node), NULL,
+                  &spot, align, size, arch_mmu_flags))
+        return spot;
 
     /* couldn't find anything */
     return -1;
-
-done:
-    if (before)
-        *before = r ? &r->node : &aspace->region_list;
-    return spot;
 }
 
 /* allocate a region structure and stick it in the address space */
@@ -284,28 +493,25 @@ static vmm_region_t *alloc_region(vmm_aspace_t *aspace, const char *name, size_t
         /* stick it in the list, checking to see if it fits */
         if (add_region_to_aspace(aspace, r) < 0) {
             /* didn't fit */
-            free(r);
+            slab_cache_free(&region_cache, r);
             return NULL;
         }
     } else {
         /* allocate a virtual slot for it */
-        struct list_node *before = NULL;
-
-        vaddr = alloc_spot(aspace, size, align_pow2, arch_mmu_flags, &before);
-        LTRACEF("alloc_spot returns 0x%lx, before %p\n", vaddr, before);
+        vaddr = alloc_spot(aspace, size, align_pow2, arch_mmu_flags);
+        LTRACEF("alloc_spot returns 0x%lx\n", vaddr);
 
         if (vaddr == (vaddr_t)-1) {
             LTRACEF("failed to find spot\n");
-            free(r);
+            slab_cache_free(&region_cache, r);
             return NULL;
         }
 
-        DEBUG_ASSERT(before != NULL);
-
         r->base = (vaddr_t)vaddr;
 
-        /* add it to the region list */
-        list_add_after(before, &r->node);
+        /* add it to the region list and tree */
+        status_t err = add_region_to_aspace(aspace, r);
+        DEBUG_ASSERT(err == NO_ERROR);
     }
 
     return r;
@@ -511,16 +717,42 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         vaddr = (vaddr_t)*ptr;
     }
 
+    /* the guard page is in front of the region, so the two don't mix */
+    size_t guard = 0;
+    uint region_flags = VMM_REGION_FLAG_PHYSICAL;
+    if (vmm_flags & VMM_FLAG_GUARD_PAGE) {
+        if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+            err = ERR_INVALID_ARGS;
+            goto err;
+        }
+        guard = PAGE_SIZE;
+        region_flags |= VMM_REGION_FLAG_GUARD_PAGE;
+    }
+
+    /* back just the top page of a commit on fault region, which creates the
+     * page tables for the rest of it */
+    size_t commit = size;
+    if ((vmm_flags & VMM_FLAG_COMMIT_ON_FAULT) && size + guard <= VMM_COMMIT_ON_FAULT_MAX) {
+        if (vmm_flags & VMM_FLAG_VALLOC_SPECIFIC) {
+            err = ERR_INVALID_ARGS;
+            goto err;
+        }
+        /* aligned to its size so it doesn't straddle two page tables */
+        align_pow2 = MAX(align_pow2, log2_uint(round_up_pow2_u32(size + guard)));
+        commit = PAGE_SIZE;
+        region_flags |= VMM_REGION_FLAG_COMMIT_ON_FAULT;
+    }
+
     /* allocate physical memory up front, in case it cant be satisfied */
 
     /* allocate a random pile of pages */
     struct list_node page_list;
     list_initialize(&page_list);
 
-    size_t count = pmm_alloc_pages(size / PAGE_SIZE, &page_list);
-    DEBUG_ASSERT(count <= size);
-    if (count < size / PAGE_SIZE) {
-        LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", size / PAGE_SIZE, count);
+    size_t count = pmm_alloc_pages(commit / PAGE_SIZE, &page_list);
+    DEBUG_ASSERT(count <= commit);
+    if (count < commit / PAGE_SIZE) {
+        LTRACEF("failed to allocate enough pages (asked for %zu, got %zu)\n", commit / PAGE_SIZE, count);
         pmm_free(&page_list);
         err = ERR_NO_MEMORY;
         goto err;
@@ -529,8 +761,8 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
     mutex_acquire(&vmm_lock);
 
     /* allocate a region and put it in the aspace list */
-    vmm_region_t *r = alloc_region(aspace, name, size, vaddr, align_pow2, vmm_flags,
-                                   VMM_REGION_FLAG_PHYSICAL, arch_mmu_flags);
+    vmm_region_t *r = alloc_region(aspace, name, size + guard, vaddr, align_pow2, vmm_flags,
+                                   region_flags, arch_mmu_flags);
     if (!r) {
         err = ERR_NO_MEMORY;
         goto err1;
@@ -538,12 +770,12 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
 
     /* return the vaddr if requested */
     if (ptr)
-        *ptr = (void *)r->base;
+        *ptr = (void *)(r->base + guard);
 
     /* map all of the pages */
     /* XXX use smarter algorithm that tries to build runs */
     vm_page_t *p;
-    vaddr_t va = r->base;
+    vaddr_t va = r->base + guard + size - commit;
     DEBUG_ASSERT(IS_PAGE_ALIGNED(va));
     while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
         DEBUG_ASSERT(va <= r->base + r->size - 1);
@@ -559,7 +791,18 @@ status_t vmm_alloc(vmm_aspace_t *aspace, const char *name, size_t size, void **p
         va += PAGE_SIZE;
     }
 
+    if (region_flags & VMM_REGION_FLAG_COMMIT_ON_FAULT) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&fault_lock, state);
+        list_add_head(&fault_region_list, &r->fault_node);
+        spin_unlock_irqrestore(&fault_lock, state);
+    }
+
     mutex_release(&vmm_lock);
+
+    if (region_flags & VMM_REGION_FLAG_COMMIT_ON_FAULT)
+        vmm_fault_reserve_fill();
+
     return NO_ERROR;
 
 err1:
@@ -569,6 +812,92 @@ err:
     return err;
 }
 
+/* stop vmm_page_fault() from committing pages in a region that is going away,
+ * after which its page list is stable */
+static void region_fault_remove(vmm_region_t *r)
+{
+    if (!(r->flags & VMM_REGION_FLAG_COMMIT_ON_FAULT))
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&fault_lock, state);
+    list_delete(&r->fault_node);
+    spin_unlock_irqrestore(&fault_lock, state);
+}
+
+void vmm_fault_reserve_fill(void)
+{
+    uint want = VMM_FAULT_RESERVE - MIN(fault_reserve_count, VMM_FAULT_RESERVE);
+    if (want == 0)
+        return;
+
+    struct list_node page_list = LIST_INITIAL_VALUE(page_list);
+    pmm_alloc_pages(want, &page_list);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&fault_lock, state);
+    vm_page_t *p;
+    while (fault_reserve_count < VMM_FAULT_RESERVE &&
+            (p = list_remove_head_type(&page_list, vm_page_t, node))) {
+        list_add_tail(&fault_reserve, &p->node);
+        fault_reserve_count++;
+    }
+    spin_unlock_irqrestore(&fault_lock, state);
+
+    /* someone else filled it in the meantime */
+    pmm_free(&page_list);
+}
+
+status_t vmm_page_fault(vaddr_t vaddr)
+{
+    vmm_aspace_t *aspace = vmm_get_kernel_aspace();
+    status_t err = ERR_NOT_FOUND;
+
+    vaddr = ROUNDDOWN(vaddr, PAGE_SIZE);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&fault_lock, state);
+
+    vmm_region_t *r;
+    list_for_every_entry(&fault_region_list, r, vmm_region_t, fault_node) {
+        vaddr_t base = r->base;
+        if (r->flags & VMM_REGION_FLAG_GUARD_PAGE)
+            base += PAGE_SIZE;
+
+        if (vaddr < base || vaddr > r->base + r->size - 1)
+            continue;
+
+        /* another cpu got to it first */
+        if (arch_mmu_query(&aspace->arch_aspace, vaddr, NULL, NULL) >= 0) {
+            err = NO_ERROR;
+            break;
+        }
+
+        vm_page_t *p = list_remove_head_type(&fault_reserve, vm_page_t, node);
+        if (!p) {
+            err = ERR_NO_MEMORY;
+            break;
+        }
+        fault_reserve_count--;
+
+        err = arch_mmu_map(&aspace->arch_aspace, vaddr, vm_page_to_paddr(p), 1, r->arch_mmu_flags);
+        if (err < 0) {
+            list_add_head(&fault_reserve, &p->node);
+            fault_reserve_count++;
+            break;
+        }
+        list_add_tail(&r->page_list, &p->node);
+        err = NO_ERROR;
+        break;
+    }
+
+    spin_unlock_irqrestore(&fault_lock, state);
+
+    LTRACEF("vaddr 0x%lx err %d\n", vaddr, err);
+
+    return err;
+}
+
 static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
 {
     vmm_region_t *r;
@@ -578,9 +907,14 @@ static vmm_region_t *vmm_find_region(const vmm_aspace_t *aspace, vaddr_t vaddr)
     if (!aspace)
         return NULL;
 
-    /* search the region list */
-    list_for_every_entry(&aspace->region_list, r, vmm_region_t, node) {
-        if ((vaddr >= r->base) && (vaddr <= r->base + r->size - 1))
+    /* search the region tree */
+    r = aspace->region_tree;
+    while (r) {
+        if (vaddr < r->base)
+            r = r->tree_left;
+        else if (vaddr > r->base + r->size - 1)
+            r = r->tree_right;
+        else
             return r;
     }
 
@@ -598,7 +932,10 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     }
 
     /* remove it from aspace */
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
     list_delete(&r->node);
+    region_tree_remove(aspace, r, next);
+    region_fault_remove(r);
 
     /* unmap it */
     arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
@@ -609,11 +946,148 @@ status_t vmm_free_region(vmm_aspace_t *aspace, vaddr_t vaddr)
     pmm_free(&r->page_list);
 
     /* free it */
-    free(r);
+    slab_cache_free(&region_cache, r);
 
     return NO_ERROR;
 }
 
+status_t vmm_resize_region(vmm_aspace_t *aspace, vaddr_t vaddr, size_t size, void **ptr)
+{
+    status_t err = NO_ERROR;
+
+    LTRACEF("aspace %p vaddr 0x%lx size 0x%zx\n", aspace, vaddr, size);
+
+    DEBUG_ASSERT(aspace);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+    if (size == 0)
+        return ERR_INVALID_ARGS;
+
+    struct list_node page_list;
+    list_initialize(&page_list);
+
+    mutex_acquire(&vmm_lock);
+
+    vmm_region_t *r = vmm_find_region(aspace, vaddr);
+    if (!r || r->base != vaddr) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+
+    /* only regions backed by pages from the pmm can be resized, and not the
+     * ones the fault handler commits pages in behind the vmm lock's back */
+    if (!(r->flags & VMM_REGION_FLAG_PHYSICAL) || list_is_empty(&r->page_list) ||
+            (r->flags & VMM_REGION_FLAG_COMMIT_ON_FAULT)) {
+        err = ERR_NOT_SUPPORTED;
+        goto out;
+    }
+
+    vmm_region_t *next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    if (size <= r->size) {
+        /* shrinking, give back the pages past the new end */
+        for (vaddr_t va = r->base + size; va < r->base + r->size; va += PAGE_SIZE) {
+            paddr_t pa;
+            if (arch_mmu_query(&aspace->arch_aspace, va, &pa, NULL) < 0)
+                continue;
+
+            vm_page_t *p = paddr_to_vm_page(pa);
+            DEBUG_ASSERT(p);
+            list_delete(&p->node);
+            list_add_tail(&page_list, &p->node);
+        }
+        arch_mmu_unmap(&aspace->arch_aspace, r->base + size, (r->size - size) / PAGE_SIZE);
+
+        r->size = size;
+        if (next)
+            region_tree_fixup(aspace, next);
+
+        if (ptr)
+            *ptr = (void *)r->base;
+        goto out;
+    }
+
+    /* growing, get the extra pages up front so we can't fail halfway through */
+    size_t extra = (size - r->size) / PAGE_SIZE;
+    mutex_release(&vmm_lock);
+    size_t count = pmm_alloc_pages(extra, &page_list);
+    mutex_acquire(&vmm_lock);
+    if (count < extra) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    /* the region may have gone away while we weren't holding the lock */
+    r = vmm_find_region(aspace, vaddr);
+    if (!r || r->base != vaddr) {
+        err = ERR_NOT_FOUND;
+        goto out;
+    }
+    next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+
+    vaddr_t limit = next ? next->base : aspace->base + aspace->size;
+    if (r->base + size <= r->base || r->base + size > limit) {
+        /* no room to grow in place, move the existing pages to a new spot */
+        vmm_region_t *new_r = alloc_region(aspace, r->name, size, 0, 0, 0, r->flags, r->arch_mmu_flags);
+        if (!new_r) {
+            err = ERR_NO_MEMORY;
+            goto out;
+        }
+
+        for (size_t off = 0; off < r->size; off += PAGE_SIZE) {
+            paddr_t pa;
+            if (arch_mmu_query(&aspace->arch_aspace, r->base + off, &pa, NULL) < 0)
+                continue;
+            arch_mmu_map(&aspace->arch_aspace, new_r->base + off, pa, 1, r->arch_mmu_flags);
+        }
+        arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
+
+        vm_page_t *p;
+        while ((p = list_remove_head_type(&r->page_list, vm_page_t, node)))
+            list_add_tail(&new_r->page_list, &p->node);
+
+        /* retire the old region */
+        next = list_next_type(&aspace->region_list, &r->node, vmm_region_t, node);
+        list_delete(&r->node);
+        region_tree_remove(aspace, r, next);
+
+        vaddr_t old_end = new_r->base + r->size;
+        slab_cache_free(&region_cache, r);
+        r = new_r;
+
+        /* the new pages go after the moved ones */
+        for (vaddr_t va = old_end; va < r->base + r->size; va += PAGE_SIZE) {
+            p = list_remove_head_type(&page_list, vm_page_t, node);
+            arch_mmu_map(&aspace->arch_aspace, va, vm_page_to_paddr(p), 1, r->arch_mmu_flags);
+            list_add_tail(&r->page_list, &p->node);
+        }
+    } else {
+        /* extend in place */
+        vm_page_t *p;
+        vaddr_t va = r->base + r->size;
+        while ((p = list_remove_head_type(&page_list, vm_page_t, node))) {
+            arch_mmu_map(&aspace->arch_aspace, va, vm_page_to_paddr(p), 1, r->arch_mmu_flags);
+            list_add_tail(&r->page_list, &p->node);
+            va += PAGE_SIZE;
+        }
+
+        r->size = size;
+        if (next)
+            region_tree_fixup(aspace, next);
+    }
+
+    if (ptr)
+        *ptr = (void *)r->base;
+
+out:
+    mutex_release(&vmm_lock);
+
+    /* return any pages we trimmed or didn't end up using */
+    pmm_free(&page_list);
+
+    return err;
+}
+
 status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 {
     status_t err;
@@ -647,6 +1121,7 @@ status_t vmm_create_aspace(vmm_aspace_t **_aspace, const char *name, uint flags)
 
     list_clear_node(&aspace->node);
     list_initialize(&aspace->region_list);
+    aspace->region_tree = NULL;
 
     mutex_acquire(&vmm_lock);
     list_add_head(&aspace_list, &aspace->node);
@@ -674,10 +1149,12 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
     while ((r = list_remove_head_type(&aspace->region_list, vmm_region_t, node))) {
         /* add it to our tempoary list */
         list_add_tail(&region_list, &r->node);
+        region_fault_remove(r);
 
         /* unmap it */
         arch_mmu_unmap(&aspace->arch_aspace, r->base, r->size / PAGE_SIZE);
     }
+    aspace->region_tree = NULL;
     mutex_release(&vmm_lock);
 
     /* without the vmm lock held, free all of the pmm pages and the structure */
@@ -686,7 +1163,7 @@ status_t vmm_free_aspace(vmm_aspace_t *aspace)
         pmm_free(&r->page_list);
 
         /* free it */
-        free(r);
+        slab_cache_free(&region_cache, r);
     }
 
     /* make sure the current thread does not map the aspace */
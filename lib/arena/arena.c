@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/arena.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <pow2.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <lib/page_alloc.h>
+#include <lk/init.h>
+
+#define LOCAL_TRACE 0
+
+/* scratch arenas start out this big */
+#define ARENA_SCRATCH_SIZE (PAGE_SIZE * 2)
+
+/* each run of pages starts with one of these */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+};
+
+#define CHUNK_HEADER_SIZE ROUNDUP(sizeof(struct arena_chunk), ARENA_ALIGN)
+
+static struct list_node scratch_list = LIST_INITIAL_VALUE(scratch_list);
+static spin_lock_t scratch_lock = SPIN_LOCK_INITIAL_VALUE;
+static uint scratch_count;
+
+static struct arena_chunk *chunk_alloc(size_t size)
+{
+    DEBUG_ASSERT(IS_PAGE_ALIGNED(size));
+
+    struct arena_chunk *chunk = page_alloc(size / PAGE_SIZE, PAGE_ALLOC_ANY_ARENA);
+    if (!chunk)
+        return NULL;
+
+    chunk->next = NULL;
+    chunk->size = size;
+
+    return chunk;
+}
+
+static void chunk_free(struct arena_chunk *chunk)
+{
+    page_free(chunk, chunk->size / PAGE_SIZE);
+}
+
+arena_t *arena_create(const char *name, size_t size)
+{
+    LTRACEF("name '%s' size %zu\n", name, size);
+
+    /* the arena structure lives at the start of the first chunk */
+    size_t header = CHUNK_HEADER_SIZE + ROUNDUP(sizeof(arena_t), ARENA_ALIGN);
+    if (size > SIZE_MAX - header - PAGE_SIZE)
+        return NULL;
+    size_t chunk_size = ROUNDUP(header + size, PAGE_SIZE);
+
+    struct arena_chunk *chunk = chunk_alloc(chunk_size);
+    if (!chunk)
+        return NULL;
+
+    arena_t *arena = (arena_t *)((uintptr_t)chunk + CHUNK_HEADER_SIZE);
+    memset(arena, 0, sizeof(*arena));
+    list_clear_node(&arena->node);
+    arena->name = name;
+    arena->chunk_size = chunk_size;
+    arena->chunks = chunk;
+    arena->pos = (uintptr_t)chunk + header;
+    arena->end = (uintptr_t)chunk + chunk_size;
+    arena->chunk_count = 1;
+
+    return arena;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    LTRACEF("arena %p\n", arena);
+
+    if (!arena)
+        return;
+
+    /* the first chunk holds the arena itself, so it goes last */
+    arena_reset(arena);
+    chunk_free(arena->chunks);
+}
+
+void arena_reset(arena_t *arena)
+{
+    LTRACEF("arena %p, %zu chunks, %zu bytes\n", arena, arena->chunk_count, arena->bytes_allocated);
+
+    /* free everything but the first chunk, which is at the tail of the list */
+    struct arena_chunk *chunk = arena->chunks;
+    while (chunk->next) {
+        struct arena_chunk *next = chunk->next;
+        chunk_free(chunk);
+        chunk = next;
+    }
+
+    arena->chunks = chunk;
+    arena->pos = (uintptr_t)chunk + CHUNK_HEADER_SIZE + ROUNDUP(sizeof(arena_t), ARENA_ALIGN);
+    arena->end = (uintptr_t)chunk + chunk->size;
+    arena->chunk_count = 1;
+    arena->bytes_allocated = 0;
+}
+
+arena_mark_t arena_mark(const arena_t *arena)
+{
+    arena_mark_t mark = {
+        .chunk = arena->chunks,
+        .pos = arena->pos,
+        .bytes_allocated = arena->bytes_allocated,
+    };
+
+    return mark;
+}
+
+void arena_release(arena_t *arena, arena_mark_t mark)
+{
+    LTRACEF("arena %p, to chunk %p pos 0x%lx\n", arena, mark.chunk, mark.pos);
+
+    /* free the chunks chained on since the mark */
+    struct arena_chunk *chunk = arena->chunks;
+    while (chunk != mark.chunk) {
+        DEBUG_ASSERT(chunk->next);
+        struct arena_chunk *next = chunk->next;
+        chunk_free(chunk);
+        arena->chunk_count--;
+        chunk = next;
+    }
+
+    DEBUG_ASSERT(mark.pos >= (uintptr_t)chunk && mark.pos <= (uintptr_t)chunk + chunk->size);
+
+    arena->chunks = chunk;
+    arena->pos = mark.pos;
+    arena->end = (uintptr_t)chunk + chunk->size;
+    arena->bytes_allocated = mark.bytes_allocated;
+}
+
+/* chain on a new chunk big enough for an allocation of size and alignment */
+static bool arena_grow(arena_t *arena, size_t size, size_t align)
+{
+    size_t needed = CHUNK_HEADER_SIZE + align + size;
+    if (needed < size)
+        return false;
+
+    size_t chunk_size = MAX(arena->chunk_size, ROUNDUP(needed, PAGE_SIZE));
+    struct arena_chunk *chunk = chunk_alloc(chunk_size);
+    if (!chunk)
+        return false;
+
+    LTRACEF("arena %p new chunk %p size %zu\n", arena, chunk, chunk_size);
+
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->pos = (uintptr_t)chunk + CHUNK_HEADER_SIZE;
+    arena->end = (uintptr_t)chunk + chunk_size;
+    arena->chunk_count++;
+
+    return true;
+}
+
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t align)
+{
+    DEBUG_ASSERT(ispow2(align));
+
+    if (align < ARENA_ALIGN)
+        align = ARENA_ALIGN;
+
+    uintptr_t ptr = ROUNDUP(arena->pos, align);
+    if (ptr < arena->pos || ptr > arena->end || arena->end - ptr < size) {
+        if (!arena_grow(arena, size, align))
+            return NULL;
+        ptr = ROUNDUP(arena->pos, align);
+    }
+
+    arena->pos = ptr + ROUNDUP(size, ARENA_ALIGN);
+    if (arena->pos > arena->end)
+        arena->pos = arena->end;
+    arena->bytes_allocated += size;
+
+    return (void *)ptr;
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    return arena_alloc_aligned(arena, size, ARENA_ALIGN);
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    char *s = arena_alloc_aligned(arena, len, 1);
+    if (s)
+        memcpy(s, str, len);
+
+    return s;
+}
+
+static arena_t *arena_scratch_create(void)
+{
+    return arena_create("scratch", ARENA_SCRATCH_SIZE - PAGE_SIZE);
+}
+
+arena_t *arena_scratch_get(void)
+{
+    DEBUG_ASSERT(!arch_in_int_handler());
+
+    /* the thread's own arena, if it isn't already using it */
+    arena_t *arena = (arena_t *)tls_set(TLS_ENTRY_ARENA, 0);
+    if (arena)
+        return arena;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&scratch_lock, state);
+    arena = list_remove_head_type(&scratch_list, arena_t, node);
+    if (arena)
+        scratch_count--;
+    spin_unlock_irqrestore(&scratch_lock, state);
+
+    if (!arena)
+        arena = arena_scratch_create();
+
+    return arena;
+}
+
+/* give an arena back to the shared pool, or destroy it if that is full */
+static void arena_scratch_pool_put(arena_t *arena)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&scratch_lock, state);
+    if (scratch_count < ARENA_SCRATCH_MAX) {
+        list_add_head(&scratch_list, &arena->node);
+        scratch_count++;
+        arena = NULL;
+    }
+    spin_unlock_irqrestore(&scratch_lock, state);
+
+    /* the pool is full */
+    if (arena)
+        arena_destroy(arena);
+}
+
+void arena_scratch_put(arena_t *arena)
+{
+    DEBUG_ASSERT(!arch_in_int_handler());
+
+    if (!arena)
+        return;
+
+    arena_reset(arena);
+
+    /* keep it for the thread's next get, unless it already has one */
+    if (tls_get(TLS_ENTRY_ARENA) == 0) {
+        tls_set(TLS_ENTRY_ARENA, (uintptr_t)arena);
+        return;
+    }
+
+    arena_scratch_pool_put(arena);
+}
+
+void arena_scratch_thread_exit(void)
+{
+    arena_t *arena = (arena_t *)tls_set(TLS_ENTRY_ARENA, 0);
+    if (arena)
+        arena_scratch_pool_put(arena);
+}
+
+uint arena_scratch_available(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&scratch_lock, state);
+    uint count = scratch_count;
+    spin_unlock_irqrestore(&scratch_lock, state);
+
+    return count;
+}
+
+/* fill the pool up front so the first users don't pay for it */
+static void arena_scratch_init(uint level)
+{
+    for (uint i = 0; i < ARENA_SCRATCH_MAX; i++) {
+        arena_t *arena = arena_scratch_create();
+        if (!arena) {
+            TRACEF("only %u of %u scratch arenas\n", i, ARENA_SCRATCH_MAX);
+            break;
+        }
+        arena_scratch_pool_put(arena);
+    }
+}
+
+LK_INIT_HOOK(arena_scratch, &arena_scratch_init, LK_INIT_LEVEL_KERNEL);
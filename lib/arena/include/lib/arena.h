@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/**
+ * A bump pointer (region) allocator for bulk, short lived allocations.
+ *
+ * An arena hands out memory from runs of pages by bumping a pointer, and
+ * everything allocated from it is released at once by arena_reset() or
+ * arena_destroy(). There is no per-allocation free. When the current run of
+ * pages fills up, another one is chained on, so allocations never fail while
+ * the page allocator has memory.
+ *
+ * An arena is not locked, it is meant to be owned by one thread or protected
+ * by its owner's lock.
+ *
+ * Scratch arenas are for temporary allocations within a function. A thread
+ * takes one with arena_scratch_get() and arena_scratch_put() resets it and
+ * gives it back, so hold one only as long as the allocations are needed. Each
+ * thread keeps the last one it put back in a thread local slot, so the usual
+ * get and put touch no shared state. A nested get, or a thread's first, takes
+ * one from a shared pool instead, which is filled with ARENA_SCRATCH_MAX
+ * arenas at boot. When the pool is empty a new arena is created, and arenas
+ * put back into a full pool are destroyed. A thread's own arena goes back to
+ * the pool when it exits. Not for use in interrupt context.
+ *
+ * Typical usage:
+ *
+ * arena_t *a = arena_scratch_get();
+ * foo_t *foo = arena_alloc(a, sizeof(foo_t));
+ * char *buf = arena_alloc(a, 512);
+ * ...
+ * arena_scratch_put(a);
+ */
+
+#include <compiler.h>
+#include <list.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+/* default alignment of allocations */
+#define ARENA_ALIGN (sizeof(void *) * 2)
+
+/* scratch arenas kept in the shared pool */
+#define ARENA_SCRATCH_MAX 4
+
+struct arena_chunk;
+
+typedef struct arena {
+    struct list_node node;
+    const char *name;
+
+    /* size of the runs of pages we allocate, in bytes */
+    size_t chunk_size;
+
+    /* chunks we have allocated, the current one at the head */
+    struct arena_chunk *chunks;
+
+    /* free space in the current chunk */
+    uintptr_t pos;
+    uintptr_t end;
+
+    /* stats */
+    size_t chunk_count;
+    size_t bytes_allocated;
+} arena_t;
+
+/* Create an arena, size is a hint of how much will be allocated from it. */
+arena_t *arena_create(const char *name, size_t size);
+
+/* Release all of the memory in the arena and the arena itself. */
+void arena_destroy(arena_t *arena);
+
+/* Free everything allocated from the arena, keeping its first chunk. */
+void arena_reset(arena_t *arena) __NONNULL((1));
+
+/* A position in an arena. arena_release() frees everything allocated since
+ * the mark was taken, so a function can borrow an arena it was passed. */
+typedef struct arena_mark {
+    struct arena_chunk *chunk;
+    uintptr_t pos;
+    size_t bytes_allocated;
+} arena_mark_t;
+
+arena_mark_t arena_mark(const arena_t *arena) __NONNULL((1));
+void arena_release(arena_t *arena, arena_mark_t mark) __NONNULL((1));
+
+/* Allocate memory aligned to ARENA_ALIGN, or to align. Returns NULL if out of memory. */
+void *arena_alloc(arena_t *arena, size_t size) __NONNULL((1)) __MALLOC;
+void *arena_alloc_aligned(arena_t *arena, size_t size, size_t align) __NONNULL((1)) __MALLOC;
+
+/* Copy a string into the arena. */
+char *arena_strdup(arena_t *arena, const char *str) __NONNULL((1, 2)) __MALLOC;
+
+/* Borrow the thread's scratch arena, or one from the pool, or create one. */
+arena_t *arena_scratch_get(void);
+
+/* Reset a scratch arena and give it back to the thread, or to the pool. */
+void arena_scratch_put(arena_t *arena);
+
+/* number of arenas waiting in the shared scratch pool */
+uint arena_scratch_available(void);
+
+/* called by thread_exit() to return the thread's scratch arena to the pool */
+void arena_scratch_thread_exit(void);
+
+__END_CDECLS;
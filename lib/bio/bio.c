@@ -29,9 +29,14 @@
 #include <list.h>
 #include <pow2.h>
 #include <lib/bio.h>
+#include <kernel/event.h>
 #include <kernel/mutex.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
 #include <lk/init.h>
 
+#include "bio_priv.h"
+
 #define LOCAL_TRACE 0
 
 static struct {
@@ -42,6 +47,20 @@ static struct {
     .lock = MUTEX_INITIAL_VALUE(bdevs.lock),
 };
 
+/* Asynchronous requests to a driver without a submit hook are queued here and
+ * run one at a time against its synchronous hooks by a worker thread, which
+ * is started on the first request. */
+struct bio_queue {
+    struct list_node list;
+    spin_lock_t lock;
+    event_t event;
+    thread_t *thread;
+    bool shutdown;
+    bool detached;  /* the worker frees the queue as it exits */
+};
+
+static void bio_queue_destroy(struct bio_queue *q);
+
 /* default implementation is to use the read_block hook to 'deblock' the device */
 static ssize_t bio_default_read(struct bdev *dev, void *_buf, off_t offset, size_t len)
 {
@@ -287,14 +306,29 @@ static ssize_t bio_default_erase(struct bdev *dev, off_t offset, size_t len)
     return erased;
 }
 
+/* drivers with only a submit hook get their block hooks as submit and wait */
 static ssize_t bio_default_read_block(struct bdev *dev, void *buf, bnum_t block, uint count)
 {
-    return ERR_NOT_SUPPORTED;
+    if (!dev->submit)
+        return ERR_NOT_SUPPORTED;
+
+    bio_request_t req;
+    bio_request_init(&req, BIO_OP_READ, buf, (off_t)block << dev->block_shift,
+                     (size_t)count << dev->block_shift, NULL, NULL);
+
+    return bio_submit_wait(dev, &req);
 }
 
 static ssize_t bio_default_write_block(struct bdev *dev, const void *buf, bnum_t block, uint count)
 {
-    return ERR_NOT_SUPPORTED;
+    if (!dev->submit)
+        return ERR_NOT_SUPPORTED;
+
+    bio_request_t req;
+    bio_request_init(&req, BIO_OP_WRITE, (void *)buf, (off_t)block << dev->block_shift,
+                     (size_t)count << dev->block_shift, NULL, NULL);
+
+    return bio_submit_wait(dev, &req);
 }
 
 static void bdev_inc_ref(bdev_t *dev)
@@ -315,6 +349,16 @@ static void bdev_dec_ref(bdev_t *dev)
 
         TRACEF("last ref, removing (%s)\n", dev->name);
 
+        // release anything the scheduler holds, then drain and stop the worker
+        if (dev->sched) {
+            bio_sched_destroy(dev->sched);
+            dev->sched = NULL;
+        }
+        if (dev->queue) {
+            bio_queue_destroy(dev->queue);
+            dev->queue = NULL;
+        }
+
         // call the close hook if it exists
         if (dev->close)
             dev->close(dev);
@@ -464,6 +508,222 @@ int bio_ioctl(bdev_t *dev, int request, void *argp)
     }
 }
 
+status_t bio_flush(bdev_t *dev)
+{
+    LTRACEF("dev '%s'\n", dev->name);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    /* the synchronous hooks are done with the data by the time they return */
+    if (!dev->submit)
+        return NO_ERROR;
+
+    bio_request_t req;
+    bio_request_init(&req, BIO_OP_FLUSH, NULL, 0, 0, NULL, NULL);
+
+    return bio_submit_wait(dev, &req);
+}
+
+static ssize_t bio_queue_run(bdev_t *dev, bio_request_t *req)
+{
+    switch (req->op) {
+        case BIO_OP_READ:
+            return dev->read(dev, req->buf, req->offset, req->len);
+        case BIO_OP_WRITE:
+            return dev->write(dev, req->buf, req->offset, req->len);
+        case BIO_OP_ERASE:
+            return dev->erase(dev, req->offset, req->len);
+        case BIO_OP_FLUSH:
+            return NO_ERROR;
+    }
+
+    return ERR_INVALID_ARGS;
+}
+
+static int bio_queue_worker(void *arg)
+{
+    bdev_t *dev = (bdev_t *)arg;
+    struct bio_queue *q = dev->queue;
+
+    for (;;) {
+        event_wait(&q->event);
+
+        for (;;) {
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&q->lock, state);
+            bio_request_t *req = list_remove_head_type(&q->list, bio_request_t, node);
+            bool shutdown = q->shutdown;
+            bool detached = q->detached;
+            spin_unlock_irqrestore(&q->lock, state);
+
+            if (!req) {
+                if (shutdown) {
+                    /* the device may be gone already, only the queue is ours */
+                    if (detached) {
+                        event_destroy(&q->event);
+                        free(q);
+                    }
+                    return 0;
+                }
+                break;
+            }
+
+            LTRACEF("dev '%s', req %p op %d\n", dev->name, req, req->op);
+            bio_complete(req, bio_queue_run(dev, req));
+        }
+    }
+}
+
+static struct bio_queue *bio_get_queue(bdev_t *dev)
+{
+    mutex_acquire(&bdevs.lock);
+
+    struct bio_queue *q = dev->queue;
+    if (!q) {
+        q = malloc(sizeof(struct bio_queue));
+        if (!q)
+            goto out;
+
+        list_initialize(&q->list);
+        spin_lock_init(&q->lock);
+        event_init(&q->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+        q->shutdown = false;
+        q->detached = false;
+
+        /* the worker picks the queue up from the device */
+        dev->queue = q;
+        q->thread = thread_create("bio worker", &bio_queue_worker, dev,
+                                  DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+        if (!q->thread) {
+            dev->queue = NULL;
+            event_destroy(&q->event);
+            free(q);
+            q = NULL;
+            goto out;
+        }
+        thread_resume(q->thread);
+    }
+
+out:
+    mutex_release(&bdevs.lock);
+    return q;
+}
+
+static void bio_queue_destroy(struct bio_queue *q)
+{
+    /* The last close can come from a completion callback running on the
+     * worker, which can't wait for itself. Let it go and clean up after
+     * itself once the callback returns. */
+    bool self = (get_current_thread() == q->thread);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+    q->shutdown = true;
+    q->detached = self;
+    spin_unlock_irqrestore(&q->lock, state);
+
+    if (self) {
+        thread_detach(q->thread);
+        return;
+    }
+
+    event_signal(&q->event, true);
+    thread_join(q->thread, NULL, INFINITE_TIME);
+
+    DEBUG_ASSERT(list_is_empty(&q->list));
+    event_destroy(&q->event);
+    free(q);
+}
+
+status_t bio_submit(bdev_t *dev, bio_request_t *req)
+{
+    LTRACEF("dev '%s', req %p op %d, buf %p, offset %lld, len %zu\n",
+            dev->name, req, req->op, req->buf, req->offset, req->len);
+
+    DEBUG_ASSERT(dev && dev->ref > 0);
+    DEBUG_ASSERT(req && req->callback);
+
+    req->dev = dev;
+    req->result = 0;
+
+    switch (req->op) {
+        case BIO_OP_READ:
+        case BIO_OP_WRITE:
+            DEBUG_ASSERT(req->buf);
+            if (!IS_ALIGNED(req->offset, dev->block_size) || !IS_ALIGNED(req->len, dev->block_size))
+                return ERR_INVALID_ARGS;
+        /* fallthrough */
+        case BIO_OP_ERASE:
+            /* range check */
+            req->len = bio_trim_range(dev, req->offset, req->len);
+            if (req->len == 0) {
+                bio_complete(req, 0);
+                return NO_ERROR;
+            }
+            break;
+        case BIO_OP_FLUSH:
+            break;
+        default:
+            return ERR_INVALID_ARGS;
+    }
+
+    if (dev->sched)
+        return bio_sched_submit(dev, req);
+
+    return bio_dispatch(dev, req);
+}
+
+status_t bio_dispatch(bdev_t *dev, bio_request_t *req)
+{
+    if (dev->submit)
+        return dev->submit(dev, req);
+
+    struct bio_queue *q = dev->queue ? dev->queue : bio_get_queue(dev);
+    if (!q)
+        return ERR_NO_MEMORY;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&q->lock, state);
+    list_add_tail(&q->list, &req->node);
+    spin_unlock_irqrestore(&q->lock, state);
+
+    event_signal(&q->event, false);
+
+    return NO_ERROR;
+}
+
+static void bio_wait_callback(bio_request_t *req)
+{
+    event_signal((event_t *)req->cookie, false);
+}
+
+ssize_t bio_submit_wait(bdev_t *dev, bio_request_t *req)
+{
+    event_t done;
+    event_init(&done, false, 0);
+
+    req->callback = bio_wait_callback;
+    req->cookie = &done;
+
+    ssize_t err = bio_submit(dev, req);
+    if (err == NO_ERROR) {
+        event_wait(&done);
+        err = req->result;
+    }
+
+    event_destroy(&done);
+
+    return err;
+}
+
+void bio_complete(bio_request_t *req, ssize_t result)
+{
+    LTRACEF("req %p, result %ld\n", req, (long)result);
+
+    req->result = result;
+    req->callback(req);
+}
+
 void bio_initialize_bdev(bdev_t *dev,
                          const char *name,
                          size_t block_size,
@@ -538,6 +798,9 @@ void bio_initialize_bdev(bdev_t *dev,
     dev->write_block = bio_default_write_block;
     dev->erase = bio_default_erase;
     dev->close = NULL;
+    dev->submit = NULL;
+    dev->queue = NULL;
+    dev->sched = NULL;
 }
 
 void bio_register_device(bdev_t *dev)
@@ -30,6 +30,7 @@
 #include <lib/bio.h>
 #include <lib/partition.h>
 #include <platform.h>
+#include <kernel/event.h>
 #include <kernel/thread.h>
 
 #if WITH_LIB_CKSUM
@@ -45,6 +46,7 @@
 #if LK_DEBUGLEVEL > 0
 static int cmd_bio(int argc, const cmd_args *argv);
 static int bio_test_device(bdev_t *device);
+static int bio_bench_device(bdev_t *device, uint depth, uint count);
 
 STATIC_COMMAND_START
 STATIC_COMMAND("bio", "block io debug commands", &cmd_bio)
@@ -66,6 +68,10 @@ usage:
         printf("%s ioctl <device> <request> <arg>\n", argv[0].str);
         printf("%s remove <device>\n", argv[0].str);
         printf("%s test <device>\n", argv[0].str);
+        printf("%s bench <device> <queue depth> [count]\n", argv[0].str);
+        printf("%s sched <device> [on|sort|off]\n", argv[0].str);
+        printf("%s ramdisk <name> <size>\n", argv[0].str);
+        printf("%s snapshot <device> <name>\n", argv[0].str);
 #if WITH_LIB_PARTITION
         printf("%s partscan <device> [offset]\n", argv[0].str);
 #endif
@@ -223,6 +229,58 @@ usage:
         bio_close(dev);
 
         rc = err;
+    } else if (!strcmp(argv[1].str, "bench")) {
+        if (argc < 4) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        rc = bio_bench_device(dev, argv[3].u, (argc > 4) ? argv[4].u : 4096);
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "sched")) {
+        if (argc < 3) goto notenoughargs;
+
+        bdev_t *dev = bio_open(argv[2].str);
+        if (!dev) {
+            printf("error opening block device\n");
+            return -1;
+        }
+
+        if (argc < 4) {
+            struct bio_sched_stats stats;
+            rc = bio_sched_get_stats(dev, &stats);
+            if (rc < 0) {
+                printf("no scheduler on %s\n", dev->name);
+            } else {
+                printf("%llu requests, %llu merged, %llu transfers (%llu bounced), %llu bytes\n",
+                       stats.requests, stats.merged, stats.dispatched, stats.bounced, stats.bytes);
+                if (stats.dispatched > 0) {
+                    uint64_t ratio = stats.requests * 100 / stats.dispatched;
+                    printf("%llu.%02llu requests per transfer, %llu bytes per transfer\n",
+                           ratio / 100, ratio % 100, stats.bytes / stats.dispatched);
+                }
+            }
+        } else if (!strcmp(argv[3].str, "off")) {
+            bio_sched_disable(dev);
+        } else {
+            struct bio_sched_config config = { .flags = BIO_SCHED_SORT };
+            rc = bio_sched_enable(dev, !strcmp(argv[3].str, "sort") ? &config : NULL);
+            if (rc < 0)
+                printf("error %d enabling scheduler\n", rc);
+        }
+
+        bio_close(dev);
+    } else if (!strcmp(argv[1].str, "ramdisk")) {
+        if (argc < 4) goto notenoughargs;
+
+        rc = create_sparse_membdev(argv[2].str, argv[3].u);
+    } else if (!strcmp(argv[1].str, "snapshot")) {
+        if (argc < 4) goto notenoughargs;
+
+        rc = snapshot_sparse_membdev(argv[2].str, argv[3].str);
 #if WITH_LIB_PARTITION
     } else if (!strcmp(argv[1].str, "partscan")) {
         if (argc < 3) goto notenoughargs;
@@ -562,3 +620,116 @@ static int bio_test_device(bdev_t *device)
 
     return 0;
 }
+
+#define BENCH_IO_SIZE 4096
+
+struct bench_slot {
+    bio_request_t req;
+    volatile bool busy;
+};
+
+struct bench_state {
+    event_t event;
+    volatile int errors;
+};
+
+static void bench_callback(bio_request_t *req)
+{
+    struct bench_slot *slot = containerof(req, struct bench_slot, req);
+    struct bench_state *state = (struct bench_state *)req->cookie;
+
+    if (req->result < 0)
+        atomic_add(&state->errors, 1);
+    slot->busy = false;
+    event_signal(&state->event, false);
+}
+
+/* random reads of BENCH_IO_SIZE, keeping up to depth of them in flight */
+static int bio_bench_device(bdev_t *device, uint depth, uint count)
+{
+    if (depth == 0 || device->block_size > BENCH_IO_SIZE)
+        return ERR_INVALID_ARGS;
+
+    bnum_t blocks = BENCH_IO_SIZE / device->block_size;
+    bnum_t chunks = device->block_count / blocks;
+    if (chunks == 0)
+        return ERR_INVALID_ARGS;
+
+    struct bench_slot *slots = calloc(depth, sizeof(struct bench_slot));
+    uint8_t *buf = memalign(DMA_ALIGNMENT, depth * BENCH_IO_SIZE);
+    if (!slots || !buf) {
+        free(slots);
+        free(buf);
+        return ERR_NO_MEMORY;
+    }
+
+    struct bench_state state;
+    event_init(&state.event, false, EVENT_FLAG_AUTOUNSIGNAL);
+    state.errors = 0;
+
+    int err = NO_ERROR;
+    uint issued = 0;
+    uint done = 0;
+    lk_bigtime_t start = current_time_hires();
+
+    while (done < count) {
+        uint inflight = 0;
+        bio_plug(device);
+        for (uint i = 0; i < depth; i++) {
+            if (slots[i].busy) {
+                inflight++;
+                continue;
+            }
+            if (issued == count)
+                continue;
+
+            off_t offset = (off_t)(rand() % chunks) * BENCH_IO_SIZE;
+            bio_request_init(&slots[i].req, BIO_OP_READ, buf + i * BENCH_IO_SIZE,
+                             offset, BENCH_IO_SIZE, bench_callback, &state);
+            slots[i].busy = true;
+            err = bio_submit(device, &slots[i].req);
+            if (err < 0) {
+                slots[i].busy = false;
+                break;
+            }
+            issued++;
+            inflight++;
+        }
+        bio_unplug(device);
+        if (err < 0 || inflight == 0)
+            break;
+
+        event_wait(&state.event);
+
+        done = issued;
+        for (uint i = 0; i < depth; i++) {
+            if (slots[i].busy)
+                done--;
+        }
+    }
+
+    /* let anything still in flight finish before tearing down */
+    for (uint i = 0; i < depth; i++) {
+        while (slots[i].busy)
+            event_wait(&state.event);
+    }
+
+    lk_bigtime_t elapsed = current_time_hires() - start;
+
+    if (err < 0) {
+        printf("error %d submitting request\n", err);
+    } else {
+        printf("%u reads of %u bytes at queue depth %u in %llu usecs, %d errors\n",
+               done, BENCH_IO_SIZE, depth, elapsed, state.errors);
+        if (elapsed > 0) {
+            printf("%llu iops, %llu KB/sec\n", (uint64_t)done * 1000000 / elapsed,
+                   (uint64_t)done * BENCH_IO_SIZE * 1000000 / elapsed / 1024);
+        }
+    }
+
+    event_destroy(&state.event);
+    free(buf);
+    free(slots);
+
+    return err;
+}
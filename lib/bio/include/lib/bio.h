@@ -31,6 +31,7 @@ __BEGIN_CDECLS;
 #define BIO_FLAGS_NONE                (0 << 0)
 #define BIO_FLAG_CACHE_ALIGNED_READS  (1 << 0)
 #define BIO_FLAG_CACHE_ALIGNED_WRITES (1 << 1)
+#define BIO_FLAG_ROTATIONAL           (1 << 2)  /* seeks are expensive */
 
 typedef uint32_t bnum_t;
 
@@ -41,6 +42,50 @@ typedef struct bio_erase_geometry_info {
     size_t erase_shift;
 } bio_erase_geometry_info_t;
 
+struct bdev;
+struct bio_queue;
+struct bio_sched;
+
+/* asynchronous requests */
+enum bio_op {
+    BIO_OP_READ,
+    BIO_OP_WRITE,
+    BIO_OP_ERASE,
+    BIO_OP_FLUSH,   /* complete once everything submitted before it is durable */
+};
+
+typedef struct bio_request {
+    struct list_node node;  /* for use by whoever holds the request */
+    struct bdev *dev;
+
+    enum bio_op op;
+    void *buf;
+    off_t offset;
+    size_t len;
+
+    /* bytes transferred or a negative error, valid in the callback */
+    ssize_t result;
+
+    /* called once the request finishes, possibly from interrupt context */
+    void (*callback)(struct bio_request *req);
+    void *cookie;
+} bio_request_t;
+
+static inline void bio_request_init(bio_request_t *req, enum bio_op op, void *buf,
+                                    off_t offset, size_t len,
+                                    void (*callback)(bio_request_t *), void *cookie)
+{
+    list_clear_node(&req->node);
+    req->dev = NULL;
+    req->op = op;
+    req->buf = buf;
+    req->offset = offset;
+    req->len = len;
+    req->result = 0;
+    req->callback = callback;
+    req->cookie = cookie;
+}
+
 typedef struct bdev {
     struct list_node node;
     volatile int ref;
@@ -68,6 +113,17 @@ typedef struct bdev {
     ssize_t (*erase)(struct bdev *, off_t offset, size_t len);
     int (*ioctl)(struct bdev *, int request, void *argp);
     void (*close)(struct bdev *);
+
+    /* Optional native asynchronous interface. The driver queues the request
+     * and calls bio_complete() when it is done. Drivers that only implement
+     * this get the synchronous block hooks for free. */
+    status_t (*submit)(struct bdev *, bio_request_t *req);
+
+    /* worker queue for asynchronous requests to drivers without submit */
+    struct bio_queue *queue;
+
+    /* optional request scheduler in front of the above */
+    struct bio_sched *sched;
 } bdev_t;
 
 /* user api */
@@ -79,6 +135,54 @@ ssize_t bio_write(bdev_t *dev, const void *buf, off_t offset, size_t len);
 ssize_t bio_write_block(bdev_t *dev, const void *buf, bnum_t block, uint count);
 ssize_t bio_erase(bdev_t *dev, off_t offset, size_t len);
 int bio_ioctl(bdev_t *dev, int request, void *argp);
+status_t bio_flush(bdev_t *dev);
+
+/* Queue a request. Ranges are trimmed to the device like the synchronous
+ * calls, and reads and writes must be block aligned. On success the callback
+ * runs exactly once, maybe before bio_submit() returns. On failure it is
+ * never called. The device must stay open until the request completes. */
+status_t bio_submit(bdev_t *dev, bio_request_t *req);
+
+/* submit and block until done, replacing the request's callback. Returns
+ * the request's result. */
+ssize_t bio_submit_wait(bdev_t *dev, bio_request_t *req);
+
+/* used by drivers to finish a request passed to their submit hook */
+void bio_complete(bio_request_t *req, ssize_t result);
+
+/* Optional request scheduler. Once enabled, reads and writes submitted to the
+ * device are held while it is plugged, for up to the window, or while the
+ * driver already has max_inflight transfers, and adjacent ones are merged into
+ * a single transfer in the meantime. Flushes and erases release everything
+ * held before them. */
+#define BIO_SCHED_SORT (1 << 0)  /* dispatch in block order rather than fifo */
+
+struct bio_sched_config {
+    uint32_t flags;
+    uint max_inflight;  /* transfers the driver is given before holding */
+    size_t max_merge;   /* largest transfer built by merging */
+    lk_time_t window;   /* how long to hold a request for neighbours, 0 for none */
+};
+
+struct bio_sched_stats {
+    uint64_t requests;    /* reads and writes submitted */
+    uint64_t merged;      /* requests that joined another transfer */
+    uint64_t dispatched;  /* transfers handed to the driver */
+    uint64_t bounced;     /* merged transfers that went through a bounce buffer */
+    uint64_t bytes;       /* bytes dispatched */
+};
+
+/* Enable with the given config, or defaults for the device if NULL. Zero
+ * max_inflight or max_merge also pick the defaults. Neither call may race
+ * with requests to the device. */
+status_t bio_sched_enable(bdev_t *dev, const struct bio_sched_config *config);
+void bio_sched_disable(bdev_t *dev);
+status_t bio_sched_get_stats(bdev_t *dev, struct bio_sched_stats *stats);
+
+/* hold requests to the device until the matching unplug, plugs nest. Don't
+ * wait on requests queued while plugged before unplugging. */
+void bio_plug(bdev_t *dev);
+void bio_unplug(bdev_t *dev);
 
 /* register a block device */
 void bio_register_device(bdev_t *dev);
@@ -105,6 +209,12 @@ status_t bio_publish_subdevice(const char *parent_dev,
 /* memory based block device */
 int create_membdev(const char *name, void *ptr, size_t len);
 
+/* sparse memory block device, pages are only allocated once written */
+status_t create_sparse_membdev(const char *name, off_t size);
+
+/* copy-on-write snapshot of a sparse memory block device */
+status_t snapshot_sparse_membdev(const char *src_name, const char *name);
+
 /* helper routine to trim an offset + len to the device */
 size_t bio_trim_range(const bdev_t *dev, off_t offset, size_t len);
 
@@ -0,0 +1,594 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list.h>
+#include <lib/bio.h>
+#include <kernel/event.h>
+#include <kernel/spinlock.h>
+#include <kernel/thread.h>
+#include <kernel/timer.h>
+
+#include "bio_priv.h"
+
+#define LOCAL_TRACE 0
+
+#define BIO_SCHED_DEFAULT_DEPTH (32)
+#define BIO_SCHED_DEFAULT_MERGE (128 * 1024)
+#define BIO_SCHED_IO_CACHE      (32)
+
+/* One transfer as the driver sees it, built from one or more of the callers'
+ * requests covering adjacent blocks. Flushes and erases get one each too and
+ * act as barriers: nothing queued after them merges with or passes anything
+ * queued before them. */
+struct bio_sched_io {
+    bio_request_t req;
+    struct list_node children;  /* the callers' requests, in block order */
+    void *bounce;               /* if the callers' buffers don't line up */
+};
+
+struct bio_sched {
+    bdev_t *dev;
+    struct bio_sched_config config;
+
+    spin_lock_t lock;
+    struct list_node queue;     /* held transfers, by block within a barrier if sorting */
+    uint barriers;              /* flushes and erases on the queue */
+    uint inflight;              /* transfers the driver has */
+    uint plugged;
+    bool window_open;
+    bool timer_armed;
+    bool dispatching;           /* one thread at a time hands transfers down, in order */
+    off_t head;                 /* end of the last transfer, for the elevator */
+
+    struct list_node done;      /* finished transfers for the thread to recycle */
+    struct list_node cache;
+    uint cache_count;
+
+    struct bio_sched_stats stats;
+
+    /* dispatches what completions and the window timer release */
+    timer_t timer;
+    event_t event;
+    thread_t *thread;
+    bool shutdown;
+    bool detached;              /* the thread frees the scheduler as it exits */
+};
+
+static inline bool bio_sched_is_barrier(const struct bio_sched_io *io)
+{
+    return io->req.op != BIO_OP_READ && io->req.op != BIO_OP_WRITE;
+}
+
+static struct bio_sched_io *bio_sched_get_io(struct bio_sched *s)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    struct bio_sched_io *io = list_remove_head_type(&s->cache, struct bio_sched_io, req.node);
+    if (io)
+        s->cache_count--;
+    spin_unlock_irqrestore(&s->lock, state);
+
+    if (!io) {
+        io = malloc(sizeof(struct bio_sched_io));
+        if (!io)
+            return NULL;
+        io->bounce = NULL;
+    }
+
+    list_initialize(&io->children);
+    return io;
+}
+
+/* thread context only, completions hand their transfers to the thread */
+static void bio_sched_put_io(struct bio_sched *s, struct bio_sched_io *io)
+{
+    free(io->bounce);
+    io->bounce = NULL;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    if (s->cache_count < BIO_SCHED_IO_CACHE) {
+        list_add_head(&s->cache, &io->req.node);
+        s->cache_count++;
+        io = NULL;
+    }
+    spin_unlock_irqrestore(&s->lock, state);
+
+    free(io);
+}
+
+static void bio_sched_reap(struct bio_sched *s)
+{
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&s->lock, state);
+        struct bio_sched_io *io = list_remove_head_type(&s->done, struct bio_sched_io, req.node);
+        spin_unlock_irqrestore(&s->lock, state);
+
+        if (!io)
+            break;
+        bio_sched_put_io(s, io);
+    }
+}
+
+/* a queued transfer that the range could be added to, at either end */
+static struct bio_sched_io *bio_sched_find(struct bio_sched *s, struct bio_sched_io *skip,
+                                           enum bio_op op, off_t offset, size_t len)
+{
+    struct bio_sched_io *io = list_peek_tail_type(&s->queue, struct bio_sched_io, req.node);
+
+    /* only what was queued since the last barrier */
+    for (; io && !bio_sched_is_barrier(io);
+            io = list_prev_type(&s->queue, &io->req.node, struct bio_sched_io, req.node)) {
+        if (io == skip || io->req.op != op)
+            continue;
+        if (io->req.len + len > s->config.max_merge)
+            continue;
+        if (io->req.offset + (off_t)io->req.len == offset || offset + (off_t)len == io->req.offset)
+            return io;
+    }
+
+    return NULL;
+}
+
+/* move the requests of an adjacent transfer into another */
+static void bio_sched_merge(struct bio_sched_io *into, struct bio_sched_io *from)
+{
+    bio_request_t *child;
+
+    if (from->req.offset > into->req.offset) {
+        while ((child = list_remove_head_type(&from->children, bio_request_t, node)))
+            list_add_tail(&into->children, &child->node);
+    } else {
+        while ((child = list_remove_tail_type(&from->children, bio_request_t, node)))
+            list_add_head(&into->children, &child->node);
+        into->req.offset = from->req.offset;
+    }
+    into->req.len += from->req.len;
+}
+
+static void bio_sched_insert(struct bio_sched *s, struct bio_sched_io *io)
+{
+    if (bio_sched_is_barrier(io)) {
+        list_add_tail(&s->queue, &io->req.node);
+        s->barriers++;
+        return;
+    }
+
+    if (!(s->config.flags & BIO_SCHED_SORT)) {
+        list_add_tail(&s->queue, &io->req.node);
+        return;
+    }
+
+    /* after the last barrier and anything below it */
+    struct bio_sched_io *pos = list_peek_tail_type(&s->queue, struct bio_sched_io, req.node);
+    while (pos && !bio_sched_is_barrier(pos) && pos->req.offset > io->req.offset)
+        pos = list_prev_type(&s->queue, &pos->req.node, struct bio_sched_io, req.node);
+
+    list_add_after(pos ? &pos->req.node : &s->queue, &io->req.node);
+}
+
+/* the next transfer to hand down, or NULL to hold on to the rest */
+static struct bio_sched_io *bio_sched_next(struct bio_sched *s)
+{
+    struct bio_sched_io *io = list_peek_head_type(&s->queue, struct bio_sched_io, req.node);
+    if (!io)
+        return NULL;
+
+    /* a barrier releases everything in front of it regardless */
+    if (!s->barriers) {
+        if (s->plugged || s->window_open)
+            return NULL;
+        if (s->inflight >= s->config.max_inflight)
+            return NULL;
+    }
+
+    if ((s->config.flags & BIO_SCHED_SORT) && !bio_sched_is_barrier(io)) {
+        /* one way elevator: the first transfer at or past the head, else wrap around */
+        struct bio_sched_io *e = io;
+        for (; e && !bio_sched_is_barrier(e);
+                e = list_next_type(&s->queue, &e->req.node, struct bio_sched_io, req.node)) {
+            if (e->req.offset >= s->head) {
+                io = e;
+                break;
+            }
+        }
+    }
+
+    list_delete(&io->req.node);
+    if (bio_sched_is_barrier(io)) {
+        s->barriers--;
+    } else {
+        s->head = io->req.offset + io->req.len;
+        s->stats.dispatched++;
+        s->stats.bytes += io->req.len;
+    }
+    if (list_is_empty(&s->queue))
+        s->window_open = false;
+    s->inflight++;
+
+    return io;
+}
+
+static void bio_sched_done(bio_request_t *req)
+{
+    struct bio_sched_io *io = containerof(req, struct bio_sched_io, req);
+    struct bio_sched *s = (struct bio_sched *)req->cookie;
+
+    LTRACEF("io %p, offset %lld, len %zu, result %ld\n", io, req->offset, req->len, (long)req->result);
+
+    /* hand each request its share of the transfer */
+    ssize_t left = req->result;
+    uint8_t *bounce = io->bounce;
+    bio_request_t *child;
+    while ((child = list_remove_head_type(&io->children, bio_request_t, node))) {
+        ssize_t result = left;
+        if (left >= 0 && !bio_sched_is_barrier(io)) {
+            result = MIN((size_t)left, child->len);
+            left -= result;
+            if (bounce) {
+                if (req->op == BIO_OP_READ)
+                    memcpy(child->buf, bounce, result);
+                bounce += child->len;
+            }
+        }
+        bio_complete(child, result);
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    s->inflight--;
+    list_add_tail(&s->done, &io->req.node);
+    spin_unlock_irqrestore(&s->lock, state);
+
+    event_signal(&s->event, false);
+}
+
+static void bio_sched_dispatch(struct bio_sched *s, struct bio_sched_io *io)
+{
+    bio_request_t *first = list_peek_head_type(&io->children, bio_request_t, node);
+    bio_request_t *child;
+
+    LTRACEF("io %p, op %d, offset %lld, len %zu\n", io, io->req.op, io->req.offset, io->req.len);
+
+    io->req.buf = first->buf;
+
+    /* go straight to the callers' buffers if they line up, else bounce */
+    bool adjacent = true;
+    uint8_t *next = first->buf;
+    list_for_every_entry(&io->children, child, bio_request_t, node) {
+        if (child->buf != next) {
+            adjacent = false;
+            break;
+        }
+        next += child->len;
+    }
+
+    if (!adjacent) {
+        io->bounce = memalign(CACHE_LINE, io->req.len);
+        if (!io->bounce) {
+            /* out of memory, send the requests down one by one instead */
+            while ((child = list_remove_head_type(&io->children, bio_request_t, node))) {
+                status_t err = bio_dispatch(s->dev, child);
+                if (err < 0)
+                    bio_complete(child, err);
+            }
+
+            spin_lock_saved_state_t state;
+            spin_lock_irqsave(&s->lock, state);
+            s->inflight--;
+            spin_unlock_irqrestore(&s->lock, state);
+
+            bio_sched_put_io(s, io);
+            return;
+        }
+
+        if (io->req.op == BIO_OP_WRITE) {
+            uint8_t *buf = io->bounce;
+            list_for_every_entry(&io->children, child, bio_request_t, node) {
+                memcpy(buf, child->buf, child->len);
+                buf += child->len;
+            }
+        }
+        io->req.buf = io->bounce;
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&s->lock, state);
+        s->stats.bounced++;
+        spin_unlock_irqrestore(&s->lock, state);
+    }
+
+    status_t err = bio_dispatch(s->dev, &io->req);
+    if (err < 0)
+        bio_complete(&io->req, err);
+}
+
+static void bio_sched_run(struct bio_sched *s)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+
+    /* whoever is already dispatching sees the new state before stopping */
+    if (!s->dispatching) {
+        s->dispatching = true;
+
+        struct bio_sched_io *io;
+        while ((io = bio_sched_next(s))) {
+            spin_unlock_irqrestore(&s->lock, state);
+            bio_sched_dispatch(s, io);
+            spin_lock_irqsave(&s->lock, state);
+        }
+
+        s->dispatching = false;
+    }
+
+    spin_unlock_irqrestore(&s->lock, state);
+}
+
+static enum handler_return bio_sched_timer(timer_t *timer, lk_time_t now, void *arg)
+{
+    struct bio_sched *s = (struct bio_sched *)arg;
+
+    spin_lock(&s->lock);
+    s->timer_armed = false;
+    s->window_open = false;
+    spin_unlock(&s->lock);
+
+    event_signal(&s->event, false);
+
+    return INT_RESCHEDULE;
+}
+
+static void bio_sched_free(struct bio_sched *s)
+{
+    DEBUG_ASSERT(list_is_empty(&s->queue) && list_is_empty(&s->done));
+
+    struct bio_sched_io *io;
+    while ((io = list_remove_head_type(&s->cache, struct bio_sched_io, req.node)))
+        free(io);
+
+    event_destroy(&s->event);
+    free(s);
+}
+
+static int bio_sched_thread(void *arg)
+{
+    struct bio_sched *s = (struct bio_sched *)arg;
+
+    for (;;) {
+        event_wait(&s->event);
+
+        bio_sched_reap(s);
+        bio_sched_run(s);
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&s->lock, state);
+        bool stop = s->shutdown && list_is_empty(&s->queue) && s->inflight == 0;
+        bool detached = s->detached;
+        spin_unlock_irqrestore(&s->lock, state);
+
+        if (stop) {
+            bio_sched_reap(s);
+            if (detached)
+                bio_sched_free(s);
+            return 0;
+        }
+    }
+}
+
+status_t bio_sched_submit(bdev_t *dev, bio_request_t *req)
+{
+    struct bio_sched *s = dev->sched;
+
+    struct bio_sched_io *io = bio_sched_get_io(s);
+    if (!io)
+        return ERR_NO_MEMORY;
+
+    bio_request_init(&io->req, req->op, NULL, req->offset, req->len, bio_sched_done, s);
+    io->req.dev = dev;
+    list_add_tail(&io->children, &req->node);
+
+    struct bio_sched_io *merged = NULL;
+    struct bio_sched_io *joined = NULL;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+
+    struct bio_sched_io *into = NULL;
+    if (!bio_sched_is_barrier(io)) {
+        s->stats.requests++;
+        into = bio_sched_find(s, NULL, io->req.op, io->req.offset, io->req.len);
+    }
+
+    if (into) {
+        bio_sched_merge(into, io);
+        s->stats.merged++;
+        merged = io;
+
+        /* it may have closed the gap to another transfer */
+        joined = bio_sched_find(s, into, into->req.op, into->req.offset, into->req.len);
+        if (joined) {
+            list_delete(&joined->req.node);
+            bio_sched_merge(into, joined);
+            s->stats.merged++;
+        }
+    } else {
+        if (list_is_empty(&s->queue) && s->config.window && !bio_sched_is_barrier(io)) {
+            s->window_open = true;
+            if (!s->timer_armed) {
+                s->timer_armed = true;
+                timer_set_oneshot(&s->timer, s->config.window, bio_sched_timer, s);
+            }
+        }
+        bio_sched_insert(s, io);
+    }
+
+    spin_unlock_irqrestore(&s->lock, state);
+
+    if (merged)
+        bio_sched_put_io(s, merged);
+    if (joined)
+        bio_sched_put_io(s, joined);
+
+    bio_sched_run(s);
+
+    return NO_ERROR;
+}
+
+status_t bio_sched_enable(bdev_t *dev, const struct bio_sched_config *config)
+{
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    if (dev->sched)
+        return ERR_ALREADY_STARTED;
+
+    struct bio_sched *s = calloc(1, sizeof(struct bio_sched));
+    if (!s)
+        return ERR_NO_MEMORY;
+
+    s->dev = dev;
+    if (config)
+        s->config = *config;
+    else if (dev->flags & BIO_FLAG_ROTATIONAL)
+        s->config.flags = BIO_SCHED_SORT;
+
+    /* drivers without submit run one request at a time on the worker anyway */
+    if (s->config.max_inflight == 0)
+        s->config.max_inflight = dev->submit ? BIO_SCHED_DEFAULT_DEPTH : 1;
+    if (s->config.max_merge == 0)
+        s->config.max_merge = BIO_SCHED_DEFAULT_MERGE;
+    s->config.max_merge = MAX(ROUNDDOWN(s->config.max_merge, dev->block_size), dev->block_size);
+
+    spin_lock_init(&s->lock);
+    list_initialize(&s->queue);
+    list_initialize(&s->done);
+    list_initialize(&s->cache);
+    timer_initialize(&s->timer);
+    event_init(&s->event, false, EVENT_FLAG_AUTOUNSIGNAL);
+
+    s->thread = thread_create("bio sched", &bio_sched_thread, s,
+                              DEFAULT_PRIORITY, DEFAULT_STACK_SIZE);
+    if (!s->thread) {
+        event_destroy(&s->event);
+        free(s);
+        return ERR_NO_MEMORY;
+    }
+    thread_resume(s->thread);
+
+    LTRACEF("dev '%s', flags 0x%x, max inflight %u, max merge %zu, window %u\n", dev->name,
+            s->config.flags, s->config.max_inflight, s->config.max_merge, s->config.window);
+
+    dev->sched = s;
+
+    return NO_ERROR;
+}
+
+/* releases and waits out everything held, the device must be idle otherwise */
+void bio_sched_destroy(struct bio_sched *s)
+{
+    /* a completion callback on our own thread can't wait for it, so leave
+     * the thread to finish up and free everything itself */
+    bool self = (get_current_thread() == s->thread);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    s->shutdown = true;
+    s->detached = self;
+    s->plugged = 0;
+    s->window_open = false;
+    spin_unlock_irqrestore(&s->lock, state);
+
+    timer_cancel(&s->timer);
+
+    if (self) {
+        thread_detach(s->thread);
+        return;
+    }
+
+    event_signal(&s->event, true);
+    thread_join(s->thread, NULL, INFINITE_TIME);
+
+    bio_sched_free(s);
+}
+
+void bio_sched_disable(bdev_t *dev)
+{
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    struct bio_sched *s = dev->sched;
+    if (!s)
+        return;
+
+    dev->sched = NULL;
+    bio_sched_destroy(s);
+}
+
+status_t bio_sched_get_stats(bdev_t *dev, struct bio_sched_stats *stats)
+{
+    DEBUG_ASSERT(dev && dev->ref > 0);
+
+    struct bio_sched *s = dev->sched;
+    if (!s)
+        return ERR_NOT_FOUND;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    *stats = s->stats;
+    spin_unlock_irqrestore(&s->lock, state);
+
+    return NO_ERROR;
+}
+
+void bio_plug(bdev_t *dev)
+{
+    struct bio_sched *s = dev->sched;
+    if (!s)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    s->plugged++;
+    spin_unlock_irqrestore(&s->lock, state);
+}
+
+void bio_unplug(bdev_t *dev)
+{
+    struct bio_sched *s = dev->sched;
+    if (!s)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&s->lock, state);
+    DEBUG_ASSERT(s->plugged > 0);
+    bool release = (--s->plugged == 0);
+    if (release)
+        s->window_open = false;
+    spin_unlock_irqrestore(&s->lock, state);
+
+    if (release)
+        bio_sched_run(s);
+}
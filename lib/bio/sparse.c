@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <debug.h>
+#include <err.h>
+#include <trace.h>
+#include <string.h>
+#include <stdlib.h>
+#include <arch/ops.h>
+#include <kernel/mutex.h>
+#include <lib/bio.h>
+#include <lib/page_alloc.h>
+
+#define LOCAL_TRACE 0
+
+/*
+ * Sparse ram disk. Backing pages are allocated on the first write that lands
+ * in them, holes read back as zeros. Pages are reference counted so a
+ * snapshot only copies the page table; whichever device writes a shared page
+ * first gets its own copy of it.
+ */
+
+#define BLOCKSIZE 512
+
+typedef struct sparse_page {
+    volatile int ref;
+    void *data;
+} sparse_page_t;
+
+/* the page table is two levels, leaves are allocated as they are needed */
+#define LEAF_ENTRIES (PAGE_SIZE / sizeof(sparse_page_t *))
+
+typedef struct sparse_bdev {
+    bdev_t dev; // base device
+
+    mutex_t lock;
+    size_t page_count;
+    size_t leaf_count;
+    sparse_page_t ***leaves;
+} sparse_bdev_t;
+
+static sparse_page_t *sparse_page_alloc(const void *copy)
+{
+    sparse_page_t *page = malloc(sizeof(sparse_page_t));
+    if (!page)
+        return NULL;
+
+    page->data = page_alloc(1, PAGE_ALLOC_ANY_ARENA);
+    if (!page->data) {
+        free(page);
+        return NULL;
+    }
+
+    if (copy)
+        memcpy(page->data, copy, PAGE_SIZE);
+    else
+        memset(page->data, 0, PAGE_SIZE);
+    page->ref = 1;
+
+    return page;
+}
+
+static void sparse_page_put(sparse_page_t *page)
+{
+    if (atomic_add(&page->ref, -1) == 1) {
+        page_free(page->data, 1);
+        free(page);
+    }
+}
+
+static sparse_page_t **sparse_slot(sparse_bdev_t *sparse, size_t pn, bool create)
+{
+    sparse_page_t **leaf = sparse->leaves[pn / LEAF_ENTRIES];
+
+    if (!leaf) {
+        if (!create)
+            return NULL;
+        leaf = calloc(LEAF_ENTRIES, sizeof(sparse_page_t *));
+        if (!leaf)
+            return NULL;
+        sparse->leaves[pn / LEAF_ENTRIES] = leaf;
+    }
+
+    return &leaf[pn % LEAF_ENTRIES];
+}
+
+static sparse_page_t *sparse_lookup(sparse_bdev_t *sparse, size_t pn)
+{
+    sparse_page_t **slot = sparse_slot(sparse, pn, false);
+
+    return slot ? *slot : NULL;
+}
+
+/* return the page at pn for writing, allocating it or breaking the share */
+static void *sparse_page_writable(sparse_bdev_t *sparse, size_t pn)
+{
+    sparse_page_t **slot = sparse_slot(sparse, pn, true);
+    if (!slot)
+        return NULL;
+
+    sparse_page_t *page = *slot;
+    if (!page) {
+        page = sparse_page_alloc(NULL);
+    } else if (page->ref > 1) {
+        /* another device still sees the old contents */
+        LTRACEF("copying shared page %zu\n", pn);
+        sparse_page_t *copy = sparse_page_alloc(page->data);
+        if (copy)
+            sparse_page_put(page);
+        page = copy;
+    }
+    if (!page)
+        return NULL;
+
+    *slot = page;
+    return page->data;
+}
+
+static bool is_zero(const uint8_t *buf, size_t len)
+{
+    while (len-- > 0) {
+        if (*buf++)
+            return false;
+    }
+    return true;
+}
+
+static ssize_t sparse_bdev_read(bdev_t *bdev, void *_buf, off_t offset, size_t len)
+{
+    sparse_bdev_t *sparse = (sparse_bdev_t *)bdev;
+    uint8_t *buf = _buf;
+
+    LTRACEF("bdev %s, buf %p, offset %lld, len %zu\n", bdev->name, buf, offset, len);
+
+    mutex_acquire(&sparse->lock);
+
+    size_t pos = 0;
+    while (pos < len) {
+        off_t o = offset + pos;
+        size_t page_offset = o % PAGE_SIZE;
+        size_t chunk = MIN(len - pos, PAGE_SIZE - page_offset);
+
+        sparse_page_t *page = sparse_lookup(sparse, o / PAGE_SIZE);
+        if (page)
+            memcpy(buf + pos, (uint8_t *)page->data + page_offset, chunk);
+        else
+            memset(buf + pos, 0, chunk);
+
+        pos += chunk;
+    }
+
+    mutex_release(&sparse->lock);
+
+    return len;
+}
+
+static ssize_t sparse_bdev_read_block(struct bdev *bdev, void *buf, bnum_t block, uint count)
+{
+    LTRACEF("bdev %s, buf %p, block %u, count %u\n", bdev->name, buf, block, count);
+
+    return sparse_bdev_read(bdev, buf, (off_t)block * BLOCKSIZE, count * BLOCKSIZE);
+}
+
+static ssize_t sparse_bdev_write(bdev_t *bdev, const void *_buf, off_t offset, size_t len)
+{
+    sparse_bdev_t *sparse = (sparse_bdev_t *)bdev;
+    const uint8_t *buf = _buf;
+    ssize_t err = len;
+
+    LTRACEF("bdev %s, buf %p, offset %lld, len %zu\n", bdev->name, buf, offset, len);
+
+    mutex_acquire(&sparse->lock);
+
+    size_t pos = 0;
+    while (pos < len) {
+        off_t o = offset + pos;
+        size_t pn = o / PAGE_SIZE;
+        size_t page_offset = o % PAGE_SIZE;
+        size_t chunk = MIN(len - pos, PAGE_SIZE - page_offset);
+
+        /* zeros written over a hole don't need a page */
+        if (!sparse_lookup(sparse, pn) && is_zero(buf + pos, chunk)) {
+            pos += chunk;
+            continue;
+        }
+
+        uint8_t *data = sparse_page_writable(sparse, pn);
+        if (!data) {
+            err = pos ? (ssize_t)pos : ERR_NO_MEMORY;
+            break;
+        }
+        memcpy(data + page_offset, buf + pos, chunk);
+
+        pos += chunk;
+    }
+
+    mutex_release(&sparse->lock);
+
+    return err;
+}
+
+static ssize_t sparse_bdev_write_block(struct bdev *bdev, const void *buf, bnum_t block, uint count)
+{
+    LTRACEF("bdev %s, buf %p, block %u, count %u\n", bdev->name, buf, block, count);
+
+    return sparse_bdev_write(bdev, buf, (off_t)block * BLOCKSIZE, count * BLOCKSIZE);
+}
+
+/* erasing punches holes, whole pages go back to the allocator */
+static ssize_t sparse_bdev_erase(bdev_t *bdev, off_t offset, size_t len)
+{
+    sparse_bdev_t *sparse = (sparse_bdev_t *)bdev;
+    ssize_t err = len;
+
+    LTRACEF("bdev %s, offset %lld, len %zu\n", bdev->name, offset, len);
+
+    mutex_acquire(&sparse->lock);
+
+    size_t pos = 0;
+    while (pos < len) {
+        off_t o = offset + pos;
+        size_t pn = o / PAGE_SIZE;
+        size_t page_offset = o % PAGE_SIZE;
+        size_t chunk = MIN(len - pos, PAGE_SIZE - page_offset);
+
+        sparse_page_t **slot = sparse_slot(sparse, pn, false);
+        if (slot && *slot) {
+            if (chunk == PAGE_SIZE) {
+                sparse_page_put(*slot);
+                *slot = NULL;
+            } else {
+                uint8_t *data = sparse_page_writable(sparse, pn);
+                if (!data) {
+                    err = pos ? (ssize_t)pos : ERR_NO_MEMORY;
+                    break;
+                }
+                memset(data + page_offset, 0, chunk);
+            }
+        }
+
+        pos += chunk;
+    }
+
+    mutex_release(&sparse->lock);
+
+    return err;
+}
+
+static void sparse_bdev_close(bdev_t *bdev)
+{
+    sparse_bdev_t *sparse = (sparse_bdev_t *)bdev;
+
+    LTRACEF("bdev %s\n", bdev->name);
+
+    for (size_t i = 0; i < sparse->leaf_count; i++) {
+        sparse_page_t **leaf = sparse->leaves[i];
+        if (!leaf)
+            continue;
+
+        for (size_t j = 0; j < LEAF_ENTRIES; j++) {
+            if (leaf[j])
+                sparse_page_put(leaf[j]);
+        }
+        free(leaf);
+    }
+
+    free(sparse->leaves);
+    sparse->leaves = NULL;
+    mutex_destroy(&sparse->lock);
+}
+
+static sparse_bdev_t *sparse_bdev_alloc(const char *name, bnum_t block_count)
+{
+    sparse_bdev_t *sparse = calloc(1, sizeof(sparse_bdev_t));
+    if (!sparse)
+        return NULL;
+
+    sparse->page_count = ROUNDUP((off_t)block_count * BLOCKSIZE, PAGE_SIZE) / PAGE_SIZE;
+    sparse->leaf_count = ROUNDUP(sparse->page_count, LEAF_ENTRIES) / LEAF_ENTRIES;
+    sparse->leaves = calloc(sparse->leaf_count, sizeof(sparse_page_t **));
+    if (!sparse->leaves) {
+        free(sparse);
+        return NULL;
+    }
+
+    /* set up the base device */
+    bio_initialize_bdev(&sparse->dev, name, BLOCKSIZE, block_count, 0, NULL,
+                        BIO_FLAGS_NONE);
+
+    /* our bits */
+    mutex_init(&sparse->lock);
+    sparse->dev.read = sparse_bdev_read;
+    sparse->dev.read_block = sparse_bdev_read_block;
+    sparse->dev.write = sparse_bdev_write;
+    sparse->dev.write_block = sparse_bdev_write_block;
+    sparse->dev.erase = sparse_bdev_erase;
+    sparse->dev.close = sparse_bdev_close;
+
+    return sparse;
+}
+
+status_t create_sparse_membdev(const char *name, off_t size)
+{
+    LTRACEF("name %s, size %lld\n", name, size);
+
+    if (size <= 0 || size / BLOCKSIZE > (bnum_t)-1)
+        return ERR_INVALID_ARGS;
+
+    sparse_bdev_t *sparse = sparse_bdev_alloc(name, size / BLOCKSIZE);
+    if (!sparse)
+        return ERR_NO_MEMORY;
+
+    /* register it */
+    bio_register_device(&sparse->dev);
+
+    return NO_ERROR;
+}
+
+status_t snapshot_sparse_membdev(const char *src_name, const char *name)
+{
+    LTRACEF("src %s, name %s\n", src_name, name);
+
+    bdev_t *src_dev = bio_open(src_name);
+    if (!src_dev)
+        return ERR_NOT_FOUND;
+
+    status_t err = NO_ERROR;
+    sparse_bdev_t *snap = NULL;
+    if (src_dev->close != sparse_bdev_close) {
+        err = ERR_NOT_SUPPORTED;
+        goto out;
+    }
+
+    sparse_bdev_t *src = (sparse_bdev_t *)src_dev;
+    snap = sparse_bdev_alloc(name, src_dev->block_count);
+    if (!snap) {
+        err = ERR_NO_MEMORY;
+        goto out;
+    }
+
+    /* share every page, the next write to one from either side copies it */
+    mutex_acquire(&src->lock);
+    for (size_t i = 0; i < src->leaf_count; i++) {
+        if (!src->leaves[i])
+            continue;
+
+        snap->leaves[i] = malloc(PAGE_SIZE);
+        if (!snap->leaves[i]) {
+            err = ERR_NO_MEMORY;
+            break;
+        }
+        memcpy(snap->leaves[i], src->leaves[i], PAGE_SIZE);
+
+        for (size_t j = 0; j < LEAF_ENTRIES; j++) {
+            if (snap->leaves[i][j])
+                atomic_add(&snap->leaves[i][j]->ref, 1);
+        }
+    }
+    mutex_release(&src->lock);
+
+    if (err < 0) {
+        /* drops whatever was shared so far */
+        sparse_bdev_close(&snap->dev);
+        free(snap->dev.name);
+        free(snap);
+        goto out;
+    }
+
+    bio_register_device(&snap->dev);
+
+out:
+    bio_close(src_dev);
+    return err;
+}
@@ -30,6 +30,7 @@
 #include <stdlib.h>
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
+#include <lib/arena.h>
 #include <lib/console.h>
 #if WITH_LIB_ENV
 #include <lib/env.h>
@@ -604,27 +605,92 @@ static void convert_args(int argc, cmd_args *argv)
 }
 
 
-static status_t command_loop(int (*get_line)(const char **, void *), void *get_line_cookie, bool showprompt, bool locked)
+/* Tokenize and run the first command in a line. The token buffers come from
+ * a scratch arena held only while the command runs, so nested and
+ * concurrent command loops don't each pin one down. */
+static status_t command_run(const char *buffer, const char **continuebuffer,
+                            bool showprompt, bool locked, bool *exit)
 {
-    bool exit;
+    const size_t outbuflen = 1024;
+
+    arena_t *scratch = arena_scratch_get();
+    if (unlikely(scratch == NULL)) {
+        return ERR_NO_MEMORY;
+    }
+
+    cmd_args *args = arena_alloc(scratch, MAX_NUM_ARGS * sizeof(cmd_args));
+    char *outbuf = arena_alloc(scratch, outbuflen);
+    if (unlikely(args == NULL || outbuf == NULL)) {
+        arena_scratch_put(scratch);
+        return ERR_NO_MEMORY;
+    }
+
+    /* tokenize the line */
+    int argc = tokenize_command(buffer, continuebuffer, outbuf, outbuflen,
+                                args, MAX_NUM_ARGS);
+    if (argc < 0) {
+        if (showprompt)
+            printf("syntax error\n");
+        goto out;
+    } else if (argc == 0) {
+        goto out;
+    }
+
+//  dprintf("after tokenize: argc %d\n", argc);
+//  for (int i = 0; i < argc; i++)
+//      dprintf("%d: '%s'\n", i, args[i].str);
+
+    /* convert the args */
+    convert_args(argc, args);
+
+    /* try to match the command */
+    const cmd *command = match_command(args[0].str, CMD_AVAIL_NORMAL);
+    if (!command) {
+        if (showprompt)
+            printf("command not found\n");
+        goto out;
+    }
+
+    if (!locked)
+        mutex_acquire(command_lock);
+
+    abort_script = false;
+    lastresult = command->cmd_callback(argc, args);
+
 #if WITH_LIB_ENV
     bool report_result;
+    env_get_bool("reportresult", &report_result, false);
+    if (report_result) {
+        if (lastresult < 0)
+            printf("FAIL %d\n", lastresult);
+        else
+            printf("PASS %d\n", lastresult);
+    }
 #endif
-    cmd_args *args = NULL;
-    const char *buffer;
-    const char *continuebuffer;
-    char *outbuf = NULL;
 
-    args = (cmd_args *) malloc (MAX_NUM_ARGS * sizeof(cmd_args));
-    if (unlikely(args == NULL)) {
-        goto no_mem_error;
-    }
+#if WITH_LIB_ENV
+    // stuff the result in an environment var
+    env_set_int("?", lastresult, true);
+#endif
 
-    const size_t outbuflen = 1024;
-    outbuf = malloc(outbuflen);
-    if (unlikely(outbuf == NULL)) {
-        goto no_mem_error;
-    }
+    // someone must have aborted the current script
+    if (abort_script)
+        *exit = true;
+    abort_script = false;
+
+    if (!locked)
+        mutex_release(command_lock);
+
+out:
+    arena_scratch_put(scratch);
+    return NO_ERROR;
+}
+
+static status_t command_loop(int (*get_line)(const char **, void *), void *get_line_cookie, bool showprompt, bool locked)
+{
+    bool exit;
+    const char *buffer;
+    const char *continuebuffer;
 
     exit = false;
     continuebuffer = NULL;
@@ -645,74 +711,13 @@ static status_t command_loop(int (*get_line)(const char **, void *), void *get_l
 
 //      dprintf("line = '%s'\n", buffer);
 
-        /* tokenize the line */
-        int argc = tokenize_command(buffer, &continuebuffer, outbuf, outbuflen,
-                                    args, MAX_NUM_ARGS);
-        if (argc < 0) {
-            if (showprompt)
-                printf("syntax error\n");
-            continue;
-        } else if (argc == 0) {
-            continue;
-        }
-
-//      dprintf("after tokenize: argc %d\n", argc);
-//      for (int i = 0; i < argc; i++)
-//          dprintf("%d: '%s'\n", i, args[i].str);
-
-        /* convert the args */
-        convert_args(argc, args);
-
-        /* try to match the command */
-        const cmd *command = match_command(args[0].str, CMD_AVAIL_NORMAL);
-        if (!command) {
-            if (showprompt)
-                printf("command not found\n");
-            continue;
-        }
-
-        if (!locked)
-            mutex_acquire(command_lock);
-
-        abort_script = false;
-        lastresult = command->cmd_callback(argc, args);
-
-#if WITH_LIB_ENV
-        bool report_result;
-        env_get_bool("reportresult", &report_result, false);
-        if (report_result) {
-            if (lastresult < 0)
-                printf("FAIL %d\n", lastresult);
-            else
-                printf("PASS %d\n", lastresult);
-        }
-#endif
-
-#if WITH_LIB_ENV
-        // stuff the result in an environment var
-        env_set_int("?", lastresult, true);
-#endif
-
-        // someone must have aborted the current script
-        if (abort_script)
-            exit = true;
-        abort_script = false;
-
-        if (!locked)
-            mutex_release(command_lock);
+        if (command_run(buffer, &continuebuffer, showprompt, locked, &exit) < 0)
+            goto no_mem_error;
     }
 
-    free(outbuf);
-    free(args);
     return NO_ERROR;
 
 no_mem_error:
-    if (outbuf)
-        free(outbuf);
-
-    if (args)
-        free(args);
-
     dprintf(INFO, "%s: not enough memory\n", __func__);
     return ERR_NO_MEMORY;
 }
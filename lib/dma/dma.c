@@ -0,0 +1,537 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/dma.h>
+
+#include <assert.h>
+#include <bits.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <pow2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+#include <lib/page_alloc.h>
+#include <lk/init.h>
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* pages set aside at boot for bouncing transfers, 0 to disable */
+#ifndef DMA_BOUNCE_PAGES
+#define DMA_BOUNCE_PAGES 32
+#endif
+
+/* devices on x86 always snoop the cpu caches */
+#if ARCH_x86
+#define DMA_ARCH_COHERENT 1
+#else
+#define DMA_ARCH_COHERENT 0
+#endif
+
+#if DMA_BOUNCE_PAGES > 0
+static uint8_t *bounce_base;
+static paddr_t bounce_pa;
+static unsigned long bounce_map[BITMAP_NUM_WORDS(DMA_BOUNCE_PAGES)];
+static spin_lock_t bounce_lock = SPIN_LOCK_INITIAL_VALUE;
+#endif
+
+struct dma_pool_chunk {
+    struct list_node node;
+    uint8_t *va;
+    paddr_t pa;
+};
+
+struct dma_pool {
+    const char *name;
+    const struct dma_device *dev;
+    size_t size;
+    size_t chunk_len;
+
+    spin_lock_t lock;
+    struct list_node chunks;
+    void *free_list; /* free objects are linked through their first word */
+};
+
+/* single mappings point at their own iovec lazily, so a map can be copied */
+static inline const iovec_t *dma_map_iov(const dma_map_t *map)
+{
+    return map->iov ? map->iov : &map->single;
+}
+
+static inline bool dma_is_coherent(const struct dma_device *dev)
+{
+    return DMA_ARCH_COHERENT || dev->coherent;
+}
+
+static paddr_t dma_virt_to_phys(const void *va)
+{
+#if WITH_KERNEL_VM
+    return vaddr_to_paddr((void *)va);
+#else
+    return (paddr_t)(uintptr_t)va;
+#endif
+}
+
+/* one maintenance operation per virtually contiguous range */
+static void dma_sync_for_device(const struct dma_device *dev, enum dma_direction dir, void *va, size_t len)
+{
+    if (dma_is_coherent(dev) || len == 0)
+        return;
+
+    /* push out anything the cpu wrote, and make sure no dirty line for a
+     * buffer the device is about to fill gets evicted on top of its data */
+    if (dir == DMA_TO_DEVICE)
+        arch_clean_cache_range((addr_t)va, len);
+    else
+        arch_clean_invalidate_cache_range((addr_t)va, len);
+}
+
+static void dma_sync_for_cpu(const struct dma_device *dev, enum dma_direction dir, void *va, size_t len)
+{
+    if (dma_is_coherent(dev) || len == 0 || dir == DMA_TO_DEVICE)
+        return;
+
+    /* drop lines the cpu may have speculatively pulled in during the transfer */
+    arch_invalidate_cache_range((addr_t)va, len);
+}
+
+/* Would invalidating a buffer the device writes to also throw away data that
+ * shares its first or last cache line? */
+static bool dma_misaligned(const struct dma_device *dev, enum dma_direction dir,
+                           const iovec_t *iov, uint iov_cnt)
+{
+    if (dma_is_coherent(dev) || dir == DMA_TO_DEVICE)
+        return false;
+
+    for (uint i = 0; i < iov_cnt; i++) {
+        uintptr_t start = (uintptr_t)iov[i].iov_base;
+        if ((start | (start + iov[i].iov_len)) & (CACHE_LINE - 1))
+            return true;
+    }
+    return false;
+}
+
+/* Break the buffer up into physically contiguous runs, merging across page
+ * boundaries where the pages happen to be adjacent. */
+static ssize_t dma_build_segs(const struct dma_device *dev, const iovec_t *iov, uint iov_cnt,
+                              dma_segment_t *segs, uint max_segs)
+{
+    uint n = 0;
+
+    for (uint i = 0; i < iov_cnt; i++) {
+        uintptr_t va = (uintptr_t)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len > 0) {
+            size_t chunk = MIN(len, PAGE_SIZE - (va & (PAGE_SIZE - 1)));
+            paddr_t pa = dma_virt_to_phys((void *)va);
+#if WITH_KERNEL_VM
+            if (pa == 0)
+                return ERR_INVALID_ARGS;
+#endif
+            if (dev->addr_limit && (pa + chunk - 1 > dev->addr_limit || pa + chunk - 1 < pa))
+                return ERR_OUT_OF_RANGE;
+
+            while (chunk > 0) {
+                dma_segment_t *s = n ? &segs[n - 1] : NULL;
+                size_t take;
+
+                if (s && s->addr + s->len == pa && (!dev->max_seg_len || s->len < dev->max_seg_len)) {
+                    take = dev->max_seg_len ? MIN(chunk, dev->max_seg_len - s->len) : chunk;
+                    s->len += take;
+                } else {
+                    if (n == max_segs)
+                        return ERR_TOO_BIG;
+                    take = dev->max_seg_len ? MIN(chunk, dev->max_seg_len) : chunk;
+                    segs[n].addr = pa;
+                    segs[n].len = take;
+                    n++;
+                }
+
+                pa += take;
+                va += take;
+                len -= take;
+                chunk -= take;
+            }
+        }
+    }
+
+    return n;
+}
+
+#if DMA_BOUNCE_PAGES > 0
+static void *dma_bounce_alloc(const struct dma_device *dev, size_t len)
+{
+    uint pages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+    if (!bounce_base || pages == 0 || pages > DMA_BOUNCE_PAGES)
+        return NULL;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bounce_lock, state);
+
+    /* first fit, the pool is small */
+    uint run = 0;
+    for (uint i = 0; i < DMA_BOUNCE_PAGES; i++) {
+        if (bitmap_test(bounce_map, i)) {
+            run = 0;
+            continue;
+        }
+        if (++run < pages)
+            continue;
+
+        uint start = i + 1 - pages;
+        paddr_t pa = bounce_pa + start * PAGE_SIZE;
+        if (dev->addr_limit && pa + len - 1 > dev->addr_limit)
+            break;
+
+        for (uint j = start; j <= i; j++)
+            bitmap_set(bounce_map, j);
+        spin_unlock_irqrestore(&bounce_lock, state);
+
+        return bounce_base + start * PAGE_SIZE;
+    }
+
+    spin_unlock_irqrestore(&bounce_lock, state);
+
+    LTRACEF("no room for %zu bytes\n", len);
+    return NULL;
+}
+
+static void dma_bounce_free(void *ptr, size_t len)
+{
+    uint start = ((uint8_t *)ptr - bounce_base) / PAGE_SIZE;
+    uint pages = ROUNDUP(len, PAGE_SIZE) / PAGE_SIZE;
+
+    DEBUG_ASSERT(start + pages <= DMA_BOUNCE_PAGES);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&bounce_lock, state);
+    for (uint i = start; i < start + pages; i++)
+        bitmap_clear(bounce_map, i);
+    spin_unlock_irqrestore(&bounce_lock, state);
+}
+#else
+static inline void *dma_bounce_alloc(const struct dma_device *dev, size_t len) { return NULL; }
+static inline void dma_bounce_free(void *ptr, size_t len) {}
+#endif
+
+static ssize_t dma_map_direct(dma_map_t *map, dma_segment_t *segs, uint max_segs)
+{
+    const iovec_t *iov = dma_map_iov(map);
+    ssize_t n = dma_build_segs(map->dev, iov, map->iov_cnt, segs, max_segs);
+    if (n < 0)
+        return n;
+
+    for (uint i = 0; i < map->iov_cnt; i++)
+        dma_sync_for_device(map->dev, map->dir, iov[i].iov_base, iov[i].iov_len);
+
+    return n;
+}
+
+static ssize_t dma_map_bounce(dma_map_t *map, dma_segment_t *segs, uint max_segs)
+{
+    const iovec_t *iov = dma_map_iov(map);
+    size_t len = iovec_size(iov, map->iov_cnt);
+    void *bounce = dma_bounce_alloc(map->dev, len);
+    if (!bounce)
+        return ERR_NO_MEMORY;
+
+    LTRACEF("bouncing %zu bytes through %p\n", len, bounce);
+
+    if (map->dir != DMA_FROM_DEVICE)
+        iovec_to_membuf(bounce, len, iov, map->iov_cnt, 0);
+
+    iovec_t biov = { bounce, len };
+    ssize_t n = dma_build_segs(map->dev, &biov, 1, segs, max_segs);
+    if (n < 0) {
+        dma_bounce_free(bounce, len);
+        return n;
+    }
+
+    map->bounce = bounce;
+    map->bounce_len = len;
+    dma_sync_for_device(map->dev, map->dir, bounce, len);
+
+    return n;
+}
+
+static ssize_t dma_map_start(dma_map_t *map, dma_segment_t *segs, uint max_segs)
+{
+    DEBUG_ASSERT(segs || max_segs == 0);
+
+    map->bounce = NULL;
+    map->bounce_len = 0;
+
+    ssize_t n;
+    bool misaligned = dma_misaligned(map->dev, map->dir, dma_map_iov(map), map->iov_cnt);
+    if (!misaligned) {
+        n = dma_map_direct(map, segs, max_segs);
+        if (n != ERR_TOO_BIG && n != ERR_OUT_OF_RANGE)
+            return n;
+    }
+
+    n = dma_map_bounce(map, segs, max_segs);
+
+    /* sharing a cache line is still better than not doing the transfer */
+    if (n == ERR_NO_MEMORY && misaligned)
+        n = dma_map_direct(map, segs, max_segs);
+
+    return n;
+}
+
+ssize_t dma_map_sg(const struct dma_device *dev, const iovec_t *iov, uint iov_cnt, enum dma_direction dir,
+                   dma_segment_t *segs, uint max_segs, dma_map_t *map)
+{
+    LTRACEF("dev %p, iov %p, iov_cnt %u, dir %d, max_segs %u\n", dev, iov, iov_cnt, dir, max_segs);
+
+    DEBUG_ASSERT(dev && iov && map);
+
+    map->dev = dev;
+    map->dir = dir;
+    map->iov = iov;
+    map->iov_cnt = iov_cnt;
+
+    return dma_map_start(map, segs, max_segs);
+}
+
+ssize_t dma_map_single(const struct dma_device *dev, void *buf, size_t len, enum dma_direction dir,
+                       dma_segment_t *segs, uint max_segs, dma_map_t *map)
+{
+    LTRACEF("dev %p, buf %p, len %zu, dir %d, max_segs %u\n", dev, buf, len, dir, max_segs);
+
+    DEBUG_ASSERT(dev && map);
+
+    map->dev = dev;
+    map->dir = dir;
+    map->iov = NULL;
+    map->iov_cnt = 1;
+    map->single.iov_base = buf;
+    map->single.iov_len = len;
+
+    return dma_map_start(map, segs, max_segs);
+}
+
+void dma_unmap(dma_map_t *map)
+{
+    LTRACEF("map %p, bounce %p\n", map, map->bounce);
+
+    const iovec_t *iov = dma_map_iov(map);
+    if (map->bounce) {
+        dma_sync_for_cpu(map->dev, map->dir, map->bounce, map->bounce_len);
+
+        if (map->dir != DMA_TO_DEVICE) {
+            const uint8_t *src = map->bounce;
+            for (uint i = 0; i < map->iov_cnt; i++) {
+                memcpy(iov[i].iov_base, src, iov[i].iov_len);
+                src += iov[i].iov_len;
+            }
+        }
+
+        dma_bounce_free(map->bounce, map->bounce_len);
+        map->bounce = NULL;
+    } else {
+        for (uint i = 0; i < map->iov_cnt; i++)
+            dma_sync_for_cpu(map->dev, map->dir, iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+void *dma_alloc_coherent(const struct dma_device *dev, size_t size, paddr_t *pa)
+{
+    LTRACEF("dev %p, size %zu\n", dev, size);
+
+    size = ROUNDUP(size, PAGE_SIZE);
+
+#if WITH_KERNEL_VM
+    void *ptr;
+    uint flags = ARCH_MMU_FLAG_PERM_NO_EXECUTE;
+    if (!dma_is_coherent(dev))
+        flags |= ARCH_MMU_FLAG_UNCACHED;
+
+    status_t err = vmm_alloc_contiguous(vmm_get_kernel_aspace(), "dma", size, &ptr, 0, 0, flags);
+    if (err < 0)
+        return NULL;
+#else
+    void *ptr = page_alloc(size / PAGE_SIZE, PAGE_ALLOC_ANY_ARENA);
+    if (!ptr)
+        return NULL;
+#endif
+
+    paddr_t p = dma_virt_to_phys(ptr);
+    if (dev->addr_limit && p + size - 1 > dev->addr_limit) {
+        LTRACEF("pa 0x%lx out of reach of the device\n", p);
+        dma_free_coherent(ptr, size);
+        return NULL;
+    }
+
+    memset(ptr, 0, size);
+#if !WITH_KERNEL_VM
+    dma_sync_for_device(dev, DMA_BIDIRECTIONAL, ptr, size);
+#endif
+
+    if (pa)
+        *pa = p;
+    return ptr;
+}
+
+void dma_free_coherent(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+
+#if WITH_KERNEL_VM
+    vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+#else
+    page_free(ptr, ROUNDUP(size, PAGE_SIZE) / PAGE_SIZE);
+#endif
+}
+
+dma_pool_t *dma_pool_create(const char *name, const struct dma_device *dev, size_t size, size_t align)
+{
+    LTRACEF("name '%s', size %zu, align %zu\n", name, size, align);
+
+    if (size == 0 || !ispow2(align) || align > PAGE_SIZE)
+        return NULL;
+
+    dma_pool_t *pool = calloc(1, sizeof(dma_pool_t));
+    if (!pool)
+        return NULL;
+
+    /* objects are packed back to back, so their size keeps them aligned */
+    align = MAX(align, sizeof(void *));
+    pool->name = name;
+    pool->dev = dev;
+    pool->size = ROUNDUP(size, align);
+    pool->chunk_len = ROUNDUP(pool->size, PAGE_SIZE);
+    pool->lock = SPIN_LOCK_INITIAL_VALUE;
+    list_initialize(&pool->chunks);
+
+    return pool;
+}
+
+void dma_pool_destroy(dma_pool_t *pool)
+{
+    if (!pool)
+        return;
+
+    struct dma_pool_chunk *chunk;
+    while ((chunk = list_remove_head_type(&pool->chunks, struct dma_pool_chunk, node))) {
+        dma_free_coherent(chunk->va, pool->chunk_len);
+        free(chunk);
+    }
+
+    free(pool);
+}
+
+static status_t dma_pool_grow(dma_pool_t *pool)
+{
+    struct dma_pool_chunk *chunk = malloc(sizeof(struct dma_pool_chunk));
+    if (!chunk)
+        return ERR_NO_MEMORY;
+
+    chunk->va = dma_alloc_coherent(pool->dev, pool->chunk_len, &chunk->pa);
+    if (!chunk->va) {
+        free(chunk);
+        return ERR_NO_MEMORY;
+    }
+
+    LTRACEF("pool '%s' new chunk va %p pa 0x%lx\n", pool->name, chunk->va, chunk->pa);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pool->lock, state);
+    list_add_tail(&pool->chunks, &chunk->node);
+    for (size_t off = 0; off + pool->size <= pool->chunk_len; off += pool->size) {
+        void **obj = (void **)(chunk->va + off);
+        *obj = pool->free_list;
+        pool->free_list = obj;
+    }
+    spin_unlock_irqrestore(&pool->lock, state);
+
+    return NO_ERROR;
+}
+
+void *dma_pool_alloc(dma_pool_t *pool, paddr_t *pa)
+{
+    for (;;) {
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&pool->lock, state);
+
+        void **obj = pool->free_list;
+        if (obj) {
+            pool->free_list = *obj;
+
+            struct dma_pool_chunk *chunk;
+            list_for_every_entry(&pool->chunks, chunk, struct dma_pool_chunk, node) {
+                if ((uint8_t *)obj >= chunk->va && (uint8_t *)obj < chunk->va + pool->chunk_len) {
+                    if (pa)
+                        *pa = chunk->pa + ((uint8_t *)obj - chunk->va);
+                    break;
+                }
+            }
+        }
+
+        spin_unlock_irqrestore(&pool->lock, state);
+
+        if (obj) {
+            memset(obj, 0, pool->size);
+            return obj;
+        }
+
+        if (dma_pool_grow(pool) < 0)
+            return NULL;
+    }
+}
+
+void dma_pool_free(dma_pool_t *pool, void *ptr)
+{
+    if (!ptr)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&pool->lock, state);
+    *(void **)ptr = pool->free_list;
+    pool->free_list = ptr;
+    spin_unlock_irqrestore(&pool->lock, state);
+}
+
+#if DMA_BOUNCE_PAGES > 0
+static void dma_init(uint level)
+{
+    /* grab the pool early, while low memory is still likely to be free */
+    bounce_base = page_alloc(DMA_BOUNCE_PAGES, PAGE_ALLOC_ANY_ARENA);
+    if (!bounce_base) {
+        dprintf(INFO, "dma: no memory for %u page bounce pool\n", DMA_BOUNCE_PAGES);
+        return;
+    }
+
+    bounce_pa = dma_virt_to_phys(bounce_base);
+    LTRACEF("bounce pool %p pa 0x%lx, %u pages\n", bounce_base, bounce_pa, DMA_BOUNCE_PAGES);
+}
+
+LK_INIT_HOOK(dma, &dma_init, LK_INIT_LEVEL_VM);
+#endif
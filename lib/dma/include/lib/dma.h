@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/**
+ * Streaming and coherent DMA for device drivers.
+ *
+ * A streaming mapping hands a buffer the cpu owns over to a device. Mapping
+ * translates the buffer into physically contiguous segments and does the
+ * cache maintenance the transfer direction needs. Unmapping gives the buffer
+ * back to the cpu. The buffer must not be touched while it is mapped.
+ *
+ * If the buffer needs more segments than the caller has room for, or lies
+ * outside what the device can address, the transfer goes through a bounce
+ * buffer instead. Data is copied in at map time and out at unmap time.
+ *
+ * Coherent memory is mapped uncached (unless the device snoops the caches)
+ * and can be shared with the device without any maintenance. It is meant for
+ * descriptors and other small control structures. dma_pool carves fixed
+ * size objects out of it. Without the VM there is no way to map memory
+ * uncached, so there it is only coherent on cores without a data cache.
+ *
+ * Typical usage:
+ *
+ * dma_segment_t segs[4];
+ * dma_map_t map;
+ * ssize_t n = dma_map_single(&dev->dma, buf, len, DMA_FROM_DEVICE, segs, countof(segs), &map);
+ * if (n < 0)
+ *     return n;
+ * ... point the device at segs[0..n-1] and wait for it ...
+ * dma_unmap(&map);
+ */
+
+#include <compiler.h>
+#include <iovec.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+__BEGIN_CDECLS;
+
+enum dma_direction {
+    DMA_TO_DEVICE,
+    DMA_FROM_DEVICE,
+    DMA_BIDIRECTIONAL,
+};
+
+/* what a device can reach, shared by all of its mappings */
+struct dma_device {
+    paddr_t addr_limit;     /* highest address the device can reach, 0 for no limit */
+    size_t max_seg_len;     /* longest segment the device can take, 0 for no limit */
+    bool coherent;          /* device snoops the cpu caches */
+};
+
+typedef struct dma_segment {
+    paddr_t addr;
+    size_t len;
+} dma_segment_t;
+
+typedef struct dma_map {
+    const struct dma_device *dev;
+    enum dma_direction dir;
+
+    /* the caller's buffer, which must stay valid until unmapped. Single
+     * buffers are kept in the map itself, so a map may be copied. */
+    const iovec_t *iov;
+    uint iov_cnt;
+    iovec_t single;
+
+    /* set if the transfer was bounced */
+    void *bounce;
+    size_t bounce_len;
+} dma_map_t;
+
+/* Map a buffer for a transfer in direction dir, filling in up to max_segs
+ * segments. Returns the number of segments or a negative error. */
+ssize_t dma_map_single(const struct dma_device *dev, void *buf, size_t len, enum dma_direction dir,
+                       dma_segment_t *segs, uint max_segs, dma_map_t *map);
+ssize_t dma_map_sg(const struct dma_device *dev, const iovec_t *iov, uint iov_cnt, enum dma_direction dir,
+                   dma_segment_t *segs, uint max_segs, dma_map_t *map);
+
+/* finish a transfer and give the buffer back to the cpu, safe at interrupt time */
+void dma_unmap(dma_map_t *map);
+
+/* allocate zeroed memory shared with the device, size is rounded up to pages */
+void *dma_alloc_coherent(const struct dma_device *dev, size_t size, paddr_t *pa);
+void dma_free_coherent(void *ptr, size_t size);
+
+/* a pool of small fixed size coherent objects */
+typedef struct dma_pool dma_pool_t;
+
+dma_pool_t *dma_pool_create(const char *name, const struct dma_device *dev, size_t size, size_t align);
+void dma_pool_destroy(dma_pool_t *pool);
+
+/* may block to grow the pool, frees are safe at interrupt time */
+void *dma_pool_alloc(dma_pool_t *pool, paddr_t *pa);
+void dma_pool_free(dma_pool_t *pool, void *ptr);
+
+__END_CDECLS;
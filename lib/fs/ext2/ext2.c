@@ -119,7 +119,14 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     if (!dev)
         return ERR_NOT_FOUND;
 
-    ext2_t *ext2 = malloc(sizeof(ext2_t));
+    /* everything allocated here goes away together at unmount */
+    arena_t *arena = arena_create("ext2", sizeof(ext2_t));
+    if (!arena)
+        return ERR_NO_MEMORY;
+
+    ext2_t *ext2 = arena_alloc(arena, sizeof(ext2_t));
+    memset(ext2, 0, sizeof(ext2_t));
+    ext2->arena = arena;
     ext2->dev = dev;
 
     err = bio_read(dev, &ext2->sb, 1024, sizeof(struct ext2_super_block));
@@ -131,7 +138,7 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     /* see if the superblock is good */
     if (ext2->sb.s_magic != EXT2_SUPER_MAGIC) {
         err = -1;
-        return err;
+        goto err;
     }
 
     /* calculate group count, rounded up */
@@ -152,23 +159,27 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
     /* we only support dynamic revs */
     if (ext2->sb.s_rev_level > EXT2_DYNAMIC_REV) {
         err = -2;
-        return err;
+        goto err;
     }
 
     /* make sure it doesn't have any ro features we don't support */
     if (ext2->sb.s_feature_ro_compat & ~(EXT2_FEATURE_RO_COMPAT_SPARSE_SUPER|EXT2_FEATURE_RO_COMPAT_LARGE_FILE)) {
         err = -3;
-        return err;
+        goto err;
     }
 
     /* read in all the group descriptors */
-    ext2->gd = malloc(sizeof(struct ext2_group_desc) * ext2->s_group_count);
+    ext2->gd = arena_alloc(ext2->arena, sizeof(struct ext2_group_desc) * ext2->s_group_count);
+    if (!ext2->gd) {
+        err = ERR_NO_MEMORY;
+        goto err;
+    }
     err = bio_read(ext2->dev, (void *)ext2->gd,
                    (EXT2_BLOCK_SIZE(ext2->sb) == 4096) ? 4096 : 2048,
                    sizeof(struct ext2_group_desc) * ext2->s_group_count);
     if (err < 0) {
         err = -4;
-        return err;
+        goto err;
     }
 
     int i;
@@ -200,7 +211,9 @@ status_t ext2_mount(bdev_t *dev, fscookie **cookie)
 err:
     LTRACEF("exiting with err code %d\n", err);
 
-    free(ext2);
+    if (ext2->cache)
+        bcache_destroy(ext2->cache);
+    arena_destroy(ext2->arena);
     return err;
 }
 
@@ -210,8 +223,7 @@ status_t ext2_unmount(fscookie *cookie)
     ext2_t *ext2 = (ext2_t *)cookie;
 
     bcache_destroy(ext2->cache);
-    free(ext2->gd);
-    free(ext2);
+    arena_destroy(ext2->arena);
 
     return 0;
 }
@@ -24,6 +24,7 @@
 #ifndef __EXT2_PRIV_H
 #define __EXT2_PRIV_H
 
+#include <lib/arena.h>
 #include <lib/bio.h>
 #include <lib/bcache.h>
 #include <lib/fs.h>
@@ -34,6 +35,7 @@ typedef uint32_t inodenum_t;
 typedef uint32_t groupnum_t;
 
 typedef struct {
+    arena_t *arena; // holds this structure and everything else that lives as long as the mount
     bdev_t *dev;
     bcache_t cache;
 
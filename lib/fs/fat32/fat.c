@@ -22,11 +22,11 @@
  */
 
 #include <err.h>
+#include <lib/arena.h>
 #include <lib/bio.h>
 #include <lib/fs.h>
 #include <trace.h>
 #include <debug.h>
-#include <malloc.h>
 #include <string.h>
 #include <endian.h>
 
@@ -58,7 +58,19 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
     if (!dev)
         return ERR_NOT_VALID;
 
-    uint8_t *bs = malloc(512);
+    /* the boot sector is only needed while parsing, borrow a scratch arena for it */
+    arena_t *scratch = arena_scratch_get();
+    if (!scratch)
+        return ERR_NO_MEMORY;
+
+    fat_fs_t *fat = NULL;
+    arena_t *arena = NULL;
+    uint8_t *bs = arena_alloc(scratch, 512);
+    if (!bs) {
+        result = ERR_NO_MEMORY;
+        goto end;
+    }
+
     int err = bio_read(dev, bs, 1024, 512);
     if (err < 0) {
         result = ERR_GENERIC;
@@ -71,7 +83,14 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
         goto end;
     }
 
-    fat_fs_t *fat = malloc(sizeof(fat_fs_t));
+    arena = arena_create("fat32", sizeof(fat_fs_t));
+    if (!arena) {
+        result = ERR_NO_MEMORY;
+        goto end;
+    }
+    fat = arena_alloc(arena, sizeof(fat_fs_t));
+    memset(fat, 0, sizeof(fat_fs_t));
+    fat->arena = arena;
     fat->lba_start = 1024;
     fat->dev = dev;
 
@@ -170,7 +189,9 @@ status_t fat32_mount(bdev_t *dev, fscookie **cookie)
 
     *cookie = (fscookie *)fat;
 end:
-    free(bs);
+    if (result != NO_ERROR)
+        arena_destroy(arena);
+    arena_scratch_put(scratch);
     return result;
 }
 
@@ -178,7 +199,7 @@ status_t fat32_unmount(fscookie *cookie)
 {
     fat_fs_t *fat = (fat_fs_t *)cookie;
     bcache_destroy(fat->cache);
-    free(fat);
+    arena_destroy(fat->arena);
     return NO_ERROR;
 }
 
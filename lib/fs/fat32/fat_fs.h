@@ -24,10 +24,12 @@
 #ifndef _FAT_FS_H
 #define _FAT_FS_H
 
+#include <lib/arena.h>
 #include <lib/bio.h>
 #include <lib/bcache.h>
 
 typedef struct {
+    arena_t *arena;
     bdev_t *dev;
     bcache_t cache;
 
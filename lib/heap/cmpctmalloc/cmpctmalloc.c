@@ -29,6 +29,7 @@
 #include <kernel/thread.h>
 #include <kernel/mutex.h>
 #include <kernel/spinlock.h>
+#include <kernel/shrinker.h>
 #include <lib/cmpctmalloc.h>
 #include <lib/heap.h>
 #include <lib/page_alloc.h>
@@ -57,8 +58,7 @@
 
 STATIC_ASSERT(IS_PAGE_ALIGNED(HEAP_GROW_SIZE));
 
-// Individual allocations above 4Mbytes are just fetched directly from the
-// block allocator.
+// The freelists cover areas of up to 4Mbytes.
 #define HEAP_ALLOC_VIRTUAL_BITS 22
 
 // When we grow the heap we have to have somewhere in the freelist to put the
@@ -66,6 +66,15 @@ STATIC_ASSERT(IS_PAGE_ALIGNED(HEAP_GROW_SIZE));
 // buckets.
 STATIC_ASSERT(HEAP_GROW_SIZE <= (1u << HEAP_ALLOC_VIRTUAL_BITS));
 
+// Individual allocations of at least this size are not carved out of the
+// areas the small objects live in.  They get a run of pages of their own,
+// which goes straight back to the OS when they are freed.
+#ifndef CMPCT_LARGE_ALLOC_THRESHOLD
+#define CMPCT_LARGE_ALLOC_THRESHOLD (64 * 1024)
+#endif
+
+STATIC_ASSERT(CMPCT_LARGE_ALLOC_THRESHOLD <= (1u << HEAP_ALLOC_VIRTUAL_BITS));
+
 // Buckets for allocations.  The smallest 15 buckets are 8, 16, 24, etc. up to
 // 120 bytes.  After that we round up to the nearest size that can be written
 // /^0*1...0*$/, giving 8 buckets per order of binary magnitude.  The freelist
@@ -86,9 +95,22 @@ typedef struct free_struct {
     struct free_struct *prev;
 } free_t;
 
+// Page backed allocations start with this.  The header of the allocation is
+// immediately before the payload like everywhere else, but its left pointer is
+// a tag that can never be a real (8 byte aligned) pointer.
+typedef struct large_header_struct {
+    void *base;  // Start of the run of pages.
+    size_t size;  // Size of the run of pages.
+    header_t header;
+} large_header_t;
+
+#define LARGE_ALLOC_TAG ((header_t *)0x2)
+
 struct heap {
     size_t size;
     size_t remaining;
+    size_t large_size;
+    size_t large_count;
     mutex_t lock;
     free_t *free_lists[NUMBER_OF_BUCKETS];
     // We have some 32 bit words that tell us whether there is an entry in the
@@ -124,6 +146,10 @@ void cmpct_dump(void)
     dprintf(INFO, "\tsize %lu, remaining %lu\n",
             (unsigned long)theheap.size,
             (unsigned long)theheap.remaining);
+    dprintf(INFO, "\tpage backed allocations %lu, size %lu (threshold %u)\n",
+            (unsigned long)theheap.large_count,
+            (unsigned long)theheap.large_size,
+            CMPCT_LARGE_ALLOC_THRESHOLD);
 
     dprintf(INFO, "\tfree list:\n");
     for (int i = 0; i < NUMBER_OF_BUCKETS; i++) {
@@ -241,6 +267,11 @@ static int find_nonempty_bucket(int index)
     return -1;
 }
 
+static bool is_large_allocation(header_t *header)
+{
+    return header->left == LARGE_ALLOC_TAG;
+}
+
 static bool is_start_of_os_allocation(header_t *header)
 {
     return header->left == untag(NULL);
@@ -338,7 +369,9 @@ static void *TestTrimHelper(ssize_t target)
     char *answer = NULL;
     size_t remaining = theheap.remaining;
     while (theheap.remaining - target > 512) {
-        char *next_block = cmpct_alloc(8 + ((theheap.remaining - target) >> 2));
+        // Stay below the size that would get pages of its own.
+        char *next_block = cmpct_alloc(MIN(8 + ((theheap.remaining - target) >> 2),
+                                           CMPCT_LARGE_ALLOC_THRESHOLD - 1));
         *(char **)next_block = answer;
         answer = next_block;
         if (theheap.remaining > remaining) return answer;
@@ -570,9 +603,44 @@ static void cmpct_test_return_to_os(void)
     ASSERT(remaining == theheap.remaining);
 }
 
+static void cmpct_test_large(void)
+{
+    size_t large_count = theheap.large_count;
+    size_t size = CMPCT_LARGE_ALLOC_THRESHOLD;
+    char *a = cmpct_alloc(size);
+    if (a == NULL) return;
+    ASSERT(is_large_allocation((header_t *)a - 1));
+    ASSERT(theheap.large_count == large_count + 1);
+    for (size_t i = 0; i < size; i++) a[i] = i * 7;
+
+    // Growing keeps the contents, whether or not the pages had to move.
+    char *b = cmpct_realloc(a, size * 4);
+    if (b != NULL) {
+        for (size_t i = 0; i < size; i++) ASSERT(b[i] == (char)(i * 7));
+        a = b;
+    }
+
+    // Shrinking below the threshold moves it back to the freelists.
+    b = cmpct_realloc(a, 100);
+    ASSERT(b != NULL);
+    ASSERT(!is_large_allocation((header_t *)b - 1));
+    for (size_t i = 0; i < 100; i++) ASSERT(b[i] == (char)(i * 7));
+    ASSERT(theheap.large_count == large_count);
+    cmpct_free(b);
+
+    void *c = cmpct_memalign(size, PAGE_SIZE * 4);
+    if (c != NULL) {
+        ASSERT(IS_ALIGNED(c, PAGE_SIZE * 4));
+        ASSERT(cmpct_usable_size(c) >= size);
+        cmpct_free(c);
+    }
+    ASSERT(theheap.large_count == large_count);
+}
+
 void cmpct_test(void)
 {
     cmpct_test_buckets();
+    cmpct_test_large();
     cmpct_test_get_back_newly_freed();
     cmpct_test_return_to_os();
     cmpct_test_trim();
@@ -630,40 +698,93 @@ void cmpct_test(void)
     cmpct_dump();
 }
 
-static void *large_alloc(size_t size)
+static void *create_large_header(char *base, size_t size, char *payload)
 {
-#ifdef CMPCT_DEBUG
-    size_t requested_size = size;
-#endif
-    size = ROUNDUP(size, 8);
-    free_t *free_area = NULL;
+    large_header_t *large = (large_header_t *)payload - 1;
+    large->base = base;
+    large->size = size;
+    large->header.left = LARGE_ALLOC_TAG;
+    large->header.size = base + size - (char *)&large->header;
+    return payload;
+}
+
+static void *large_alloc(size_t size, size_t alignment)
+{
+    if (alignment < 8) alignment = 8;
+    // The run of pages is only page aligned, so bigger alignments need slack.
+    size_t slack = ROUNDUP(sizeof(large_header_t), alignment);
+    if (alignment > PAGE_SIZE) slack += alignment - PAGE_SIZE;
+    if (size > SIZE_MAX - slack - PAGE_SIZE) return NULL;
+    size_t run = ROUNDUP(size + slack, PAGE_SIZE);
+
+    char *base = page_alloc_mapped(run >> PAGE_SIZE_SHIFT);
+    if (base == NULL) return NULL;
+    char *payload = (char *)ROUNDUP((uintptr_t)base + sizeof(large_header_t), alignment);
+    DEBUG_ASSERT(payload + size <= base + run);
+    LTRACEF("size %zu alignment %zu -> %p, %zu bytes of pages at %p\n",
+            size, alignment, payload, run, base);
+
     lock();
-    if (heap_grow(size, &free_area) < 0) {
-      return 0;
-    }
-    void *result =
-        create_allocation_header(free_area, 0, free_area->header.size, free_area->header.left);
-    // Normally the 'remaining free space' counter would be decremented when we
-    // unlink the free area from its bucket.  However in this case the free
-    // area was too big to go in any bucket and we had it in our own
-    // "free_area" variable so there is no unlinking and we have to adjust the
-    // counter here.
-    theheap.remaining -= free_area->header.size;
+    theheap.large_size += run;
+    theheap.large_count++;
     unlock();
+
 #ifdef CMPCT_DEBUG
-    memset(result, ALLOC_FILL, requested_size);
-    memset((char *)result + requested_size, PADDING_FILL,
-        free_area->header.size - (requested_size + sizeof(header_t)));
+    memset(payload, ALLOC_FILL, size);
 #endif
-    return result;
+    return create_large_header(base, run, payload);
+}
+
+static void large_free(header_t *header)
+{
+    large_header_t *large = containerof(header, large_header_t, header);
+    void *base = large->base;
+    size_t size = large->size;
+
+    lock();
+    theheap.large_size -= size;
+    theheap.large_count--;
+    unlock();
+
+    page_free_mapped(base, size >> PAGE_SIZE_SHIFT);
+}
+
+// Resize the run of pages under a large allocation, moving it by remapping
+// if it has to.  Returns NULL if that can't be done.
+static void *large_realloc(header_t *header, size_t size)
+{
+    large_header_t *large = containerof(header, large_header_t, header);
+    size_t offset = (char *)(header + 1) - (char *)large->base;
+    if (size > SIZE_MAX - offset - PAGE_SIZE) return NULL;
+    size_t old_run = large->size;
+    size_t run = ROUNDUP(offset + size, PAGE_SIZE);
+    if (run == old_run) return header + 1;
+
+    char *base = page_resize_mapped(large->base, old_run >> PAGE_SIZE_SHIFT, run >> PAGE_SIZE_SHIFT);
+    if (base == NULL) return NULL;
+
+    lock();
+    theheap.large_size += run - old_run;
+    unlock();
+
+    return create_large_header(base, run, base + offset);
 }
 
 void cmpct_trim(void)
 {
+    lock();
+    cmpct_trim_locked();
+    unlock();
+}
+
+void cmpct_trim_locked(void)
+{
+    DEBUG_ASSERT(is_mutex_held(&theheap.lock));
+
     // Look at free list entries that are at least as large as one page plus a
     // header. They might be at the start or the end of a block, so we can trim
-    // them and free the page(s).
-    lock();
+    // them and free the page(s).  If they are in the middle of a block we can
+    // punch out the whole pages they cover, splitting the block in two.
     for (int bucket = size_to_index_freeing(PAGE_SIZE);
             bucket < NUMBER_OF_BUCKETS;
             bucket++) {
@@ -724,17 +845,49 @@ void cmpct_trim(void)
                 }
                 page_free(old_os_allocation_start, freed_up >> PAGE_SIZE_SHIFT);
                 theheap.size -= freed_up;
+            } else {
+                // The left half keeps a free area and gets a new right sentinel.
+                char *hole_start = (char *)
+                                   ROUNDUP((uintptr_t)free_area + sizeof(free_t) + sizeof(header_t), PAGE_SIZE);
+                // The right half starts with a new left sentinel at a page boundary.
+                char *hole_end = (char *)ROUNDDOWN((uintptr_t)(right - 1), PAGE_SIZE);
+                if (hole_end <= hole_start) continue;
+                size_t freed_up = hole_end - hole_start;
+                unlink_free(free_area, bucket);
+                size_t left_free_size = hole_start - sizeof(header_t) - (char *)free_area;
+                size_t right_size = (char *)right - hole_end;
+                DEBUG_ASSERT(left_free_size >= sizeof(free_t));
+                DEBUG_ASSERT(right_size >= sizeof(header_t));
+                // Right sentinel of the left half, stops attempts to coalesce right.
+                create_allocation_header(hole_start - sizeof(header_t), 0, 0, free_area);
+                create_free_area(free_area, untag(free_area->header.left), left_free_size, NULL);
+                // Left sentinel of the right half, stops attempts to coalesce left.
+                size_t sentinel_size = sizeof(header_t);
+                size_t right_free_size = right_size - sentinel_size;
+                if (right_free_size < sizeof(free_t)) {
+                    sentinel_size += right_free_size;
+                    right_free_size = 0;
+                }
+                create_allocation_header(hole_end, 0, sentinel_size, NULL);
+                if (right_free_size == 0) {
+                    FixLeftPointer(right, (header_t *)hole_end);
+                } else {
+                    char *new_free = hole_end + sentinel_size;
+                    create_free_area(new_free, hole_end, right_free_size, NULL);
+                    FixLeftPointer(right, (header_t *)new_free);
+                }
+                page_free(hole_start, freed_up >> PAGE_SIZE_SHIFT);
+                theheap.size -= freed_up;
             }
         }
     }
-    unlock();
 }
 
 void *cmpct_alloc(size_t size)
 {
     if (size == 0u) return NULL;
 
-    if (size + sizeof(header_t) > (1u << HEAP_ALLOC_VIRTUAL_BITS)) return large_alloc(size);
+    if (size >= CMPCT_LARGE_ALLOC_THRESHOLD) return large_alloc(size, 0);
 
     size_t rounded_up;
     int start_bucket = size_to_index_allocating(size, &rounded_up);
@@ -789,7 +942,9 @@ void *cmpct_memalign(size_t size, size_t alignment)
     if (alignment < 8) return cmpct_alloc(size);
     size_t padded_size =
         size + alignment + sizeof(free_t) + sizeof(header_t);
+    if (padded_size >= CMPCT_LARGE_ALLOC_THRESHOLD) return large_alloc(size, alignment);
     char *unaligned = (char *)cmpct_alloc(padded_size);
+    if (unaligned == NULL) return NULL;
     lock();
     size_t mask = alignment - 1;
     uintptr_t payload_int = (uintptr_t)unaligned + sizeof(free_t) +
@@ -813,13 +968,10 @@ void *cmpct_memalign(size_t size, size_t alignment)
     return payload;
 }
 
-void cmpct_free(void *payload)
+// Put a small allocation back on the free lists.  Called with the lock held.
+static void free_small(header_t *header)
 {
-    if (payload == NULL) return;
-    header_t *header = (header_t *)payload - 1;
-    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
     size_t size = header->size;
-    lock();
     header_t *left = header->left;
     if (left != NULL && is_tagged_as_free(left)) {
         // Coalesce with left free object.
@@ -848,15 +1000,72 @@ void cmpct_free(void *payload)
             free_memory(header, left, size);
         }
     }
+}
+
+void cmpct_free(void *payload)
+{
+    if (payload == NULL) return;
+    header_t *header = (header_t *)payload - 1;
+    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
+    if (is_large_allocation(header)) {
+        large_free(header);
+        return;
+    }
+    lock();
+    free_small(header);
     unlock();
 }
 
+// cmpct_free() for a caller that already holds the lock, see cmpct_trylock().
+// Large allocations give their pages back through the vmm, which may call
+// back into the heap, so those are refused and must be freed after unlocking.
+bool cmpct_free_locked(void *payload)
+{
+    if (payload == NULL) return true;
+    DEBUG_ASSERT(is_mutex_held(&theheap.lock));
+    header_t *header = (header_t *)payload - 1;
+    DEBUG_ASSERT(!is_tagged_as_free(header));  // Double free!
+    if (is_large_allocation(header)) return false;
+    free_small(header);
+    return true;
+}
+
+// For callers that must not block on the heap, such as shrinkers.  Fails if
+// the lock is busy or already held by this thread.
+bool cmpct_trylock(void)
+{
+    return shrinker_trylock(&theheap.lock);
+}
+
+void cmpct_unlock(void)
+{
+    unlock();
+}
+
+size_t cmpct_usable_size(void *payload)
+{
+    if (payload == NULL) return 0;
+    header_t *header = (header_t *)payload - 1;
+    DEBUG_ASSERT(!is_tagged_as_free(header));
+    return header->size - sizeof(header_t);
+}
+
 void *cmpct_realloc(void *payload, size_t size)
 {
     if (payload == NULL) return cmpct_alloc(size);
     header_t *header = (header_t *)payload - 1;
     size_t old_size = header->size - sizeof(header_t);
+    if (is_large_allocation(header) && size >= CMPCT_LARGE_ALLOC_THRESHOLD) {
+        // Grow or shrink the pages underneath without copying.
+        void *resized = large_realloc(header, size);
+        if (resized != NULL) return resized;
+    }
+    if (size == 0) {
+        cmpct_free(payload);
+        return NULL;
+    }
     void *new_payload = cmpct_alloc(size);
+    if (new_payload == NULL) return NULL;
     memcpy(new_payload, payload, MIN(size, old_size));
     cmpct_free(payload);
     return new_payload;
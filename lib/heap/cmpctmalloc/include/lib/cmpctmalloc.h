@@ -23,6 +23,7 @@
 #pragma once
 
 #include <compiler.h>
+#include <stdbool.h>
 
 __BEGIN_CDECLS;
 
@@ -30,10 +31,17 @@ void *cmpct_alloc(size_t);
 void *cmpct_realloc(void *, size_t);
 void cmpct_free(void *);
 void *cmpct_memalign(size_t size, size_t alignment);
+size_t cmpct_usable_size(void *);
 
 void cmpct_init(void);
 void cmpct_dump(void);
 void cmpct_test(void);
 void cmpct_trim(void);
 
+/* for callers that can't block on the heap lock, e.g. shrinkers */
+bool cmpct_trylock(void);
+void cmpct_unlock(void);
+bool cmpct_free_locked(void *);
+void cmpct_trim_locked(void);
+
 __END_CDECLS;
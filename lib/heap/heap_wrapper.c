@@ -26,12 +26,17 @@
 #include <debug.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <err.h>
 #include <list.h>
+#include <kernel/shrinker.h>
 #include <kernel/spinlock.h>
+#include <arch/ops.h>
 #include <lib/console.h>
 #include <lib/page_alloc.h>
+#include <lk/init.h>
 
 #define LOCAL_TRACE 0
 
@@ -72,6 +77,10 @@ static inline void HEAP_INIT(void)
 }
 #define HEAP_DUMP miniheap_dump
 #define HEAP_TRIM miniheap_trim
+#define HEAP_TRYLOCK miniheap_trylock
+#define HEAP_UNLOCK miniheap_unlock
+#define HEAP_FREE_LOCKED miniheap_free_locked
+#define HEAP_TRIM_LOCKED miniheap_trim_locked
 
 /* end miniheap implementation */
 #elif WITH_LIB_HEAP_CMPCTMALLOC
@@ -85,6 +94,11 @@ static inline void HEAP_INIT(void)
 #define HEAP_INIT cmpct_init
 #define HEAP_DUMP cmpct_dump
 #define HEAP_TRIM cmpct_trim
+#define HEAP_TRYLOCK cmpct_trylock
+#define HEAP_UNLOCK cmpct_unlock
+#define HEAP_FREE_LOCKED cmpct_free_locked
+#define HEAP_TRIM_LOCKED cmpct_trim_locked
+#define HEAP_USABLE_SIZE cmpct_usable_size
 static inline void *HEAP_CALLOC(size_t n, size_t s)
 {
     size_t realsize = n * s;
@@ -130,12 +144,617 @@ static inline void HEAP_DUMP(void)
 
 static inline void HEAP_TRIM(void) { dlmalloc_trim(0); }
 
+/* dlmalloc keeps its lock to itself, so the shrinker can't trim it */
+static inline bool HEAP_TRYLOCK(void) { return false; }
+static inline void HEAP_UNLOCK(void) {}
+static inline bool HEAP_FREE_LOCKED(void *p) { return false; }
+static inline void HEAP_TRIM_LOCKED(void) {}
+
 /* end dlmalloc implementation */
 #else
 #error need to select valid heap implementation or provide wrapper
 #endif
 
-static void heap_free_delayed_list(void)
+/*
+ * Per-cpu magazine front end for small allocations.
+ *
+ * Allocations up to HEAP_MAG_MAX_SIZE are rounded up to one of a handful of
+ * size classes and served out of a per-cpu magazine (a small stack of free
+ * blocks) without touching the underlying heap's lock. Each cpu keeps a loaded
+ * and a previous magazine per class; when both run dry or fill up, whole
+ * magazines are traded with a global depot, so the depot lock is taken at most
+ * once per HEAP_MAG_ROUNDS operations.
+ *
+ * Blocks are not owned by the cpu that allocated them: a free on any cpu just
+ * lands in that cpu's magazine and flows back to the rest of the system through
+ * the depot. The class of a freed block is derived from its usable size as
+ * reported by the backend, so blocks that came straight from the backend (via
+ * memalign or realloc) can be cached as well.
+ *
+ * Requires a backend that can report the size of an allocation.
+ */
+#if defined(HEAP_USABLE_SIZE) && !defined(HEAP_NO_MAGAZINES)
+#define HEAP_MAGAZINES 1
+#else
+#define HEAP_MAGAZINES 0
+#endif
+
+#if HEAP_MAGAZINES
+#define HEAP_MAG_GRAIN      16
+#define HEAP_MAG_CLASSES    16
+#define HEAP_MAG_MAX_SIZE   (HEAP_MAG_GRAIN * HEAP_MAG_CLASSES)
+#define HEAP_MAG_ROUNDS     30
+#define HEAP_DEPOT_MAX_FULL 16 /* per class, extra full magazines are returned to the heap */
+
+struct heap_magazine {
+    struct heap_magazine *next;
+    uint count;
+    void *rounds[HEAP_MAG_ROUNDS];
+};
+
+struct heap_cpu_cache {
+    spin_lock_t lock;
+    struct {
+        struct heap_magazine *loaded;
+        struct heap_magazine *prev;
+    } mag[HEAP_MAG_CLASSES];
+
+    /* stats */
+    ulong alloc_hits;
+    ulong alloc_misses;
+    ulong free_hits;
+    ulong free_misses;
+} __CPU_ALIGN;
+
+struct heap_depot {
+    struct heap_magazine *full;
+    struct heap_magazine *empty;
+    uint full_count;
+    uint empty_count;
+};
+
+static struct heap_cpu_cache heap_cpu_cache[SMP_MAX_CPUS];
+static struct heap_depot heap_depot[HEAP_MAG_CLASSES];
+static spin_lock_t heap_depot_lock = SPIN_LOCK_INITIAL_VALUE;
+
+static inline uint heap_mag_alloc_class(size_t size)
+{
+    DEBUG_ASSERT(size > 0 && size <= HEAP_MAG_MAX_SIZE);
+    return (size - 1) / HEAP_MAG_GRAIN;
+}
+
+static inline size_t heap_mag_class_size(uint class)
+{
+    return (class + 1) * HEAP_MAG_GRAIN;
+}
+
+/* the largest class a block of the given usable size can satisfy, or -1 */
+static inline int heap_mag_free_class(size_t usable)
+{
+    if (usable < HEAP_MAG_GRAIN || usable >= HEAP_MAG_MAX_SIZE + HEAP_MAG_GRAIN)
+        return -1;
+    return usable / HEAP_MAG_GRAIN - 1;
+}
+
+/* disable interrupts and lock the current cpu's cache, pinning us to it */
+static struct heap_cpu_cache *heap_cpu_cache_lock(spin_lock_saved_state_t *state)
+{
+    arch_interrupt_save(state, SPIN_LOCK_FLAG_INTERRUPTS);
+    struct heap_cpu_cache *cc = &heap_cpu_cache[arch_curr_cpu_num()];
+    spin_lock(&cc->lock);
+    return cc;
+}
+
+static void heap_cpu_cache_unlock(struct heap_cpu_cache *cc, spin_lock_saved_state_t state)
+{
+    spin_unlock(&cc->lock);
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+/* hand a magazine's blocks back to the heap, leaving it empty */
+/* give a block back to the backend, whose lock the caller holds if locked */
+static void heap_mag_free_block(void *ptr, bool locked)
+{
+    if (locked) {
+        /* magazines only ever hold small blocks, which the backend can always take */
+        __UNUSED bool freed = HEAP_FREE_LOCKED(ptr);
+        DEBUG_ASSERT(freed);
+    } else {
+        HEAP_FREE(ptr);
+    }
+}
+
+static void heap_mag_release_rounds(struct heap_magazine *m, bool locked)
+{
+    for (uint i = 0; i < m->count; i++)
+        heap_mag_free_block(m->rounds[i], locked);
+    m->count = 0;
+}
+
+static void heap_depot_put_empty(uint class, struct heap_magazine *m)
+{
+    DEBUG_ASSERT(m->count == 0);
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_depot_lock, state);
+    m->next = heap_depot[class].empty;
+    heap_depot[class].empty = m;
+    heap_depot[class].empty_count++;
+    spin_unlock_irqrestore(&heap_depot_lock, state);
+}
+
+static void *heap_mag_alloc(size_t size)
+{
+    uint class = heap_mag_alloc_class(size);
+    void *ptr = NULL;
+
+    spin_lock_saved_state_t state;
+    struct heap_cpu_cache *cc = heap_cpu_cache_lock(&state);
+    struct heap_magazine **loaded = &cc->mag[class].loaded;
+    struct heap_magazine **prev = &cc->mag[class].prev;
+
+    if (unlikely(!*loaded || (*loaded)->count == 0)) {
+        if (*prev && (*prev)->count > 0) {
+            struct heap_magazine *temp = *loaded;
+            *loaded = *prev;
+            *prev = temp;
+        } else {
+            /* trade our empty magazine for a full one from the depot */
+            struct heap_depot *d = &heap_depot[class];
+            spin_lock(&heap_depot_lock);
+            struct heap_magazine *full = d->full;
+            if (full) {
+                d->full = full->next;
+                d->full_count--;
+                if (*prev) {
+                    (*prev)->next = d->empty;
+                    d->empty = *prev;
+                    d->empty_count++;
+                }
+                *prev = *loaded;
+                *loaded = full;
+            }
+            spin_unlock(&heap_depot_lock);
+        }
+    }
+
+    if (likely(*loaded && (*loaded)->count > 0)) {
+        ptr = (*loaded)->rounds[--(*loaded)->count];
+        cc->alloc_hits++;
+    } else {
+        cc->alloc_misses++;
+    }
+    heap_cpu_cache_unlock(cc, state);
+
+    if (!ptr)
+        ptr = HEAP_MALLOC(heap_mag_class_size(class));
+
+    return ptr;
+}
+
+static void heap_mag_free(void *ptr)
+{
+    int class = heap_mag_free_class(HEAP_USABLE_SIZE(ptr));
+    if (class < 0) {
+        HEAP_FREE(ptr);
+        return;
+    }
+
+    struct heap_magazine *spare = NULL;
+    for (;;) {
+        struct heap_magazine *spill = NULL;
+
+        spin_lock_saved_state_t state;
+        struct heap_cpu_cache *cc = heap_cpu_cache_lock(&state);
+        struct heap_magazine **loaded = &cc->mag[class].loaded;
+        struct heap_magazine **prev = &cc->mag[class].prev;
+
+        if (likely(*loaded && (*loaded)->count < HEAP_MAG_ROUNDS)) {
+            (*loaded)->rounds[(*loaded)->count++] = ptr;
+            cc->free_hits++;
+            heap_cpu_cache_unlock(cc, state);
+            break;
+        }
+
+        if (*prev && (*prev)->count < HEAP_MAG_ROUNDS) {
+            struct heap_magazine *temp = *loaded;
+            *loaded = *prev;
+            *prev = temp;
+            (*loaded)->rounds[(*loaded)->count++] = ptr;
+            cc->free_hits++;
+            heap_cpu_cache_unlock(cc, state);
+            break;
+        }
+
+        /* both magazines are full (or missing), trade one for an empty from the depot */
+        struct heap_depot *d = &heap_depot[class];
+        spin_lock(&heap_depot_lock);
+        struct heap_magazine *empty = d->empty;
+        if (empty) {
+            d->empty = empty->next;
+            d->empty_count--;
+        } else {
+            empty = spare;
+            spare = NULL;
+        }
+        if (empty) {
+            if (*prev) {
+                if (d->full_count < HEAP_DEPOT_MAX_FULL) {
+                    (*prev)->next = d->full;
+                    d->full = *prev;
+                    d->full_count++;
+                } else {
+                    spill = *prev;
+                }
+            }
+            *prev = *loaded;
+            *loaded = empty;
+            empty->rounds[empty->count++] = ptr;
+            cc->free_hits++;
+        } else {
+            cc->free_misses++;
+        }
+        spin_unlock(&heap_depot_lock);
+        heap_cpu_cache_unlock(cc, state);
+
+        if (empty) {
+            /* the depot is at its limit, give the blocks back to the heap */
+            if (spill) {
+                heap_mag_release_rounds(spill, false);
+                heap_depot_put_empty(class, spill);
+            }
+            break;
+        }
+
+        /* no empty magazines anywhere, make a new one and try again */
+        spare = HEAP_MALLOC(sizeof(struct heap_magazine));
+        if (!spare) {
+            HEAP_FREE(ptr);
+            return;
+        }
+        spare->count = 0;
+    }
+
+    if (spare)
+        heap_depot_put_empty(class, spare);
+}
+
+/* return every cached block and magazine to the underlying heap */
+static void heap_mag_flush(bool locked)
+{
+    struct heap_magazine *list = NULL;
+
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct heap_cpu_cache *cc = &heap_cpu_cache[cpu];
+
+        spin_lock_saved_state_t state;
+        spin_lock_irqsave(&cc->lock, state);
+        for (uint class = 0; class < HEAP_MAG_CLASSES; class++) {
+            struct heap_magazine *m[2] = { cc->mag[class].loaded, cc->mag[class].prev };
+            cc->mag[class].loaded = cc->mag[class].prev = NULL;
+            for (uint i = 0; i < countof(m); i++) {
+                if (m[i]) {
+                    m[i]->next = list;
+                    list = m[i];
+                }
+            }
+        }
+        spin_unlock_irqrestore(&cc->lock, state);
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_depot_lock, state);
+    for (uint class = 0; class < HEAP_MAG_CLASSES; class++) {
+        struct heap_depot *d = &heap_depot[class];
+        struct heap_magazine *lists[2] = { d->full, d->empty };
+        for (uint i = 0; i < countof(lists); i++) {
+            struct heap_magazine *m = lists[i];
+            while (m) {
+                struct heap_magazine *next = m->next;
+                m->next = list;
+                list = m;
+                m = next;
+            }
+        }
+        d->full = d->empty = NULL;
+        d->full_count = d->empty_count = 0;
+    }
+    spin_unlock_irqrestore(&heap_depot_lock, state);
+
+    while (list) {
+        struct heap_magazine *next = list->next;
+        heap_mag_release_rounds(list, locked);
+        heap_mag_free_block(list, locked);
+        list = next;
+    }
+}
+
+static void heap_mag_dump(void)
+{
+    printf("\tmagazines (%u classes up to %u bytes, %u rounds each):\n",
+           HEAP_MAG_CLASSES, HEAP_MAG_MAX_SIZE, HEAP_MAG_ROUNDS);
+    for (uint cpu = 0; cpu < SMP_MAX_CPUS; cpu++) {
+        struct heap_cpu_cache *cc = &heap_cpu_cache[cpu];
+        if (cc->alloc_hits + cc->alloc_misses + cc->free_hits + cc->free_misses == 0)
+            continue;
+        printf("\t\tcpu %u: alloc hits %lu misses %lu, free hits %lu misses %lu\n",
+               cpu, cc->alloc_hits, cc->alloc_misses, cc->free_hits, cc->free_misses);
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_depot_lock, state);
+    for (uint class = 0; class < HEAP_MAG_CLASSES; class++) {
+        struct heap_depot *d = &heap_depot[class];
+        if (d->full_count + d->empty_count == 0)
+            continue;
+        printf("\t\tdepot class %zu: %u full, %u empty\n",
+               heap_mag_class_size(class), d->full_count, d->empty_count);
+    }
+    spin_unlock_irqrestore(&heap_depot_lock, state);
+}
+#endif // HEAP_MAGAZINES
+
+/*
+ * Allocation profiler.
+ *
+ * When built with LK_HEAP_PROFILE and switched on with `heap profile on`,
+ * one in every heap_prof_rate allocations is sampled. A sampled allocation is
+ * charged to its site, which is the caller's return address or an explicit tag
+ * passed to malloc_tagged(). It also goes into a size class histogram and is
+ * remembered in a table of live sampled blocks, so a later free can take it
+ * off its site's live count again. Every count is weighted by the sampling
+ * rate in effect when the block was allocated, so the totals estimate the
+ * real numbers.
+ *
+ * `heap profile dump` prints the sites in a line-oriented format that
+ * tools/heapprof.py turns into folded stacks for flamegraph.pl.
+ */
+#if LK_HEAP_PROFILE
+#define HEAP_PROF_SITES 512   /* must be a power of 2 */
+#define HEAP_PROF_LIVE  4096  /* must be a power of 2 */
+#define HEAP_PROF_HIST  (sizeof(size_t) * 8)
+
+struct heap_prof_site {
+    uintptr_t caller;
+    const char *tag;
+    uint64_t allocs;
+    uint64_t alloc_bytes;
+    uint64_t live;
+    uint64_t live_bytes;
+};
+
+struct heap_prof_live {
+    void *ptr;
+    size_t size;
+    uint weight;
+    struct heap_prof_site *site;
+};
+
+static bool heap_prof_enabled;
+static uint heap_prof_rate = 1;
+static volatile int heap_prof_counter;
+static uint heap_prof_live_count;
+static ulong heap_prof_dropped;
+static spin_lock_t heap_prof_lock = SPIN_LOCK_INITIAL_VALUE;
+static struct heap_prof_site heap_prof_sites[HEAP_PROF_SITES];
+static struct heap_prof_site heap_prof_overflow_site = { .tag = "(untracked sites)" };
+static struct heap_prof_live heap_prof_live[HEAP_PROF_LIVE];
+static uint64_t heap_prof_hist[HEAP_PROF_HIST];
+
+static inline uint heap_prof_hash(uintptr_t val, uint mask)
+{
+    /* fibonacci hashing, allocations are at least 8 byte aligned */
+    return ((val >> 3) * 2654435761u) & mask;
+}
+
+static struct heap_prof_site *heap_prof_find_site(uintptr_t caller, const char *tag)
+{
+    uint mask = HEAP_PROF_SITES - 1;
+    uint i = heap_prof_hash(caller ^ (uintptr_t)tag, mask);
+
+    for (uint n = 0; n < HEAP_PROF_SITES; n++, i = (i + 1) & mask) {
+        struct heap_prof_site *s = &heap_prof_sites[i];
+        if (s->caller == caller && s->tag == tag)
+            return s;
+        if (s->caller == 0 && s->tag == NULL) {
+            s->caller = caller;
+            s->tag = tag;
+            return s;
+        }
+    }
+
+    return &heap_prof_overflow_site;
+}
+
+static void heap_prof_record_alloc(void *ptr, size_t size, uintptr_t caller, const char *tag)
+{
+    uint rate = heap_prof_rate;
+    if (rate > 1 && (uint)atomic_add(&heap_prof_counter, 1) % rate != 0)
+        return;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_prof_lock, state);
+
+    struct heap_prof_site *site = heap_prof_find_site(tag ? 0 : caller, tag);
+    site->allocs += rate;
+    site->alloc_bytes += (uint64_t)size * rate;
+    heap_prof_hist[size ? (sizeof(size_t) * 8 - 1 - __builtin_clzl(size)) : 0] += rate;
+
+    /* keep the table at most 3/4 full so probe sequences stay short */
+    if (heap_prof_live_count >= HEAP_PROF_LIVE / 4 * 3) {
+        heap_prof_dropped++;
+    } else {
+        uint mask = HEAP_PROF_LIVE - 1;
+        uint i = heap_prof_hash((uintptr_t)ptr, mask);
+        while (heap_prof_live[i].ptr)
+            i = (i + 1) & mask;
+
+        heap_prof_live[i].ptr = ptr;
+        heap_prof_live[i].size = size;
+        heap_prof_live[i].weight = rate;
+        heap_prof_live[i].site = site;
+        heap_prof_live_count++;
+
+        site->live += rate;
+        site->live_bytes += (uint64_t)size * rate;
+    }
+
+    spin_unlock_irqrestore(&heap_prof_lock, state);
+}
+
+static void heap_prof_record_free(void *ptr)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_prof_lock, state);
+
+    uint mask = HEAP_PROF_LIVE - 1;
+    uint i = heap_prof_hash((uintptr_t)ptr, mask);
+    while (heap_prof_live[i].ptr && heap_prof_live[i].ptr != ptr)
+        i = (i + 1) & mask;
+
+    if (heap_prof_live[i].ptr) {
+        struct heap_prof_live *l = &heap_prof_live[i];
+        l->site->live -= l->weight;
+        l->site->live_bytes -= (uint64_t)l->size * l->weight;
+        heap_prof_live_count--;
+
+        /* close the hole by shifting back any entry that probed past it */
+        uint j = i;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (!heap_prof_live[j].ptr)
+                break;
+            uint k = heap_prof_hash((uintptr_t)heap_prof_live[j].ptr, mask);
+            if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+                continue;
+            heap_prof_live[i] = heap_prof_live[j];
+            i = j;
+        }
+        heap_prof_live[i].ptr = NULL;
+    }
+
+    spin_unlock_irqrestore(&heap_prof_lock, state);
+}
+
+static void heap_prof_reset(void)
+{
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_prof_lock, state);
+    memset(heap_prof_sites, 0, sizeof(heap_prof_sites));
+    memset(heap_prof_live, 0, sizeof(heap_prof_live));
+    memset(heap_prof_hist, 0, sizeof(heap_prof_hist));
+    heap_prof_overflow_site.allocs = heap_prof_overflow_site.alloc_bytes = 0;
+    heap_prof_overflow_site.live = heap_prof_overflow_site.live_bytes = 0;
+    heap_prof_live_count = 0;
+    heap_prof_dropped = 0;
+    spin_unlock_irqrestore(&heap_prof_lock, state);
+}
+
+/* copy a site out so it can be printed without holding the lock */
+static bool heap_prof_get_site(uint index, struct heap_prof_site *out)
+{
+    struct heap_prof_site *s = (index < HEAP_PROF_SITES) ? &heap_prof_sites[index] : &heap_prof_overflow_site;
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&heap_prof_lock, state);
+    *out = *s;
+    spin_unlock_irqrestore(&heap_prof_lock, state);
+
+    return out->allocs != 0;
+}
+
+static void heap_prof_print_site(const char *prefix, const struct heap_prof_site *s)
+{
+    if (s->tag)
+        printf("%s%s", prefix, s->tag);
+    else
+        printf("%s%p", prefix, (void *)s->caller);
+}
+
+/* human readable summary, the sites holding the most memory first */
+static void heap_prof_summary(void)
+{
+    printf("heap profile: %s, sampling 1 in %u, %u live samples, %lu dropped\n",
+           heap_prof_enabled ? "on" : "off", heap_prof_rate, heap_prof_live_count, heap_prof_dropped);
+
+    printf("\ttop sites by live bytes:\n");
+    uint64_t last = UINT64_MAX;
+    uint last_index = 0;
+    for (uint n = 0; n < 20; n++) {
+        /* find the next biggest site after the one we printed last */
+        struct heap_prof_site best = { 0 }, s;
+        uint best_index = UINT_MAX;
+        for (uint i = 0; i <= HEAP_PROF_SITES; i++) {
+            if (!heap_prof_get_site(i, &s))
+                continue;
+            if (s.live_bytes > last || (s.live_bytes == last && i <= last_index))
+                continue;
+            if (best_index == UINT_MAX || s.live_bytes > best.live_bytes) {
+                best = s;
+                best_index = i;
+            }
+        }
+        if (best_index == UINT_MAX)
+            break;
+
+        heap_prof_print_site("\t\t", &best);
+        printf(": live %llu bytes in %llu blocks, total %llu bytes in %llu allocations\n",
+               best.live_bytes, best.live, best.alloc_bytes, best.allocs);
+        last = best.live_bytes;
+        last_index = best_index;
+    }
+
+    printf("\tallocation sizes:\n");
+    for (uint i = 0; i < HEAP_PROF_HIST; i++) {
+        if (heap_prof_hist[i])
+            printf("\t\t%10zu+ bytes: %llu\n", (size_t)1 << i, heap_prof_hist[i]);
+    }
+}
+
+/*
+ * machine readable dump, one record per line:
+ *   heapprof begin <rate>
+ *   heapprof site <caller> <allocs> <alloc bytes> <live blocks> <live bytes> <tag or ->
+ *   heapprof hist <min size> <allocs>
+ *   heapprof end
+ * the site tag goes last since it may contain spaces.
+ */
+static void heap_prof_dump(void)
+{
+    printf("heapprof begin %u\n", heap_prof_rate);
+    for (uint i = 0; i <= HEAP_PROF_SITES; i++) {
+        struct heap_prof_site s;
+        if (!heap_prof_get_site(i, &s))
+            continue;
+        printf("heapprof site %#lx %llu %llu %llu %llu %s\n", (ulong)s.caller,
+               s.allocs, s.alloc_bytes, s.live, s.live_bytes, s.tag ? s.tag : "-");
+    }
+    for (uint i = 0; i < HEAP_PROF_HIST; i++) {
+        if (heap_prof_hist[i])
+            printf("heapprof hist %zu %llu\n", (size_t)1 << i, heap_prof_hist[i]);
+    }
+    printf("heapprof end\n");
+}
+
+#define HEAP_PROF_ALLOC(ptr, size, caller, tag) \
+    do { \
+        if (unlikely(heap_prof_enabled) && (ptr)) \
+            heap_prof_record_alloc((ptr), (size), (uintptr_t)(caller), (tag)); \
+    } while (0)
+#define HEAP_PROF_FREE(ptr) \
+    do { \
+        if (unlikely(heap_prof_live_count > 0) && (ptr)) \
+            heap_prof_record_free(ptr); \
+    } while (0)
+#else
+#define HEAP_PROF_ALLOC(ptr, size, caller, tag) do {} while (0)
+#define HEAP_PROF_FREE(ptr) do {} while (0)
+#endif // LK_HEAP_PROFILE
+
+/* free the blocks queued by frees from interrupt context. If locked the
+ * caller holds the backend's lock, and blocks it can't take like that are
+ * queued again. */
+static void heap_free_delayed_list(bool locked)
 {
     struct list_node list;
 
@@ -152,7 +771,13 @@ static void heap_free_delayed_list(void)
 
     while ((node = list_remove_head(&list))) {
         LTRACEF("freeing node %p\n", node);
-        HEAP_FREE(node);
+        if (!locked) {
+            HEAP_FREE(node);
+        } else if (!HEAP_FREE_LOCKED(node)) {
+            spin_lock_irqsave(&delayed_free_lock, state);
+            list_add_tail(&delayed_free_list, node);
+            spin_unlock_irqrestore(&delayed_free_lock, state);
+        }
     }
 }
 
@@ -165,37 +790,113 @@ void heap_trim(void)
 {
     // deal with the pending free list
     if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
+        heap_free_delayed_list(false);
     }
 
+#if HEAP_MAGAZINES
+    heap_mag_flush(false);
+#endif
+
     HEAP_TRIM();
 }
 
-void *malloc(size_t size)
+/* heap_trim() all under one try of the backend's lock, for the shrinker,
+ * which must not block on it. Returns false if the lock was busy. */
+static bool heap_try_trim(void)
 {
-    LTRACEF("size %zd\n", size);
+    if (!HEAP_TRYLOCK())
+        return false;
+
+    if (unlikely(!list_is_empty(&delayed_free_list))) {
+        heap_free_delayed_list(true);
+    }
+
+#if HEAP_MAGAZINES
+    heap_mag_flush(true);
+#endif
+
+    HEAP_TRIM_LOCKED();
+    HEAP_UNLOCK();
+
+    return true;
+}
+
+static size_t heap_shrink(shrinker_t *s, size_t target)
+{
+    uint before = page_free_count();
+    if (!heap_try_trim())
+        return 0;
+    return (page_free_count() - before) * PAGE_SIZE;
+}
+
+static shrinker_t heap_shrinker = SHRINKER_INITIAL_VALUE("heap", &heap_shrink, SHRINKER_COST_FREE);
 
+static void heap_shrinker_init(uint level)
+{
+    shrinker_register(&heap_shrinker);
+}
+
+LK_INIT_HOOK(heap_shrinker, &heap_shrinker_init, LK_INIT_LEVEL_KERNEL);
+
+/* out of memory, see if the shrinkers can find some before failing */
+static inline bool heap_reclaim(size_t size)
+{
+    return size > 0 && shrinker_reclaim(size) > 0;
+}
+
+static void *heap_malloc(size_t size)
+{
     // deal with the pending free list
     if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
+        heap_free_delayed_list(false);
     }
 
-    void *ptr = HEAP_MALLOC(size);
+#if HEAP_MAGAZINES
+    return (size > 0 && size <= HEAP_MAG_MAX_SIZE) ? heap_mag_alloc(size) : HEAP_MALLOC(size);
+#else
+    return HEAP_MALLOC(size);
+#endif
+}
+
+void *malloc(size_t size)
+{
+    LTRACEF("size %zd\n", size);
+
+    void *ptr = heap_malloc(size);
+    if (unlikely(!ptr) && heap_reclaim(size))
+        ptr = heap_malloc(size);
+    HEAP_PROF_ALLOC(ptr, size, __GET_CALLER(), NULL);
     if (heap_trace)
         printf("caller %p malloc %zu -> %p\n", __GET_CALLER(), size, ptr);
     return ptr;
 }
 
+void *malloc_tagged(size_t size, const char *tag)
+{
+    LTRACEF("size %zd, tag '%s'\n", size, tag);
+
+    void *ptr = heap_malloc(size);
+    if (unlikely(!ptr) && heap_reclaim(size))
+        ptr = heap_malloc(size);
+    HEAP_PROF_ALLOC(ptr, size, __GET_CALLER(), tag);
+    if (heap_trace)
+        printf("caller %p malloc %zu tag '%s' -> %p\n", __GET_CALLER(), size, tag, ptr);
+    return ptr;
+}
+
 void *memalign(size_t boundary, size_t size)
 {
     LTRACEF("boundary %zu, size %zd\n", boundary, size);
 
     // deal with the pending free list
     if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
+        heap_free_delayed_list(false);
     }
 
     void *ptr = HEAP_MEMALIGN(boundary, size);
+    if (unlikely(!ptr) && heap_reclaim(size))
+        ptr = HEAP_MEMALIGN(boundary, size);
+    HEAP_PROF_ALLOC(ptr, size, __GET_CALLER(), NULL);
     if (heap_trace)
         printf("caller %p memalign %zu, %zu -> %p\n", __GET_CALLER(), boundary, size, ptr);
     return ptr;
@@ -207,10 +908,29 @@ void *calloc(size_t count, size_t size)
 
     // deal with the pending free list
     if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
+        heap_free_delayed_list(false);
     }
 
-    void *ptr = HEAP_CALLOC(count, size);
+    void *ptr;
+    bool retried = false;
+retry:
+#if HEAP_MAGAZINES
+    size_t realsize = count * size;
+    if (realsize > 0 && realsize <= HEAP_MAG_MAX_SIZE) {
+        ptr = heap_mag_alloc(realsize);
+        if (likely(ptr))
+            memset(ptr, 0, realsize);
+    } else {
+        ptr = HEAP_CALLOC(count, size);
+    }
+#else
+    ptr = HEAP_CALLOC(count, size);
+#endif
+    if (unlikely(!ptr) && !retried && heap_reclaim(count * size)) {
+        retried = true;
+        goto retry;
+    }
+    HEAP_PROF_ALLOC(ptr, count * size, __GET_CALLER(), NULL);
     if (heap_trace)
         printf("caller %p calloc %zu, %zu -> %p\n", __GET_CALLER(), count, size, ptr);
     return ptr;
@@ -222,10 +942,15 @@ void *realloc(void *ptr, size_t size)
 
     // deal with the pending free list
     if (unlikely(!list_is_empty(&delayed_free_list))) {
-        heap_free_delayed_list();
+        heap_free_delayed_list(false);
     }
 
     void *ptr2 = HEAP_REALLOC(ptr, size);
+    if (unlikely(!ptr2) && heap_reclaim(size))
+        ptr2 = HEAP_REALLOC(ptr, size);
+    if (ptr2 || size == 0)
+        HEAP_PROF_FREE(ptr);
+    HEAP_PROF_ALLOC(ptr2, size, __GET_CALLER(), NULL);
     if (heap_trace)
         printf("caller %p realloc %p, %zu -> %p\n", __GET_CALLER(), ptr, size, ptr2);
     return ptr2;
@@ -237,7 +962,14 @@ void free(void *ptr)
     if (heap_trace)
         printf("caller %p free %p\n", __GET_CALLER(), ptr);
 
+    HEAP_PROF_FREE(ptr);
+
+#if HEAP_MAGAZINES
+    if (ptr)
+        heap_mag_free(ptr);
+#else
     HEAP_FREE(ptr);
+#endif
 }
 
 /* critical section time delayed free */
@@ -245,6 +977,8 @@ void heap_delayed_free(void *ptr)
 {
     LTRACEF("ptr %p\n", ptr);
 
+    HEAP_PROF_FREE(ptr);
+
     /* throw down a structure on the free block */
     /* XXX assumes the free block is large enough to hold a list node */
     struct list_node *node = (struct list_node *)ptr;
@@ -259,6 +993,10 @@ static void heap_dump(void)
 {
     HEAP_DUMP();
 
+#if HEAP_MAGAZINES
+    heap_mag_dump();
+#endif
+
     printf("\tdelayed free list:\n");
     spin_lock_saved_state_t state;
     spin_lock_irqsave(&delayed_free_lock, state);
@@ -350,6 +1088,10 @@ usage:
         printf("\t%s alloc <size> [alignment]\n", argv[0].str);
         printf("\t%s realloc <ptr> <size>\n", argv[0].str);
         printf("\t%s free <address>\n", argv[0].str);
+#if LK_HEAP_PROFILE
+        printf("\t%s profile [on|off|reset|dump]\n", argv[0].str);
+        printf("\t%s profile rate <n>\n", argv[0].str);
+#endif
         return -1;
     }
 
@@ -376,6 +1118,27 @@ usage:
         if (argc < 2) goto notenoughargs;
 
         free(argv[2].p);
+#if LK_HEAP_PROFILE
+    } else if (strcmp(argv[1].str, "profile") == 0) {
+        if (argc < 3) {
+            heap_prof_summary();
+        } else if (strcmp(argv[2].str, "on") == 0) {
+            heap_prof_enabled = true;
+        } else if (strcmp(argv[2].str, "off") == 0) {
+            heap_prof_enabled = false;
+        } else if (strcmp(argv[2].str, "reset") == 0) {
+            heap_prof_reset();
+        } else if (strcmp(argv[2].str, "dump") == 0) {
+            heap_prof_dump();
+        } else if (strcmp(argv[2].str, "rate") == 0) {
+            if (argc < 4) goto notenoughargs;
+
+            heap_prof_rate = MAX(argv[3].u, 1u);
+        } else {
+            printf("unrecognized command\n");
+            goto usage;
+        }
+#endif
     } else {
         printf("unrecognized command\n");
         goto usage;
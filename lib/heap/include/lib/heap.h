@@ -35,6 +35,9 @@ void *calloc(size_t count, size_t size) __MALLOC;
 void *realloc(void *ptr, size_t size) __MALLOC;
 void free(void *ptr);
 
+/* malloc, charging the allocation to tag rather than the caller when profiling */
+void *malloc_tagged(size_t size, const char *tag) __MALLOC;
+
 void heap_init(void);
 
 /* critical section time delayed free */
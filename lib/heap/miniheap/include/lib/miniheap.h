@@ -23,6 +23,7 @@
 #pragma once
 
 #include <compiler.h>
+#include <stdbool.h>
 
 __BEGIN_CDECLS;
 
@@ -44,4 +45,10 @@ void miniheap_init(void *ptr, size_t len);
 void miniheap_dump(void);
 void miniheap_trim(void);
 
+/* for callers that can't block on the heap lock, e.g. shrinkers */
+bool miniheap_trylock(void);
+void miniheap_unlock(void);
+bool miniheap_free_locked(void *);
+void miniheap_trim_locked(void);
+
 __END_CDECLS;
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <kernel/mutex.h>
+#include <kernel/shrinker.h>
 #include <lib/miniheap.h>
 #include <lib/heap.h>
 #include <lib/page_alloc.h>
@@ -50,24 +51,66 @@
 
 #define HEAP_MAGIC (0x48454150)  // 'HEAP'
 
+/*
+ * Free chunks are kept in size segregated bins, two level like TLSF. The first
+ * level is the power of two of the size, the second splits each power of two
+ * into SL_COUNT linear ranges. Below SMALL_SIZE the bins are simply linear.
+ * A bitmap of non-empty bins per level lets alloc find the smallest bin whose
+ * chunks are all big enough with a couple of bit scans, and free coalesces
+ * with its neighbors in constant time using boundary tags, so both are O(1).
+ *
+ * Every chunk, used or free, starts with a size_t holding its length and two
+ * flag bits. A free chunk also keeps a copy of its length in its last word,
+ * which lets the chunk after it find its start. Each range of memory handed to
+ * the heap starts with a heap_region and ends with a zero length used sentinel
+ * so coalescing stops there.
+ */
+#define SL_LOG2 2
+#define SL_COUNT (1U << SL_LOG2)
+#define SMALL_LOG2 6
+#define SMALL_SIZE (1U << SMALL_LOG2)
+#define FL_MAX_LOG2 31
+#define FL_COUNT (FL_MAX_LOG2 - SMALL_LOG2 + 1)
+#define MAX_ALLOC_SIZE ((size_t)1 << FL_MAX_LOG2)
+// lower bound of the last bin, which also takes every chunk too big for the bins
+#define TOP_BIN_SIZE (MAX_ALLOC_SIZE - (MAX_ALLOC_SIZE >> (SL_LOG2 + 1)))
+
+#define CHUNK_FREE (1U << 0)
+#define CHUNK_PREV_FREE (1U << 1)
+#define CHUNK_FLAGS (CHUNK_FREE | CHUNK_PREV_FREE)
+#define CHUNK_HEADER_SIZE sizeof(size_t)
+
 struct free_heap_chunk {
+    size_t len; // length of the chunk including this header, ored with CHUNK_* flags
+    struct list_node node;
+};
+
+#define MIN_CHUNK_SIZE ROUNDUP(sizeof(struct free_heap_chunk) + sizeof(size_t), sizeof(void *))
+
+// placed at the start of every range of memory added to the heap
+struct heap_region {
     struct list_node node;
     size_t len;
 };
 
+#define REGION_HEADER_SIZE ROUNDUP(sizeof(struct heap_region), sizeof(void *))
+
 struct heap {
     void *base;
     size_t len;
     size_t remaining;
     size_t low_watermark;
     mutex_t lock;
-    struct list_node free_list;
+    struct list_node regions;
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    struct list_node free_lists[FL_COUNT][SL_COUNT];
 };
 
 // heap static vars
 static struct heap theheap;
 
-// structure placed at the beginning every allocation
+// structure placed at the beginning every allocation, after the chunk header
 struct alloc_struct_begin {
 #if LK_DEBUGLEVEL > 1
     unsigned int magic;
@@ -82,104 +125,250 @@ struct alloc_struct_begin {
 
 static ssize_t heap_grow(size_t len);
 
-static void dump_free_chunk(struct free_heap_chunk *chunk)
+static inline size_t chunk_len(const struct free_heap_chunk *chunk)
 {
-    dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk + chunk->len, chunk->len);
+    return chunk->len & ~(size_t)CHUNK_FLAGS;
 }
 
-void miniheap_dump(void)
+static inline struct free_heap_chunk *chunk_next(const struct free_heap_chunk *chunk)
 {
-    dprintf(INFO, "Heap dump (using miniheap):\n");
-    dprintf(INFO, "\tbase %p, len 0x%zx\n", theheap.base, theheap.len);
-    dprintf(INFO, "\tfree list:\n");
+    return (struct free_heap_chunk *)((uintptr_t)chunk + chunk_len(chunk));
+}
 
-    mutex_acquire(&theheap.lock);
+static inline struct free_heap_chunk *chunk_prev(const struct free_heap_chunk *chunk)
+{
+    // only valid if the previous chunk is free and has a footer
+    DEBUG_ASSERT(chunk->len & CHUNK_PREV_FREE);
+    size_t prev_len = ((const size_t *)chunk)[-1];
+    return (struct free_heap_chunk *)((uintptr_t)chunk - prev_len);
+}
 
-    struct free_heap_chunk *chunk;
-    list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-        dump_free_chunk(chunk);
+static inline void chunk_set_footer(struct free_heap_chunk *chunk)
+{
+    *(size_t *)((uintptr_t)chunk_next(chunk) - sizeof(size_t)) = chunk_len(chunk);
+}
+
+static inline uint size_log2(size_t size)
+{
+    return sizeof(unsigned long) * 8 - 1 - __builtin_clzl(size);
+}
+
+// compute the bin a chunk of this size belongs in
+static void size_to_bin(size_t size, uint *fl, uint *sl)
+{
+    if (size < SMALL_SIZE) {
+        *fl = 0;
+        *sl = size / (SMALL_SIZE / SL_COUNT);
+    } else {
+        uint log2 = size_log2(size);
+        *fl = log2 - SMALL_LOG2 + 1;
+        *sl = (size >> (log2 - SL_LOG2)) & (SL_COUNT - 1);
+        if (*fl >= FL_COUNT) {
+            *fl = FL_COUNT - 1;
+            *sl = SL_COUNT - 1;
+        }
     }
-    mutex_release(&theheap.lock);
+}
 
+// round a size up so that every chunk in its bin is at least that big
+static size_t size_round_to_bin(size_t size)
+{
+    if (size < SMALL_SIZE)
+        return ROUNDUP(size, SMALL_SIZE / SL_COUNT);
+
+    size_t step = (size_t)1 << (size_log2(size) - SL_LOG2);
+    return ROUNDUP(size, step);
 }
 
-// try to insert this free chunk into the free list, consuming the chunk by merging it with
-// nearby ones if possible. Returns base of whatever chunk it became in the list.
-static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+static void bin_insert(struct free_heap_chunk *chunk)
 {
-#if LK_DEBUGLEVEL > INFO
-    vaddr_t chunk_end = (vaddr_t)chunk + chunk->len;
-#endif
+    uint fl, sl;
+    size_to_bin(chunk_len(chunk), &fl, &sl);
+
+    list_add_head(&theheap.free_lists[fl][sl], &chunk->node);
+    theheap.fl_bitmap |= 1U << fl;
+    theheap.sl_bitmap[fl] |= 1U << sl;
+}
 
-    LTRACEF("chunk ptr %p, size 0x%zx\n", chunk, chunk->len);
+static void bin_remove(struct free_heap_chunk *chunk)
+{
+    uint fl, sl;
+    size_to_bin(chunk_len(chunk), &fl, &sl);
+
+    list_delete(&chunk->node);
+    if (list_is_empty(&theheap.free_lists[fl][sl])) {
+        theheap.sl_bitmap[fl] &= ~(1U << sl);
+        if (theheap.sl_bitmap[fl] == 0)
+            theheap.fl_bitmap &= ~(1U << fl);
+    }
+}
 
-    struct free_heap_chunk *next_chunk;
-    struct free_heap_chunk *last_chunk;
+// find a free chunk of at least size bytes in the first non-empty bin that is
+// guaranteed to hold one, without looking at individual chunks
+static struct free_heap_chunk *bin_find(size_t size)
+{
+    // the top bin takes chunks of any size from TOP_BIN_SIZE up, so one rounded
+    // into it isn't guaranteed to fit; check each chunk there
+    if (size_round_to_bin(size) >= TOP_BIN_SIZE) {
+        struct free_heap_chunk *chunk;
+        list_for_every_entry(&theheap.free_lists[FL_COUNT - 1][SL_COUNT - 1], chunk,
+                             struct free_heap_chunk, node) {
+            if (chunk_len(chunk) >= size)
+                return chunk;
+        }
+        return NULL;
+    }
 
-    mutex_acquire(&theheap.lock);
+    uint fl, sl;
+    size_to_bin(size_round_to_bin(size), &fl, &sl);
 
-    theheap.remaining += chunk->len;
+    uint32_t sl_map = theheap.sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0) {
+        uint32_t fl_map = (fl + 1 < 32) ? theheap.fl_bitmap & (~0U << (fl + 1)) : 0;
+        if (fl_map == 0)
+            return NULL;
 
-    // walk through the list, finding the node to insert before
-    list_for_every_entry(&theheap.free_list, next_chunk, struct free_heap_chunk, node) {
-        if (chunk < next_chunk) {
-            DEBUG_ASSERT(chunk_end <= (vaddr_t)next_chunk);
+        fl = __builtin_ctz(fl_map);
+        sl_map = theheap.sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
 
-            list_add_before(&next_chunk->node, &chunk->node);
+    return list_peek_head_type(&theheap.free_lists[fl][sl], struct free_heap_chunk, node);
+}
 
-            goto try_merge;
+// last resort when the heap can't grow: search the bin the size itself falls in,
+// whose chunks may or may not be big enough
+static struct free_heap_chunk *bin_search(size_t size)
+{
+    uint fl, sl;
+    size_to_bin(size, &fl, &sl);
+
+    struct free_heap_chunk *chunk;
+    list_for_every_entry(&theheap.free_lists[fl][sl], chunk, struct free_heap_chunk, node) {
+        if (chunk_len(chunk) >= size)
+            return chunk;
+    }
+
+    return NULL;
+}
+
+static void dump_free_chunk(struct free_heap_chunk *chunk)
+{
+    dprintf(INFO, "\t\tbase %p, end 0x%lx, len 0x%zx\n", chunk, (vaddr_t)chunk_next(chunk), chunk_len(chunk));
+}
+
+void miniheap_dump(void)
+{
+    dprintf(INFO, "Heap dump (using miniheap):\n");
+    dprintf(INFO, "\tbase %p, len 0x%zx\n", theheap.base, theheap.len);
+    dprintf(INFO, "\tfree lists:\n");
+
+    mutex_acquire(&theheap.lock);
+
+    for (uint fl = 0; fl < FL_COUNT; fl++) {
+        for (uint sl = 0; sl < SL_COUNT; sl++) {
+            if (list_is_empty(&theheap.free_lists[fl][sl]))
+                continue;
+
+            dprintf(INFO, "\tbin %u.%u:\n", fl, sl);
+            struct free_heap_chunk *chunk;
+            list_for_every_entry(&theheap.free_lists[fl][sl], chunk, struct free_heap_chunk, node) {
+                dump_free_chunk(chunk);
+            }
         }
     }
+    mutex_release(&theheap.lock);
 
-    // walked off the end of the list, add it at the tail
-    list_add_tail(&theheap.free_list, &chunk->node);
+}
+
+// mark this chunk free and put it in its bin, consuming the chunk by merging it with
+// its neighbors if they are free. Returns whatever chunk it became. Called with the lock held.
+static struct free_heap_chunk *heap_insert_free_chunk(struct free_heap_chunk *chunk)
+{
+    LTRACEF("chunk ptr %p, size 0x%zx\n", chunk, chunk_len(chunk));
+
+    theheap.remaining += chunk_len(chunk);
 
     // try to merge with the previous chunk
-try_merge:
-    last_chunk = list_prev_type(&theheap.free_list, &chunk->node, struct free_heap_chunk, node);
-    if (last_chunk) {
-        if ((vaddr_t)last_chunk + last_chunk->len == (vaddr_t)chunk) {
-            // easy, just extend the previous chunk
-            last_chunk->len += chunk->len;
-
-            // remove ourself from the list
-            list_delete(&chunk->node);
-
-            // set the chunk pointer to the newly extended chunk, in case
-            // it needs to merge with the next chunk below
-            chunk = last_chunk;
-        }
+    if (chunk->len & CHUNK_PREV_FREE) {
+        struct free_heap_chunk *prev_chunk = chunk_prev(chunk);
+        DEBUG_ASSERT(prev_chunk->len & CHUNK_FREE);
+
+        bin_remove(prev_chunk);
+        prev_chunk->len += chunk_len(chunk);
+        chunk = prev_chunk;
     }
 
     // try to merge with the next chunk
-    if (next_chunk) {
-        if ((vaddr_t)chunk + chunk->len == (vaddr_t)next_chunk) {
-            // extend our chunk
-            chunk->len += next_chunk->len;
-
-            // remove them from the list
-            list_delete(&next_chunk->node);
-        }
+    struct free_heap_chunk *next_chunk = chunk_next(chunk);
+    if (next_chunk->len & CHUNK_FREE) {
+        bin_remove(next_chunk);
+        chunk->len += chunk_len(next_chunk);
+        next_chunk = chunk_next(chunk);
     }
 
-    mutex_release(&theheap.lock);
+    // the chunk before a free chunk is never free
+    chunk->len = chunk_len(chunk) | CHUNK_FREE;
+    chunk_set_footer(chunk);
+    next_chunk->len |= CHUNK_PREV_FREE;
+
+    bin_insert(chunk);
 
     return chunk;
 }
 
-static struct free_heap_chunk *heap_create_free_chunk(void *ptr, size_t len, bool allow_debug)
+// add a range of memory to the heap, closing it off with a sentinel
+static void heap_add_region(void *ptr, size_t len)
 {
-    DEBUG_ASSERT((len % sizeof(void *)) == 0); // size must be aligned on pointer boundary
+    DEBUG_ASSERT(IS_ALIGNED(ptr, sizeof(void *)));
+
+    len = ROUNDDOWN(len, sizeof(void *));
+    if (len < REGION_HEADER_SIZE + MIN_CHUNK_SIZE + CHUNK_HEADER_SIZE)
+        return;
 
 #if DEBUG_HEAP
-    if (allow_debug)
-        memset(ptr, FREE_FILL, len);
+    memset(ptr, FREE_FILL, len);
 #endif
 
-    struct free_heap_chunk *chunk = (struct free_heap_chunk *)ptr;
-    chunk->len = len;
+    struct heap_region *region = (struct heap_region *)ptr;
+    region->len = len;
 
-    return chunk;
+    struct free_heap_chunk *chunk = (struct free_heap_chunk *)((uintptr_t)ptr + REGION_HEADER_SIZE);
+    chunk->len = len - REGION_HEADER_SIZE - CHUNK_HEADER_SIZE;
+
+    struct free_heap_chunk *sentinel = chunk_next(chunk);
+    sentinel->len = 0;
+
+    mutex_acquire(&theheap.lock);
+    list_add_tail(&theheap.regions, &region->node);
+    heap_insert_free_chunk(chunk);
+    mutex_release(&theheap.lock);
+}
+
+// carve size bytes off the front of a free chunk, returning the rest to the bins.
+// Called with the lock held.
+static void heap_take_chunk(struct free_heap_chunk *chunk, size_t size)
+{
+    DEBUG_ASSERT(chunk->len & CHUNK_FREE);
+    DEBUG_ASSERT(chunk_len(chunk) >= size);
+
+    bin_remove(chunk);
+
+    size_t len = chunk_len(chunk);
+    if (len - size >= MIN_CHUNK_SIZE) {
+        // there's enough space in this chunk to create a new one after the allocation
+        struct free_heap_chunk *newchunk = (struct free_heap_chunk *)((uintptr_t)chunk + size);
+        newchunk->len = (len - size) | CHUNK_FREE;
+        chunk_set_footer(newchunk);
+        bin_insert(newchunk);
+
+        len = size;
+    } else {
+        chunk_next(chunk)->len &= ~(size_t)CHUNK_PREV_FREE;
+    }
+
+    chunk->len = len;
+    theheap.remaining -= len;
 }
 
 void *miniheap_alloc(size_t size, unsigned int alignment)
@@ -195,17 +384,19 @@ void *miniheap_alloc(size_t size, unsigned int alignment)
     if (alignment & (alignment - 1))
         return NULL;
 
-    // we always put a size field + base pointer + magic in front of the allocation
-    size += sizeof(struct alloc_struct_begin);
+    if (size > MAX_ALLOC_SIZE)
+        return NULL;
+
+    // we always put a chunk header + size field + base pointer + magic in front of the allocation
+    size += CHUNK_HEADER_SIZE + sizeof(struct alloc_struct_begin);
 #if DEBUG_HEAP
     size += PADDING_SIZE;
 #endif
 
-    // make sure we allocate at least the size of a struct free_heap_chunk so that
-    // when we free it, we can create a struct free_heap_chunk struct and stick it
-    // in the spot
-    if (size < sizeof(struct free_heap_chunk))
-        size = sizeof(struct free_heap_chunk);
+    // make sure we allocate at least the size of a struct free_heap_chunk and its
+    // footer so that when we free it, we can turn it back into a free chunk in the spot
+    if (size < MIN_CHUNK_SIZE)
+        size = MIN_CHUNK_SIZE;
 
     // round up size to a multiple of native pointer size
     size = ROUNDUP(size, sizeof(void *));
@@ -219,86 +410,64 @@ void *miniheap_alloc(size_t size, unsigned int alignment)
         size += alignment;
     }
 
+    bool grow_failed = false;
     int retry_count = 0;
 retry:
     mutex_acquire(&theheap.lock);
 
-    // walk through the list
     ptr = NULL;
-    struct free_heap_chunk *chunk;
-    list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-        DEBUG_ASSERT((chunk->len % sizeof(void *)) == 0); // len should always be a multiple of pointer size
+    struct free_heap_chunk *chunk = bin_find(size);
+    if (!chunk && grow_failed)
+        chunk = bin_search(size);
 
-        // is it big enough to service our allocation?
-        if (chunk->len >= size) {
-            ptr = chunk;
+    if (chunk) {
+        DEBUG_ASSERT((chunk_len(chunk) % sizeof(void *)) == 0); // len should always be a multiple of pointer size
 
-            // remove it from the list
-            struct list_node *next_node = list_next(&theheap.free_list, &chunk->node);
-            list_delete(&chunk->node);
+        heap_take_chunk(chunk, size);
 
-            if (chunk->len > size + sizeof(struct free_heap_chunk)) {
-                // there's enough space in this chunk to create a new one after the allocation
-                struct free_heap_chunk *newchunk = heap_create_free_chunk((uint8_t *)ptr + size, chunk->len - size, true);
-
-                // truncate this chunk
-                chunk->len -= chunk->len - size;
-
-                // add the new one where chunk used to be
-                if (next_node)
-                    list_add_before(next_node, &newchunk->node);
-                else
-                    list_add_tail(&theheap.free_list, &newchunk->node);
-            }
-
-            // the allocated size is actually the length of this chunk, not the size requested
-            DEBUG_ASSERT(chunk->len >= size);
-            size = chunk->len;
+        // the allocated size is actually the length of this chunk, not the size requested
+        size = chunk_len(chunk);
 
 #if DEBUG_HEAP
-            memset(ptr, ALLOC_FILL, size);
+        memset((uint8_t *)chunk + CHUNK_HEADER_SIZE, ALLOC_FILL, size - CHUNK_HEADER_SIZE);
 #endif
 
-            ptr = (void *)((addr_t)ptr + sizeof(struct alloc_struct_begin));
+        ptr = (void *)((addr_t)chunk + CHUNK_HEADER_SIZE + sizeof(struct alloc_struct_begin));
 
-            // align the output if requested
-            if (alignment > 0) {
-                ptr = (void *)ROUNDUP((addr_t)ptr, (addr_t)alignment);
-            }
+        // align the output if requested
+        if (alignment > 0) {
+            ptr = (void *)ROUNDUP((addr_t)ptr, (addr_t)alignment);
+        }
 
-            struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
-            as--;
+        struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+        as--;
 #if LK_DEBUGLEVEL > 1
-            as->magic = HEAP_MAGIC;
+        as->magic = HEAP_MAGIC;
 #endif
-            as->ptr = (void *)chunk;
-            as->size = size;
-            theheap.remaining -= size;
+        as->ptr = (void *)chunk;
+        as->size = size;
 
-            if (theheap.remaining < theheap.low_watermark) {
-                theheap.low_watermark = theheap.remaining;
-            }
+        if (theheap.remaining < theheap.low_watermark) {
+            theheap.low_watermark = theheap.remaining;
+        }
 #if DEBUG_HEAP
-            as->padding_start = ((uint8_t *)ptr + original_size);
-            as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
-//          printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
+        as->padding_start = ((uint8_t *)ptr + original_size);
+        as->padding_size = (((addr_t)chunk + size) - ((addr_t)ptr + original_size));
+//      printf("padding start %p, size %u, chunk %p, size %u\n", as->padding_start, as->padding_size, chunk, size);
 
-            memset(as->padding_start, PADDING_FILL, as->padding_size);
+        memset(as->padding_start, PADDING_FILL, as->padding_size);
 #endif
-
-            break;
-        }
     }
 
     mutex_release(&theheap.lock);
 
-    /* try to grow the heap if we can */
+    /* try to grow the heap if we can, by enough to be found in a bin that fits */
     if (ptr == NULL && retry_count == 0) {
-        ssize_t err = heap_grow(size);
-        if (err >= 0) {
-            retry_count++;
-            goto retry;
-        }
+        ssize_t err = heap_grow(size_round_to_bin(size) + CHUNK_HEADER_SIZE);
+        if (err < 0)
+            grow_failed = true;
+        retry_count++;
+        goto retry;
     }
 
     LTRACEF("returning ptr %p\n", ptr);
@@ -321,17 +490,20 @@ void *miniheap_realloc(void *ptr, size_t size)
     if (!p)
         return NULL;
 
-    memcpy(p, ptr, size); // XXX wrong
+    // copy no more than the old allocation held
+    struct alloc_struct_begin *as = (struct alloc_struct_begin *)ptr;
+    as--;
+    size_t old_size = (addr_t)as->ptr + as->size - (addr_t)ptr;
+
+    memcpy(p, ptr, MIN(size, old_size));
     miniheap_free(ptr);
 
     return p;
 }
 
-void miniheap_free(void *ptr)
+// check an allocation being freed and return the chunk to put back in the pool
+static struct free_heap_chunk *heap_free_prepare(void *ptr)
 {
-    if (!ptr)
-        return;
-
     LTRACEF("ptr %p\n", ptr);
 
     // check for the old allocation structure
@@ -357,104 +529,193 @@ void miniheap_free(void *ptr)
 
     LTRACEF("allocation was %zd bytes long at ptr %p\n", as->size, as->ptr);
 
-    // looks good, create a free chunk and add it to the pool
-    heap_insert_free_chunk(heap_create_free_chunk(as->ptr, as->size, true));
+    struct free_heap_chunk *chunk = (struct free_heap_chunk *)as->ptr;
+    DEBUG_ASSERT(chunk_len(chunk) == as->size);
+    DEBUG_ASSERT((chunk->len & CHUNK_FREE) == 0);
+
+#if DEBUG_HEAP
+    memset((uint8_t *)chunk + CHUNK_HEADER_SIZE, FREE_FILL, chunk_len(chunk) - CHUNK_HEADER_SIZE);
+#endif
+
+    return chunk;
+}
+
+void miniheap_free(void *ptr)
+{
+    if (!ptr)
+        return;
+
+    struct free_heap_chunk *chunk = heap_free_prepare(ptr);
+
+    // looks good, put the chunk back in the pool
+    mutex_acquire(&theheap.lock);
+    heap_insert_free_chunk(chunk);
+    mutex_release(&theheap.lock);
 
 #if MINIHEAP_AUTOTRIM
     miniheap_trim();
 #endif
 }
 
-void miniheap_trim(void)
+static inline struct free_heap_chunk *region_first_chunk(struct heap_region *region)
 {
-    LTRACE_ENTRY;
+    return (struct free_heap_chunk *)((uintptr_t)region + REGION_HEADER_SIZE);
+}
 
-    mutex_acquire(&theheap.lock);
+// Return the whole pages inside a free chunk to the page allocator, if there are any.
+// Whatever is left of the region in front of the pages keeps a sentinel at its end,
+// and whatever is left after them becomes a new region, which is returned in back.
+// Called with the lock held.
+static bool heap_trim_chunk(struct heap_region *region, struct free_heap_chunk *chunk,
+                            struct heap_region **back)
+{
+    uintptr_t start = (uintptr_t)chunk;
+    uintptr_t end = (uintptr_t)chunk_next(chunk);
+    uintptr_t region_end = (uintptr_t)region + region->len;
+    DEBUG_ASSERT(end > start); // make sure it doesn't wrap the address space and has a positive len
+
+    LTRACEF("looking at chunk %p, len 0x%zx\n", chunk, chunk_len(chunk));
+
+    // compute the page aligned region in this free block (if any). If the chunk starts
+    // the region the region header can go too, otherwise leave room in front for a
+    // sentinel and either nothing or a whole free chunk.
+    uintptr_t start_page;
+    bool at_region_start = (chunk == region_first_chunk(region) && IS_PAGE_ALIGNED(region));
+    if (at_region_start) {
+        start_page = (uintptr_t)region;
+    } else {
+        start_page = ROUNDUP(start + CHUNK_HEADER_SIZE, PAGE_SIZE);
+        if (start_page - start > CHUNK_HEADER_SIZE &&
+                start_page - start < MIN_CHUNK_SIZE + CHUNK_HEADER_SIZE) {
+            LTRACEF("not enough space for free chunk before\n");
+            start_page += PAGE_SIZE;
+        }
+    }
 
-    // walk through the list, finding free chunks that can be returned to the page allocator
-    struct free_heap_chunk *chunk;
-    struct free_heap_chunk *next_chunk;
-    list_for_every_entry_safe(&theheap.free_list, chunk, next_chunk, struct free_heap_chunk, node) {
-        LTRACEF("looking at chunk %p, len 0x%zx\n", chunk, chunk->len);
+    // likewise after, either the end of the region or a new region with a free chunk in it
+    uintptr_t end_page;
+    bool at_region_end = (end == region_end - CHUNK_HEADER_SIZE && IS_PAGE_ALIGNED(region_end));
+    if (at_region_end) {
+        end_page = region_end;
+    } else {
+        end_page = ROUNDDOWN(end, PAGE_SIZE);
+        if (end - end_page < REGION_HEADER_SIZE + MIN_CHUNK_SIZE) {
+            LTRACEF("not enough space for free chunk afterwards\n");
+            end_page -= PAGE_SIZE;
+        }
+    }
 
-        uintptr_t start = (uintptr_t)chunk;
-        uintptr_t end = start + chunk->len;
-        DEBUG_ASSERT(end > start); // make sure it doesn't wrap the address space and has a positive len
+    // see if the free block encompasses at least one page
+    if (likely(end_page <= start_page))
+        return false;
+
+    LTRACEF("trimming: start 0x%lx, end 0x%lx\n", start_page, end_page);
+
+    bin_remove(chunk);
+    theheap.remaining -= end - start;
+
+    // close off what's in front of the pages
+    if (at_region_start) {
+        list_delete(&region->node);
+    } else {
+        region->len = start_page - (uintptr_t)region;
+
+        struct free_heap_chunk *sentinel = (struct free_heap_chunk *)(start_page - CHUNK_HEADER_SIZE);
+        sentinel->len = 0;
+        if ((uintptr_t)sentinel > start) {
+            chunk->len = ((uintptr_t)sentinel - start) | CHUNK_FREE;
+            chunk_set_footer(chunk);
+            sentinel->len |= CHUNK_PREV_FREE;
+            bin_insert(chunk);
+            theheap.remaining += chunk_len(chunk);
+        }
+    }
 
-        // compute the page aligned region in this free block (if any)
-        uintptr_t start_page = ROUNDUP(start, PAGE_SIZE);
-        uintptr_t end_page = ROUNDDOWN(end, PAGE_SIZE);
-        DEBUG_ASSERT(end_page <= end);
-        DEBUG_ASSERT(start_page >= start);
+    // and start a new region after them
+    *back = NULL;
+    if (!at_region_end) {
+        struct heap_region *new_region = (struct heap_region *)end_page;
+        new_region->len = region_end - end_page;
+        list_add_tail(&theheap.regions, &new_region->node);
 
-        LTRACEF("start page 0x%lx, end page 0x%lx\n", start_page, end_page);
+        struct free_heap_chunk *new_chunk = region_first_chunk(new_region);
+        new_chunk->len = (end - (uintptr_t)new_chunk) | CHUNK_FREE;
+        chunk_set_footer(new_chunk);
+        bin_insert(new_chunk);
+        theheap.remaining += chunk_len(new_chunk);
 
-retry:
-        // see if the free block encompasses at least one page
-        if (unlikely(end_page > start_page)) {
-            LTRACEF("could trim: start 0x%lx, end 0x%lx\n", start_page, end_page);
-
-            // cases where the start of the block is already page aligned
-            if (start_page == start) {
-                // look for special case, we're going to completely remove the chunk
-                if (end_page == end) {
-                    LTRACEF("special case, free chunk completely covers page(s)\n");
-                    list_delete(&chunk->node);
-                    goto free_chunk;
-                }
-            } else {
-                // start of block is not page aligned,
-                // will there be enough space before the block if we trim?
-                if (start_page - start < sizeof(struct free_heap_chunk)) {
-                    LTRACEF("not enough space for free chunk before\n");
-                    start_page += PAGE_SIZE;
-                    goto retry;
-                }
-            }
+        *back = new_region;
+    }
 
-            // do we need to split the free block and create a new block afterwards?
-            if (end_page < end) {
-                size_t new_chunk_size = end - end_page;
-                LTRACEF("will have to split, new chunk will be 0x%zx bytes long\n", new_chunk_size);
+    // return it to the allocator
+    LTRACEF("returning %p size 0x%lx to the page allocator\n", (void *)start_page, end_page - start_page);
+    page_free((void *)start_page, (end_page - start_page) / PAGE_SIZE);
 
-                // if there's not enough space afterwards for a free chunk, we can't free the last page
-                if (new_chunk_size < sizeof(struct free_heap_chunk)) {
-                    LTRACEF("not enough space for free chunk afterwards\n");
-                    end_page -= PAGE_SIZE;
-                    goto retry;
-                }
+    return true;
+}
 
-                // trim the new space off the end of the current chunk
-                chunk->len -= new_chunk_size;
-                end = end_page;
+// walk the chunks in a region, trimming the free ones. Called with the lock held.
+static void heap_trim_region(struct heap_region *region)
+{
+    struct free_heap_chunk *chunk = region_first_chunk(region);
+
+    while (chunk_len(chunk) != 0) {
+        struct heap_region *back;
+        if ((chunk->len & CHUNK_FREE) && heap_trim_chunk(region, chunk, &back)) {
+            // the rest of the region, if there is any, now lives in the new one
+            if (!back)
+                return;
+            region = back;
+            chunk = region_first_chunk(region);
+        }
+        chunk = chunk_next(chunk);
+    }
+}
 
-                // create a new chunk after the one we're trimming
-                struct free_heap_chunk *new_chunk = heap_create_free_chunk((void *)end_page, new_chunk_size, false);
+// miniheap_free() for a caller that already holds the lock, see miniheap_trylock().
+// Always succeeds, the return matches the other heaps' locked frees.
+bool miniheap_free_locked(void *ptr)
+{
+    if (!ptr)
+        return true;
 
-                // link it with the current block
-                list_add_after(&chunk->node, &new_chunk->node);
-            }
+    DEBUG_ASSERT(is_mutex_held(&theheap.lock));
 
-            // check again to see if we are now completely covering a block
-            if (start_page == start && end_page == end) {
-                LTRACEF("special case, after splitting off new chunk, free chunk completely covers page(s)\n");
-                list_delete(&chunk->node);
-                goto free_chunk;
-            }
+    heap_insert_free_chunk(heap_free_prepare(ptr));
+    return true;
+}
 
-            // trim the size of the block
-            chunk->len -= end_page - start_page;
+void miniheap_trim(void)
+{
+    mutex_acquire(&theheap.lock);
+    miniheap_trim_locked();
+    mutex_release(&theheap.lock);
+}
 
-free_chunk:
-            // return it to the allocator
-            LTRACEF("returning %p size 0x%lx to the page allocator\n", (void *)start_page, end_page - start_page);
-            page_free((void *)start_page, (end_page - start_page) / PAGE_SIZE);
+void miniheap_trim_locked(void)
+{
+    LTRACE_ENTRY;
 
-            // tweak accounting
-            theheap.remaining -= end_page - start_page;
-        }
+    DEBUG_ASSERT(is_mutex_held(&theheap.lock));
+
+    // walk through the regions, finding free chunks that can be returned to the page allocator.
+    // Regions split off by trimming are added at the tail and are trimmed as they are made.
+    struct heap_region *region;
+    struct heap_region *next_region;
+    list_for_every_entry_safe(&theheap.regions, region, next_region, struct heap_region, node) {
+        heap_trim_region(region);
     }
+}
 
+// For callers that must not block on the heap, such as shrinkers. Fails if the
+// lock is busy or already held by this thread.
+bool miniheap_trylock(void)
+{
+    return shrinker_trylock(&theheap.lock);
+}
+
+void miniheap_unlock(void)
+{
     mutex_release(&theheap.lock);
 }
 
@@ -469,11 +730,15 @@ void miniheap_get_stats(struct miniheap_stats *ptr)
 
     mutex_acquire(&theheap.lock);
 
-    list_for_every_entry(&theheap.free_list, chunk, struct free_heap_chunk, node) {
-        ptr->heap_free += chunk->len;
+    for (uint fl = 0; fl < FL_COUNT; fl++) {
+        for (uint sl = 0; sl < SL_COUNT; sl++) {
+            list_for_every_entry(&theheap.free_lists[fl][sl], chunk, struct free_heap_chunk, node) {
+                ptr->heap_free += chunk_len(chunk);
 
-        if (chunk->len > ptr->heap_max_chunk) {
-            ptr->heap_max_chunk = chunk->len;
+                if (chunk_len(chunk) > ptr->heap_max_chunk) {
+                    ptr->heap_max_chunk = chunk_len(chunk);
+                }
+            }
         }
     }
 
@@ -493,7 +758,7 @@ static ssize_t heap_grow(size_t size)
 
     LTRACEF("growing heap by 0x%zx bytes, new ptr %p\n", size, ptr);
 
-    heap_insert_free_chunk(heap_create_free_chunk(ptr, size, true));
+    heap_add_region(ptr, size);
 
     /* change the heap start and end variables */
     if ((uintptr_t)ptr < (uintptr_t)theheap.base || theheap.base == 0)
@@ -514,8 +779,15 @@ void miniheap_init(void *ptr, size_t len)
     // create a mutex
     mutex_init(&theheap.lock);
 
-    // initialize the free list
-    list_initialize(&theheap.free_list);
+    list_initialize(&theheap.regions);
+
+    // initialize the free lists
+    theheap.fl_bitmap = 0;
+    for (uint fl = 0; fl < FL_COUNT; fl++) {
+        theheap.sl_bitmap[fl] = 0;
+        for (uint sl = 0; sl < SL_COUNT; sl++)
+            list_initialize(&theheap.free_lists[fl][sl]);
+    }
 
     // set the heap range
     theheap.base = ptr;
@@ -525,6 +797,5 @@ void miniheap_init(void *ptr, size_t len)
 
     // if passed a default range, use it
     if (len > 0)
-        heap_insert_free_chunk(heap_create_free_chunk(ptr, len, true));
+        heap_add_region(ptr, len);
 }
-
@@ -25,8 +25,10 @@
 
 #include <debug.h>
 #include <assert.h>
+#include <err.h>
 #include <string.h>
 #include <trace.h>
+#include <arch/ops.h>
 #if WITH_KERNEL_VM
 #include <kernel/vm.h>
 #else
@@ -50,6 +52,8 @@
 
 #endif
 
+static volatile int pages_freed;
+
 void *page_alloc(size_t pages, int arena)
 {
 #if WITH_KERNEL_VM
@@ -63,6 +67,8 @@ void *page_alloc(size_t pages, int arena)
 
 void page_free(void *ptr, size_t pages)
 {
+    atomic_add(&pages_freed, pages);
+
 #if WITH_KERNEL_VM
     DEBUG_ASSERT(IS_PAGE_ALIGNED((uintptr_t)ptr));
 
@@ -72,6 +78,64 @@ void page_free(void *ptr, size_t pages)
 #endif
 }
 
+uint page_free_count(void)
+{
+    return pages_freed;
+}
+
+void *page_alloc_mapped(size_t pages)
+{
+#if WITH_KERNEL_VM
+    void *result = NULL;
+    status_t err = vmm_alloc(vmm_get_kernel_aspace(), "heap", pages * PAGE_SIZE, &result, 0, 0,
+                             ARCH_MMU_FLAG_PERM_NO_EXECUTE);
+    if (err < 0)
+        return NULL;
+    return result;
+#else
+    return novm_alloc_pages(pages, NOVM_ARENA_ANY);
+#endif
+}
+
+void page_free_mapped(void *ptr, size_t pages)
+{
+    DEBUG_ASSERT(IS_PAGE_ALIGNED((uintptr_t)ptr));
+
+#if WITH_KERNEL_VM
+    __UNUSED status_t err = vmm_free_region(vmm_get_kernel_aspace(), (vaddr_t)ptr);
+    DEBUG_ASSERT(err == NO_ERROR);
+#else
+    novm_free_pages(ptr, pages);
+#endif
+}
+
+void *page_resize_mapped(void *ptr, size_t pages, size_t new_pages)
+{
+    LTRACEF("ptr %p, pages %zu, new_pages %zu\n", ptr, pages, new_pages);
+
+    DEBUG_ASSERT(IS_PAGE_ALIGNED((uintptr_t)ptr));
+
+    if (new_pages == 0)
+        return NULL;
+
+#if WITH_KERNEL_VM
+    void *result;
+    status_t err = vmm_resize_region(vmm_get_kernel_aspace(), (vaddr_t)ptr, new_pages * PAGE_SIZE, &result);
+    if (err < 0)
+        return NULL;
+    return result;
+#else
+    /* the novm arenas are identity mapped, so we can only resize in place */
+    if (new_pages < pages) {
+        novm_free_pages((char *)ptr + new_pages * PAGE_SIZE, pages - new_pages);
+    } else if (new_pages > pages) {
+        if (novm_alloc_specific_pages((char *)ptr + pages * PAGE_SIZE, new_pages - pages) < 0)
+            return NULL;
+    }
+    return ptr;
+#endif
+}
+
 int page_get_arenas(struct page_range *ranges, int number_of_ranges)
 {
 #if WITH_KERNEL_VM
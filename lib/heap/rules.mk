@@ -29,4 +29,10 @@ endif
 
 GLOBAL_DEFINES += LK_HEAP_IMPLEMENTATION=$(LK_HEAP_IMPLEMENTATION)
 
+# allocation profiling, see heap_wrapper.c
+ifndef LK_HEAP_PROFILE
+LK_HEAP_PROFILE=0
+endif
+GLOBAL_DEFINES += LK_HEAP_PROFILE=$(LK_HEAP_PROFILE)
+
 include make/module.mk
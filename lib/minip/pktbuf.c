@@ -34,6 +34,7 @@
 #include <kernel/spinlock.h>
 #include <lib/pktbuf.h>
 #include <lib/pool.h>
+#include <lib/slab.h>
 #include <lk/init.h>
 
 #if WITH_KERNEL_VM
@@ -46,8 +47,11 @@ static pool_t pktbuf_pool;
 static semaphore_t pktbuf_sem;
 static spin_lock_t lock;
 
+/* pktbuf headers come from their own cache, leaving the pool for buffers */
+static slab_cache_t pktbuf_hdr_cache;
 
-/* Take an object from the pool of pktbuf objects to act as a header or buffer.  */
+
+/* Take an object from the pool of pktbuf objects to act as a buffer.  */
 static void *get_pool_object(void)
 {
     pool_t *entry;
@@ -121,14 +125,14 @@ pktbuf_t *pktbuf_alloc(void)
     pktbuf_t *p = NULL;
     void *buf = NULL;
 
-    p = get_pool_object();
+    p = slab_cache_alloc(&pktbuf_hdr_cache);
     if (!p) {
         return NULL;
     }
 
     buf = get_pool_object();
     if (!buf) {
-        free_pool_object((pktbuf_pool_object_t *)p, false);
+        slab_cache_free(&pktbuf_hdr_cache, p);
         return NULL;
     }
 
@@ -139,8 +143,12 @@ pktbuf_t *pktbuf_alloc(void)
 
 pktbuf_t *pktbuf_alloc_empty(void)
 {
-    pktbuf_t *p = (pktbuf_t *) get_pool_object();
+    pktbuf_t *p = slab_cache_alloc(&pktbuf_hdr_cache);
+    if (!p) {
+        return NULL;
+    }
 
+    memset(p, 0, sizeof(pktbuf_t));
     p->flags = PKTBUF_FLAG_EOF;
     return p;
 }
@@ -152,7 +160,7 @@ int pktbuf_free(pktbuf_t *p, bool reschedule)
     if (p->cb) {
         p->cb(p->buffer, p->cb_args);
     }
-    free_pool_object((pktbuf_pool_object_t *)p, false);
+    slab_cache_free(&pktbuf_hdr_cache, p);
 
     return 1;
 }
@@ -245,6 +253,8 @@ static void pktbuf_init(uint level)
 
     pool_init(&pktbuf_pool, sizeof(struct pktbuf_pool_object), CACHE_LINE, PKTBUF_POOL_SIZE, slab);
     sem_init(&pktbuf_sem, PKTBUF_POOL_SIZE);
+
+    slab_cache_init(&pktbuf_hdr_cache, "pktbuf", sizeof(pktbuf_t), __alignof(pktbuf_t), NULL);
 }
 
 LK_INIT_HOOK(pktbuf, pktbuf_init, LK_INIT_LEVEL_THREADING);
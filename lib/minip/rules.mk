@@ -3,9 +3,11 @@ LOCAL_DIR := $(GET_LOCAL_DIR)
 MODULE := $(LOCAL_DIR)
 
 MODULE_DEPS := \
+	lib/arena \
 	lib/cbuf \
 	lib/iovec \
-	lib/pool
+	lib/pool \
+	lib/slab
 
 MODULE_SRCS += \
 	$(LOCAL_DIR)/arp.c \
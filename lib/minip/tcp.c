@@ -30,8 +30,11 @@
 #include <err.h>
 #include <string.h>
 #include <sys/types.h>
+#include <lib/arena.h>
 #include <lib/console.h>
 #include <lib/cbuf.h>
+#include <lib/slab.h>
+#include <lk/init.h>
 #include <kernel/mutex.h>
 #include <kernel/semaphore.h>
 #include <arch/ops.h>
@@ -103,6 +106,9 @@ typedef struct tcp_socket {
 
     uint32_t mss;
 
+    /* rx and tx buffers, released together when the socket goes away */
+    arena_t  *buffers;
+
     /* rx */
     uint32_t rx_win_size;
     uint32_t rx_win_low;
@@ -148,6 +154,8 @@ typedef struct tcp_socket {
 static mutex_t tcp_socket_list_lock = MUTEX_INITIAL_VALUE(tcp_socket_list_lock);
 static struct list_node tcp_socket_list = LIST_INITIAL_VALUE(tcp_socket_list);
 
+static slab_cache_t tcp_socket_cache;
+
 static bool tcp_debug = false;
 
 /* local routines */
@@ -324,10 +332,9 @@ static bool dec_socket_ref(tcp_socket_t *s)
         event_destroy(&s->tx_event);
         event_destroy(&s->rx_event);
 
-        free(s->rx_buffer_raw);
-        free(s->tx_buffer);
+        arena_destroy(s->buffers);
 
-        free(s);
+        slab_cache_free(&tcp_socket_cache, s);
     }
     return (oldval == 1);
 }
@@ -945,13 +952,21 @@ static void tcp_remote_close(tcp_socket_t *s)
     tcp_wakeup_waiters(s);
 }
 
+static void tcp_init(uint level)
+{
+    slab_cache_init(&tcp_socket_cache, "tcp socket", sizeof(tcp_socket_t), __alignof(tcp_socket_t), NULL);
+}
+
+LK_INIT_HOOK(tcp, tcp_init, LK_INIT_LEVEL_THREADING);
+
 static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
 {
     tcp_socket_t *s;
 
-    s = calloc(1, sizeof(tcp_socket_t));
+    s = slab_cache_alloc(&tcp_socket_cache);
     if (!s)
         return NULL;
+    memset(s, 0, sizeof(tcp_socket_t));
 
     mutex_init(&s->lock);
     s->ref = 1; // start with the ref already bumped
@@ -968,12 +983,20 @@ static tcp_socket_t *create_tcp_socket(bool alloc_buffers)
     event_init(&s->tx_event, true, 0);
 
     if (alloc_buffers) {
-        // XXX check for error
-        s->rx_buffer_raw = malloc(s->rx_win_size);
+        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
+
+        s->buffers = arena_create("tcp", s->rx_win_size + s->tx_buffer_size);
+        if (!s->buffers) {
+            event_destroy(&s->tx_event);
+            event_destroy(&s->rx_event);
+            slab_cache_free(&tcp_socket_cache, s);
+            return NULL;
+        }
+
+        s->rx_buffer_raw = arena_alloc(s->buffers, s->rx_win_size);
         cbuf_initialize_etc(&s->rx_buffer, s->rx_win_size, s->rx_buffer_raw);
 
-        s->tx_buffer_size = DEFAULT_TX_BUFFER_SIZE;
-        s->tx_buffer = malloc(s->tx_buffer_size);
+        s->tx_buffer = arena_alloc(s->buffers, s->tx_buffer_size);
     }
 
     sem_init(&s->accept_sem, 0);
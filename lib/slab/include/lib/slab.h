@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#pragma once
+
+/**
+ * An object cache allocator in the style of the Bonwick slab allocator.
+ *
+ * Each cache hands out objects of one size. Objects are carved out of slabs, runs of pages
+ * taken from the page allocator and managed with a lib/pool free list, and the constructor
+ * passed at creation is run once on every object as its slab is created. Objects handed back
+ * to the cache are expected to be returned to their constructed state.
+ *
+ * Allocations and frees go through a small per-cpu magazine of objects first so the common
+ * case only touches a cpu local, uncontended lock.
+ *
+ * slab_cache_free() may be called from interrupt context. slab_cache_alloc() may have to add a
+ * slab, which takes pages from the page allocator, so it must be called from thread context. Fully
+ * free slabs are kept around until slab_cache_reclaim() or
+ * slab_reclaim() gives them back to the page allocator.
+ *
+ * Typical usage:
+ *
+ * static slab_cache_t foo_cache;
+ *
+ * slab_cache_init(&foo_cache, "foo", sizeof(foo_t), __alignof(foo_t), NULL);
+ *
+ * foo_t *foo = slab_cache_alloc(&foo_cache);
+ * ...
+ * slab_cache_free(&foo_cache, foo);
+ */
+
+#include <compiler.h>
+#include <list.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <arch/defines.h>
+#include <arch/ops.h>
+#include <kernel/spinlock.h>
+
+__BEGIN_CDECLS
+
+#ifndef SLAB_MAGAZINE_SIZE
+#define SLAB_MAGAZINE_SIZE 16
+#endif
+
+typedef void (*slab_ctor_t)(void *object);
+
+/* per cpu stash of free objects, private to the cache */
+struct slab_magazine {
+    spin_lock_t lock;
+    uint count;
+    void *objects[SLAB_MAGAZINE_SIZE];
+
+    /* statistics */
+    uint64_t allocs;
+    uint64_t frees;
+} __CPU_ALIGN;
+
+typedef struct slab_cache {
+    struct list_node node;
+    const char *name;
+    uint flags;
+
+    /* layout */
+    size_t object_size;
+    size_t object_align;
+    size_t slab_size;
+    uint objects_per_slab;
+    slab_ctor_t ctor;
+
+    /* slabs, protected by lock */
+    spin_lock_t lock;
+    struct list_node partial_slabs;
+    struct list_node full_slabs;
+    struct list_node empty_slabs;
+    uint slab_count;
+    size_t objects_out; /* objects taken out of slabs, including ones sitting in magazines */
+
+    struct slab_magazine magazine[SMP_MAX_CPUS];
+} slab_cache_t;
+
+/* slab_cache_t flags */
+#define SLAB_CACHE_FLAG_ALLOCATED (0x1) /* cache structure came from slab_cache_create */
+
+/**
+ * Initialize a cache in caller provided storage.
+ * Objects must fit at least 8 to a slab of up to 16 pages.
+ */
+status_t slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size,
+                         size_t object_align, slab_ctor_t ctor) __NONNULL((1, 2));
+
+/**
+ * Allocate and initialize a cache.
+ * Returns NULL if the cache could not be allocated or the object size is not supported.
+ */
+slab_cache_t *slab_cache_create(const char *name, size_t object_size,
+                                size_t object_align, slab_ctor_t ctor) __NONNULL((1));
+
+/**
+ * Tear down a cache. All of its objects must have been freed.
+ */
+void slab_cache_destroy(slab_cache_t *cache) __NONNULL((1));
+
+/**
+ * Allocate an object from the cache.
+ * Returns NULL if no object is available and the cache could not grow.
+ */
+void *slab_cache_alloc(slab_cache_t *cache) __NONNULL((1));
+
+/**
+ * Return an object previously allocated from the cache.
+ */
+void slab_cache_free(slab_cache_t *cache, void *object) __NONNULL((1, 2));
+
+/**
+ * Flush the magazines of a cache and give its free slabs back to the page allocator.
+ * Must be called from thread context.
+ * Returns the number of pages released.
+ */
+size_t slab_cache_reclaim(slab_cache_t *cache) __NONNULL((1));
+
+/**
+ * Reclaim every cache in the system.
+ * Returns the number of pages released.
+ */
+size_t slab_reclaim(void);
+
+__END_CDECLS
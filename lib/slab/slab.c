@@ -0,0 +1,474 @@
+/*
+ * Copyright (c) 2016 The Little Kernel Authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files
+ * (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge,
+ * publish, distribute, sublicense, and/or sell copies of the Software,
+ * and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+ * IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+ * CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+ * TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+ * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+#include <lib/slab.h>
+
+#include <assert.h>
+#include <debug.h>
+#include <err.h>
+#include <list.h>
+#include <malloc.h>
+#include <pow2.h>
+#include <stdlib.h>
+#include <string.h>
+#include <trace.h>
+#include <lib/console.h>
+#include <lib/pool.h>
+#include <kernel/mutex.h>
+#include <kernel/shrinker.h>
+#include <lk/init.h>
+
+#if WITH_KERNEL_VM
+#include <kernel/vm.h>
+#else
+#include <kernel/novm.h>
+#endif
+
+#define LOCAL_TRACE 0
+
+/* largest slab we'll build, in pages */
+#define SLAB_MAX_PAGES 16
+
+/* fewest objects a slab has to hold */
+#define SLAB_MIN_OBJECTS 8
+
+/* Header at the start of every slab. Slabs are naturally aligned so the slab
+ * an object belongs to is found by rounding its address down. */
+struct slab {
+    struct list_node node;
+    pool_t pool;
+    uint inuse;
+};
+
+static struct list_node cache_list = LIST_INITIAL_VALUE(cache_list);
+static mutex_t cache_list_lock = MUTEX_INITIAL_VALUE(cache_list_lock);
+
+/* pool objects carry a free list link in their first word. When there is a
+ * constructor the object is pushed past it so the constructed state survives
+ * a trip through the free list. */
+static size_t slab_object_offset(const slab_cache_t *cache)
+{
+    return cache->ctor ? ROUNDUP(sizeof(void *), cache->object_align) : 0;
+}
+
+static size_t slab_pool_object_size(const slab_cache_t *cache)
+{
+    return slab_object_offset(cache) + cache->object_size;
+}
+
+static size_t slab_storage_offset(const slab_cache_t *cache)
+{
+    return ROUNDUP(sizeof(struct slab),
+                   POOL_STORAGE_ALIGN(slab_pool_object_size(cache), cache->object_align));
+}
+
+static struct slab *slab_from_object(const slab_cache_t *cache, void *object)
+{
+    return (struct slab *)ROUNDDOWN((uintptr_t)object, cache->slab_size);
+}
+
+static void *slab_alloc_pages(size_t size)
+{
+    uint count = size / PAGE_SIZE;
+
+#if WITH_KERNEL_VM
+    paddr_t pa;
+    if (pmm_alloc_contiguous(count, log2_uint(size), &pa, NULL) != count)
+        return NULL;
+    return paddr_to_kvaddr(pa);
+#else
+    if (count == 1)
+        return novm_alloc_pages(1, NOVM_ARENA_ANY);
+
+    /* over allocate and trim down to a naturally aligned run */
+    uint total = count * 2 - 1;
+    uint8_t *ptr = novm_alloc_pages(total, NOVM_ARENA_ANY);
+    if (!ptr)
+        return NULL;
+
+    uint8_t *aligned = (uint8_t *)ROUNDUP((uintptr_t)ptr, size);
+    if (aligned != ptr)
+        novm_free_pages(ptr, (aligned - ptr) / PAGE_SIZE);
+    uint8_t *end = ptr + total * PAGE_SIZE;
+    if (aligned + size != end)
+        novm_free_pages(aligned + size, (end - (aligned + size)) / PAGE_SIZE);
+
+    return aligned;
+#endif
+}
+
+static void slab_free_pages(void *ptr, size_t size)
+{
+#if WITH_KERNEL_VM
+    pmm_free_kpages(ptr, size / PAGE_SIZE);
+#else
+    novm_free_pages(ptr, size / PAGE_SIZE);
+#endif
+}
+
+/* add a new slab to the cache, must be called from thread context */
+static status_t slab_grow(slab_cache_t *cache)
+{
+    uint8_t *base = slab_alloc_pages(cache->slab_size);
+    if (!base)
+        return ERR_NO_MEMORY;
+
+    LTRACEF("cache '%s' slab %p\n", cache->name, base);
+
+    struct slab *slab = (struct slab *)base;
+    memset(slab, 0, sizeof(*slab));
+
+    size_t size = slab_pool_object_size(cache);
+    uint8_t *storage = base + slab_storage_offset(cache);
+    pool_init(&slab->pool, size, cache->object_align, cache->objects_per_slab, storage);
+
+    if (cache->ctor) {
+        for (uint i = 0; i < cache->objects_per_slab; i++) {
+            uint8_t *object = storage + i * POOL_PADDED_OBJECT_SIZE(size, cache->object_align);
+            cache->ctor(object + slab_object_offset(cache));
+        }
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    list_add_tail(&cache->empty_slabs, &slab->node);
+    cache->slab_count++;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    return NO_ERROR;
+}
+
+/* move objects out of slabs into a magazine, called with the magazine lock held */
+static void slab_refill(slab_cache_t *cache, struct slab_magazine *mag)
+{
+    size_t offset = slab_object_offset(cache);
+
+    spin_lock(&cache->lock);
+    while (mag->count < SLAB_MAGAZINE_SIZE / 2) {
+        /* prefer partially used slabs so free ones can be reclaimed */
+        struct slab *slab = list_peek_head_type(&cache->partial_slabs, struct slab, node);
+        if (!slab) {
+            slab = list_remove_head_type(&cache->empty_slabs, struct slab, node);
+            if (!slab)
+                break;
+            list_add_head(&cache->partial_slabs, &slab->node);
+        }
+
+        uint8_t *object = pool_alloc(&slab->pool);
+        DEBUG_ASSERT(object);
+
+        mag->objects[mag->count++] = object + offset;
+        cache->objects_out++;
+
+        if (++slab->inuse == cache->objects_per_slab) {
+            list_delete(&slab->node);
+            list_add_head(&cache->full_slabs, &slab->node);
+        }
+    }
+    spin_unlock(&cache->lock);
+}
+
+/* return the count oldest objects in a magazine to their slabs, called with
+ * the magazine lock held */
+static void slab_flush(slab_cache_t *cache, struct slab_magazine *mag, uint count)
+{
+    size_t offset = slab_object_offset(cache);
+
+    DEBUG_ASSERT(count <= mag->count);
+
+    spin_lock(&cache->lock);
+    for (uint i = 0; i < count; i++) {
+        uint8_t *object = mag->objects[i];
+        struct slab *slab = slab_from_object(cache, object);
+
+        DEBUG_ASSERT(slab->inuse > 0);
+
+        if (slab->inuse == cache->objects_per_slab) {
+            list_delete(&slab->node);
+            list_add_head(&cache->partial_slabs, &slab->node);
+        }
+
+        pool_free(&slab->pool, object - offset);
+        cache->objects_out--;
+
+        if (--slab->inuse == 0) {
+            list_delete(&slab->node);
+            list_add_head(&cache->empty_slabs, &slab->node);
+        }
+    }
+    spin_unlock(&cache->lock);
+
+    mag->count -= count;
+    memmove(&mag->objects[0], &mag->objects[count], mag->count * sizeof(void *));
+}
+
+status_t slab_cache_init(slab_cache_t *cache, const char *name, size_t object_size,
+                         size_t object_align, slab_ctor_t ctor)
+{
+    LTRACEF("cache %p name '%s' size %zu align %zu\n", cache, name, object_size, object_align);
+
+    DEBUG_ASSERT(object_size > 0);
+    DEBUG_ASSERT(ispow2(object_align));
+
+    memset(cache, 0, sizeof(*cache));
+    cache->name = name;
+    cache->object_size = object_size;
+    cache->object_align = object_align;
+    cache->ctor = ctor;
+
+    /* pick the smallest slab that holds enough objects to be worth it */
+    size_t stride = POOL_PADDED_OBJECT_SIZE(slab_pool_object_size(cache), object_align);
+    for (size_t pages = 1; pages <= SLAB_MAX_PAGES; pages *= 2) {
+        size_t size = pages * PAGE_SIZE;
+        size_t count = (size - slab_storage_offset(cache)) / stride;
+        if (count >= SLAB_MIN_OBJECTS) {
+            cache->slab_size = size;
+            cache->objects_per_slab = count;
+            break;
+        }
+    }
+    if (cache->slab_size == 0) {
+        TRACEF("object size %zu too large for cache '%s'\n", object_size, name);
+        return ERR_INVALID_ARGS;
+    }
+
+    spin_lock_init(&cache->lock);
+    list_initialize(&cache->partial_slabs);
+    list_initialize(&cache->full_slabs);
+    list_initialize(&cache->empty_slabs);
+    for (uint i = 0; i < SMP_MAX_CPUS; i++)
+        spin_lock_init(&cache->magazine[i].lock);
+
+    mutex_acquire(&cache_list_lock);
+    list_add_tail(&cache_list, &cache->node);
+    mutex_release(&cache_list_lock);
+
+    return NO_ERROR;
+}
+
+slab_cache_t *slab_cache_create(const char *name, size_t object_size,
+                                size_t object_align, slab_ctor_t ctor)
+{
+    slab_cache_t *cache = memalign(CACHE_LINE, sizeof(slab_cache_t));
+    if (!cache)
+        return NULL;
+
+    if (slab_cache_init(cache, name, object_size, object_align, ctor) < 0) {
+        free(cache);
+        return NULL;
+    }
+    cache->flags |= SLAB_CACHE_FLAG_ALLOCATED;
+
+    return cache;
+}
+
+void slab_cache_destroy(slab_cache_t *cache)
+{
+    LTRACEF("cache %p name '%s'\n", cache, cache->name);
+
+    mutex_acquire(&cache_list_lock);
+    list_delete(&cache->node);
+    mutex_release(&cache_list_lock);
+
+    slab_cache_reclaim(cache);
+
+    DEBUG_ASSERT(cache->objects_out == 0);
+    DEBUG_ASSERT(cache->slab_count == 0);
+
+    if (cache->flags & SLAB_CACHE_FLAG_ALLOCATED)
+        free(cache);
+}
+
+void *slab_cache_alloc(slab_cache_t *cache)
+{
+    for (;;) {
+        spin_lock_saved_state_t state;
+        arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        struct slab_magazine *mag = &cache->magazine[arch_curr_cpu_num()];
+        void *object = NULL;
+
+        spin_lock(&mag->lock);
+        if (mag->count == 0)
+            slab_refill(cache, mag);
+        if (mag->count > 0) {
+            object = mag->objects[--mag->count];
+            mag->allocs++;
+        }
+        spin_unlock(&mag->lock);
+
+        arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+        if (object)
+            return object;
+
+        /* out of objects, add a slab */
+        if (slab_grow(cache) < 0)
+            return NULL;
+    }
+}
+
+void slab_cache_free(slab_cache_t *cache, void *object)
+{
+    DEBUG_ASSERT(slab_from_object(cache, object)->inuse > 0);
+
+    spin_lock_saved_state_t state;
+    arch_interrupt_save(&state, SPIN_LOCK_FLAG_INTERRUPTS);
+
+    struct slab_magazine *mag = &cache->magazine[arch_curr_cpu_num()];
+
+    spin_lock(&mag->lock);
+    if (mag->count == SLAB_MAGAZINE_SIZE)
+        slab_flush(cache, mag, SLAB_MAGAZINE_SIZE / 2);
+    mag->objects[mag->count++] = object;
+    mag->frees++;
+    spin_unlock(&mag->lock);
+
+    arch_interrupt_restore(state, SPIN_LOCK_FLAG_INTERRUPTS);
+}
+
+size_t slab_cache_reclaim(slab_cache_t *cache)
+{
+    spin_lock_saved_state_t state;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        struct slab_magazine *mag = &cache->magazine[i];
+
+        spin_lock_irqsave(&mag->lock, state);
+        slab_flush(cache, mag, mag->count);
+        spin_unlock_irqrestore(&mag->lock, state);
+    }
+
+    struct list_node list = LIST_INITIAL_VALUE(list);
+    uint count = 0;
+
+    spin_lock_irqsave(&cache->lock, state);
+    struct slab *slab;
+    while ((slab = list_remove_head_type(&cache->empty_slabs, struct slab, node))) {
+        list_add_tail(&list, &slab->node);
+        count++;
+    }
+    cache->slab_count -= count;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    while ((slab = list_remove_head_type(&list, struct slab, node)))
+        slab_free_pages(slab, cache->slab_size);
+
+    LTRACEF("cache '%s' released %u slabs\n", cache->name, count);
+
+    return count * (cache->slab_size / PAGE_SIZE);
+}
+
+size_t slab_reclaim(void)
+{
+    size_t pages = 0;
+
+    mutex_acquire(&cache_list_lock);
+    slab_cache_t *cache;
+    list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+        pages += slab_cache_reclaim(cache);
+    }
+    mutex_release(&cache_list_lock);
+
+    return pages;
+}
+
+static size_t slab_shrink(shrinker_t *s, size_t target)
+{
+    size_t pages = 0;
+
+    /* whoever holds the list lock may be the one waiting on memory */
+    if (!shrinker_trylock(&cache_list_lock))
+        return 0;
+
+    slab_cache_t *cache;
+    list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+        pages += slab_cache_reclaim(cache);
+        if (pages * PAGE_SIZE >= target)
+            break;
+    }
+    mutex_release(&cache_list_lock);
+
+    return pages * PAGE_SIZE;
+}
+
+static shrinker_t slab_shrinker = SHRINKER_INITIAL_VALUE("slab", &slab_shrink, SHRINKER_COST_FREE);
+
+static void slab_shrinker_init(uint level)
+{
+    shrinker_register(&slab_shrinker);
+}
+
+LK_INIT_HOOK(slab_shrinker, &slab_shrinker_init, LK_INIT_LEVEL_KERNEL);
+
+static void slab_dump_cache(slab_cache_t *cache)
+{
+    uint64_t allocs = 0, frees = 0;
+    size_t cached = 0;
+    for (uint i = 0; i < SMP_MAX_CPUS; i++) {
+        allocs += cache->magazine[i].allocs;
+        frees += cache->magazine[i].frees;
+        cached += cache->magazine[i].count;
+    }
+
+    spin_lock_saved_state_t state;
+    spin_lock_irqsave(&cache->lock, state);
+    uint slabs = cache->slab_count;
+    uint empty = list_length(&cache->empty_slabs);
+    size_t out = cache->objects_out;
+    spin_unlock_irqrestore(&cache->lock, state);
+
+    printf("%-16s %6zu %5zu %6u %6u %6u %8zu %8zu %6zu %10llu %10llu\n",
+           cache->name, cache->object_size, cache->slab_size / PAGE_SIZE,
+           cache->objects_per_slab, slabs, empty, (size_t)slabs * cache->objects_per_slab,
+           out - cached, cached, allocs, frees);
+}
+
+static int cmd_slab(int argc, const cmd_args *argv)
+{
+    if (argc < 2) {
+        printf("%-16s %6s %5s %6s %6s %6s %8s %8s %6s %10s %10s\n",
+               "name", "size", "pages", "objs", "slabs", "empty", "total", "inuse", "mag",
+               "allocs", "frees");
+
+        mutex_acquire(&cache_list_lock);
+        slab_cache_t *cache;
+        list_for_every_entry(&cache_list, cache, slab_cache_t, node) {
+            slab_dump_cache(cache);
+        }
+        mutex_release(&cache_list_lock);
+    } else if (!strcmp(argv[1].str, "reclaim")) {
+        printf("released %zu pages\n", slab_reclaim());
+    } else {
+        printf("usage:\n");
+        printf("%s\n", argv[0].str);
+        printf("%s reclaim\n", argv[0].str);
+        return ERR_GENERIC;
+    }
+
+    return NO_ERROR;
+}
+
+STATIC_COMMAND_START
+#if LK_DEBUGLEVEL > 0
+STATIC_COMMAND("slab", "object cache allocator", &cmd_slab)
+#endif
+STATIC_COMMAND_END(slab);
@@ -30,7 +30,7 @@
 /* NOTE: keep arch/x86/crt0.S in sync with these definitions */
 
 /* interrupts */
-#define INT_VECTORS 0x31
+#define INT_VECTORS 0x40
 
 /* defined interrupts */
 #define INT_BASE            0x20
@@ -47,6 +47,12 @@
 /* APIC vectors */
 #define INT_APIC_TIMER      0x22
 
+/* message signalled interrupts, delivered through the local apic. 0x30 is
+ * the syscall gate on 32 bit. */
+#define INT_MSI_BASE        0x31
+#define INT_MSI_COUNT       14
+#define INT_APIC_SPURIOUS   0x3f
+
 /* PIC remap bases */
 #define PIC1_BASE 0x20
 #define PIC2_BASE 0x28
@@ -30,7 +30,9 @@
 #include <platform/interrupts.h>
 #include <arch/ops.h>
 #include <arch/x86.h>
+#include <kernel/mutex.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
 #include "platform_p.h"
 #include <platform/pc.h>
 
@@ -61,6 +63,31 @@ static struct int_handler_struct int_handler_table[INT_VECTORS];
  */
 static uint8_t irqMask[2];
 
+/*
+ * The local apic. Everything else still goes through the PICs, wired to
+ * LINT0, so it is only brought up when something asks for msi vectors.
+ */
+#define LAPIC_PHYS_BASE     0xfee00000
+#define LAPIC_ID            0x020
+#define LAPIC_EOI           0x0b0
+#define LAPIC_SVR           0x0f0
+#define LAPIC_LVT_LINT0     0x350
+#define LAPIC_LVT_LINT1     0x360
+
+#define LAPIC_SVR_ENABLE    (1 << 8)
+#define LAPIC_LVT_NMI       (4 << 8)
+#define LAPIC_LVT_EXTINT    (7 << 8)
+
+#define X86_MSR_APIC_BASE   0x1b
+#define X86_APIC_BASE_EN    (1 << 11)
+
+static volatile uint32_t *lapic;
+static uint32_t lapic_id;
+
+/* msi vectors are handed out in order and never given back */
+static mutex_t msi_lock = MUTEX_INITIAL_VALUE(msi_lock);
+static unsigned int next_msi_vector = INT_MSI_BASE;
+
 /*
  * init the PICs and remap them
  */
@@ -150,9 +177,45 @@ void issueEOI(unsigned int vector)
     } else if (vector >= PIC2_BASE && vector <= PIC2_BASE + 7) {
         outp(PIC2, 0x20);
         outp(PIC1, 0x20);   // must issue both for the second PIC
+    } else if (vector >= INT_MSI_BASE && vector < INT_MSI_BASE + INT_MSI_COUNT && lapic) {
+        lapic[LAPIC_EOI / 4] = 0;
     }
 }
 
+/* called with the msi lock held, mapping the apic may block */
+static status_t lapic_init(void)
+{
+    if (lapic)
+        return NO_ERROR;
+
+    uint32_t a = 1, b, c = 0, d;
+    __asm__ volatile("cpuid" : "+a"(a), "=b"(b), "+c"(c), "=d"(d));
+    if (!(d & (1 << 9)))
+        return ERR_NOT_SUPPORTED;
+
+    uint64_t base = read_msr(X86_MSR_APIC_BASE);
+    if (!(base & X86_APIC_BASE_EN) || (base & ~0xfffULL) != LAPIC_PHYS_BASE)
+        return ERR_NOT_SUPPORTED;
+
+    void *ptr;
+    status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), "lapic", PAGE_SIZE, &ptr, 0,
+                                      LAPIC_PHYS_BASE, 0, ARCH_MMU_FLAG_UNCACHED);
+    if (err < 0)
+        return err;
+
+    volatile uint32_t *regs = ptr;
+    lapic_id = regs[LAPIC_ID / 4] >> 24;
+
+    /* keep the PICs coming in through LINT0 once the apic is on */
+    regs[LAPIC_LVT_LINT0 / 4] = LAPIC_LVT_EXTINT;
+    regs[LAPIC_LVT_LINT1 / 4] = LAPIC_LVT_NMI;
+    regs[LAPIC_SVR / 4] = LAPIC_SVR_ENABLE | INT_APIC_SPURIOUS;
+
+    lapic = regs;
+
+    return NO_ERROR;
+}
+
 void platform_init_interrupts(void)
 {
     // rebase the PIC out of the way of processor exceptions
@@ -213,6 +276,10 @@ enum handler_return platform_irq(x86_iframe_t *frame)
 
     DEBUG_ASSERT(vector >= 0x20);
 
+    // spurious apic interrupts don't get an EOI
+    if (vector == INT_APIC_SPURIOUS)
+        return INT_NO_RESCHEDULE;
+
     // deliver the interrupt
     enum handler_return ret = INT_NO_RESCHEDULE;
 
@@ -238,3 +305,43 @@ void register_int_handler(unsigned int vector, int_handler handler, void *arg)
 
     spin_unlock_irqrestore(&lock, state);
 }
+
+status_t platform_pci_int_to_vector(unsigned int pci_int, unsigned int *vector)
+{
+    /* the firmware routes pci interrupts to PIC lines */
+    if (pci_int >= 16)
+        return ERR_INVALID_ARGS;
+
+    *vector = INT_BASE + pci_int;
+    return NO_ERROR;
+}
+
+status_t platform_allocate_interrupts(size_t count, unsigned int *vector)
+{
+    mutex_acquire(&msi_lock);
+
+    status_t err = lapic_init();
+    if (err >= 0) {
+        if (count == 0 || count > INT_MSI_BASE + INT_MSI_COUNT - next_msi_vector) {
+            err = ERR_NO_RESOURCES;
+        } else {
+            *vector = next_msi_vector;
+            next_msi_vector += count;
+        }
+    }
+
+    mutex_release(&msi_lock);
+
+    return err;
+}
+
+status_t platform_compose_msi_msg(unsigned int vector, uint64_t *address, uint32_t *data)
+{
+    if (vector < INT_MSI_BASE || vector >= next_msi_vector)
+        return ERR_INVALID_ARGS;
+
+    /* fixed delivery, edge triggered, to the boot cpu */
+    *address = LAPIC_PHYS_BASE | (lapic_id << 12);
+    *data = vector;
+    return NO_ERROR;
+}
@@ -26,6 +26,8 @@
 #include <string.h>
 #include <kernel/thread.h>
 #include <kernel/spinlock.h>
+#include <kernel/vm.h>
+#include <arch/x86.h>
 #include <arch/x86/descriptor.h>
 #include <dev/pci.h>
 
@@ -66,6 +68,9 @@ int (*g_pci_set_irq_hw_int)(const pci_location_t *state, uint8_t int_pin, uint8_
 
 int pci_find_pci_device(pci_location_t *state, uint16_t device_id, uint16_t vendor_id, uint16_t index)
 {
+    if (!g_pci_find_pci_device)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
     spin_lock_saved_state_t irqstate;
     spin_lock_irqsave(&lock, irqstate);
 
@@ -78,6 +83,9 @@ int pci_find_pci_device(pci_location_t *state, uint16_t device_id, uint16_t vend
 
 int pci_find_pci_class_code(pci_location_t *state, uint32_t class_code, uint16_t index)
 {
+    if (!g_pci_find_pci_class_code)
+        return _PCI_FUNC_NOT_SUPPORTED;
+
     spin_lock_saved_state_t irqstate;
     spin_lock_irqsave(&lock, irqstate);
 
@@ -191,11 +199,74 @@ int pci_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq
     return res;
 }
 
+status_t pci_map_bar(const pci_location_t *state, uint bar, const char *name, void **ptr, size_t *len)
+{
+    if (bar >= 6)
+        return ERR_INVALID_ARGS;
+
+    uint32_t reg = PCI_CONFIG_BASE_ADDRESSES + bar * 4;
+    uint32_t lo, hi = 0, size_lo, size_hi = ~0U;
+
+    if (pci_read_config_word(state, reg, &lo) != _PCI_SUCCESSFUL)
+        return ERR_NOT_FOUND;
+    if (lo & PCI_BAR_IO)
+        return ERR_NOT_SUPPORTED;
+
+    bool is64 = (lo & PCI_BAR_MEM_TYPE_MASK) == PCI_BAR_MEM_TYPE_64;
+    if (is64) {
+        if (bar == 5)
+            return ERR_BAD_STATE;
+        pci_read_config_word(state, reg + 4, &hi);
+    }
+
+    /* size the bar with decoding turned off */
+    uint16_t command;
+    pci_read_config_half(state, PCI_CONFIG_COMMAND, &command);
+    pci_write_config_half(state, PCI_CONFIG_COMMAND, command & ~PCI_COMMAND_MEM_EN);
+
+    pci_write_config_word(state, reg, ~0U);
+    pci_read_config_word(state, reg, &size_lo);
+    pci_write_config_word(state, reg, lo);
+    if (is64) {
+        pci_write_config_word(state, reg + 4, ~0U);
+        pci_read_config_word(state, reg + 4, &size_hi);
+        pci_write_config_word(state, reg + 4, hi);
+    }
+
+    pci_write_config_half(state, PCI_CONFIG_COMMAND, command);
+
+    uint64_t addr = ((uint64_t)hi << 32) | (lo & PCI_BAR_MEM_ADDR_MASK);
+    uint64_t size = ~(((uint64_t)size_hi << 32) | (size_lo & PCI_BAR_MEM_ADDR_MASK)) + 1;
+
+    if (addr == 0 || size == 0)
+        return ERR_NOT_FOUND;
+    if (addr + size - 1 > (paddr_t)~0)
+        return ERR_OUT_OF_RANGE;
+
+    /* small bars needn't be page aligned */
+    paddr_t pa = (paddr_t)addr & ~(PAGE_SIZE - 1);
+    size_t map_len = ROUNDUP((size_t)(addr + size - pa), PAGE_SIZE);
+
+    void *va;
+    status_t err = vmm_alloc_physical(vmm_get_kernel_aspace(), name, map_len, &va, 0, pa, 0,
+                                      ARCH_MMU_FLAG_UNCACHED);
+    if (err < 0)
+        return err;
+
+    *ptr = (uint8_t *)va + (addr - pa);
+    *len = size;
+
+    return NO_ERROR;
+}
+
 void pci_init(void)
 {
     if (!pci_bios_detect()) {
         dprintf(INFO, "pci bios functions installed\n");
         dprintf(INFO, "last pci bus is %d\n", last_bus);
+    } else if (!pci_type1_detect()) {
+        dprintf(INFO, "pci type 1 config access\n");
+        dprintf(INFO, "last pci bus is %d\n", last_bus);
     }
 }
 
@@ -500,7 +571,7 @@ static const char *pci_signature = "PCI ";
 static int pci_bios_detect(void)
 {
     // XXX disable for now
-    return 0;
+    return -1;
 
     pci_bios_info *pci = find_pci_bios_info();
     if (pci != NULL) {
@@ -590,3 +661,194 @@ static int pci_bios_detect(void)
 
     return -1;
 }
+
+/*
+ * type 1 config space access through the address and data ports
+ */
+#define PCI_CONFIG_ADDRESS  0xcf8
+#define PCI_CONFIG_DATA     0xcfc
+
+static uint32_t type1_address(const pci_location_t *state, uint32_t reg)
+{
+    return 0x80000000 | ((uint32_t)state->bus << 16) | ((uint32_t)state->dev_fn << 8) | (reg & 0xfc);
+}
+
+static int type1_read_config_byte(const pci_location_t *state, uint32_t reg, uint8_t *value)
+{
+    if (reg >= 256)
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    *value = inp(PCI_CONFIG_DATA + (reg & 3));
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_read_config_half(const pci_location_t *state, uint32_t reg, uint16_t *value)
+{
+    if (reg >= 256 || (reg & 1))
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    *value = inpw(PCI_CONFIG_DATA + (reg & 2));
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_read_config_word(const pci_location_t *state, uint32_t reg, uint32_t *value)
+{
+    if (reg >= 256 || (reg & 3))
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    *value = inpd(PCI_CONFIG_DATA);
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_byte(const pci_location_t *state, uint32_t reg, uint8_t value)
+{
+    if (reg >= 256)
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    outp(PCI_CONFIG_DATA + (reg & 3), value);
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_half(const pci_location_t *state, uint32_t reg, uint16_t value)
+{
+    if (reg >= 256 || (reg & 1))
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    outpw(PCI_CONFIG_DATA + (reg & 2), value);
+    return _PCI_SUCCESSFUL;
+}
+
+static int type1_write_config_word(const pci_location_t *state, uint32_t reg, uint32_t value)
+{
+    if (reg >= 256 || (reg & 3))
+        return _PCI_BAD_REGISTER_NUMBER;
+
+    outpd(PCI_CONFIG_ADDRESS, type1_address(state, reg));
+    outpd(PCI_CONFIG_DATA, value);
+    return _PCI_SUCCESSFUL;
+}
+
+/*
+ * walk every function on the busses up to last_bus, calling match on each
+ * until it returns true
+ */
+static int type1_scan(pci_location_t *state, bool (*match)(const pci_location_t *loc, uint32_t arg), uint32_t arg, uint16_t index)
+{
+    pci_location_t loc;
+
+    for (int bus = 0; bus <= last_bus; bus++) {
+        for (uint dev = 0; dev < 32; dev++) {
+            for (uint fn = 0; fn < 8; fn++) {
+                uint32_t id;
+                uint8_t header_type;
+
+                loc.bus = bus;
+                loc.dev_fn = (dev << 3) | fn;
+
+                type1_read_config_word(&loc, PCI_CONFIG_VENDOR_ID, &id);
+                if ((id & 0xffff) == 0xffff) {
+                    if (fn == 0)
+                        break;
+                    continue;
+                }
+
+                if (match(&loc, arg) && index-- == 0) {
+                    *state = loc;
+                    return _PCI_SUCCESSFUL;
+                }
+
+                /* single function devices only decode function 0 */
+                type1_read_config_byte(&loc, PCI_CONFIG_HEADER_TYPE, &header_type);
+                if (fn == 0 && !(header_type & PCI_HEADER_TYPE_MULTI_FN))
+                    break;
+            }
+        }
+    }
+
+    return _PCI_DEVICE_NOT_FOUND;
+}
+
+static bool type1_match_device(const pci_location_t *loc, uint32_t ids)
+{
+    uint32_t id;
+
+    type1_read_config_word(loc, PCI_CONFIG_VENDOR_ID, &id);
+    return id == ids;
+}
+
+static bool type1_match_class_code(const pci_location_t *loc, uint32_t class_code)
+{
+    uint32_t class_rev;
+
+    type1_read_config_word(loc, PCI_CONFIG_REVISION_ID, &class_rev);
+    return (class_rev >> 8) == class_code;
+}
+
+static int type1_find_pci_device(pci_location_t *state, uint16_t device_id, uint16_t vendor_id, uint16_t index)
+{
+    return type1_scan(state, type1_match_device, ((uint32_t)device_id << 16) | vendor_id, index);
+}
+
+static int type1_find_pci_class_code(pci_location_t *state, uint32_t class_code, uint16_t index)
+{
+    return type1_scan(state, type1_match_class_code, class_code & 0xffffff, index);
+}
+
+static int type1_get_irq_routing_options(irq_routing_options_t *route_buffer, uint16_t *pciIrqs)
+{
+    return _PCI_FUNC_NOT_SUPPORTED;
+}
+
+static int type1_set_irq_hw_int(const pci_location_t *state, uint8_t int_pin, uint8_t irq)
+{
+    return _PCI_FUNC_NOT_SUPPORTED;
+}
+
+static int pci_type1_detect(void)
+{
+    /* the address register only latches a full dword write with the enable bit */
+    uint32_t saved = inpd(PCI_CONFIG_ADDRESS);
+    outpd(PCI_CONFIG_ADDRESS, 0x80000000);
+    uint32_t probe = inpd(PCI_CONFIG_ADDRESS);
+    outpd(PCI_CONFIG_ADDRESS, saved);
+
+    if (probe != 0x80000000)
+        return -1;
+
+    g_pci_find_pci_device = type1_find_pci_device;
+    g_pci_find_pci_class_code = type1_find_pci_class_code;
+
+    g_pci_read_config_word = type1_read_config_word;
+    g_pci_read_config_half = type1_read_config_half;
+    g_pci_read_config_byte = type1_read_config_byte;
+
+    g_pci_write_config_word = type1_write_config_word;
+    g_pci_write_config_half = type1_write_config_half;
+    g_pci_write_config_byte = type1_write_config_byte;
+
+    g_pci_get_irq_routing_options = type1_get_irq_routing_options;
+    g_pci_set_irq_hw_int = type1_set_irq_hw_int;
+
+    /* find the highest bus anything answers on, so searches can stop there */
+    pci_location_t loc;
+    for (int bus = 0; bus < 256; bus++) {
+        loc.bus = bus;
+        for (uint dev = 0; dev < 32; dev++) {
+            uint32_t id;
+
+            loc.dev_fn = dev << 3;
+            type1_read_config_word(&loc, PCI_CONFIG_VENDOR_ID, &id);
+            if ((id & 0xffff) != 0xffff) {
+                last_bus = bus;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
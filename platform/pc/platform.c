@@ -40,6 +40,9 @@
 #include <string.h>
 #include <assert.h>
 #include <kernel/vm.h>
+#if WITH_DEV_VIRTIO
+#include <dev/virtio.h>
+#endif
 
 #define LOCAL_TRACE 0
 
@@ -212,6 +215,14 @@ void platform_init_multiboot_info(void)
                 }
             }
         }
+
+#if WITH_DEV_VIRTIO
+        if (_multiboot_info->flags & MB_INFO_CMD_LINE) {
+            const char *cmdline = (const char *)((uintptr_t)_multiboot_info->cmdline + KERNEL_BASE);
+            LTRACEF("command line '%s'\n", cmdline);
+            virtio_parse_cmdline(cmdline);
+        }
+#endif
     }
 
 #if ARCH_X86_32
@@ -257,4 +268,9 @@ void platform_init(void)
 #endif
 
     platform_init_mmu_mappings();
+
+#if WITH_DEV_VIRTIO
+    /* pick up any virtio devices on the pci bus */
+    virtio_pci_detect();
+#endif
 }
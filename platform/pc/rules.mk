@@ -6,6 +6,14 @@ CPU := generic
 
 MODULE_DEPS += \
     lib/cbuf \
+    dev/block/ahci \
+    dev/block/nvme \
+    dev/virtio/block \
+    dev/virtio/gpu \
+    dev/virtio/net \
+
+# probe the pci bus for virtio devices
+VIRTIO_PCI := 1
 
 MODULE_SRCS += \
     $(LOCAL_DIR)/interrupts.c \
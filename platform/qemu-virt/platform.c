@@ -124,6 +124,11 @@ void platform_early_init(void)
                     /* set the size in the pmm arena */
                     arena.size = len;
                 }
+            } else if (strcmp(name, "chosen") == 0) {
+                /* the command line, if one was passed */
+                const char *bootargs = fdt_getprop(fdt, offset, "bootargs", NULL);
+                if (bootargs)
+                    virtio_parse_cmdline(bootargs);
             }
         }
     }
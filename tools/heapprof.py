@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+# vim: set expandtab ts=4 sw=4 tw=100:
+#
+# Turn the output of `heap profile dump` into folded stacks for flamegraph.pl.
+#
+# Usage: heapprof.py [--elf lk.elf] [--allocs] [console log] > heap.folded
+#        flamegraph.pl heap.folded > heap.svg
+#
+# Sites recorded by return address are symbolized (including inlined callers)
+# with addr2line if an elf is given. By default the stacks are weighted by live
+# bytes; --allocs weights them by the total bytes ever allocated instead.
+
+import subprocess
+import sys
+from argparse import ArgumentParser
+
+
+def symbolize(addr2line, elf, addrs):
+    if not elf or not addrs:
+        return {}
+
+    # one query per address so multi-frame (inlined) answers can be told apart
+    frames = {}
+    for addr in addrs:
+        out = subprocess.run([addr2line, "-e", elf, "-f", "-i", "-C", "-s", addr],
+                             capture_output=True, text=True).stdout.split("\n")
+        funcs = [out[i] for i in range(0, len(out) - 1, 2) if out[i] != "??"]
+        if funcs:
+            # addr2line lists the innermost function first
+            frames[addr] = list(reversed(funcs))
+    return frames
+
+
+def main():
+    parser = ArgumentParser()
+    parser.add_argument("--elf", help="kernel image to symbolize sites with")
+    parser.add_argument("--addr2line", default="addr2line", help="addr2line binary to use")
+    parser.add_argument("--allocs", action="store_true",
+                        help="weight by total allocated bytes instead of live bytes")
+    parser.add_argument("log", nargs="?", help="console log containing the dump (default stdin)")
+    args = parser.parse_args()
+
+    f = open(args.log, errors="replace") if args.log else sys.stdin
+
+    sites = []
+    for line in f:
+        # tolerate console noise in front of the records
+        idx = line.find("heapprof ")
+        if idx < 0:
+            continue
+        # the tag is last and may contain spaces
+        fields = line[idx:].rstrip("\r\n").split(" ", 7)
+        if len(fields) == 8 and fields[1] == "site":
+            caller, tag = fields[2], fields[7]
+            alloc_bytes, live_bytes = int(fields[4]), int(fields[6])
+            sites.append((caller, tag, alloc_bytes if args.allocs else live_bytes))
+
+    frames = symbolize(args.addr2line, args.elf,
+                       sorted(set(caller for caller, tag, _ in sites if tag == "-")))
+
+    for caller, tag, weight in sites:
+        if weight == 0:
+            continue
+        if tag != "-":
+            stack = ["tag:" + tag]
+        else:
+            stack = frames.get(caller, [caller])
+        print("heap;%s %d" % (";".join(stack), weight))
+
+
+if __name__ == "__main__":
+    main()